@@ -0,0 +1,177 @@
+// 批次模式吞吐量量測工具
+// 產生一個大型文件與幾種批次腳本，以 --batch 執行編輯器，量測每種腳本每秒套用的命令數
+// （包含讀入文件與最後寫回一次的時間）
+//
+// 使用方式： ./batchbench [-l 行數] [-c 命令數] [-r 次數] [-d 暫存目錄] [-e 編輯器執行檔]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static const char *bench_exe = "./main";
+static const char *bench_dir = "/tmp";
+static long bench_lines = 1000000;
+static long bench_cmds = 5000000;
+static int bench_runs = 3;
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void usage(const char *prog) {
+	printf("使用方式: %s [-l 行數] [-c 命令數] [-r 次數] [-d 暫存目錄] [-e 編輯器執行檔]\n", prog);
+	printf("  -l  測試文件的行數（預設 1000000）\n");
+	printf("  -c  每個腳本的命令數（預設 5000000）\n");
+	printf("  -r  每個腳本重複幾次取中位數（預設 3）\n");
+	printf("  -d  產生測試文件與腳本的目錄（預設 /tmp）\n");
+	printf("  -e  編輯器執行檔（預設 ./main）\n");
+}
+
+static int make_file(const char *path) {
+	FILE *f = fopen(path, "w");
+	if (!f) return 0;
+	for (long i = 1; i <= bench_lines; i++) fprintf(f, "line %08ld the quick brown fox jumps over the lazy dog\n", i);
+	return fclose(f) == 0;
+}
+
+// 各種腳本：從第 1 行往後依序走過文件，走到底再從頭開始
+enum { SCRIPT_CHANGE, SCRIPT_INSERT_DELETE, SCRIPT_SUBST, SCRIPT_MIXED, SCRIPT_COUNT };
+
+static const char *script_names[SCRIPT_COUNT] = {
+	"跳行 + 取代行",
+	"插入 + 刪除",
+	"跳行 + s 取代",
+	"混合",
+};
+
+static int make_script(const char *path, int kind) {
+	FILE *f = fopen(path, "w");
+	if (!f) return 0;
+	long line = 1;
+	for (long n = 0; n < bench_cmds;) {
+		switch (kind) {
+		case SCRIPT_CHANGE:
+			fprintf(f, "%ld\nc changed line %ld\n", line, line);
+			n += 2;
+			break;
+		case SCRIPT_INSERT_DELETE:
+			// 插入一行再刪掉它，行數不變
+			fprintf(f, "%ld\na inserted\nd\n", line);
+			n += 3;
+			break;
+		case SCRIPT_SUBST:
+			fprintf(f, "%ld\ns/quick/slow/\n", line);
+			n += 2;
+			break;
+		default:
+			fprintf(f, "%ld\nc changed line %ld\na inserted\nd\ns/brown/red/\n", line, line);
+			n += 5;
+			break;
+		}
+		line = (line % bench_lines) + 1;
+	}
+	return fclose(f) == 0;
+}
+
+// 執行一次 --batch；失敗回傳負值
+static double run_once(const char *script, const char *master, const char *work) {
+	// 每次從同一份原始文件開始
+	char cmd[2048];
+	snprintf(cmd, sizeof(cmd), "cp '%s' '%s'", master, work);
+	if (system(cmd) != 0) return -1;
+	double t0 = now_ms();
+	pid_t pid = fork();
+	if (pid < 0) return -1;
+	if (pid == 0) {
+		execl(bench_exe, bench_exe, "--batch", script, work, (char *)NULL);
+		_exit(127);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+	return now_ms() - t0;
+}
+
+// 終端機上的顯示寬度：ASCII 佔一格，其他（這裡只有中文）佔兩格
+static int display_width(const char *s) {
+	int w = 0;
+	for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+		if (*p < 0x80) w++;
+		else if ((*p & 0xC0) == 0xC0) w += 2;
+	}
+	return w;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "l:c:r:d:e:h")) != -1) {
+		if (opt == 'l') bench_lines = atol(optarg);
+		else if (opt == 'c') bench_cmds = atol(optarg);
+		else if (opt == 'r') bench_runs = atoi(optarg);
+		else if (opt == 'd') bench_dir = optarg;
+		else if (opt == 'e') bench_exe = optarg;
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (bench_lines < 1 || bench_cmds < 1 || bench_runs < 1 || bench_runs > 64) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (access(bench_exe, X_OK) != 0) {
+		printf("找不到編輯器執行檔 %s（先執行 make）\n", bench_exe);
+		return 1;
+	}
+
+	char master[512], work[512], script[512];
+	snprintf(master, sizeof(master), "%s/batchbench-%ld.txt", bench_dir, bench_lines);
+	snprintf(work, sizeof(work), "%s/batchbench-work.txt", bench_dir);
+	if (!make_file(master)) {
+		printf("無法建立測試文件 %s（%s）\n", master, strerror(errno));
+		return 1;
+	}
+	struct stat st;
+	stat(master, &st);
+	printf("編輯器: %s，文件 %ld 行（%lld MB），每個腳本 %ld 個命令，%d 次取中位數\n\n", bench_exe, bench_lines,
+	       (long long)st.st_size >> 20, bench_cmds, bench_runs);
+	printf("腳本                 時間        命令/秒\n");
+	for (int kind = 0; kind < SCRIPT_COUNT; kind++) {
+		snprintf(script, sizeof(script), "%s/batchbench-%d.ed", bench_dir, kind);
+		if (!make_script(script, kind)) {
+			printf("無法建立腳本 %s（%s）\n", script, strerror(errno));
+			return 1;
+		}
+		double times[64];
+		int done = 0;
+		for (int r = 0; r < bench_runs; r++) {
+			double t = run_once(script, master, work);
+			if (t < 0) {
+				printf("%s：第 %d 次執行失敗\n", script_names[kind], r + 1);
+				continue;
+			}
+			times[done++] = t;
+		}
+		unlink(script);
+		if (done == 0) return 1;
+		qsort(times, (size_t)done, sizeof(double), cmp_double);
+		double t = times[done / 2];
+		printf("%s%*s %8.0f ms  %10.2f M\n", script_names[kind], 20 - display_width(script_names[kind]), "", t,
+		       bench_cmds / t / 1000.0);
+	}
+	unlink(work);
+	return 0;
+}
@@ -0,0 +1,704 @@
+// Live Share 壓力測試與延遲量測工具
+// 啟動一個本機 --host 主機，再以 N 個模擬參與者依設定的操作比例與速率送出編輯，
+// 量測吞吐量、操作端到端延遲（p50/p99/p999）、主機 CPU 用量，並在結束時檢查各方內容是否一致
+//
+// 使用方式： ./livebench [-n 人數] [-d 秒數] [-r 每人每秒操作數] [-m 修改:插入:刪除:游標] [-l 初始行數] [-p port] [-e 主機執行檔]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// 與 main.c 相同的封包類型
+enum {
+	OP_CURSOR = 6,
+	OP_HELLO = 7,
+	OP_SYNC_BEGIN = 8,
+	OP_SYNC_CHUNK = 9,
+	OP_SYNC_END = 10,
+	OP_SPLICE = 11
+};
+
+enum {
+	MIX_EDIT = 0,     // 修改一行
+	MIX_INSERT = 1,   // 插入一行
+	MIX_DELETE = 2,   // 刪除一行
+	MIX_CURSOR = 3,   // 移動游標
+	MIX_KINDS = 4
+};
+
+#define MAX_IDS 8192   // 主機分配的 id 上限（主機的防護上限為 4096 人）
+
+// ===== HDR 風格的延遲直方圖 =====
+// 小於 64 ns 逐一計數，之後每個 2 的次方區間再分 32 格（相對誤差約 3%），記憶體與樣本數無關
+#define HIST_BUCKETS 1216
+typedef struct {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t total;
+	int64_t max;
+} Hist;
+
+static int hist_index(int64_t v) {
+	if (v < 0) v = 0;
+	if (v < 64) return (int)v;
+	int e = 63 - __builtin_clzll((unsigned long long)v);
+	int idx = (e - 5) * 32 + (int)(v >> (e - 5));
+	return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// 區間的上界（回報百分位時採保守值）
+static int64_t hist_value(int idx) {
+	if (idx < 64) return idx;
+	int shift = idx / 32 - 1;
+	int64_t m = idx % 32 + 32;
+	return ((m + 1) << shift) - 1;
+}
+
+static void hist_add(Hist *h, int64_t v) {
+	h->count[hist_index(v)]++;
+	h->total++;
+	if (v > h->max) h->max = v;
+}
+
+static void hist_merge(Hist *dst, const Hist *src) {
+	for (int i = 0; i < HIST_BUCKETS; i++) dst->count[i] += src->count[i];
+	dst->total += src->total;
+	if (src->max > dst->max) dst->max = src->max;
+}
+
+static double hist_pct_ms(const Hist *h, double p) {
+	if (h->total == 0) return 0;
+	uint64_t want = (uint64_t)(p * (double)h->total);
+	if (want >= h->total) want = h->total - 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen > want) {
+			int64_t v = hist_value(i);
+			return (v > h->max ? h->max : v) / 1e6;
+		}
+	}
+	return h->max / 1e6;
+}
+
+static void hist_print(const char *label, const Hist *h) {
+	printf("%s p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  max %.3f ms（%llu 筆）\n", label,
+	       hist_pct_ms(h, 0.50), hist_pct_ms(h, 0.99), hist_pct_ms(h, 0.999), h->max / 1e6,
+	       (unsigned long long)h->total);
+}
+
+// ===== 內建 LZ 解壓（與 main.c 的快照格式相同） =====
+static long lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+	size_t ip = 0, op = 0;
+	while (ip < n) {
+		uint8_t token = src[ip++];
+		size_t lit = token >> 4;
+		if (lit == 15) {
+			uint8_t b;
+			do {
+				if (ip >= n) return -1;
+				b = src[ip++];
+				lit += b;
+			} while (b == 255);
+		}
+		if (lit > n - ip || lit > cap - op) return -1;
+		memcpy(dst + op, src + ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip >= n) break;
+		if (n - ip < 2) return -1;
+		size_t off = (size_t)src[ip] | ((size_t)src[ip + 1] << 8);
+		ip += 2;
+		if (off == 0 || off > op) return -1;
+		size_t mlen = token & 15;
+		if (mlen == 15) {
+			uint8_t b;
+			do {
+				if (ip >= n) return -1;
+				b = src[ip++];
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += 4;
+		if (mlen > cap - op) return -1;
+		for (size_t i = 0; i < mlen; i++) {
+			dst[op + i] = dst[op - off + i];
+		}
+		op += mlen;
+	}
+	return (long)op;
+}
+
+// ===== 設定與共用狀態 =====
+static int bench_clients = 20;
+static double bench_secs = 10;
+static double bench_rate = 20;               // 每位參與者每秒的操作數（含游標移動）
+static int bench_mix[MIX_KINDS] = { 4, 3, 2, 1 };
+static int bench_lines = 200;
+static int bench_port = 0;
+static const char *bench_exe = "./main";
+
+static volatile int bench_phase = 0;         // 0 同步中、1 量測中、2 停止送出
+static int bench_synced = 0;                 // 已完成同步的參與者數（原子存取）
+static int bench_id_index[MAX_IDS];          // 主機 id → 參與者編號，-1 表示未知
+
+static int64_t mono_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 每位模擬參與者；文件只保存主機定序後的內容（自己的操作等回聲才套用），結束時可直接比對
+typedef struct {
+	int index;
+	int fd;
+	int id;
+	pthread_t thread;
+	unsigned seed;
+	// 文件內容（每行皆以換行結尾）
+	char *doc;
+	size_t len;
+	size_t cap;
+	int lines;
+	int version;
+	int synced;
+	size_t sync_total;
+	// 送出與確認
+	int inflight;
+	int64_t *sent_at;            // 第 k 個編輯操作的送出時間，供其他參與者計算延遲
+	int sent_count;              // 已送出的編輯數（原子存取）
+	int sent_cap;
+	int *seen;                   // 已收到各參與者的第幾個編輯
+	uint64_t cursors;
+	uint64_t stalls;             // 排定送出時仍有在途操作而延後的次數
+	uint64_t errors;             // 版本不連續或格式錯誤
+	Hist apply;                  // 送出 → 本參與者套用（含自己）
+	Hist ack;                    // 送出 → 自己的回聲
+	// 接收緩衝
+	char *in;
+	size_t in_len;
+	size_t in_cap;
+} BenchClient;
+
+static BenchClient *bench;
+
+// ===== 文件操作（與 main.c 的 editor_apply_splice 相同語意） =====
+static size_t doc_line_offset(const BenchClient *b, int line_no) {
+	const char *p = b->doc;
+	const char *end = b->doc + b->len;
+	for (int i = 1; i < line_no; i++) {
+		const char *next = memchr(p, '\n', (size_t)(end - p));
+		if (!next) return b->len;
+		p = next + 1;
+	}
+	return (size_t)(p - b->doc);
+}
+
+static int doc_reserve(BenchClient *b, size_t need) {
+	if (need <= b->cap) return 1;
+	size_t cap = b->cap ? b->cap : 4096;
+	while (cap < need) cap *= 2;
+	char *nb = (char *)realloc(b->doc, cap);
+	if (!nb) return 0;
+	b->doc = nb;
+	b->cap = cap;
+	return 1;
+}
+
+// 從第 pos 行起刪除 del 行，再插入 nlines 行；初始內容每行都以換行結尾，所有操作都維持此性質
+static void doc_splice(BenchClient *b, int pos, int del, const char *text, size_t tlen, int nlines) {
+	if (pos < 1) pos = 1;
+	if (del < 0) del = 0;
+	if (nlines <= 0) {
+		nlines = 0;
+		tlen = 0;
+	}
+	size_t start = doc_line_offset(b, pos);
+	size_t end = (del > 0) ? doc_line_offset(b, pos + del) : start;
+	size_t rlen = nlines > 0 ? tlen + 1 : 0;
+	if (!doc_reserve(b, b->len - (end - start) + rlen + 1)) return;
+	memmove(b->doc + start + rlen, b->doc + end, b->len - end);
+	if (rlen > 0) {
+		memcpy(b->doc + start, text, tlen);
+		b->doc[start + tlen] = '\n';
+	}
+	b->len = b->len - (end - start) + rlen;
+	b->lines = 0;
+	for (size_t i = 0; i < b->len; i++) {
+		if (b->doc[i] == '\n') b->lines++;
+	}
+}
+
+static uint64_t hash_bytes(const char *p, size_t n) {
+	uint64_t h = 1469598103934665603ULL;
+	for (size_t i = 0; i < n; i++) {
+		h ^= (unsigned char)p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// ===== 網路 =====
+static int send_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		buf += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+// 標頭與 payload 合併成一次送出
+static int send_frame(int fd, const char *header, const char *payload, size_t plen) {
+	char buf[512];
+	size_t hlen = strlen(header);
+	if (hlen + plen > sizeof(buf)) return -1;
+	memcpy(buf, header, hlen);
+	if (plen > 0) memcpy(buf + hlen, payload, plen);
+	return send_all(fd, buf, hlen + plen);
+}
+
+static int bench_connect(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+// 處理一個完整封包；回傳 0 表示連線應結束
+static int bench_frame(BenchClient *b, const char *header, const char *payload, int64_t now) {
+	int type = 0, doc = 0, line = 0, ver = 0, base = 0, origin = 0, del = 0, nlines = 0;
+	size_t len = 0;
+	if (sscanf(header, "OP %d %d %d %zu %d %d %d %d %d", &type, &doc, &line, &len, &ver, &base, &origin, &del, &nlines) < 4) {
+		b->errors++;
+		return 1;
+	}
+	if (doc != 0) return 1;
+	if (type == OP_HELLO) {
+		char tmp[32] = { 0 };
+		memcpy(tmp, payload, len < sizeof(tmp) - 1 ? len : sizeof(tmp) - 1);
+		b->id = atoi(tmp);
+		if (b->id > 0 && b->id < MAX_IDS) __atomic_store_n(&bench_id_index[b->id], b->index, __ATOMIC_RELEASE);
+	} else if (type == OP_SYNC_BEGIN) {
+		size_t chunks = 0;
+		char tmp[64] = { 0 };
+		memcpy(tmp, payload, len < sizeof(tmp) - 1 ? len : sizeof(tmp) - 1);
+		sscanf(tmp, "%zu %zu %d", &b->sync_total, &chunks, &b->version);
+		b->len = 0;
+		// 基底版本太舊時主機改送快照，在途的操作不會再有回聲
+		__atomic_store_n(&b->inflight, 0, __ATOMIC_RELEASE);
+		if (!doc_reserve(b, b->sync_total + 1)) return 0;
+	} else if (type == OP_SYNC_CHUNK) {
+		size_t raw = line > 0 ? (size_t)line : 0;
+		if (!doc_reserve(b, b->len + raw + 1)) return 0;
+		long got = lz_decompress((const uint8_t *)payload, len, (uint8_t *)b->doc + b->len, raw);
+		if (got != (long)raw) {
+			b->errors++;
+			return 0;
+		}
+		b->len += raw;
+	} else if (type == OP_SYNC_END) {
+		doc_splice(b, 1, 0, NULL, 0, 0);  // 重新計算行數
+		b->synced = 1;
+		__atomic_add_fetch(&bench_synced, 1, __ATOMIC_RELEASE);
+	} else if (type == OP_SPLICE) {
+		if (ver != b->version + 1) b->errors++;
+		__atomic_store_n(&b->version, ver, __ATOMIC_RELEASE);
+		doc_splice(b, line, del, payload, len, nlines);
+		// 依來源的編輯次序找出送出時間
+		int src = (origin > 0 && origin < MAX_IDS) ? __atomic_load_n(&bench_id_index[origin], __ATOMIC_ACQUIRE) : -1;
+		if (src >= 0) {
+			BenchClient *o = &bench[src];
+			int k = b->seen[src]++;
+			if (k < __atomic_load_n(&o->sent_count, __ATOMIC_ACQUIRE) && o->sent_at[k] > 0) {
+				int64_t lat = now - o->sent_at[k];
+				hist_add(&b->apply, lat);
+				if (src == b->index) hist_add(&b->ack, lat);
+			}
+		}
+		if (origin == b->id) __atomic_store_n(&b->inflight, 0, __ATOMIC_RELEASE);
+	} else if (type == OP_CURSOR) {
+		b->cursors++;
+	}
+	return 1;
+}
+
+// 讀取可用資料並處理其中完整的封包
+static int bench_readable(BenchClient *b) {
+	if (b->in_cap - b->in_len < 65536) {
+		size_t cap = b->in_cap ? b->in_cap * 2 : 131072;
+		char *nb = (char *)realloc(b->in, cap);
+		if (!nb) return 0;
+		b->in = nb;
+		b->in_cap = cap;
+	}
+	ssize_t n = recv(b->fd, b->in + b->in_len, b->in_cap - b->in_len, 0);
+	if (n <= 0) return n < 0 && errno == EINTR;
+	b->in_len += (size_t)n;
+	int64_t now = mono_ns();
+	size_t off = 0;
+	while (off < b->in_len) {
+		char *nl = memchr(b->in + off, '\n', b->in_len - off);
+		if (!nl) break;
+		size_t hlen = (size_t)(nl - (b->in + off)) + 1;
+		char header[192];
+		if (hlen >= sizeof(header)) return 0;
+		memcpy(header, b->in + off, hlen);
+		header[hlen] = '\0';
+		size_t plen = 0;
+		int type = 0, doc = 0, line = 0;
+		if (sscanf(header, "OP %d %d %d %zu", &type, &doc, &line, &plen) < 4) return 0;
+		if (b->in_len - off - hlen < plen) {
+			if (hlen + plen > b->in_cap) {
+				char *nb = (char *)realloc(b->in, hlen + plen);
+				if (!nb) return 0;
+				b->in = nb;
+				b->in_cap = hlen + plen;
+			}
+			break;
+		}
+		if (!bench_frame(b, header, b->in + off + hlen, now)) return 0;
+		off += hlen + plen;
+	}
+	memmove(b->in, b->in + off, b->in_len - off);
+	b->in_len -= off;
+	return 1;
+}
+
+static int bench_pick_kind(BenchClient *b) {
+	int sum = 0;
+	for (int k = 0; k < MIX_KINDS; k++) sum += bench_mix[k];
+	int r = (int)(rand_r(&b->seed) % (unsigned)sum);
+	for (int k = 0; k < MIX_KINDS; k++) {
+		if (r < bench_mix[k]) return k;
+		r -= bench_mix[k];
+	}
+	return MIX_EDIT;
+}
+
+// 依操作比例送出一個操作；編輯一次只有一個在途（與編輯器相同），回傳 0 表示需等待確認
+static int bench_send_op(BenchClient *b) {
+	int kind = bench_pick_kind(b);
+	char header[160];
+	char text[64];
+	int tlen = 0;
+	if (kind == MIX_CURSOR) {
+		int line = b->lines > 0 ? (int)(rand_r(&b->seed) % (unsigned)b->lines) + 1 : 1;
+		tlen = snprintf(text, sizeof(text), "%d %d %d", b->id, line, (int)(rand_r(&b->seed) % 40));
+		snprintf(header, sizeof(header), "OP %d 0 0 %d\n", OP_CURSOR, tlen);
+		send_frame(b->fd, header, text, (size_t)tlen);
+		b->cursors++;
+		return 1;
+	}
+	if (b->inflight) {
+		b->stalls++;
+		return 0;
+	}
+	if (b->lines == 0) kind = MIX_INSERT;
+	int pos, del, nlines;
+	if (kind == MIX_INSERT) {
+		pos = (int)(rand_r(&b->seed) % (unsigned)(b->lines + 1)) + 1;
+		del = 0;
+		nlines = 1;
+	} else {
+		pos = (int)(rand_r(&b->seed) % (unsigned)b->lines) + 1;
+		del = 1;
+		nlines = (kind == MIX_EDIT) ? 1 : 0;
+	}
+	if (nlines > 0) tlen = snprintf(text, sizeof(text), "c%d op%d", b->id, b->sent_count);
+	if (b->sent_count == b->sent_cap) return 0;  // 其他執行緒會讀取 sent_at，不能搬移
+	snprintf(header, sizeof(header), "OP %d 0 %d %d 0 %d %d %d %d\n", OP_SPLICE, pos, tlen, b->version, b->id, del, nlines);
+	b->sent_at[b->sent_count] = mono_ns();
+	__atomic_store_n(&b->sent_count, b->sent_count + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&b->inflight, 1, __ATOMIC_RELEASE);
+	send_frame(b->fd, header, text, (size_t)tlen);
+	return 1;
+}
+
+static void *bench_client_thread(void *arg) {
+	BenchClient *b = (BenchClient *)arg;
+	const char *hello = "0 0:-1 relay:0";
+	char header[64];
+	snprintf(header, sizeof(header), "OP %d 0 0 %zu\n", OP_HELLO, strlen(hello));
+	if (send_frame(b->fd, header, hello, strlen(hello)) != 0) return NULL;
+	int64_t interval = (int64_t)(1e9 / bench_rate);
+	int64_t next = 0;
+	while (1) {
+		int phase = __atomic_load_n(&bench_phase, __ATOMIC_ACQUIRE);
+		if (phase == 3) break;
+		int64_t now = mono_ns();
+		if (phase == 1 && b->synced) {
+			if (next == 0) next = now + (int64_t)(rand_r(&b->seed) % (unsigned)interval);
+			while (next <= now && bench_send_op(b)) next += interval;
+			// 落後太多（確認較慢）時不補送，避免一次湧出
+			if (next < now - interval) next = now;
+		}
+		int timeout = 50;
+		if (phase == 1 && b->synced && !b->inflight) {
+			int64_t wait = (next - now) / 1000000;
+			timeout = wait < 0 ? 0 : (wait > 50 ? 50 : (int)wait);
+		}
+		struct pollfd pfd = { b->fd, POLLIN, 0 };
+		int r = poll(&pfd, 1, timeout);
+		if (r > 0 && !bench_readable(b)) break;
+	}
+	return NULL;
+}
+
+// 主機行程的 CPU 時間（秒）
+static double proc_cpu_secs(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (!f) return 0;
+	char buf[1024];
+	size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+	// 第 2 欄（行程名稱）可能含空白，從最後一個 ')' 之後開始數
+	char *p = strrchr(buf, ')');
+	if (!p) return 0;
+	unsigned long utime = 0, stime = 0;
+	if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) return 0;
+	return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static int parse_mix(const char *s) {
+	int v[MIX_KINDS];
+	if (sscanf(s, "%d:%d:%d:%d", &v[0], &v[1], &v[2], &v[3]) != MIX_KINDS) return 0;
+	int sum = 0;
+	for (int k = 0; k < MIX_KINDS; k++) {
+		if (v[k] < 0) return 0;
+		sum += v[k];
+	}
+	if (sum == 0) return 0;
+	memcpy(bench_mix, v, sizeof(v));
+	return 1;
+}
+
+static void usage(const char *prog) {
+	printf("使用方式: %s [-n 人數] [-d 秒數] [-r 每人每秒操作數] [-m 修改:插入:刪除:游標] [-l 初始行數] [-p port] [-e 主機執行檔]\n", prog);
+	printf("  預設 -n 20 -d 10 -r 20 -m 4:3:2:1 -l 200 -e ./main，port 未指定時自動選擇\n");
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "n:d:r:m:l:p:e:h")) != -1) {
+		if (opt == 'n') bench_clients = atoi(optarg);
+		else if (opt == 'd') bench_secs = atof(optarg);
+		else if (opt == 'r') bench_rate = atof(optarg);
+		else if (opt == 'm' && parse_mix(optarg)) continue;
+		else if (opt == 'l') bench_lines = atoi(optarg);
+		else if (opt == 'p') bench_port = atoi(optarg);
+		else if (opt == 'e') bench_exe = optarg;
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (bench_clients < 1 || bench_secs <= 0 || bench_rate <= 0 || bench_lines < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (bench_port <= 0) bench_port = 20000 + (int)(getpid() % 20000);
+	signal(SIGPIPE, SIG_IGN);
+
+	// 主機編輯的暫存檔；主機結束時寫回，用來比對最終內容
+	char path[] = "/tmp/livebench-XXXXXX";
+	int tfd = mkstemp(path);
+	if (tfd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	FILE *tf = fdopen(tfd, "w");
+	for (int i = 1; i <= bench_lines; i++) fprintf(tf, "line %d\n", i);
+	fclose(tf);
+
+	// 主機以 pipe 作為鍵盤輸入：先送一個鍵跳過開始畫面，結束時送 q 存檔離開
+	int keys[2];
+	if (pipe(keys) != 0) {
+		perror("pipe");
+		return 1;
+	}
+	char port_arg[16];
+	snprintf(port_arg, sizeof(port_arg), "%d", bench_port);
+	pid_t host = fork();
+	if (host == 0) {
+		dup2(keys[0], STDIN_FILENO);
+		close(keys[1]);
+		int devnull = open("/dev/null", O_WRONLY);
+		if (devnull >= 0) {
+			dup2(devnull, STDOUT_FILENO);
+			dup2(devnull, STDERR_FILENO);
+		}
+		execl(bench_exe, bench_exe, "--host", port_arg, path, (char *)NULL);
+		_exit(127);
+	}
+	close(keys[0]);
+	if (host < 0 || write(keys[1], " ", 1) != 1) {
+		perror("fork");
+		return 1;
+	}
+
+	for (int i = 0; i < MAX_IDS; i++) bench_id_index[i] = -1;
+	bench = (BenchClient *)calloc((size_t)bench_clients, sizeof(BenchClient));
+	if (!bench) return 1;
+	int first_fd = -1;
+	for (int tries = 0; tries < 100 && first_fd < 0; tries++) {
+		first_fd = bench_connect(bench_port);
+		if (first_fd < 0) usleep(50 * 1000);
+	}
+	if (first_fd < 0) {
+		printf("無法連線到主機（%s --host %d）\n", bench_exe, bench_port);
+		kill(host, SIGTERM);
+		waitpid(host, NULL, 0);
+		unlink(path);
+		return 1;
+	}
+	int expected = (int)(bench_rate * bench_secs) + 64;
+	for (int i = 0; i < bench_clients; i++) {
+		BenchClient *b = &bench[i];
+		b->index = i;
+		b->seed = (unsigned)(i * 7919 + getpid());
+		b->fd = (i == 0) ? first_fd : bench_connect(bench_port);
+		b->sent_cap = expected;
+		b->sent_at = (int64_t *)calloc((size_t)expected, sizeof(int64_t));
+		b->seen = (int *)calloc((size_t)bench_clients, sizeof(int));
+		if (b->fd < 0 || !b->sent_at || !b->seen) {
+			printf("建立第 %d 位參與者失敗\n", i + 1);
+			return 1;
+		}
+	}
+	// sent_at 預留整段量測所需的空間，之後不再搬移
+	for (int i = 0; i < bench_clients; i++) {
+		pthread_create(&bench[i].thread, NULL, bench_client_thread, &bench[i]);
+	}
+
+	// 等待所有人完成同步
+	int64_t t_sync = mono_ns();
+	while (__atomic_load_n(&bench_synced, __ATOMIC_ACQUIRE) < bench_clients) {
+		if (mono_ns() - t_sync > (int64_t)30e9) {
+			printf("同步逾時：%d/%d 位參與者完成\n", bench_synced, bench_clients);
+			break;
+		}
+		usleep(10 * 1000);
+	}
+	double sync_ms = (mono_ns() - t_sync) / 1e6;
+
+	// 量測
+	double cpu0 = proc_cpu_secs(host);
+	int64_t t0 = mono_ns();
+	__atomic_store_n(&bench_phase, 1, __ATOMIC_RELEASE);
+	usleep((useconds_t)(bench_secs * 1e6));
+	__atomic_store_n(&bench_phase, 2, __ATOMIC_RELEASE);
+	double elapsed = (mono_ns() - t0) / 1e9;
+	double cpu = proc_cpu_secs(host) - cpu0;
+
+	// 停止送出後等待所有在途操作確認、各方版本一致
+	int64_t t_quiet = mono_ns();
+	int quiet = 0;
+	while (!quiet && mono_ns() - t_quiet < (int64_t)5e9) {
+		usleep(20 * 1000);
+		int maxv = 0, busy = 0;
+		for (int i = 0; i < bench_clients; i++) {
+			int v = __atomic_load_n(&bench[i].version, __ATOMIC_ACQUIRE);
+			if (v > maxv) maxv = v;
+			busy |= __atomic_load_n(&bench[i].inflight, __ATOMIC_ACQUIRE);
+		}
+		quiet = !busy;
+		for (int i = 0; quiet && i < bench_clients; i++) {
+			quiet = (__atomic_load_n(&bench[i].version, __ATOMIC_ACQUIRE) == maxv);
+		}
+	}
+	__atomic_store_n(&bench_phase, 3, __ATOMIC_RELEASE);
+	for (int i = 0; i < bench_clients; i++) {
+		pthread_join(bench[i].thread, NULL);
+	}
+
+	// 主機存檔離開後讀回最終內容
+	if (write(keys[1], "q", 1) != 1) kill(host, SIGTERM);
+	close(keys[1]);
+	int status = 0;
+	waitpid(host, &status, 0);
+	FILE *hf = fopen(path, "r");
+	char *hbuf = NULL;
+	size_t hlen = 0;
+	if (hf) {
+		size_t cap = 0;
+		while (1) {
+			if (hlen + 65536 > cap) {
+				cap = cap ? cap * 2 : 65536 * 2;
+				char *nb = (char *)realloc(hbuf, cap);
+				if (!nb) break;
+				hbuf = nb;
+			}
+			size_t n = fread(hbuf + hlen, 1, 65536, hf);
+			if (n == 0) break;
+			hlen += n;
+		}
+		fclose(hf);
+	}
+	unlink(path);
+
+	// 彙整
+	Hist *apply = (Hist *)calloc(1, sizeof(Hist));
+	Hist *ack = (Hist *)calloc(1, sizeof(Hist));
+	if (!apply || !ack) return 1;
+	uint64_t ops = 0, cursors = 0, stalls = 0, errors = 0;
+	int diverged = 0;
+	uint64_t ref = hash_bytes(bench[0].doc, bench[0].len);
+	for (int i = 0; i < bench_clients; i++) {
+		BenchClient *b = &bench[i];
+		hist_merge(apply, &b->apply);
+		hist_merge(ack, &b->ack);
+		ops += (uint64_t)b->sent_count;
+		cursors += b->cursors;
+		stalls += b->stalls;
+		errors += b->errors;
+		if (hash_bytes(b->doc, b->len) != ref || b->version != bench[0].version) diverged++;
+	}
+	int host_ok = hbuf && hash_bytes(hbuf, hlen) == ref;
+
+	printf("livebench：%d 位參與者，%.1f 秒，每人每秒 %.0f 個操作，比例 修改:插入:刪除:游標 = %d:%d:%d:%d\n",
+	       bench_clients, elapsed, bench_rate, bench_mix[0], bench_mix[1], bench_mix[2], bench_mix[3]);
+	printf("同步：%.1f ms（%d 行）\n", sync_ms, bench_lines);
+	printf("吞吐量：定序 %llu 個編輯（%.0f/s），送達 %llu 次（%.0f/s），游標 %llu 次；等待確認而延後 %llu 次\n",
+	       (unsigned long long)ops, ops / elapsed, (unsigned long long)apply->total, apply->total / elapsed,
+	       (unsigned long long)cursors, (unsigned long long)stalls);
+	hist_print("延遲（送出 → 各參與者套用）：", apply);
+	hist_print("確認（送出 → 自己的回聲）：  ", ack);
+	printf("主機 CPU：%.1f%%（%.2f 秒）\n", 100.0 * cpu / elapsed, cpu);
+	if (!quiet) printf("警告：停止送出 5 秒後仍有操作未確認\n");
+	if (diverged == 0 && host_ok && errors == 0) {
+		printf("一致性：%d 位參與者與主機內容一致（版本 %d，%d 行）\n", bench_clients, bench[0].version, bench[0].lines);
+	} else {
+		printf("一致性：%d 位參與者與第 1 位不同，主機%s，協定錯誤 %llu 次\n", diverged,
+		       host_ok ? "一致" : "不一致", (unsigned long long)errors);
+	}
+	return (diverged == 0 && host_ok && errors == 0) ? 0 : 2;
+}
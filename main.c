@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,31 +7,69 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <regex.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stddef.h>
 
 struct termios orig_termios;
 
 #define VISIBLE_LINES 15  // 一次顯示的行數
 
-// 剪貼板緩衝區（用於複製貼上）
-char clipboard[512] = {0};
+// 剪貼板（用於複製貼上）：可存放多行，各行以換行分隔，最後一行不含換行，隨需成長
+char *clipboard = NULL;
+size_t clipboard_len = 0;       // 內容長度
+int clipboard_lines = 0;        // 行數
 int clipboard_has_content = 0;  // 標記剪貼板是否有內容
 
 // 編輯器狀態結構體（每個文件一個）
 typedef struct {
     int type;               // 逆操作類型
     int line;               // 相關行號
-    char content[512];      // 逆操作所需內容（例如原行內容或插入內容）
+    int count;              // 多行操作的行數
+    char *text;             // 要換回的原內容（動態配置，各行以換行分隔，不限長度）
+    int nlines;             // text 的行數
 } UndoEntry;
 
+// 上次排入保存後修改過的位元組範圍（以目前內容的位移表示）
+#define DIRTY_RANGES_MAX 64
+typedef struct {
+    size_t start[DIRTY_RANGES_MAX];  // 長度不變的修改區段 [start, end)，依位置排序且互不相鄰
+    size_t end[DIRTY_RANGES_MAX];
+    int count;
+    int has_tail;           // 有改變長度的修改：tail 之後全部重寫
+    size_t tail;
+    int full;               // 無法以區段表示（區段過多、內容整份取代）：整份保存
+} DirtyRanges;
+
 typedef struct {
     char filename[256];
-    char buffer[1024];
+    char *buffer;           // 文件內容（動態配置，以 '\0' 結尾）
+    size_t length;          // 內容長度（不含 '\0'）
+    size_t capacity;        // 已配置大小
     int current_line;
     int row_offset;
+    int sel_anchor;         // 選取範圍的起點行（另一端是 current_line），0 表示沒有選取
     int total_lines;
+    int no_final_nl;        // 最後一行沒有換行：開啟或取得快照時決定，之後的編輯都維持（最後一行是空行時除外）
     char search_term[128];
     int search_mode;
     int search_result_line;
@@ -40,6 +79,26 @@ typedef struct {
     UndoEntry undo_stack[100];
     int undo_top;
     int suppress_undo;  // 正在執行復原時避免將操作再次推入堆疊
+    unsigned long edit_gen;    // 內容每次修改遞增
+    unsigned long queued_gen;  // 已交給背景寫入執行緒的版本
+    unsigned long saved_gen;   // 已寫入磁碟的版本（由寫入執行緒更新）
+    int save_errno;            // 最近一次保存失敗的 errno（0 表示成功）
+    double dirty_since;        // 第一筆未排入保存的修改時間（毫秒），0 表示沒有
+    double save_due;           // 防抖到期時間（毫秒），0 表示沒有排程
+    int journal;               // 日誌模式：修改逐筆附加到 <文件>.journal
+    int journal_stale;         // 內容有日誌無法表示的變動（分塊快照），需整份重寫
+    size_t journal_bytes;      // 上次壓實後寫入日誌的位元組數
+    int journal_records;       // 上次壓實後寫入日誌的紀錄數
+    DirtyRanges dirty;         // 上次排入保存後的修改範圍
+    unsigned long long save_last_bytes;   // 最近一次保存實際寫入的位元組數（寫入執行緒更新）
+    unsigned long long save_total_bytes;  // 開啟以來累計寫入的位元組數
+    int loading;               // 背景載入中：buffer 只有開頭一段，total_lines 是這一段的行數
+    int view_line;             // 上次畫面起始行（0 表示沒有）與它的位移，捲動時從這裡開始找
+    size_t view_off;
+    unsigned long view_gen;    // 記錄時的 edit_gen；內容被修改過就不能沿用
+    int line_hint;             // 最近一次查到的行號（0 表示沒有）與它的位移，找相鄰的行時從這裡開始
+    size_t line_hint_off;
+    unsigned long line_hint_gen;  // 記錄時的 edit_gen；修改在這一行之後時會跟著更新
 } EditorState;
 
 // 全局變數
@@ -54,11 +113,21 @@ void insert_new_line(EditorState *ed, int after_line);
 int delete_line(EditorState *ed, int line_to_delete);
 void paste_line(EditorState *ed, int after_line);
 static void undo_last_action(EditorState *ed);
-// 供 undo 使用之前置宣告，避免隱式宣告
-static void replace_line_silent(char *buffer, int line_no, const char *new_content);
-static void insert_after_silent(char *buffer, int after_line, const char *payload);
-static void delete_line_silent(char *buffer, int line_to_delete);
+static int autosave_timeout_ms(void);
+static int autosave_tick(void);
+static void journal_record(EditorState *ed, size_t off, size_t del, const char *ins, size_t ins_len);
+static void dirty_mark(DirtyRanges *d, size_t off, size_t del, size_t ins);
+static void swap_record(EditorState *ed, size_t off, size_t del, const char *ins, size_t ins_len);
+static void swap_snapshot(int idx);
+static void swap_msync(int idx);
+static void follow_drain(void);
+static int follow_timeout_ms(int timeout);
+static int follow_paint_due(void);
+static char read_key_raw(void);
 char read_key();
+char read_key_or_refresh();
+void clear_screen();
+static int editor_load_finish(int idx, int wait);
 
 // ===== Live Share（即時共同編輯）相關 =====
 enum {
@@ -69,20 +138,69 @@ enum {
 
 enum LiveOpType {
 	OP_SYNC_FULL = 1,
-	OP_EDIT_LINE = 2,
+	OP_EDIT_LINE = 2,      // 2..5 為舊版單行操作，已由 OP_SPLICE 取代
 	OP_INSERT_AFTER = 3,
 	OP_DELETE_LINE = 4,
 	OP_PASTE_AFTER = 5,
 	OP_CURSOR = 6,
-	OP_HELLO = 7
+	OP_HELLO = 7,
+	OP_SYNC_BEGIN = 8,   // 分塊快照開始：payload "原始總長 塊數 版本 最後一行沒有換行"
+	OP_SYNC_CHUNK = 9,   // 分塊快照：line 為該塊原始長度，payload 為壓縮資料
+	OP_SYNC_END = 10,    // 分塊快照結束
+	OP_SPLICE = 11,      // 行層級編輯：line 為起始行，附帶 del/nlines 與版本資訊
+	OP_RESUME_END = 12,  // 續傳結束：payload "起始版本 結束版本"
+	OP_RELAY = 13,       // 主機 → 加入者：指定轉送樹上游 "id 位址 port"（id 1 為主機直接廣播）；加入者 → 主機：要求改派
+	OP_RESYNC = 14,      // 加入者 → 主機：收到的操作有缺漏，請補送 line 版本之後的操作
+	OP_BATCH = 15,       // 主機 → 觀看者：多個廣播封包合併壓縮，line 為原始長度
+	OP_CHARS = 16        // 字元層級編輯：line 為所在行，del/nlines 欄位改放起始位元組與刪除位元組數，payload 為插入的內容
 };
 
+// 統一的行層級編輯：從第 pos 行起刪除 del 行，再插入 text 中的 nlines 行
+// 編輯一行 = (L,1,1)、在 L 後插入 = (L+1,0,1)、刪除一行 = (L,1,0)
+typedef struct {
+	int pos;        // 起始行（1 起算）
+	int del;        // 刪除行數
+	int nlines;     // 插入行數（text 以 '\n' 分隔）
+	char *text;     // 插入內容（動態配置，可為 NULL）
+	size_t tlen;
+	int chars;      // 字元層級編輯：第 pos 行從位元組 col 起刪除 cdel 位元組，插入 text（不含換行）；del/nlines 不使用
+	int col;
+	int cdel;
+	int origin;     // 發起者 id
+	int version;    // 主機定序後的版本，0 表示尚未定序
+	int doc;        // 文件編號（即 editors[] 索引）
+	long long t_send;   // 發起者送出的時間（主機時鐘，微秒），0 表示未知
+	long long t_relay;  // 主機定序並廣播的時間（主機時鐘，微秒），0 表示未知
+} LiveOp;
+
+// 網路封包標頭："OP type doc line len [ver base origin del nlines [tsend trelay]]\n"
+// doc 為文件編號；連線層級的封包（HELLO）固定為 0
+typedef struct {
+	int type;
+	int doc;
+	int line;
+	size_t len;
+	int ver;        // 主機指派的版本
+	int base;       // 發送端送出時已知的版本
+	int origin;     // 發起者 id
+	int del;        // OP_SPLICE：刪除行數（OP_CHARS：起始位元組）
+	int nlines;     // OP_SPLICE：插入行數（OP_CHARS：刪除位元組數）
+	long long tsend;    // OP_SPLICE：送出時間（主機時鐘，微秒），0 表示未知
+	long long trelay;   // OP_SPLICE：主機廣播時間（主機時鐘，微秒），0 表示未知
+} LiveHeader;
+
+static LiveOp live_op_make(int pos, int del, const char *text, int nlines);
+static void editor_commit_local(EditorState *ed, LiveOp *op);
+static void edit_session_flush(void);
+static void edit_session_patch(EditorState *ed, const LiveOp *op);
+static void edit_session_reload(EditorState *ed);
+
 // Undo 逆操作類型
 enum UndoOpType {
 	UNDO_NONE = 0,
-	UNDO_SET_LINE = 1,                    // 將指定行設定為 content
 	UNDO_DELETE_LINE = 2,                 // 刪除指定行
-	UNDO_INSERT_AFTER_WITH_CONTENT = 3    // 在 line 之後插入 content
+	UNDO_DELETE_LINES = 4,                // 刪除 line 起的 count 行
+	UNDO_REPLACE_LINES = 5                // 把 line 起的 count 行換回 text 的 nlines 行
 };
 
 static int live_mode = LIVE_NONE;       // 0: 關閉, 1: 主機, 2: 加入
@@ -90,50 +208,492 @@ static int live_server_sock = -1;       // 僅主機使用，用於 listen
 static int live_sock = -1;              // 已連線的對等端
 static volatile int live_running = 0;   // 收發執行緒運行旗標
 static pthread_t live_thread;
-static pthread_mutex_t editor_mutex[2] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+static pthread_t live_accept_tid;       // 接受連線的執行緒（主機與轉送中的加入者）
+static int live_io_count = 0;           // 已啟動的 I/O 執行緒數
 static volatile int live_remote_line = 0; // 已廢棄（保留避免破壞原行為）
 
-#define MAX_PEERS 20
+#define LIVE_PEER_LIMIT 4096   // 同時連線人數上限（僅作防護，表格為動態配置）
+#define LIVE_IO_THREADS 4      // 主機端處理所有連線的 I/O 執行緒數
 static int live_self_id = 1; // host 為 1；client 由主機指定
-static int live_peer_line[MAX_PEERS + 1] = {0}; // 1..MAX_PEERS 的每位參與者所在行
-static int live_peer_col[MAX_PEERS + 1] = {0};  // 1..MAX_PEERS 的每位參與者所在欄位（內容游標）
 
-// Host 端多連線管理
+// 參與者游標，依 line 排序，
+// 繪製時以二分搜尋找出可見範圍，成本只與畫面內的參與者數量有關
 typedef struct {
-	int fd;
 	int id;
-	int in_use;
-	pthread_t thread;
+	int line;
+	int col;     // 內容游標欄位
+} LivePresence;
+
+// 無鎖多生產者單消費者佇列（Vyukov 侵入式 MPSC）
+// 生產者只做一次原子交換，消費者獨佔 tail；節點以 LiveNode 作為第一個成員嵌入
+typedef struct LiveNode {
+	struct LiveNode *next;
+} LiveNode;
+
+typedef struct {
+	LiveNode *head;   // 生產者推入端
+	LiveNode *tail;   // 消費者取出端
+	LiveNode stub;
+} LiveQueue;
+
+// 同機共享記憶體傳輸（--host shm:NAME / --join shm:NAME）
+// 主機與每位參與者共用一段 memfd，內含兩個單生產者單消費者的位元組環狀緩衝區，
+// 承載與 TCP 相同的位元組串流，封包格式與處理流程完全共用。
+// 加入時經由抽象命名空間的 unix socket 以 SCM_RIGHTS 取得 memfd 與兩個 eventfd，之後該 socket 只用來偵測對方離線
+#define LIVE_SHM_RING (1u << 18)   // 每個方向的緩衝區大小（2 的次方）
+typedef struct {
+	uint32_t head;      // 生產者累計寫入量
+	uint32_t tail;      // 消費者累計讀取量；阻塞的生產者以 futex 等待其變化
+	int sleeping;       // 消費者發現沒有資料、準備等待：生產者寫入後需以 eventfd 喚醒
+	int want_space;     // 生產者等待空間：消費者讀取後需喚醒
+	char data[LIVE_SHM_RING];
+} LiveRing;
+
+typedef struct {
+	LiveRing up;        // 參與者 → 主機
+	LiveRing down;      // 主機 → 參與者
+} LiveShmSeg;
+
+typedef struct {
+	LiveShmSeg *seg;
+	LiveRing *tx;       // 本端寫入
+	LiveRing *rx;       // 本端讀取
+	int tx_efd;         // 通知對方（有新資料或騰出空間）
+	int rx_efd;         // 對方通知本端
+	int ctl;            // 交握用的 unix socket，斷線時收到 HUP
+	int dead;           // 本端已關閉或對方停止讀取，阻塞寫入立即失敗
+} LiveShm;
+
+static LiveShm *live_sock_shm = NULL;   // client 端的共享記憶體連線（live_sock 為其交握 socket）
+static char live_shm_name[64];          // 非空時改用同機共享記憶體傳輸
+
+// Host 端多連線管理：每個連線由固定的 I/O 執行緒以 epoll 處理
+// 連線表、佇列中的訊息與同步工作各持有一個參考，最後一個釋放者負責關閉與釋放
+typedef struct {
+	int fd;
+	int id;                      // 收到 HELLO 後分配，0 表示尚未分配
+	unsigned ready;              // 已同步的文件（位元遮罩），只接收這些文件的廣播
+	int worker;                  // 負責的 I/O 執行緒
+	int refs;
+	int closed;                  // 已斷線，不再送出
+	pthread_mutex_t send_mutex;  // 保護以下輸出狀態，避免封包交錯
+	int syncing;                 // 傳送中的同步工作數，期間的封包一律排入輸出佇列
+	int want_out;                // 已向 epoll 註冊可寫事件
+	char *out;                   // 尚未送出的資料（送出不阻塞 UI，由 I/O 執行緒在可寫時補送）
+	size_t out_len;
+	size_t out_cap;
+	char *in;                    // 尚未解析的接收資料
+	size_t in_len;
+	size_t in_cap;
+	LiveShm *shm;                // 共享記憶體連線；NULL 表示 TCP（fd 為交握用的 unix socket）
+	// 轉送樹（以下由 live_clients_mutex 保護）
+	int parent;                  // 主機模式：上游 id，1 表示由主機直接廣播；加入者的下游固定為 0
+	int children;                // 由此節點轉送的下游數
+	int depth;                   // 與主機的距離，沿上游到下游嚴格遞增
+	int relay_port;              // 可供下游連入的 port，0 表示無法轉送
+	unsigned subs;               // 訂閱的文件
+	char addr[INET6_ADDRSTRLEN];
+	int spectator;               // 觀看者：不分配 id、不在轉送樹中，廣播改由共用串流送達
+	int64_t spec_off;            // 觀看者在共用串流中的下一個位置，-1 表示尚未同步（send_mutex 保護）
 } ClientInfo;
 
-static ClientInfo live_clients[MAX_PEERS] = {0};
+#define LIVE_OUT_MAX (64u << 20)  // 輸出佇列上限，超過視為對方停止接收而中斷連線
+#define LIVE_FRAME_MAX LIVE_OUT_MAX  // 收到的封包 payload 上限：更大的封包也無法轉送給其他人，視為協定錯誤
+
+static ClientInfo **live_clients = NULL;   // 目前連線（緊密排列）
+static int live_client_count = 0;
+static int live_client_cap = 0;
 static pthread_mutex_t live_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int next_assign_id = 2;
+// 已釋放的 id 以 FIFO 回收，最久未使用者優先，讓剛斷線的人較有機會以原 id 續傳
+static int *live_free_ids = NULL;
+static int live_free_head = 0;
+static int live_free_count = 0;
+static int live_free_cap = 0;
+static int live_epoll_fd[LIVE_IO_THREADS];
+static pthread_t live_io_threads[LIVE_IO_THREADS];
+static LiveQueue live_jobs[LIVE_IO_THREADS];   // UI 執行緒交給各 I/O 執行緒的同步工作
+static int live_job_fd[LIVE_IO_THREADS];       // 通知 I/O 執行緒有新工作的 eventfd
+static pthread_mutex_t live_sock_mutex = PTHREAD_MUTEX_INITIALIZER; // client 端送出序列化
+
+// 加入者的連線狀態
+static char live_join_host[64];
+static int live_join_port = 0;
+static volatile int live_connected = 0;  // 目前是否連線中
+static volatile int live_reconnects = 0;         // 本次斷線後的重試次數
+
+// 快照串流狀態（client 端）
+#define LIVE_SYNC_CHUNK 16384   // 快照每塊的原始大小
+typedef struct {
+	int active;               // 正在接收分塊
+	size_t raw_total;         // 快照原始總長
+	int no_final_nl;          // 主機文件的 no_final_nl，-1 表示主機沒有提供
+	size_t raw_received;      // 已套用的原始位元組
+	size_t wire_received;     // 已接收的壓縮位元組
+	double t_begin;           // 開始接收時間（ms）
+	double t_end;             // 完成時間（ms），未完成為 0
+	double first_render_ms;   // 首次繪製距開始的時間，尚未繪製為 -1
+} LiveSyncStats;
+
+// 經由不同路徑（轉送樹、主機補送）收到、尚無法依版本順序套用的操作
+typedef struct {
+	LiveHeader h;
+	char *payload;
+} LiveHeld;
+
+// 每份共享文件的同步狀態，文件編號即 editors[] 索引
+// 網路執行緒只負責解碼並把封包推入 live_inbox，文件內容與以下狀態只由 UI 執行緒存取，不需上鎖
+// 主機：已定序操作的環狀紀錄，版本 v 存於 log[v % LIVE_LOG_MAX]，用來轉換基於舊版本的操作
+// 加入者：尚未確認的本地操作，pending[0] 在 inflight 時為已送出、等待回聲確認者
+#define LIVE_LOG_MAX 4096
+#define LIVE_MAX_DOCS 2
+typedef struct {
+	int version;
+	LiveOp log[LIVE_LOG_MAX];
+	LiveOp *pending;
+	int pending_count;
+	int pending_cap;
+	int inflight;
+	int synced;              // 曾完整同步過（可續傳）
+	int resuming;            // 等待續傳結束，期間不送出新操作
+	int resume_id;           // 斷線前的 id（用於辨識續傳中自己操作的回聲）
+	int resumed_ops;         // 上次續傳補送的操作數，-1 表示未續傳過
+	LiveHeld *held;          // 加入者：版本不連續而暫存的操作，依版本排序
+	int held_count;
+	int held_cap;
+	int gap_req;             // 已向主機要求補送缺漏
+	LiveSyncStats sync;
+	LivePresence *presence;  // 參與者游標
+	int presence_count;
+	int presence_cap;
+} LiveDoc;
+
+static LiveDoc live_docs[LIVE_MAX_DOCS];
+
+// 觀看者（--watch）：只接收、不送出編輯的跟隨者，不分配 id，也不計入參與人數
+// 主機把廣播累積成批，由 UI 執行緒壓縮成一個 OP_BATCH 附加到共用串流；
+// 所有觀看者從各自的位置讀取同一份壓縮資料，編碼成本與觀看人數無關
+#define LIVE_SPEC_RING (8u << 20)     // 共用串流保留的壓縮資料量（2 的次方），落後超過即中斷連線
+#define LIVE_SPEC_BATCH (64u << 10)   // 待發布的批次累積到此大小就先發布
+static pthread_rwlock_t live_spec_lock = PTHREAD_RWLOCK_INITIALIZER;  // 發布者寫入、I/O 執行緒讀取
+static char *live_spec_ring = NULL;
+static int64_t live_spec_end = 0;      // 已發布的累計位元組數
+static pthread_mutex_t live_spec_batch_mutex = PTHREAD_MUTEX_INITIALIZER;  // 保護待發布批次，發布依序進行
+static char *live_spec_batch = NULL;
+static size_t live_spec_batch_len = 0;
+static size_t live_spec_batch_cap = 0;
+static uint8_t *live_spec_zbuf = NULL;
+static size_t live_spec_zcap = 0;
+static int live_spec_count = 0;        // 目前的觀看者數（原子存取），為 0 時不累積
+static int live_spectator = 0;         // 加入者：以觀看者身分連線
+
+// 轉送樹：主機只直接廣播給少數下游，其餘參與者由其他加入者逐層轉送，主機的上傳量與總人數無關
+// 快照、續傳與補送仍由主機經各自的連線送出；編輯操作以版本號確保各路徑收到的順序一致
+#define LIVE_RELAY_FANOUT 8     // 每個節點（含主機）最多直接轉送的下游數
+static int live_host_children = 0;   // 主機直接廣播的參與者數（live_clients_mutex 保護）
+
+// 加入者的轉送狀態（live_relay_mutex 保護）；轉送與補送在同一把鎖下進行，下游收到的順序不會交錯
+typedef struct {
+	int ver;                 // 0 表示空位
+	char *frame;             // 原始封包（標頭 + payload）
+	size_t len;
+} LiveRelayFrame;
+
+static pthread_mutex_t live_relay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t live_relay_cond = PTHREAD_COND_INITIALIZER;
+static int live_parent_id = 1;             // 目前的上游，1 表示由主機直接廣播
+static char live_parent_addr[INET6_ADDRSTRLEN];
+static int live_parent_port = 0;
+static int live_parent_gen = 0;            // 每次改派加一，轉送執行緒據此重新連線
+static int live_parent_sock = -1;
+static pthread_t live_parent_thread;
+static int live_relay_port = 0;            // 本機供下游連入的 port，0 表示不轉送
+static int live_relay_ver[LIVE_MAX_DOCS];  // 已轉送的最新版本，-1 表示尚未收到
+static LiveRelayFrame *live_relay_log[LIVE_MAX_DOCS];  // 最近轉送的操作，供新接上的下游補送
+
+// 網路執行緒送往 UI 執行緒的訊息
+enum {
+	LIVE_MSG_FRAME = 0,        // 收到的封包
+	LIVE_MSG_JOIN = 1,         // 主機：參與者要求同步 doc（h.base 為續傳起點，-1 表示送快照）
+	LIVE_MSG_LEAVE = 2,        // 主機：參與者 h.origin 離線
+	LIVE_MSG_DISCONNECTED = 3, // 加入者：與主機斷線
+	LIVE_MSG_CONNECTED = 4,    // 加入者：已重新連線，需送出 HELLO
+	LIVE_MSG_RESYNC = 5        // 主機：參與者要求補送 doc 版本 h.line 之後的操作
+};
+
+typedef struct {
+	LiveNode node;
+	int kind;
+	LiveHeader h;
+	char *payload;
+	ClientInfo *from;          // 主機端的來源連線（持有參考），加入者為 NULL
+} LiveMsg;
+
+// UI 執行緒準備好、交由連線所屬 I/O 執行緒送出的同步資料（快照或續傳）
+typedef struct {
+	LiveNode node;
+	ClientInfo *c;
+	int doc;
+	int version;
+	char *snap;                // 快照內容；NULL 表示續傳
+	size_t total;
+	int no_final_nl;           // 快照時文件的 no_final_nl
+	LiveOp *ops;               // 續傳：from 之後的紀錄
+	int count;
+	int from;
+	LivePresence *known;       // 該文件目前已知的游標
+	int nknown;
+} LiveSyncJob;
+
+static LiveQueue live_inbox;
+
+// 網路執行緒喚醒 UI 重繪用的 pipe（讀端由 read_key_or_refresh 監聽）
+static int ui_wake_fd[2] = { -1, -1 };
+
+// 追蹤模式（--follow）的 inotify，也由 read_key_or_refresh 監聽；-1 表示沒有追蹤
+static int follow_mode = 0;
+static int follow_inotify = -1;
+
+// 重播巨集中：按鍵從錄製內容取出，不重繪、不自動保存、不廣播，修改在結束時一次提交
+static int macro_replaying = 0;
+
+static void ui_wake(void) {
+	if (ui_wake_fd[1] >= 0) {
+		char c = 1;
+		ssize_t n = write(ui_wake_fd[1], &c, 1);
+		(void)n; // pipe 滿時代表已有待處理的喚醒
+	}
+}
+
+// 單調時鐘（毫秒）
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// ===== 操作延遲統計 =====
+// 每個操作帶著送出時間與主機廣播時間（皆以主機的單調時鐘表示），
+// 加入者以 HELLO 往返估計與主機的時鐘差，套用時即可拆出上行（送出 → 主機定序）與下行（定序 → 套用）
+static long long live_clock_offset = 0;   // 加入者：主機時鐘 − 本機時鐘（微秒，原子存取）
+static long long live_clock_rtt = -1;     // 估計時 HELLO 的往返時間（微秒），-1 表示尚未估計
+
+static long long live_now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 目前時間，以主機時鐘表示
+static long long live_host_clock_us(void) {
+	return live_now_us() + __atomic_load_n(&live_clock_offset, __ATOMIC_RELAXED);
+}
+
+// HDR 風格直方圖（微秒）：小於 64 逐一計數，之後每個 2 的次方區間再分 32 格，相對誤差約 3%，大小固定
+#define LIVE_HIST_BUCKETS 1216
+typedef struct {
+	uint64_t count[LIVE_HIST_BUCKETS];
+	uint64_t total;
+	long long max;
+} LiveHist;
+
+enum {
+	LIVE_LAT_UP = 0,      // 送出 → 主機定序
+	LIVE_LAT_DOWN = 1,    // 主機定序 → 本機套用
+	LIVE_LAT_TOTAL = 2,   // 送出 → 本機套用
+	LIVE_LAT_KINDS = 3
+};
+
+static LiveHist live_lat[LIVE_LAT_KINDS];   // 只由 UI 執行緒存取
+
+static int live_hist_index(long long v) {
+	if (v < 0) v = 0;
+	if (v < 64) return (int)v;
+	int e = 63 - __builtin_clzll((unsigned long long)v);
+	int idx = (e - 5) * 32 + (int)(v >> (e - 5));
+	return idx < LIVE_HIST_BUCKETS ? idx : LIVE_HIST_BUCKETS - 1;
+}
+
+// 區間的上界（百分位採保守值）
+static long long live_hist_value(int idx) {
+	if (idx < 64) return idx;
+	int shift = idx / 32 - 1;
+	long long m = idx % 32 + 32;
+	return ((m + 1) << shift) - 1;
+}
+
+static void live_hist_add(LiveHist *h, long long v) {
+	if (v < 0) v = 0;  // 時鐘差的估計誤差
+	h->count[live_hist_index(v)]++;
+	h->total++;
+	if (v > h->max) h->max = v;
+}
+
+// 第 p 百分位（微秒）
+static long long live_hist_pct(const LiveHist *h, double p) {
+	if (h->total == 0) return 0;
+	uint64_t want = (uint64_t)(p * (double)h->total);
+	if (want >= h->total) want = h->total - 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < LIVE_HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen > want) {
+			long long v = live_hist_value(i);
+			return v > h->max ? h->max : v;
+		}
+	}
+	return h->max;
+}
+
+// 記錄一個操作的延遲；apply 為套用時間（主機時鐘），未知的時間戳記為 0
+static void live_lat_record(long long tsend, long long trelay, long long apply) {
+	if (tsend > 0 && trelay > 0) live_hist_add(&live_lat[LIVE_LAT_UP], trelay - tsend);
+	if (trelay > 0) live_hist_add(&live_lat[LIVE_LAT_DOWN], apply - trelay);
+	if (tsend > 0) live_hist_add(&live_lat[LIVE_LAT_TOTAL], apply - tsend);
+}
+
+// ===== 無鎖 MPSC 佇列 =====
+static void live_queue_init(LiveQueue *q) {
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+// 任意執行緒皆可推入
+static void live_queue_push(LiveQueue *q, LiveNode *n) {
+	__atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+	LiveNode *prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
 
-static void live_lock_editor(int idx) {
-	if (idx >= 0 && idx < 2) {
-		pthread_mutex_lock(&editor_mutex[idx]);
+// 只能由單一消費者呼叫；回傳 NULL 表示佇列為空，或生產者尚未完成推入（其稍後的喚醒會再觸發取出）
+static LiveNode *live_queue_pop(LiveQueue *q) {
+	LiveNode *tail = q->tail;
+	LiveNode *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (tail == &q->stub) {
+		if (!next) return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
 	}
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) return NULL;
+	live_queue_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+// ===== 內建 LZ 壓縮（LZ4 風格區塊格式，無外部相依） =====
+// 序列格式：token(高 4 位字面長度、低 4 位匹配長度-4) [延伸長度] 字面值 offset(2B LE) [延伸長度]
+// 最後一個序列只有字面值
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+static size_t lz_bound(size_t n) {
+	return n + n / 255 + 16;
+}
+
+static uint32_t lz_read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
 }
-static void live_unlock_editor(int idx) {
-	if (idx >= 0 && idx < 2) {
-		pthread_mutex_unlock(&editor_mutex[idx]);
+
+static void lz_put_len(uint8_t **op, size_t len) {
+	while (len >= 255) {
+		*(*op)++ = 255;
+		len -= 255;
 	}
+	*(*op)++ = (uint8_t)len;
 }
 
-static int send_all(int sock, const void *buf, size_t len) {
-	const char *p = (const char *)buf;
-	size_t left = len;
-	while (left > 0) {
-		ssize_t n = send(sock, p, left, 0);
-		if (n <= 0) {
-			if (errno == EINTR) continue;
-			return -1;
+static uint8_t *lz_put_literals(uint8_t *op, const uint8_t *lit, size_t n) {
+	uint8_t *token = op++;
+	*token = (uint8_t)((n >= 15 ? 15 : n) << 4);
+	if (n >= 15) lz_put_len(&op, n - 15);
+	memcpy(op, lit, n);
+	return op + n;
+}
+
+// 壓縮 src[0..n) 至 dst（容量至少 lz_bound(n)），回傳壓縮後長度
+static size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0xff, sizeof(table));
+	uint8_t *op = dst;
+	size_t ip = 0, anchor = 0;
+	while (n >= LZ_MIN_MATCH && ip <= n - LZ_MIN_MATCH) {
+		uint32_t seq = lz_read32(src + ip);
+		uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+		uint32_t ref = table[h];
+		table[h] = (uint32_t)ip;
+		if (ref == UINT32_MAX || ip - ref > 65535 || lz_read32(src + ref) != seq) {
+			ip++;
+			continue;
 		}
-		p += n;
-		left -= (size_t)n;
+		size_t mlen = LZ_MIN_MATCH;
+		while (ip + mlen < n && src[ref + mlen] == src[ip + mlen]) mlen++;
+		uint8_t *token = op;
+		op = lz_put_literals(op, src + anchor, ip - anchor);
+		size_t off = ip - ref;
+		*op++ = (uint8_t)(off & 0xff);
+		*op++ = (uint8_t)(off >> 8);
+		size_t ml = mlen - LZ_MIN_MATCH;
+		*token |= (uint8_t)(ml >= 15 ? 15 : ml);
+		if (ml >= 15) lz_put_len(&op, ml - 15);
+		ip += mlen;
+		anchor = ip;
 	}
-	return 0;
+	op = lz_put_literals(op, src + anchor, n - anchor);
+	return (size_t)(op - dst);
+}
+
+// 解壓縮至 dst（容量 cap），回傳輸出長度；格式錯誤回傳 -1
+static long lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+	size_t ip = 0, op = 0;
+	while (ip < n) {
+		uint8_t token = src[ip++];
+		size_t lit = token >> 4;
+		if (lit == 15) {
+			uint8_t b;
+			do {
+				if (ip >= n) return -1;
+				b = src[ip++];
+				lit += b;
+			} while (b == 255);
+		}
+		if (lit > n - ip || lit > cap - op) return -1;
+		memcpy(dst + op, src + ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip >= n) break; // 最後一個序列
+		if (n - ip < 2) return -1;
+		size_t off = (size_t)src[ip] | ((size_t)src[ip + 1] << 8);
+		ip += 2;
+		if (off == 0 || off > op) return -1;
+		size_t mlen = token & 15;
+		if (mlen == 15) {
+			uint8_t b;
+			do {
+				if (ip >= n) return -1;
+				b = src[ip++];
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += LZ_MIN_MATCH;
+		if (mlen > cap - op) return -1;
+		for (size_t i = 0; i < mlen; i++) { // 允許來源與目的重疊
+			dst[op + i] = dst[op - off + i];
+		}
+		op += mlen;
+	}
+	return (long)op;
 }
 
 static int recv_line(int sock, char *buf, size_t max) {
@@ -164,611 +724,3062 @@ static int recv_all(int sock, void *buf, size_t len) {
 	return 0;
 }
 
-static void send_header_payload_to_fd(int fd, const char *header, size_t hlen, const char *payload, size_t plen) {
-	if (fd < 0) return;
-	if (send_all(fd, header, hlen) != 0) return;
-	if (plen > 0 && payload) {
-		send_all(fd, payload, plen);
+// ===== 同機共享記憶體傳輸 =====
+static void live_efd_signal(int fd) {
+	uint64_t one = 1;
+	ssize_t n = write(fd, &one, sizeof(one));
+	(void)n; // 計數器將溢位時代表已有待處理的通知
+}
+
+static void live_efd_drain(int fd) {
+	uint64_t cnt;
+	ssize_t n = read(fd, &cnt, sizeof(cnt));
+	(void)n;
+}
+
+// 跨行程的 futex（不可用 PRIVATE，兩端映射的是同一段共享記憶體）
+static void live_futex_wait(uint32_t *addr, uint32_t val, int timeout_ms) {
+	struct timespec ts = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000L };
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void live_futex_wake(uint32_t *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+static uint32_t live_ring_used(LiveRing *r) {
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+// 盡量寫入，回傳實際寫入量；消費者正在等待時才需要系統呼叫喚醒
+static size_t live_ring_write(LiveShm *s, const char *data, size_t len) {
+	LiveRing *r = s->tx;
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	size_t room = LIVE_SHM_RING - (head - tail);
+	size_t n = (len < room) ? len : room;
+	if (n == 0) return 0;
+	size_t at = head % LIVE_SHM_RING;
+	size_t first = (n < LIVE_SHM_RING - at) ? n : LIVE_SHM_RING - at;
+	memcpy(r->data + at, data, first);
+	memcpy(r->data, data + first, n - first);
+	__atomic_store_n(&r->head, head + (uint32_t)n, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&r->sleeping, 0, __ATOMIC_SEQ_CST)) live_efd_signal(s->tx_efd);
+	return n;
+}
+
+// 消費者準備等待：標記 sleeping 後再檢查一次，回傳 1 表示其間已有新資料（不需等待）
+static int live_ring_park(LiveRing *r) {
+	__atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == __atomic_load_n(&r->tail, __ATOMIC_RELAXED)) return 0;
+	__atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+	return 1;
+}
+
+// 盡量讀取，回傳實際讀取量；沒有資料時標記 sleeping，讓生產者下次寫入時喚醒
+static size_t live_ring_read(LiveShm *s, char *buf, size_t cap) {
+	LiveRing *r = s->rx;
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		if (!live_ring_park(r)) return 0;
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
 	}
+	size_t n = head - tail;
+	if (n > cap) n = cap;
+	size_t at = tail % LIVE_SHM_RING;
+	size_t first = (n < LIVE_SHM_RING - at) ? n : LIVE_SHM_RING - at;
+	memcpy(buf, r->data + at, first);
+	memcpy(buf + first, r->data, n - first);
+	__atomic_store_n(&r->tail, tail + (uint32_t)n, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&r->want_space, 0, __ATOMIC_SEQ_CST)) {
+		live_futex_wake(&r->tail);
+		live_efd_signal(s->tx_efd);
+	}
+	return n;
 }
 
-static void broadcast_header_payload_except(int except_fd, const char *header, size_t hlen, const char *payload, size_t plen) {
-	pthread_mutex_lock(&live_clients_mutex);
-	for (int i = 0; i < MAX_PEERS; i++) {
-		if (live_clients[i].in_use && live_clients[i].fd >= 0 && live_clients[i].fd != except_fd) {
-			send_header_payload_to_fd(live_clients[i].fd, header, hlen, payload, plen);
+// 對方是否已離線（交握 socket 收到 HUP）
+static int live_shm_peer_gone(LiveShm *s) {
+	struct pollfd p = { s->ctl, POLLRDHUP, 0 };
+	return poll(&p, 1, 0) > 0 && p.revents != 0;
+}
+
+// 阻塞寫入全部資料；對方離線、本端關閉或 5 秒內都沒有騰出空間時失敗（與 TCP 的送出逾時一致）
+static int live_shm_write_all(LiveShm *s, const char *data, size_t len) {
+	int waited = 0;
+	while (len > 0) {
+		if (__atomic_load_n(&s->dead, __ATOMIC_ACQUIRE)) return -1;
+		size_t n = live_ring_write(s, data, len);
+		data += n;
+		len -= n;
+		if (n > 0) {
+			waited = 0;
+			continue;
+		}
+		uint32_t tail = __atomic_load_n(&s->tx->tail, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&s->tx->want_space, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&s->tx->tail, __ATOMIC_SEQ_CST) != tail) continue;
+		live_futex_wait(&s->tx->tail, tail, 100);
+		if (++waited >= 50 || live_shm_peer_gone(s)) {
+			__atomic_store_n(&s->dead, 1, __ATOMIC_RELEASE);
+			return -1;
 		}
 	}
-	pthread_mutex_unlock(&live_clients_mutex);
+	return 0;
 }
 
-static void live_broadcast_simple(enum LiveOpType t, int line) {
-	char header[128];
-	int header_len = snprintf(header, sizeof(header), "OP %d %d 0\n", (int)t, line);
-	if (header_len <= 0) return;
-	if (live_mode == LIVE_HOST) {
-		broadcast_header_payload_except(-1, header, (size_t)header_len, NULL, 0);
-	} else if (live_mode == LIVE_JOIN) {
-		if (live_sock >= 0) {
-			send_all(live_sock, header, (size_t)header_len);
+static int live_shm_send_frame(LiveShm *s, const char *header, size_t hlen, const char *payload, size_t plen) {
+	if (live_shm_write_all(s, header, hlen) != 0) return -1;
+	if (plen > 0 && payload) return live_shm_write_all(s, payload, plen);
+	return 0;
+}
+
+// 阻塞讀取剛好 len 位元組；以 poll 同時等待資料通知與交握 socket 的 HUP（對方離線或本端停止）
+static int live_shm_read_all(LiveShm *s, char *buf, size_t len) {
+	int hup = 0;
+	while (len > 0) {
+		size_t n = live_ring_read(s, buf, len);
+		if (n > 0) {
+			buf += n;
+			len -= n;
+			continue;
+		}
+		if (hup) return -1;
+		struct pollfd p[2] = { { s->rx_efd, POLLIN, 0 }, { s->ctl, POLLRDHUP, 0 } };
+		if (poll(p, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			return -1;
 		}
+		if (p[0].revents & POLLIN) live_efd_drain(s->rx_efd);
+		if (p[1].revents) hup = 1;  // 先讀完對方離線前寫入的資料
 	}
+	return 0;
 }
 
-static void live_broadcast_with_payload(enum LiveOpType t, int line, const char *payload) {
-	size_t plen = payload ? strlen(payload) : 0;
-	char header[128];
-	int header_len = snprintf(header, sizeof(header), "OP %d %d %zu\n", (int)t, line, plen);
-	if (header_len <= 0) return;
-	if (live_mode == LIVE_HOST) {
-		broadcast_header_payload_except(-1, header, (size_t)header_len, payload, plen);
-	} else if (live_mode == LIVE_JOIN) {
-		if (live_sock >= 0) {
-			if (send_all(live_sock, header, (size_t)header_len) != 0) return;
-			if (plen > 0) send_all(live_sock, payload, plen);
-		}
+static int live_shm_read_line(LiveShm *s, char *buf, size_t max) {
+	size_t i = 0;
+	while (i + 1 < max) {
+		if (live_shm_read_all(s, &buf[i], 1) != 0) return -1;
+		if (buf[i++] == '\n') break;
 	}
+	buf[i] = '\0';
+	return (int)i;
 }
 
-static void live_broadcast_cursor(int current_line, int current_col) {
-	// 格式："id line col"
-	char buf[64];
-	int n = snprintf(buf, sizeof(buf), "%d %d %d", live_self_id, current_line, current_col);
-	if (n <= 0) return;
-	live_broadcast_with_payload(OP_CURSOR, 0, buf);
+static void live_shm_free(LiveShm *s) {
+	if (!s) return;
+	munmap(s->seg, sizeof(LiveShmSeg));
+	close(s->tx_efd);
+	close(s->rx_efd);
+	free(s);
 }
 
-static void editor_recount_and_clamp(EditorState *ed) {
-	ed->total_lines = count_lines(ed->buffer);
-	if (ed->total_lines < 1) ed->total_lines = 1;
-	if (ed->current_line < 1) ed->current_line = 1;
-	if (ed->current_line > ed->total_lines) ed->current_line = ed->total_lines;
-	if (ed->row_offset < 1) ed->row_offset = 1;
-	if (ed->current_line >= ed->row_offset + VISIBLE_LINES) {
-		ed->row_offset = ed->current_line - VISIBLE_LINES + 1;
-	}
-	if (ed->current_line < ed->row_offset) {
-		ed->row_offset = ed->current_line;
-	}
+// 抽象命名空間位址（不在檔案系統留下檔案）
+static socklen_t live_shm_addr(struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "texteditor-live-%s", live_shm_name);
+	return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + (size_t)n);
 }
 
-// ===== Undo 工具 =====
-static void push_undo(EditorState *ed, int type, int line, const char *content) {
-    if (!ed || ed->suppress_undo) return;
-    if (ed->undo_top >= (int)(sizeof(ed->undo_stack) / sizeof(ed->undo_stack[0]))) {
-        // 滿了就移除最舊的一個
-        for (int i = 1; i < ed->undo_top; i++) {
-            ed->undo_stack[i - 1] = ed->undo_stack[i];
-        }
-        ed->undo_top--;
-    }
-    UndoEntry *e = &ed->undo_stack[ed->undo_top++];
-    e->type = type;
-    e->line = line;
-    if (content) {
-        strncpy(e->content, content, sizeof(e->content) - 1);
-        e->content[sizeof(e->content) - 1] = '\0';
-    } else {
-        e->content[0] = '\0';
-    }
+// Host 端：為新連線建立共享區段與兩個 eventfd，經由 SCM_RIGHTS 交給對方
+static LiveShm *live_shm_offer(int cfd) {
+	LiveShm *s = (LiveShm *)calloc(1, sizeof(LiveShm));
+	if (!s) return NULL;
+	int mfd = memfd_create("texteditor-live", MFD_CLOEXEC);
+	int up = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int down = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	void *seg = MAP_FAILED;
+	if (mfd >= 0 && up >= 0 && down >= 0 && ftruncate(mfd, sizeof(LiveShmSeg)) == 0) {
+		seg = mmap(NULL, sizeof(LiveShmSeg), PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+	}
+	int sent = -1;
+	if (seg != MAP_FAILED) {
+		// 雙方都尚未開始讀取，第一筆寫入就需要喚醒
+		((LiveShmSeg *)seg)->up.sleeping = 1;
+		((LiveShmSeg *)seg)->down.sleeping = 1;
+		int fds[3] = { mfd, up, down };
+		char cbuf[CMSG_SPACE(sizeof(fds))];
+		memset(cbuf, 0, sizeof(cbuf));
+		char tag = 'S';
+		struct iovec iov = { &tag, 1 };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(fds));
+		memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+		sent = (int)sendmsg(cfd, &msg, MSG_NOSIGNAL);
+	}
+	if (mfd >= 0) close(mfd);
+	if (sent != 1) {
+		if (seg != MAP_FAILED) munmap(seg, sizeof(LiveShmSeg));
+		if (up >= 0) close(up);
+		if (down >= 0) close(down);
+		free(s);
+		return NULL;
+	}
+	s->seg = (LiveShmSeg *)seg;
+	s->tx = &s->seg->down;
+	s->rx = &s->seg->up;
+	s->tx_efd = down;
+	s->rx_efd = up;
+	s->ctl = cfd;
+	return s;
 }
 
-static void undo_last_action(EditorState *ed) {
-    if (!ed) return;
-    if (ed->undo_top <= 0) {
-        printf("\n✗ 沒有可復原的動作\n");
-        printf("按任意鍵繼續...");
-        read_key();
-        return;
-    }
-    UndoEntry entry = ed->undo_stack[--ed->undo_top];
-    int ed_idx = (ed == &editors[0]) ? 0 : 1;
-    ed->suppress_undo = 1;
-    live_lock_editor(ed_idx);
-    if (entry.type == UNDO_SET_LINE) {
-        replace_line_silent(ed->buffer, entry.line, entry.content);
-        live_unlock_editor(ed_idx);
-        editor_recount_and_clamp(ed);
-        ed->current_line = entry.line;
-        live_broadcast_with_payload(OP_EDIT_LINE, entry.line, entry.content);
-    } else if (entry.type == UNDO_DELETE_LINE) {
-        delete_line_silent(ed->buffer, entry.line);
-        live_unlock_editor(ed_idx);
-        editor_recount_and_clamp(ed);
-        if (ed->current_line > ed->total_lines) ed->current_line = ed->total_lines;
-        if (ed->current_line < 1) ed->current_line = 1;
-        live_broadcast_simple(OP_DELETE_LINE, entry.line);
-    } else if (entry.type == UNDO_INSERT_AFTER_WITH_CONTENT) {
-        insert_after_silent(ed->buffer, entry.line, entry.content);
-        live_unlock_editor(ed_idx);
-        editor_recount_and_clamp(ed);
-        ed->current_line = entry.line + 1;
-        live_broadcast_with_payload(OP_PASTE_AFTER, entry.line, entry.content);
-    } else {
-        live_unlock_editor(ed_idx);
-    }
-    ed->suppress_undo = 0;
-    // 自動保存與訊息
-    save_editor(ed);
-    // printf("\n✓ 已復原上一個動作\n");
-    // printf("按任意鍵繼續...");
-    // read_key();
-    // 廣播目前游標（非編輯模式，欄位用 0）
-    live_broadcast_cursor(ed->current_line, 0);
-}
-
-// 在指定行替換為新內容（不包含換行），保留行後剩餘內容
-static void replace_line_silent(char *buffer, int line_no, const char *new_content) {
-	if (line_no < 1) return;
-	char *line_start = buffer;
-	for (int i = 0; i < line_no - 1; i++) {
-		char *next = strchr(line_start, '\n');
-		if (!next) {
-			// 補到最後為止
-			line_start = buffer + strlen(buffer);
-			break;
+// Client 端：連上主機的交握 socket 並映射共享區段，回傳交握 socket，失敗回傳 -1
+static int live_shm_connect(LiveShm **out) {
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	struct sockaddr_un addr;
+	socklen_t alen = live_shm_addr(&addr);
+	int fds[3] = { -1, -1, -1 };
+	char tag = 0;
+	if (connect(fd, (struct sockaddr *)&addr, alen) == 0) {
+		char cbuf[CMSG_SPACE(sizeof(fds))];
+		struct iovec iov = { &tag, 1 };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		struct cmsghdr *cm;
+		if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) == 1 && (cm = CMSG_FIRSTHDR(&msg)) != NULL &&
+		    cm->cmsg_type == SCM_RIGHTS && cm->cmsg_len == CMSG_LEN(sizeof(fds))) {
+			memcpy(fds, CMSG_DATA(cm), sizeof(fds));
 		}
-		line_start = next + 1;
 	}
-	char *line_end = strchr(line_start, '\n');
-	char after_line[512] = {0};
-	if (line_end) {
-		strcpy(after_line, line_end);
-	} else {
-		after_line[0] = '\0';
+	LiveShm *s = NULL;
+	void *seg = MAP_FAILED;
+	if (tag == 'S' && fds[0] >= 0) {
+		seg = mmap(NULL, sizeof(LiveShmSeg), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+		close(fds[0]);
 	}
-	size_t new_len = new_content ? strlen(new_content) : 0;
-	// 將新內容寫入並接回後續
-	if (new_len > 0) {
-		strcpy(line_start, new_content);
-		strcpy(line_start + new_len, after_line);
-	} else {
-		// 清空此行
-		strcpy(line_start, after_line[0] ? after_line + 1 : "");
+	if (seg != MAP_FAILED) s = (LiveShm *)calloc(1, sizeof(LiveShm));
+	if (!s) {
+		if (seg != MAP_FAILED) munmap(seg, sizeof(LiveShmSeg));
+		if (fds[1] >= 0) close(fds[1]);
+		if (fds[2] >= 0) close(fds[2]);
+		close(fd);
+		return -1;
 	}
+	s->seg = (LiveShmSeg *)seg;
+	s->tx = &s->seg->up;
+	s->rx = &s->seg->down;
+	s->tx_efd = fds[1];
+	s->rx_efd = fds[2];
+	s->ctl = fd;
+	*out = s;
+	return fd;
 }
 
-// 在 after_line 之後插入一行，內容為 payload（可為空）
-static void insert_after_silent(char *buffer, int after_line, const char *payload) {
-	char *insert_pos = buffer;
-	if (after_line > 0) {
-		for (int i = 0; i < after_line; i++) {
-			char *next = strchr(insert_pos, '\n');
-			if (next) {
-				insert_pos = next + 1;
-			} else {
-				insert_pos = buffer + strlen(buffer);
-				break;
-			}
+// 標頭與 payload 以同一次 sendmsg 送出，小封包不會被拆成兩段
+// 回傳已送出的位元組數；flags 含 MSG_DONTWAIT 時送不下即返回，連線錯誤回傳 -1
+static ssize_t live_sendv(int fd, const char *header, size_t hlen, const char *payload, size_t plen, int flags) {
+	if (!payload) plen = 0;
+	size_t sent = 0;
+	while (sent < hlen + plen) {
+		struct iovec iov[2];
+		int n = 0;
+		if (sent < hlen) {
+			iov[n].iov_base = (void *)(header + sent);
+			iov[n].iov_len = hlen - sent;
+			n++;
+		}
+		if (plen > 0) {
+			size_t poff = (sent > hlen) ? sent - hlen : 0;
+			iov[n].iov_base = (void *)(payload + poff);
+			iov[n].iov_len = plen - poff;
+			n++;
+		}
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = (size_t)n;
+		ssize_t r = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+		if (r > 0) {
+			sent += (size_t)r;
+			continue;
+		}
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && (flags & MSG_DONTWAIT)) break;
+		return -1;
+	}
+	return (ssize_t)sent;
+}
+
+static void send_header_payload_to_fd(int fd, const char *header, size_t hlen, const char *payload, size_t plen) {
+	if (fd < 0) return;
+	live_sendv(fd, header, hlen, payload, plen, 0);
+}
+
+// 關閉 Nagle：封包已整個交給核心，等待對方 ACK 再送只會把延遲推到延遲確認的 40 ms
+static void live_tcp_nodelay(int fd) {
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// 以非阻塞方式盡量送出，回傳已送出的位元組數；連線錯誤時視為全部送出，由 I/O 執行緒清理
+static size_t live_try_send(int fd, const char *data, size_t len) {
+	size_t sent = 0;
+	while (sent < len) {
+		ssize_t n = send(fd, data + sent, len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n > 0) {
+			sent += (size_t)n;
+			continue;
 		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		return len;
 	}
-	char after_content[512] = {0};
-	strcpy(after_content, insert_pos);
-	const char *content = payload ? payload : "";
-	strcpy(insert_pos, content);
-	strcpy(insert_pos + strlen(content), "\n");
-	strcpy(insert_pos + strlen(content) + 1, after_content);
+	return sent;
+}
+
+static size_t live_client_try_send(ClientInfo *c, const char *data, size_t len) {
+	if (c->shm) return live_ring_write(c->shm, data, len);
+	return live_try_send(c->fd, data, len);
 }
 
-// 刪除此行（不做任何 UI 提示）
-static void delete_line_silent(char *buffer, int line_to_delete) {
-	int total = count_lines(buffer);
-	if (total <= 1) {
+// 中斷連線；共享記憶體連線另外讓阻塞中的寫入立即失敗
+static void live_client_shutdown(ClientInfo *c) {
+	if (c->shm) __atomic_store_n(&c->shm->dead, 1, __ATOMIC_RELEASE);
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+// 排入輸出佇列（呼叫端持有 send_mutex）；超過上限視為對方停止接收，與記憶體不足時一樣中斷連線
+static void live_out_append(ClientInfo *c, const char *data, size_t len) {
+	if (len == 0) return;
+	if (c->out_len + len > LIVE_OUT_MAX) {
+		c->closed = 1;
+		live_client_shutdown(c);
 		return;
 	}
-	char *line_start = buffer;
-	for (int i = 0; i < line_to_delete - 1; i++) {
-		char *next = strchr(line_start, '\n');
-		if (next) {
-			line_start = next + 1;
-		} else {
+	if (c->out_len + len > c->out_cap) {
+		size_t cap = c->out_cap ? c->out_cap : 4096;
+		while (cap < c->out_len + len) cap *= 2;
+		char *nb = (char *)realloc(c->out, cap);
+		if (!nb) {
+			// 放不下整個封包：丟掉一部分會讓之後的封包錯位，比照佇列過長斷線，由對方重連後重新同步
+			c->closed = 1;
+			live_client_shutdown(c);
 			return;
 		}
+		c->out = nb;
+		c->out_cap = cap;
 	}
-	char *line_end = strchr(line_start, '\n');
-	char after_content[512] = {0};
-	if (line_end) {
-		strcpy(after_content, line_end + 1);
-		strcpy(line_start, after_content);
-	} else {
-		if (line_start > buffer && *(line_start - 1) == '\n') {
-			*(line_start - 1) = '\0';
-		} else {
-			*line_start = '\0';
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+}
+
+// 向 epoll 註冊或取消可寫事件（呼叫端持有 send_mutex）
+// 共享記憶體連線改為請對方讀取後以 eventfd 通知，由同一個可讀事件觸發補送
+static void live_watch_out(ClientInfo *c, int on) {
+	if (c->shm) {
+		if (on) {
+			__atomic_store_n(&c->shm->tx->want_space, 1, __ATOMIC_SEQ_CST);
+			// 標記前對方已讀完：自行觸發一次
+			if (live_ring_used(c->shm->tx) < LIVE_SHM_RING) live_efd_signal(c->shm->rx_efd);
 		}
+		c->want_out = on;
+		return;
 	}
+	if (c->want_out == on) return;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(live_epoll_fd[c->worker], EPOLL_CTL_MOD, c->fd, &ev);
+	c->want_out = on;
 }
 
-static void apply_remote_op(enum LiveOpType t, int line, const char *payload, size_t plen) {
-	// 目前僅同步第一個編輯器
-	EditorState *ed = &editors[0];
-	live_lock_editor(0);
-	if (t == OP_SYNC_FULL) {
-		size_t copy_len = (plen < sizeof(ed->buffer) - 1) ? plen : sizeof(ed->buffer) - 1;
-		memset(ed->buffer, 0, sizeof(ed->buffer));
-		if (copy_len > 0) {
-			memcpy(ed->buffer, payload, copy_len);
-			ed->buffer[copy_len] = '\0';
-		}
-		editor_recount_and_clamp(ed);
-	} else if (t == OP_EDIT_LINE) {
-		char tmp[512];
-		size_t copy_len = (plen < sizeof(tmp) - 1) ? plen : sizeof(tmp) - 1;
-		memcpy(tmp, payload, copy_len);
-		tmp[copy_len] = '\0';
-		replace_line_silent(ed->buffer, line, tmp);
-		editor_recount_and_clamp(ed);
-	} else if (t == OP_INSERT_AFTER) {
-		char tmp[512] = {0};
-		if (plen > 0) {
-			size_t copy_len = (plen < sizeof(tmp) - 1) ? plen : sizeof(tmp) - 1;
-			memcpy(tmp, payload, copy_len);
-			tmp[copy_len] = '\0';
-		}
-		insert_after_silent(ed->buffer, line, tmp);
-		editor_recount_and_clamp(ed);
-	} else if (t == OP_DELETE_LINE) {
-		delete_line_silent(ed->buffer, line);
-		editor_recount_and_clamp(ed);
-	} else if (t == OP_PASTE_AFTER) {
-		char tmp[512] = {0};
-		size_t copy_len = (plen < sizeof(tmp) - 1) ? plen : sizeof(tmp) - 1;
-		memcpy(tmp, payload, copy_len);
-		tmp[copy_len] = '\0';
-		insert_after_silent(ed->buffer, line, tmp);
-		editor_recount_and_clamp(ed);
-	} else if (t == OP_CURSOR) {
-		// payload: "id line col"
-		int pid = 0, pline = 0, pcol = 0;
-		if (payload && plen > 0) {
-			char tmp[64] = {0};
-			size_t copy_len = (plen < sizeof(tmp) - 1) ? plen : sizeof(tmp) - 1;
-			memcpy(tmp, payload, copy_len);
-			tmp[copy_len] = '\0';
-			sscanf(tmp, "%d %d %d", &pid, &pline, &pcol);
-			if (pid >= 1 && pid <= MAX_PEERS && pid != live_self_id) {
-				live_peer_line[pid] = pline;
-				if (pcol < 0) pcol = 0;
-				live_peer_col[pid] = pcol;
-			}
-		}
-	} else if (t == OP_HELLO) {
-		// 僅 client 端接收：設定 self id
-		if (payload && plen > 0 && live_mode == LIVE_JOIN) {
-			char tmp[32] = {0};
-			size_t copy_len = (plen < sizeof(tmp) - 1) ? plen : sizeof(tmp) - 1;
-			memcpy(tmp, payload, copy_len);
-			tmp[copy_len] = '\0';
-			int assigned = atoi(tmp);
-			if (assigned >= 1 && assigned <= MAX_PEERS) {
-				live_self_id = assigned;
-			}
+// 送出一個封包給 c，不會阻塞呼叫端（UI 執行緒也會廣播）；
+// 送不完或同步資料傳送中的部分排入輸出佇列，由 I/O 執行緒在可寫時補送
+static void live_client_send(ClientInfo *c, const char *header, size_t hlen, const char *payload, size_t plen) {
+	pthread_mutex_lock(&c->send_mutex);
+	if (!c->closed) {
+		size_t hs = 0, ps = 0;
+		if (c->syncing == 0 && c->out_len == 0 && c->shm) {
+			hs = live_client_try_send(c, header, hlen);
+			if (hs == hlen && plen > 0) ps = live_client_try_send(c, payload, plen);
+		} else if (c->syncing == 0 && c->out_len == 0) {
+			// 連線錯誤時視為全部送出，由 I/O 執行緒清理
+			ssize_t n = live_sendv(c->fd, header, hlen, payload, plen, MSG_DONTWAIT);
+			size_t sent = (n < 0) ? hlen + plen : (size_t)n;
+			hs = (sent < hlen) ? sent : hlen;
+			ps = sent - hs;
 		}
+		live_out_append(c, header + hs, hlen - hs);
+		if (plen > 0) live_out_append(c, payload + ps, plen - ps);
+		if (c->syncing == 0 && c->out_len > 0) live_watch_out(c, 1);
 	}
-	live_unlock_editor(0);
+	pthread_mutex_unlock(&c->send_mutex);
 }
 
-// ===== Host 端：每個客戶端的接收線程 =====
-static void *host_client_thread(void *arg) {
-	int idx = *(int*)arg;
-	free(arg);
-	int cfd = -1;
-	int cid = 0;
-	{
-		pthread_mutex_lock(&live_clients_mutex);
-		if (idx >= 0 && idx < MAX_PEERS && live_clients[idx].in_use) {
-			cfd = live_clients[idx].fd;
-			cid = live_clients[idx].id;
-		}
-		pthread_mutex_unlock(&live_clients_mutex);
+// ===== 觀看者的共用串流（主機） =====
+// 附加到共用串流（呼叫端持有 live_spec_lock 寫鎖）
+static void live_spec_put(const void *data, size_t len) {
+	const char *p = (const char *)data;
+	while (len > 0) {
+		size_t at = (size_t)(live_spec_end & (LIVE_SPEC_RING - 1));
+		size_t n = LIVE_SPEC_RING - at;
+		if (n > len) n = len;
+		memcpy(live_spec_ring + at, p, n);
+		live_spec_end += (int64_t)n;
+		p += n;
+		len -= n;
 	}
-	if (cfd < 0 || cid <= 0) return NULL;
-
-	// 發送 HELLO 與完整同步、目前已知的游標位置
-	{
-		char idbuf[32];
-		int idlen = snprintf(idbuf, sizeof(idbuf), "%d", cid);
-		char header[128];
-		int header_len = snprintf(header, sizeof(header), "OP %d 0 %d\n", (int)OP_HELLO, idlen);
-		send_header_payload_to_fd(cfd, header, (size_t)header_len, idbuf, (size_t)idlen);
-
-		// 發送完整內容
-		EditorState *ed = &editors[0];
-		size_t plen = strlen(ed->buffer);
-		header_len = snprintf(header, sizeof(header), "OP %d 0 %zu\n", (int)OP_SYNC_FULL, plen);
-		send_header_payload_to_fd(cfd, header, (size_t)header_len, ed->buffer, plen);
-
-		// 發送當前已知游標（包含主機自己與其他人）
-		for (int i = 1; i <= MAX_PEERS; i++) {
-			if (live_peer_line[i] > 0) {
-				char payload[64];
-				int n = snprintf(payload, sizeof(payload), "%d %d %d", i, live_peer_line[i], live_peer_col[i]);
-				header_len = snprintf(header, sizeof(header), "OP %d 0 %d\n", (int)OP_CURSOR, n);
-				send_header_payload_to_fd(cfd, header, (size_t)header_len, payload, (size_t)n);
-			}
-		}
+}
+
+// 把待發布批次壓縮成一個 OP_BATCH 附加到共用串流，並通知 I/O 執行緒送給觀看者（呼叫端持有 live_spec_batch_mutex）
+static void live_spec_publish_locked(void) {
+	if (live_spec_batch_len == 0 || !live_spec_ring) return;
+	size_t raw = live_spec_batch_len;
+	if (lz_bound(raw) > live_spec_zcap) {
+		uint8_t *nb = (uint8_t *)realloc(live_spec_zbuf, lz_bound(raw));
+		if (!nb) return;  // 保留批次，下次再試
+		live_spec_zbuf = nb;
+		live_spec_zcap = lz_bound(raw);
+	}
+	size_t zlen = lz_compress((const uint8_t *)live_spec_batch, raw, live_spec_zbuf);
+	char header[64];
+	int header_len = snprintf(header, sizeof(header), "OP %d 0 %zu %zu\n", (int)OP_BATCH, raw, zlen);
+	pthread_rwlock_wrlock(&live_spec_lock);
+	live_spec_put(header, (size_t)header_len);
+	live_spec_put(live_spec_zbuf, zlen);
+	pthread_rwlock_unlock(&live_spec_lock);
+	live_spec_batch_len = 0;
+	uint64_t one = 1;
+	for (int w = 0; w < live_io_count; w++) {
+		ssize_t n = write(live_job_fd[w], &one, sizeof(one));
+		(void)n;
 	}
+}
 
-	// 接收循環
-	while (live_running) {
-		char header[128];
-		if (recv_line(cfd, header, sizeof(header)) <= 0) {
-			break;
-		}
-		int t = 0, line = 0;
-		size_t len = 0;
-		if (sscanf(header, "OP %d %d %zu", &t, &line, &len) != 3) {
-			continue;
-		}
-		char *payload = NULL;
-		if (len > 0) {
-			payload = (char *)malloc(len);
-			if (!payload) break;
-			if (recv_all(cfd, payload, len) != 0) {
-				free(payload);
-				break;
-			}
+// UI 執行緒在兩次繪製之間發布一次，同一輪的廣播合併成一個壓縮封包
+static void live_spec_publish(void) {
+	if (live_mode != LIVE_HOST) return;
+	pthread_mutex_lock(&live_spec_batch_mutex);
+	live_spec_publish_locked();
+	pthread_mutex_unlock(&live_spec_batch_mutex);
+}
+
+// 任意執行緒：把廣播的封包加入待發布批次；沒有觀看者時不累積
+static void live_spec_append(const char *header, size_t hlen, const char *payload, size_t plen) {
+	if (__atomic_load_n(&live_spec_count, __ATOMIC_ACQUIRE) == 0) return;
+	pthread_mutex_lock(&live_spec_batch_mutex);
+	size_t need = live_spec_batch_len + hlen + plen;
+	if (need > live_spec_batch_cap) {
+		size_t cap = live_spec_batch_cap ? live_spec_batch_cap : LIVE_SPEC_BATCH;
+		while (cap < need) cap *= 2;
+		char *nb = (char *)realloc(live_spec_batch, cap);
+		if (!nb) {
+			pthread_mutex_unlock(&live_spec_batch_mutex);
+			return;
 		}
-		// 先轉發給其它客戶端（不含來源）
-		broadcast_header_payload_except(cfd, header, strlen(header), payload, len);
-		// 套用到本地
-		apply_remote_op((enum LiveOpType)t, line, payload, len);
-		if (payload) free(payload);
+		live_spec_batch = nb;
+		live_spec_batch_cap = cap;
+	}
+	memcpy(live_spec_batch + live_spec_batch_len, header, hlen);
+	if (plen > 0) memcpy(live_spec_batch + live_spec_batch_len + hlen, payload, plen);
+	live_spec_batch_len = need;
+	if (live_spec_batch_len >= LIVE_SPEC_BATCH) live_spec_publish_locked();
+	pthread_mutex_unlock(&live_spec_batch_mutex);
+}
+
+// I/O 執行緒：送出共用串流中 c 還沒收到的部分（呼叫端持有 send_mutex），回傳是否仍有未送完的資料
+// 同步資料與輸出佇列優先，送完後才接續串流
+static int live_spec_flush(ClientInfo *c) {
+	if (c->closed || c->spec_off < 0 || c->syncing > 0 || c->out_len > 0) return 0;
+	pthread_rwlock_rdlock(&live_spec_lock);
+	int64_t end = live_spec_end;
+	if (end - c->spec_off > (int64_t)LIVE_SPEC_RING) {
+		// 落後超過保留量，資料已被覆寫：中斷連線，對方重新連線後以續傳或快照追上
+		pthread_rwlock_unlock(&live_spec_lock);
+		c->closed = 1;
+		live_client_shutdown(c);
+		return 0;
+	}
+	while (c->spec_off < end) {
+		size_t at = (size_t)(c->spec_off & (LIVE_SPEC_RING - 1));
+		size_t len = (size_t)(end - c->spec_off);
+		if (len > LIVE_SPEC_RING - at) len = LIVE_SPEC_RING - at;
+		size_t n = live_client_try_send(c, live_spec_ring + at, len);
+		c->spec_off += (int64_t)n;
+		if (n < len) break;
+	}
+	pthread_rwlock_unlock(&live_spec_lock);
+	return c->spec_off < end;
+}
+
+// I/O 執行緒：補送輸出佇列，清空後取消可寫事件
+static void live_client_flush_out(ClientInfo *c) {
+	pthread_mutex_lock(&c->send_mutex);
+	if (c->syncing == 0 && c->out_len > 0) {
+		size_t n = live_client_try_send(c, c->out, c->out_len);
+		memmove(c->out, c->out + n, c->out_len - n);
+		c->out_len -= n;
 	}
+	int behind = c->spectator && live_spec_flush(c);
+	live_watch_out(c, (c->syncing == 0 && c->out_len > 0) || behind);
+	pthread_mutex_unlock(&c->send_mutex);
+}
 
-	// 斷線清理
+// I/O 執行緒：共用串流有新資料時，送給自己負責的觀看者
+static void live_spec_flush_worker(int w) {
 	pthread_mutex_lock(&live_clients_mutex);
-	live_peer_line[cid] = 0;
-	live_peer_col[cid] = 0;
-	if (idx >= 0 && idx < MAX_PEERS && live_clients[idx].in_use) {
-		close(live_clients[idx].fd);
-		live_clients[idx].fd = -1;
-		live_clients[idx].in_use = 0;
-		live_clients[idx].id = 0;
+	for (int i = 0; i < live_client_count; i++) {
+		ClientInfo *c = live_clients[i];
+		if (c->spectator && c->worker == w) live_client_flush_out(c);
 	}
 	pthread_mutex_unlock(&live_clients_mutex);
-	return NULL;
 }
 
-// Host 端：接受新連線
-static void *host_accept_thread(void *arg) {
-	(void)arg;
-	while (live_running) {
-		struct sockaddr_in cliaddr;
-		socklen_t clilen = sizeof(cliaddr);
-		int cfd = accept(live_server_sock, (struct sockaddr *)&cliaddr, &clilen);
-		if (cfd < 0) {
-			if (!live_running) break;
-			continue;
-		}
-		pthread_mutex_lock(&live_clients_mutex);
-		// 超過最大人數則關閉
-		if (next_assign_id > MAX_PEERS) {
-			pthread_mutex_unlock(&live_clients_mutex);
-			close(cfd);
-			continue;
-		}
-		// 找空槽
-		int slot = -1;
-		for (int i = 0; i < MAX_PEERS; i++) {
-			if (!live_clients[i].in_use) { slot = i; break; }
-		}
-		if (slot == -1) {
-			pthread_mutex_unlock(&live_clients_mutex);
-			close(cfd);
-			continue;
+// 廣播給已同步該文件、且直接由本機轉送的客戶端（其餘由轉送樹逐層送達）；主機的觀看者一律經由共用串流
+static void broadcast_header_payload_except(int doc, int except_fd, const char *header, size_t hlen, const char *payload, size_t plen) {
+	if (live_mode == LIVE_HOST) live_spec_append(header, hlen, payload, plen);
+	pthread_mutex_lock(&live_clients_mutex);
+	for (int i = 0; i < live_client_count; i++) {
+		ClientInfo *c = live_clients[i];
+		if ((__atomic_load_n(&c->ready, __ATOMIC_ACQUIRE) & (1u << doc)) && !c->spectator && c->parent <= 1 && c->fd >= 0 && c->fd != except_fd) {
+			live_client_send(c, header, hlen, payload, plen);
 		}
-		live_clients[slot].fd = cfd;
-		live_clients[slot].id = next_assign_id++;
-		live_clients[slot].in_use = 1;
-		// 預設新加入者游標未知（0）
-		live_peer_line[live_clients[slot].id] = 0;
-		int *pidx = (int*)malloc(sizeof(int));
-		*pidx = slot;
-		pthread_create(&live_clients[slot].thread, NULL, host_client_thread, pidx);
-		pthread_mutex_unlock(&live_clients_mutex);
 	}
-	return NULL;
+	pthread_mutex_unlock(&live_clients_mutex);
 }
 
-// Client 端：接收主機廣播
-static void *live_thread_func(void *arg) {
-	(void)arg;
-	// 收取循環（client）
-	while (live_running) {
-		char header[128];
-		if (recv_line(live_sock, header, sizeof(header)) <= 0) {
+// client 端送往主機（只有 UI 執行緒送出；接收執行緒重新連線時會替換 live_sock）
+static void live_sock_send(const char *header, size_t hlen, const char *payload, size_t plen) {
+	pthread_mutex_lock(&live_sock_mutex);
+	if (live_sock_shm) {
+		live_shm_send_frame(live_sock_shm, header, hlen, payload, plen);
+	} else {
+		send_header_payload_to_fd(live_sock, header, hlen, payload, plen);
+	}
+	pthread_mutex_unlock(&live_sock_mutex);
+}
+
+// client 端接收（僅接收執行緒使用）
+static int live_sock_recv_line(char *buf, size_t max) {
+	if (live_sock_shm) return live_shm_read_line(live_sock_shm, buf, max);
+	return recv_line(live_sock, buf, max);
+}
+
+static int live_sock_recv_all(char *buf, size_t len) {
+	if (live_sock_shm) return live_shm_read_all(live_sock_shm, buf, len);
+	return recv_all(live_sock, buf, len);
+}
+
+// 關閉與主機的連線（呼叫端持有 live_sock_mutex）
+static void live_sock_close(void) {
+	if (live_sock >= 0) {
+		close(live_sock);
+		live_sock = -1;
+	}
+	live_shm_free(live_sock_shm);
+	live_sock_shm = NULL;
+}
+
+static int live_parse_header(const char *line, LiveHeader *h) {
+	memset(h, 0, sizeof(*h));
+	if (sscanf(line, "OP %d %d %d %zu %d %d %d %d %d %lld %lld", &h->type, &h->doc, &h->line, &h->len,
+	           &h->ver, &h->base, &h->origin, &h->del, &h->nlines, &h->tsend, &h->trelay) < 4) return 0;
+	return h->doc >= 0 && h->doc < LIVE_MAX_DOCS;
+}
+
+static void live_broadcast_with_payload(enum LiveOpType t, int doc, int line, const char *payload) {
+	size_t plen = payload ? strlen(payload) : 0;
+	char header[128];
+	int header_len = snprintf(header, sizeof(header), "OP %d %d %d %zu\n", (int)t, doc, line, plen);
+	if (header_len <= 0) return;
+	if (live_mode == LIVE_HOST) {
+		broadcast_header_payload_except(doc, -1, header, (size_t)header_len, payload, plen);
+	} else if (live_mode == LIVE_JOIN) {
+		live_sock_send(header, (size_t)header_len, payload, plen);
+	}
+}
+
+// 第一個 line 不小於指定值的位置
+static int live_presence_lower_bound(const LiveDoc *d, int line) {
+	int lo = 0, hi = d->presence_count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (d->presence[mid].line < line) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// 更新文件 doc 的參與者游標；line <= 0 表示移除
+static void live_presence_set(int doc, int id, int line, int col) {
+	LiveDoc *d = &live_docs[doc];
+	for (int i = 0; i < d->presence_count; i++) {
+		if (d->presence[i].id == id) {
+			memmove(&d->presence[i], &d->presence[i + 1], sizeof(LivePresence) * (size_t)(d->presence_count - i - 1));
+			d->presence_count--;
 			break;
 		}
-		int t = 0, line = 0;
-		size_t len = 0;
-		if (sscanf(header, "OP %d %d %zu", &t, &line, &len) != 3) {
-			continue;
-		}
-		char *payload = NULL;
-		if (len > 0) {
-			payload = (char *)malloc(len);
-			if (!payload) break;
-			if (recv_all(live_sock, payload, len) != 0) {
-				free(payload);
-				break;
-			}
-		}
-		apply_remote_op((enum LiveOpType)t, line, payload, len);
-		if (payload) free(payload);
 	}
-	live_running = 0;
-	if (live_sock >= 0) { close(live_sock); live_sock = -1; }
-	return NULL;
+	if (line <= 0) return;
+	if (d->presence_count == d->presence_cap) {
+		int cap = d->presence_cap ? d->presence_cap * 2 : 32;
+		LivePresence *np = (LivePresence *)realloc(d->presence, sizeof(LivePresence) * (size_t)cap);
+		if (!np) return;
+		d->presence = np;
+		d->presence_cap = cap;
+	}
+	int pos = live_presence_lower_bound(d, line + 1);
+	memmove(&d->presence[pos + 1], &d->presence[pos], sizeof(LivePresence) * (size_t)(d->presence_count - pos));
+	d->presence[pos].id = id;
+	d->presence[pos].line = line;
+	d->presence[pos].col = (col < 0) ? 0 : col;
+	d->presence_count++;
 }
 
-static int live_start_host(int port) {
-	live_mode = LIVE_HOST;
-	live_self_id = 1;
-	live_server_sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (live_server_sock < 0) return 0;
-	int opt = 1;
-	setsockopt(live_server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-	struct sockaddr_in addr;
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = INADDR_ANY;
-	addr.sin_port = htons((uint16_t)port);
-	if (bind(live_server_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) return 0;
-	if (listen(live_server_sock, MAX_PEERS) < 0) return 0;
-	live_running = 1;
-	if (pthread_create(&live_thread, NULL, host_accept_thread, NULL) != 0) {
-		live_running = 0;
-		return 0;
+static void live_broadcast_cursor(EditorState *ed, int current_line, int current_col) {
+	// 格式："id line col"，標頭帶文件編號
+	if (live_spectator || macro_replaying) return;  // 觀看者不送出任何封包；重播結束時才廣播
+	int doc = (ed == &editors[0]) ? 0 : 1;
+	char buf[64];
+	int n = snprintf(buf, sizeof(buf), "%d %d %d", live_self_id, current_line, current_col);
+	if (n <= 0) return;
+	if (live_mode == LIVE_HOST) {
+		// 主機自己的游標也記在參與者表，供新加入者取得
+		live_presence_set(doc, live_self_id, current_line, current_col);
 	}
-	// 主機的游標行先記錄
-	if (editors[0].current_line > 0) {
-		live_peer_line[live_self_id] = editors[0].current_line;
-		live_peer_col[live_self_id] = 0;
+	live_broadcast_with_payload(OP_CURSOR, doc, 0, buf);
+}
+
+// 依 total_lines 修正游標與視窗位置
+static void editor_clamp(EditorState *ed) {
+	if (ed->total_lines < 1) ed->total_lines = 1;
+	if (ed->current_line < 1) ed->current_line = 1;
+	if (ed->current_line > ed->total_lines) ed->current_line = ed->total_lines;
+	if (ed->row_offset < 1) ed->row_offset = 1;
+	if (ed->current_line >= ed->row_offset + VISIBLE_LINES) {
+		ed->row_offset = ed->current_line - VISIBLE_LINES + 1;
 	}
+	if (ed->current_line < ed->row_offset) {
+		ed->row_offset = ed->current_line;
+	}
+}
+
+static void editor_recount_and_clamp(EditorState *ed) {
+	ed->total_lines = count_lines(ed->buffer);
+	editor_clamp(ed);
+}
+
+// 內容整份取代（開啟、復原、快照）後依目前內容決定 no_final_nl
+static void editor_detect_final_nl(EditorState *ed) {
+	ed->no_final_nl = (ed->length > 0 && ed->buffer[ed->length - 1] != '\n');
+}
+
+// ===== 緩衝區工具 =====
+// 確保緩衝區可容納 need 位元組（含結尾 '\0'）
+static int editor_reserve(EditorState *ed, size_t need) {
+	if (need <= ed->capacity) return 1;
+	size_t cap = ed->capacity ? ed->capacity : 1024;
+	while (cap < need) cap *= 2;
+	char *nb = (char *)realloc(ed->buffer, cap);
+	if (!nb) return 0;
+	if (!ed->buffer) nb[0] = '\0';
+	ed->buffer = nb;
+	ed->capacity = cap;
 	return 1;
 }
 
-static int live_start_join(const char *host, int port) {
-	live_mode = LIVE_JOIN;
-	live_self_id = 0; // 等待主機分配
-	live_sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (live_sock < 0) return 0;
-	struct sockaddr_in addr;
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons((uint16_t)port);
-	if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
-		return 0;
+// 將 [off, off + del_len) 取代為 ins[0..ins_len)
+static int editor_splice(EditorState *ed, size_t off, size_t del_len, const char *ins, size_t ins_len) {
+	if (off > ed->length) off = ed->length;
+	if (del_len > ed->length - off) del_len = ed->length - off;
+	size_t new_len = ed->length - del_len + ins_len;
+	if (!editor_reserve(ed, new_len + 1)) return 0;
+	memmove(ed->buffer + off + ins_len, ed->buffer + off + del_len, ed->length - off - del_len + 1);
+	if (ins_len > 0) memcpy(ed->buffer + off, ins, ins_len);
+	ed->length = new_len;
+	// 修改在提示行之後時，提示行之前的內容不變，位置仍然有效
+	int hint_ok = (ed->line_hint_gen == ed->edit_gen && off >= ed->line_hint_off);
+	ed->edit_gen++;
+	if (hint_ok) ed->line_hint_gen = ed->edit_gen;
+	if (!macro_replaying) {
+		dirty_mark(&ed->dirty, off, del_len, ins_len);
+		journal_record(ed, off, del_len, ins, ins_len);
+		swap_record(ed, off, del_len, ins, ins_len);
+		save_editor(ed);
 	}
-	if (connect(live_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		return 0;
+	return 1;
+}
+
+// 選取範圍（沒有選取時為當前行）
+static void editor_selection(const EditorState *ed, int *first, int *last) {
+    int anchor = ed->sel_anchor;
+    if (anchor < 1) anchor = ed->current_line;
+    if (anchor > ed->total_lines) anchor = ed->total_lines;
+    *first = (anchor < ed->current_line) ? anchor : ed->current_line;
+    *last = (anchor < ed->current_line) ? ed->current_line : anchor;
+}
+
+// 第 line_no 行起始的位元組偏移（行不存在時回傳內容長度）
+// 從上次查到的行往前或往後找，比較近時才從頭找；連續編輯相鄰的行不必每次從頭數
+static size_t editor_line_offset(EditorState *ed, int line_no) {
+	int n = 1;
+	size_t off = 0;
+	if (ed->line_hint > 0 && ed->line_hint_gen == ed->edit_gen && ed->line_hint_off <= ed->length &&
+	    line_no > ed->line_hint / 2) {
+		n = ed->line_hint;
+		off = ed->line_hint_off;
 	}
-	live_running = 1;
-	if (pthread_create(&live_thread, NULL, live_thread_func, NULL) != 0) {
-		live_running = 0;
-		return 0;
+	while (n > line_no && n > 1) {
+		const char *prev = (off >= 2) ? memrchr(ed->buffer, '\n', off - 1) : NULL;
+		off = prev ? (size_t)(prev - ed->buffer) + 1 : 0;
+		n--;
 	}
-	return 1;
+	while (n < line_no) {
+		const char *next = memchr(ed->buffer + off, '\n', ed->length - off);
+		if (!next) return ed->length;
+		off = (size_t)(next - ed->buffer) + 1;
+		n++;
+	}
+	ed->line_hint = n;
+	ed->line_hint_off = off;
+	ed->line_hint_gen = ed->edit_gen;
+	return off;
 }
 
-static void live_stop() {
-	if (live_running) {
-		live_running = 0;
-		// 關閉 socket 以喚醒阻塞
-		if (live_mode == LIVE_JOIN) {
-			if (live_sock >= 0) { shutdown(live_sock, SHUT_RDWR); close(live_sock); live_sock = -1; }
-			pthread_join(live_thread, NULL);
-		} else if (live_mode == LIVE_HOST) {
-			// 關閉所有客戶端
-			pthread_mutex_lock(&live_clients_mutex);
-			for (int i = 0; i < MAX_PEERS; i++) {
-				if (live_clients[i].in_use && live_clients[i].fd >= 0) {
-					shutdown(live_clients[i].fd, SHUT_RDWR);
-					close(live_clients[i].fd);
-				}
-			}
-			pthread_mutex_unlock(&live_clients_mutex);
-			// 關閉 listen 並等待接受線程結束
-			if (live_server_sock >= 0) { shutdown(live_server_sock, SHUT_RDWR); close(live_server_sock); live_server_sock = -1; }
-			pthread_join(live_thread, NULL);
-			// 等待所有客戶端線程
-			pthread_mutex_lock(&live_clients_mutex);
-			for (int i = 0; i < MAX_PEERS; i++) {
-				if (live_clients[i].in_use) {
-					pthread_join(live_clients[i].thread, NULL);
-					live_clients[i].in_use = 0;
-					live_clients[i].fd = -1;
-					live_clients[i].id = 0;
-				}
-			}
-			pthread_mutex_unlock(&live_clients_mutex);
-		}
+// 第 first 到 last 行在緩衝區中的範圍 [*start, *end)，包含最後一行之後的換行（如果有）
+// 只從 first 行往後數，不重新從頭找 last；行不存在回傳 0
+static int editor_lines_span(EditorState *ed, int first, int last, size_t *start, size_t *end) {
+	*start = editor_line_offset(ed, first);
+	if (first < 1 || last < first || *start >= ed->length) return 0;
+	*end = *start;
+	for (int n = first; n <= last && *end < ed->length; n++) {
+		const char *nl = memchr(ed->buffer + *end, '\n', ed->length - *end);
+		*end = nl ? (size_t)(nl - ed->buffer) + 1 : ed->length;
 	}
-	live_mode = LIVE_NONE;
+	return 1;
 }
 
-// 恢復終端設定
-void disable_raw_mode() {
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+// 第 first 到 last 行的內容副本（各行以換行分隔，最後一行不含換行，'\0' 結尾）
+// 行不存在或記憶體不足回傳 NULL
+static char *editor_lines_text(EditorState *ed, int first, int last, size_t *len) {
+	size_t start, end;
+	if (!editor_lines_span(ed, first, last, &start, &end)) return NULL;
+	if (end > start && ed->buffer[end - 1] == '\n') end--;
+	char *text = (char *)malloc(end - start + 1);
+	if (!text) return NULL;
+	memcpy(text, ed->buffer + start, end - start);
+	text[end - start] = '\0';
+	*len = end - start;
+	return text;
 }
 
-// 設定終端為原始模式，可以讀取方向鍵
-void enable_raw_mode() {
-    tcgetattr(STDIN_FILENO, &orig_termios);
-    atexit(disable_raw_mode);
-    
-    struct termios raw = orig_termios;
-    raw.c_lflag &= ~(ICANON | ECHO);
-    raw.c_cc[VMIN] = 1;
-    raw.c_cc[VTIME] = 0;
-    
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+// 從 off 起算的行尾偏移（不含換行）
+static size_t editor_line_end(const EditorState *ed, size_t off) {
+	const char *nl = memchr(ed->buffer + off, '\n', ed->length - off);
+	return nl ? (size_t)(nl - ed->buffer) : ed->length;
 }
 
-// 方向鍵的內部表示（使用不可打印的控制字符避免衝突）
-#define KEY_UP         1
-#define KEY_DOWN       2
-#define KEY_RIGHT      3
-#define KEY_LEFT       4
-#define KEY_CTRL_LEFT  5
-#define KEY_CTRL_RIGHT 6
+// 將網路 payload 複製為 '\0' 結尾字串（呼叫端 free）
+static char *dup_payload(const char *payload, size_t plen) {
+	char *s = (char *)malloc(plen + 1);
+	if (!s) return NULL;
+	if (plen > 0) memcpy(s, payload, plen);
+	s[plen] = '\0';
+	return s;
+}
 
-// 讀取按鍵
-char read_key() {
-    char c;
-    while (read(STDIN_FILENO, &c, 1) != 1);
-    
-    // 檢測方向鍵（ESC序列）
-    if (c == '\033') {
-        char seq[6];
-        
-        // 使用非阻塞模式來判斷是否有後續字符
-        struct termios old_term;
-        tcgetattr(STDIN_FILENO, &old_term);
-        
-        struct termios new_term = old_term;
-        new_term.c_cc[VMIN] = 0;   // 非阻塞
-        new_term.c_cc[VTIME] = 1;  // 0.1 秒超時
-        tcsetattr(STDIN_FILENO, TCSANOW, &new_term);
-        
-        int nread1 = read(STDIN_FILENO, &seq[0], 1);
-        int nread2 = 0;
-        int nread3 = 0;
-        int nread4 = 0;
-        int nread5 = 0;
-        if (nread1 == 1) {
-            nread2 = read(STDIN_FILENO, &seq[1], 1);
-        }
-        if (nread2 == 1) {
-            nread3 = read(STDIN_FILENO, &seq[2], 1);
-        }
-        if (nread3 == 1) {
-            nread4 = read(STDIN_FILENO, &seq[3], 1);
-        }
-        if (nread4 == 1) {
-            nread5 = read(STDIN_FILENO, &seq[4], 1);
-        }
-        
-        // 恢復原始設定
-        tcsetattr(STDIN_FILENO, TCSANOW, &old_term);
-        
-        // 如果沒有後續字符，這是單純的 ESC
-        if (nread1 == 0) {
-            return c;  // 返回 ESC
-        }
-        
-        // 檢查是否是 Ctrl + 方向鍵序列 (ESC[1;5C 或 ESC[1;5D)
-        if (nread5 == 1 && seq[0] == '[' && seq[1] == '1' && seq[2] == ';' && seq[3] == '5') {
-            if (seq[4] == 'C') return KEY_CTRL_RIGHT;  // Ctrl+Right
-            if (seq[4] == 'D') return KEY_CTRL_LEFT;   // Ctrl+Left
+// ===== Undo 工具 =====
+static void push_undo(EditorState *ed, int type, int line) {
+    if (!ed || ed->suppress_undo) return;
+    if (ed->undo_top >= (int)(sizeof(ed->undo_stack) / sizeof(ed->undo_stack[0]))) {
+        // 滿了就移除最舊的一個
+        free(ed->undo_stack[0].text);
+        for (int i = 1; i < ed->undo_top; i++) {
+            ed->undo_stack[i - 1] = ed->undo_stack[i];
         }
-        
-        // 檢查是否是普通方向鍵序列
-        if (nread2 == 1 && seq[0] == '[') {
-            if (seq[1] == 'A') return KEY_UP;      // Up arrow
-            if (seq[1] == 'B') return KEY_DOWN;    // Down arrow
-            if (seq[1] == 'C') return KEY_RIGHT;   // Right arrow
+        ed->undo_top--;
+    }
+    UndoEntry *e = &ed->undo_stack[ed->undo_top++];
+    e->type = type;
+    e->line = line;
+    e->count = 0;
+    e->text = NULL;
+    e->nlines = 0;
+}
+
+// 多行操作的逆操作：只記行號與行數
+static void push_undo_lines(EditorState *ed, int type, int line, int count) {
+    if (!ed || ed->suppress_undo) return;
+    push_undo(ed, type, line);
+    ed->undo_stack[ed->undo_top - 1].count = count;
+}
+
+// 範圍操作的逆操作：把 line 起的 count 行換回 text（接手 text 的所有權）
+static void push_undo_text(EditorState *ed, int line, int count, char *text, int nlines) {
+    if (!ed || ed->suppress_undo) {
+        free(text);
+        return;
+    }
+    push_undo(ed, UNDO_REPLACE_LINES, line);
+    UndoEntry *e = &ed->undo_stack[ed->undo_top - 1];
+    e->count = count;
+    e->text = text;
+    e->nlines = nlines;
+}
+
+static void undo_last_action(EditorState *ed) {
+    if (!ed || macro_replaying) return;  // 重播的修改結束時才成為一筆逆操作
+    if (ed->undo_top <= 0) {
+        printf("\n✗ 沒有可復原的動作\n");
+        printf("按任意鍵繼續...");
+        read_key();
+        return;
+    }
+    UndoEntry entry = ed->undo_stack[--ed->undo_top];
+    ed->suppress_undo = 1;
+    if (entry.type == UNDO_DELETE_LINE) {
+        LiveOp op = live_op_make(entry.line, 1, NULL, 0);
+        editor_commit_local(ed, &op);
+        editor_recount_and_clamp(ed);
+        if (ed->current_line > ed->total_lines) ed->current_line = ed->total_lines;
+        if (ed->current_line < 1) ed->current_line = 1;
+    } else if (entry.type == UNDO_DELETE_LINES) {
+        // 整段貼上的逆操作：一次刪除整段
+        LiveOp op = live_op_make(entry.line, entry.count, NULL, 0);
+        editor_commit_local(ed, &op);
+        editor_recount_and_clamp(ed);
+        ed->current_line = entry.line;
+        if (ed->current_line > ed->total_lines) ed->current_line = ed->total_lines;
+        if (ed->current_line < 1) ed->current_line = 1;
+    } else if (entry.type == UNDO_REPLACE_LINES) {
+        // 刪除、縮排、搬移與編輯的逆操作：一次換回原內容
+        LiveOp op = live_op_make(entry.line, entry.count, entry.text, entry.nlines);
+        editor_commit_local(ed, &op);
+        free(entry.text);
+        editor_recount_and_clamp(ed);
+        ed->current_line = entry.line;
+        if (ed->current_line > ed->total_lines) ed->current_line = ed->total_lines;
+        if (ed->current_line < 1) ed->current_line = 1;
+    }
+    ed->suppress_undo = 0;
+    // 自動保存與訊息
+    save_editor(ed);
+    // printf("\n✓ 已復原上一個動作\n");
+    // printf("按任意鍵繼續...");
+    // read_key();
+    // 廣播目前游標（非編輯模式，欄位用 0）
+    live_broadcast_cursor(ed, ed->current_line, 0);
+}
+
+// 計算 p[0..n) 中的換行數
+static int count_newlines(const char *p, size_t n) {
+	int count = 0;
+	const char *end = p + n;
+	while (p < end && (p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+		count++;
+		p++;
+	}
+	return count;
+}
+
+// 行層級取代：從第 pos 行起刪除 del 行，插入 text 中的 nlines 行
+// 先當作每行都以換行結尾來修改，修改到檔尾時再依 no_final_nl 決定最後一行是否有換行：
+// 結果只由各行內容與 no_final_nl 決定，各端套用順序不同也一致；插入的行一定成為真正的一行
+// total_lines 依實際刪除與插入的換行更新，呼叫端不必自行加減
+static void editor_apply_splice(EditorState *ed, int pos, int del, const char *text, size_t tlen, int nlines) {
+	if (pos < 1) pos = 1;
+	if (del < 0) del = 0;
+	if (nlines <= 0) {
+		nlines = 0;
+		tlen = 0;
+	}
+	size_t start = editor_line_offset(ed, pos);
+	// 從 start 往後數 del 行（行位置提示留在 pos，之後的修改不會讓它失效）
+	size_t end = start;
+	for (int n = 0; n < del && end < ed->length; n++) {
+		const char *nl = memchr(ed->buffer + end, '\n', ed->length - end);
+		end = nl ? (size_t)(nl - ed->buffer) + 1 : ed->length;
+	}
+	if (start == end && nlines == 0) return;
+	int unterminated = (ed->length > 0 && ed->buffer[ed->length - 1] != '\n');
+	char *repl = (char *)malloc(tlen + 2);
+	if (!repl) return;
+	size_t rlen = 0;
+	// 在沒有換行的最後一行之後插入：先補上它的換行
+	if (unterminated && start == ed->length) repl[rlen++] = '\n';
+	if (nlines > 0) {
+		if (tlen > 0) memcpy(repl + rlen, text, tlen);
+		rlen += tlen;
+		repl[rlen++] = '\n';
+	}
+	// 修改到檔尾：最後一行不是空行時才去掉它的換行（空行去掉換行就少了一行）
+	if (end == ed->length && ed->no_final_nl) {
+		if (rlen > 0) {
+			if (rlen >= 2 && repl[rlen - 2] != '\n') rlen--;
+		} else if (start >= 2 && ed->buffer[start - 2] != '\n') {
+			// 刪到檔尾：連同前一行的換行一起刪除
+			start--;
+		}
+	}
+	// 行數 = 換行數 + 最後一行是否沒有換行；空文件的行數是 0（editor_clamp 再補成 1）
+	int lines = (ed->length > 0) ? ed->total_lines : 0;
+	lines -= count_newlines(ed->buffer + start, end - start) + unterminated;
+	if (editor_splice(ed, start, end - start, repl, rlen)) {
+		lines += count_newlines(repl, rlen) + (ed->length > 0 && ed->buffer[ed->length - 1] != '\n');
+		ed->total_lines = (lines < 1) ? 1 : lines;
+	}
+	free(repl);
+}
+
+// ===== 版本化操作與轉換（OT） =====
+static LiveOp live_op_make(int pos, int del, const char *text, int nlines) {
+	LiveOp op;
+	memset(&op, 0, sizeof(op));
+	op.pos = pos;
+	op.del = del;
+	op.nlines = nlines;
+	if (nlines > 0) {
+		op.tlen = text ? strlen(text) : 0;
+		op.text = dup_payload(text ? text : "", op.tlen);
+	}
+	return op;
+}
+
+// 字元層級編輯：第 line 行從位元組 col 起刪除 cdel 位元組，再插入 text[0..tlen)
+static LiveOp live_op_make_chars(int line, int col, int cdel, const char *text, size_t tlen) {
+	LiveOp op;
+	memset(&op, 0, sizeof(op));
+	op.pos = line;
+	op.chars = 1;
+	op.col = col;
+	op.cdel = cdel;
+	op.tlen = tlen;
+	op.text = dup_payload(text ? text : "", tlen);
+	return op;
+}
+
+static LiveOp live_op_copy(const LiveOp *src) {
+	LiveOp op = *src;
+	op.text = (src->nlines > 0 || src->chars) ? dup_payload(src->text ? src->text : "", src->tlen) : NULL;
+	return op;
+}
+
+static void live_op_free(LiveOp *op) {
+	free(op->text);
+	op->text = NULL;
+	op->tlen = 0;
+}
+
+static void live_op_drop_content(LiveOp *op) {
+	live_op_free(op);
+	op->nlines = 0;
+}
+
+// 區段轉換：x 把 [*xpos, *xpos + *xdel) 換成大小 xins 的內容，轉換為在 y 之後執行的等價操作；x_later 表示 x 在主機順序中較晚
+// 兩者對調呼叫（x_later 取反）得到的結果滿足收斂：y 後接 x' 等於 x 後接 y'
+// 範圍不重疊時僅平移；重疊時由「包含對方者」勝出，部分重疊或範圍相同則較晚者勝出：
+// 勝者取代兩者的聯集範圍，敗者只保留刪除勝者範圍外的部分（回傳 0 表示 x 的插入內容要捨棄）
+// 行層級的單位是行，字元層級的單位是同一行內的位元組
+static int live_range_transform(int *xpos, int *xdel, int xins, int ypos, int ydel, int yins, int x_later) {
+	int ys = ypos, ye = ypos + ydel;
+	int xs = *xpos, xe = *xpos + *xdel;
+	int ydelta = yins - ydel;
+	if (ydel == 0 && yins == 0) return 1;
+	if (*xdel == 0 && xins == 0) return 1;
+	if (xs == xe && ys == ye && xs == ys) {
+		// 同一位置插入：較晚者排在後面
+		if (x_later) *xpos += yins;
+		return 1;
+	}
+	if (ye <= xs) {
+		*xpos += ydelta;
+		return 1;
+	}
+	if (xe <= ys) {
+		return 1;
+	}
+	int x_contains = (xs <= ys && ye <= xe);
+	int y_contains = (ys <= xs && xe <= ye);
+	int x_wins;
+	if (x_contains && !y_contains) x_wins = 1;
+	else if (y_contains && !x_contains) x_wins = 0;
+	else x_wins = x_later;
+	if (x_wins) {
+		int us = (xs < ys) ? xs : ys;
+		int ue = (xe > ye) ? xe : ye;
+		*xpos = us;
+		*xdel = ue + ydelta - us;
+		return 1;
+	}
+	if (xs < ys) {
+		*xdel = ys - xs;
+	} else if (xe > ye) {
+		*xpos = ye + ydelta;
+		*xdel = xe - ye;
+	} else {
+		*xdel = 0;
+	}
+	return 0;
+}
+
+// 將 x 轉換為在 y 之後執行的等價操作；x_later 表示 x 在主機順序中較晚
+// 字元層級操作遇到刪除或取代它所在行的行層級操作一律作廢（整行以對方為準），
+// 行層級操作不受字元層級操作影響；同一行的兩個字元層級操作以位元組範圍轉換
+static void live_op_transform(LiveOp *x, const LiveOp *y, int x_later) {
+	if (!x->chars && !y->chars) {
+		if (!live_range_transform(&x->pos, &x->del, x->nlines, y->pos, y->del, y->nlines, x_later)) {
+			live_op_drop_content(x);
+		}
+	} else if (x->chars && y->chars) {
+		if (x->pos == y->pos &&
+		    !live_range_transform(&x->col, &x->cdel, (int)x->tlen, y->col, y->cdel, (int)y->tlen, x_later)) {
+			live_op_drop_content(x);
+		}
+	} else if (x->chars) {
+		int ys = y->pos, ye = y->pos + y->del;
+		if (y->del == 0) {
+			if (ys <= x->pos) x->pos += y->nlines;
+		} else if (ye <= x->pos) {
+			x->pos += y->nlines - y->del;
+		} else if (ys <= x->pos) {
+			x->cdel = 0;
+			live_op_drop_content(x);
+		}
+	}
+}
+
+// 字元層級編輯只動同一行內的位元組；行不存在時忽略，範圍超出行尾時截到行尾（各端狀態相同，結果一致）
+// 緊接在最後一行之後、從內容結尾開始的那一行照行層級插入處理：插入的文字成為新的一行
+static void editor_apply_chars(EditorState *ed, int line, int col, int cdel, const char *text, size_t tlen) {
+	if (line < 1) return;
+	size_t off = editor_line_offset(ed, line);
+	if (off >= ed->length) {
+		int lines = (ed->length > 0) ? ed->total_lines : 0;
+		if (line == lines + 1 && tlen > 0) editor_apply_splice(ed, line, 0, text, tlen, 1);
+		return;
+	}
+	size_t eol = editor_line_end(ed, off);
+	size_t len = eol - off;
+	size_t c = (col > 0) ? (size_t)col : 0;
+	size_t d = (cdel > 0) ? (size_t)cdel : 0;
+	if (c > len) c = len;
+	if (d > len - c) d = len - c;
+	if (d == 0 && tlen == 0) return;
+	// 最後一行沒有換行的文件：最後一行清空時補回換行（否則就少了一行），空的最後一行有了內容時去掉換行
+	if (ed->no_final_nl && eol == ed->length && d == len && tlen == 0) {
+		editor_splice(ed, off, len, "\n", 1);
+	} else if (ed->no_final_nl && len == 0 && eol + 1 == ed->length) {
+		editor_splice(ed, off, 1, text, tlen);
+	} else {
+		editor_splice(ed, off + c, d, text, tlen);
+	}
+}
+
+static void editor_apply_op(EditorState *ed, const LiveOp *op) {
+	if (op->chars) {
+		editor_apply_chars(ed, op->pos, op->col, op->cdel, op->text, op->tlen);
+	} else {
+		editor_apply_splice(ed, op->pos, op->del, op->text, op->tlen, op->nlines);
+	}
+}
+
+// 由封包標頭與 payload 組出操作（payload 會複製）
+static LiveOp live_op_from_header(const LiveHeader *h, const char *payload) {
+	if (h->type == OP_CHARS) return live_op_make_chars(h->line, h->del, h->nlines, payload, h->len);
+	LiveOp op = live_op_make(h->line, h->del, NULL, 0);
+	op.nlines = h->nlines;
+	if (op.nlines > 0) {
+		op.text = dup_payload(payload, h->len);
+		op.tlen = h->len;
+	}
+	return op;
+}
+
+static int live_format_op_header(char *header, size_t cap, const LiveOp *op, int base) {
+	if (op->chars) {
+		return snprintf(header, cap, "OP %d %d %d %zu %d %d %d %d %d %lld %lld\n", (int)OP_CHARS, op->doc, op->pos,
+		                op->tlen, op->version, base, op->origin, op->col, op->cdel, op->t_send, op->t_relay);
+	}
+	return snprintf(header, cap, "OP %d %d %d %zu %d %d %d %d %d %lld %lld\n", (int)OP_SPLICE, op->doc,
+	                op->pos, op->tlen, op->version, base, op->origin, op->del, op->nlines, op->t_send, op->t_relay);
+}
+
+static void live_send_op(ClientInfo *c, const LiveOp *op, int base) {
+	char header[160];
+	int header_len = live_format_op_header(header, sizeof(header), op, base);
+	if (c) {
+		live_client_send(c, header, (size_t)header_len, op->text, op->tlen);
+	} else if (live_mode == LIVE_HOST) {
+		broadcast_header_payload_except(op->doc, -1, header, (size_t)header_len, op->text, op->tlen);
+	} else if (live_mode == LIVE_JOIN) {
+		live_sock_send(header, (size_t)header_len, op->text, op->tlen);
+	}
+}
+
+// 主機：定序並記錄，廣播給所有人（來源據此確認）
+static void live_host_sequence(LiveOp *op) {
+	LiveDoc *d = &live_docs[op->doc];
+	op->version = ++d->version;
+	op->t_relay = live_now_us();
+	LiveOp *slot = &d->log[op->version % LIVE_LOG_MAX];
+	live_op_free(slot);
+	*slot = live_op_copy(op);
+	live_send_op(NULL, op, op->version - 1);
+}
+
+// 加入者：送出下一個待確認操作（一次只有一個在途，主機可直接以紀錄轉換）
+// 每個文件各自只有一個在途操作
+static void live_client_flush(int doc) {
+	LiveDoc *d = &live_docs[doc];
+	if (d->inflight || d->resuming || d->pending_count == 0) return;
+	d->inflight = 1;
+	live_send_op(NULL, &d->pending[0], d->version);
+}
+
+static void live_client_clear_pending(int doc) {
+	LiveDoc *d = &live_docs[doc];
+	for (int i = 0; i < d->pending_count; i++) {
+		live_op_free(&d->pending[i]);
+	}
+	d->pending_count = 0;
+	d->inflight = 0;
+}
+
+// 提交已在本地套用的操作
+static void live_submit_local(LiveOp *op) {
+	op->origin = live_self_id;
+	op->t_send = live_host_clock_us();
+	if (live_mode == LIVE_HOST) {
+		live_host_sequence(op);
+	} else if (live_mode == LIVE_JOIN && live_running) {
+		LiveDoc *d = &live_docs[op->doc];
+		if (d->pending_count == d->pending_cap) {
+			int cap = d->pending_cap ? d->pending_cap * 2 : 16;
+			LiveOp *np = (LiveOp *)realloc(d->pending, sizeof(LiveOp) * (size_t)cap);
+			if (!np) return;
+			d->pending = np;
+			d->pending_cap = cap;
+		}
+		d->pending[d->pending_count++] = live_op_copy(op);
+		live_client_flush(op->doc);
+	}
+}
+
+// 套用本地編輯：立即寫入緩衝區（樂觀），再以該編輯器的文件編號提交給 Live Share
+static void editor_commit_local(EditorState *ed, LiveOp *op) {
+	int ed_idx = (ed == &editors[0]) ? 0 : 1;
+	op->doc = ed_idx;
+	editor_apply_op(ed, op);
+	if (!macro_replaying) live_submit_local(op);
+	live_op_free(op);
+}
+
+// 主機：接收 client 操作，轉換到目前版本後套用並廣播
+// 回傳 0 表示基底版本已不在紀錄中，需改送快照
+static int live_host_receive_op(int origin, const LiveHeader *h, const char *payload) {
+	// 字元層級編輯不能跨行：內容含換行或範圍為負時丟棄
+	if (h->type == OP_CHARS && (h->del < 0 || h->nlines < 0 || (h->len > 0 && memchr(payload, '\n', h->len)))) return 1;
+	LiveOp op = live_op_from_header(h, payload);
+	op.origin = origin;
+	op.doc = h->doc;
+	op.t_send = h->tsend;
+	LiveDoc *d = &live_docs[h->doc];
+	if (h->base < d->version - LIVE_LOG_MAX + 1 || h->base > d->version) {
+		live_op_free(&op);
+		return 0;
+	}
+	// 單一在途保證 base 之後的紀錄都來自其他參與者
+	for (int v = h->base + 1; v <= d->version; v++) {
+		live_op_transform(&op, &d->log[v % LIVE_LOG_MAX], 1);
+	}
+	editor_apply_op(&editors[h->doc], &op);
+	// 字元層級編輯不改變行數，不必重新計算
+	if (!op.chars) editor_recount_and_clamp(&editors[h->doc]);
+	edit_session_patch(&editors[h->doc], &op);
+	live_host_sequence(&op);
+	live_lat_record(op.t_send, op.t_relay, op.t_relay);
+	live_op_free(&op);
+	return 1;
+}
+
+// 加入者：接收主機定序的操作
+static void live_client_receive_op(const LiveHeader *h, const char *payload) {
+	EditorState *ed = &editors[h->doc];
+	LiveDoc *d = &live_docs[h->doc];
+	int own = (h->origin == live_self_id || (d->resume_id > 0 && h->origin == d->resume_id));
+	live_lat_record(h->tsend, h->trelay, live_host_clock_us());
+	if (own && d->inflight) {
+		// 自己操作的回聲：已在本地套用，視為確認
+		live_op_free(&d->pending[0]);
+		memmove(d->pending, d->pending + 1, sizeof(LiveOp) * (size_t)(d->pending_count - 1));
+		d->pending_count--;
+		d->inflight = 0;
+		d->version = h->ver;
+		live_client_flush(h->doc);
+		return;
+	}
+	LiveOp op = live_op_from_header(h, payload);
+	// 主機操作較早；本地未確認操作較晚，兩者互相轉換
+	for (int i = 0; i < d->pending_count; i++) {
+		LiveOp remote = op;
+		live_op_transform(&op, &d->pending[i], 0);
+		live_op_transform(&d->pending[i], &remote, 1);
+	}
+	editor_apply_op(ed, &op);
+	if (!op.chars) editor_recount_and_clamp(ed);
+	edit_session_patch(ed, &op);
+	live_op_free(&op);
+	d->version = h->ver;
+}
+
+// 加入者：暫存的操作依版本套用；已套用過的版本直接丟棄
+static void live_client_drain_held(int doc) {
+	LiveDoc *d = &live_docs[doc];
+	if (!d->synced || d->sync.active) return;
+	int i = 0;
+	while (i < d->held_count && d->held[i].h.ver <= d->version + 1) {
+		if (d->held[i].h.ver == d->version + 1) {
+			live_client_receive_op(&d->held[i].h, d->held[i].payload);
+		}
+		free(d->held[i].payload);
+		i++;
+	}
+	if (i > 0) {
+		memmove(d->held, d->held + i, sizeof(LiveHeld) * (size_t)(d->held_count - i));
+		d->held_count -= i;
+	}
+}
+
+// 加入者：轉送路徑切換時可能漏掉一段版本，向主機要求補送 version 之後的操作
+static void live_client_check_gap(int doc) {
+	LiveDoc *d = &live_docs[doc];
+	// 觀看者不送出補送要求：共用串流本身連續，落後太多時主機會中斷連線，重新連線後續傳
+	if (live_spectator || d->held_count == 0 || d->gap_req || !d->synced || d->sync.active || d->resuming || !live_connected) return;
+	if (d->held[0].h.ver <= d->version + 1) return;
+	char header[64];
+	int header_len = snprintf(header, sizeof(header), "OP %d %d %d 0\n", (int)OP_RESYNC, doc, d->version);
+	live_sock_send(header, (size_t)header_len, NULL, 0);
+	d->gap_req = 1;
+}
+
+static void live_client_clear_held(int doc) {
+	LiveDoc *d = &live_docs[doc];
+	for (int i = 0; i < d->held_count; i++) {
+		free(d->held[i].payload);
+	}
+	free(d->held);
+	d->held = NULL;
+	d->held_count = 0;
+	d->held_cap = 0;
+	d->gap_req = 0;
+}
+
+// 加入者：操作可能經由主機或轉送節點到達，依版本順序套用
+// 同步尚未完成或版本不連續時先暫存，補齊後再依序套用
+static void live_client_order_op(const LiveHeader *h, const char *payload) {
+	LiveDoc *d = &live_docs[h->doc];
+	int ready = d->synced && !d->sync.active;
+	if (ready && h->ver <= d->version) return;
+	if (ready && h->ver == d->version + 1) {
+		live_client_receive_op(h, payload);
+		live_client_drain_held(h->doc);
+		live_client_check_gap(h->doc);
+		return;
+	}
+	int pos = d->held_count;
+	while (pos > 0 && d->held[pos - 1].h.ver > h->ver) pos--;
+	if (pos > 0 && d->held[pos - 1].h.ver == h->ver) return;
+	if (d->held_count >= LIVE_LOG_MAX) return;  // 缺漏補送時會一併取得
+	if (d->held_count == d->held_cap) {
+		int cap = d->held_cap ? d->held_cap * 2 : 16;
+		LiveHeld *grown = (LiveHeld *)realloc(d->held, sizeof(LiveHeld) * (size_t)cap);
+		if (!grown) return;
+		d->held = grown;
+		d->held_cap = cap;
+	}
+	char *copy = NULL;
+	if (h->len > 0) {
+		copy = dup_payload(payload, h->len);
+		if (!copy) return;
+	}
+	memmove(d->held + pos + 1, d->held + pos, sizeof(LiveHeld) * (size_t)(d->held_count - pos));
+	d->held[pos].h = *h;
+	d->held[pos].payload = copy;
+	d->held_count++;
+	live_client_check_gap(h->doc);
+}
+
+static void apply_remote_op(const LiveHeader *h, const char *payload) {
+	// 依文件編號套用到對應的編輯器；本地沒有開啟的文件直接忽略
+	int doc = h->doc;
+	if (doc >= num_editors) return;
+	EditorState *ed = &editors[doc];
+	LiveDoc *d = &live_docs[doc];
+	int t = h->type;
+	int line = h->line;
+	size_t plen = h->len;
+	if (t == OP_SYNC_FULL) {
+		editor_splice(ed, 0, ed->length, payload, plen);
+		editor_recount_and_clamp(ed);
+		editor_detect_final_nl(ed);
+		edit_session_reload(ed);
+	} else if (t == OP_SYNC_BEGIN) {
+		// 預先配置並清空，之後的分塊逐一附加
+		size_t total = 0, chunks = 0;
+		int version = 0, no_final_nl = -1;
+		char *info = dup_payload(payload, plen);
+		if (info) {
+			sscanf(info, "%zu %zu %d %d", &total, &chunks, &version, &no_final_nl);
+			free(info);
+		}
+		// 快照取代本地狀態：未確認的操作一併捨棄
+		live_client_clear_pending(doc);
+		// 分塊內容不經過 editor_splice，日誌無法表示，同步結束後整份重寫
+		ed->journal_stale = 1;
+		d->version = version;
+		// 接收期間交換檔停止記錄，結束時再整份快照
+		d->sync.active = 1;
+		editor_reserve(ed, total + 1);
+		editor_splice(ed, 0, ed->length, NULL, 0);
+		ed->total_lines = 1;
+		editor_clamp(ed);
+		d->sync.raw_total = total;
+		d->sync.no_final_nl = no_final_nl;
+		d->sync.raw_received = 0;
+		d->sync.wire_received = 0;
+		d->sync.t_begin = now_ms();
+		d->sync.t_end = 0;
+		d->sync.first_render_ms = -1;
+	} else if (t == OP_SYNC_CHUNK) {
+		size_t raw = (line > 0) ? (size_t)line : 0;
+		if (d->sync.active && raw > 0 && editor_reserve(ed, ed->length + raw + 1)) {
+			long got = lz_decompress((const uint8_t *)payload, plen, (uint8_t *)ed->buffer + ed->length, raw);
+			if (got == (long)raw) {
+				// 行數只計算新加入的部分
+				int had_tail = (ed->length > 0 && ed->buffer[ed->length - 1] != '\n');
+				int newlines = 0;
+				for (size_t i = 0; i < raw; i++) {
+					if (ed->buffer[ed->length + i] == '\n') newlines++;
+				}
+				int complete = (ed->length > 0) ? ed->total_lines - had_tail : 0;
+				ed->length += raw;
+				ed->buffer[ed->length] = '\0';
+				ed->total_lines = complete + newlines + (ed->buffer[ed->length - 1] != '\n');
+				editor_clamp(ed);
+				d->sync.raw_received += raw;
+			}
+		}
+		d->sync.wire_received += plen;
+	} else if (t == OP_SYNC_END) {
+		d->sync.active = 0;
+		d->sync.t_end = now_ms();
+		editor_recount_and_clamp(ed);
+		// 主機的最後一行是空行時內容看不出它是否以換行結尾，以主機提供的為準（舊版主機沒有提供）
+		if (d->sync.no_final_nl >= 0) ed->no_final_nl = d->sync.no_final_nl;
+		else editor_detect_final_nl(ed);
+		edit_session_reload(ed);
+		swap_snapshot(doc);
+		d->synced = 1;
+		d->resuming = 0;
+		d->resume_id = 0;
+		d->gap_req = 0;
+		live_client_drain_held(doc);
+		live_client_flush(doc);
+		live_client_check_gap(doc);
+	} else if (t == OP_RESUME_END) {
+		// 續傳完成：在途操作若未在補送中被確認，代表主機沒收到，重新送出
+		int from = 0, to = 0;
+		char *info = dup_payload(payload, plen);
+		if (info) {
+			sscanf(info, "%d %d", &from, &to);
+			free(info);
+		}
+		if (!d->resuming) {
+			// 缺漏補送完成（連線並未中斷，在途操作不需重送）
+			d->gap_req = 0;
+			live_client_drain_held(doc);
+			live_client_check_gap(doc);
+			return;
+		}
+		d->resumed_ops = to - from;
+		d->resuming = 0;
+		d->resume_id = 0;
+		d->gap_req = 0;
+		live_client_drain_held(doc);
+		if (d->inflight && d->pending_count > 0) {
+			live_send_op(NULL, &d->pending[0], d->version);
+		} else {
+			live_client_flush(doc);
+		}
+		live_client_check_gap(doc);
+	} else if (t == OP_SPLICE || t == OP_CHARS) {
+		if (live_mode == LIVE_JOIN) live_client_order_op(h, payload);
+	} else if (t == OP_CURSOR) {
+		// payload: "id line col"
+		int pid = 0, pline = 0, pcol = 0;
+		if (payload && plen > 0) {
+			char tmp[64] = {0};
+			size_t copy_len = (plen < sizeof(tmp) - 1) ? plen : sizeof(tmp) - 1;
+			memcpy(tmp, payload, copy_len);
+			tmp[copy_len] = '\0';
+			sscanf(tmp, "%d %d %d", &pid, &pline, &pcol);
+			if (pid >= 1 && pid != live_self_id) {
+				live_presence_set(doc, pid, pline, pcol);
+			}
+		}
+	} else if (t == OP_HELLO) {
+		// 僅 client 端接收：設定 self id
+		if (payload && plen > 0 && live_mode == LIVE_JOIN) {
+			char tmp[32] = {0};
+			size_t copy_len = (plen < sizeof(tmp) - 1) ? plen : sizeof(tmp) - 1;
+			memcpy(tmp, payload, copy_len);
+			tmp[copy_len] = '\0';
+			int assigned = atoi(tmp);
+			if (assigned >= 1) {
+				live_self_id = assigned;
+			}
+		}
+	}
+}
+
+static void live_client_ref(ClientInfo *c) {
+	__atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
+
+// 釋放參考；最後一個參考負責關閉 socket（延後關閉可避免 fd 被重用後誤送）
+static void live_client_unref(ClientInfo *c) {
+	if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+	if (c->fd >= 0) close(c->fd);
+	live_shm_free(c->shm);
+	pthread_mutex_destroy(&c->send_mutex);
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+static void live_sync_job_free(LiveSyncJob *job) {
+	free(job->snap);
+	for (int i = 0; i < job->count; i++) {
+		live_op_free(&job->ops[i]);
+	}
+	free(job->ops);
+	free(job->known);
+	if (job->c) live_client_unref(job->c);
+	free(job);
+}
+
+// UI 執行緒：為 c 準備文件 doc 的同步資料並交給其 I/O 執行緒送出
+// from 仍在紀錄範圍內時只補送之後的操作（續傳），否則複製完整快照；
+// 標記 syncing 後到送完之前的廣播都排入輸出佇列，確保排在同步資料之後
+static void live_queue_sync(ClientInfo *c, int doc, int from) {
+	LiveDoc *d = &live_docs[doc];
+	EditorState *ed = &editors[doc];
+	LiveSyncJob *job = (LiveSyncJob *)calloc(1, sizeof(LiveSyncJob));
+	if (!job) return;
+	job->doc = doc;
+	job->version = d->version;
+	job->from = from;
+	if (from >= 0 && from >= d->version - LIVE_LOG_MAX && from <= d->version) {
+		int count = d->version - from;
+		job->ops = (LiveOp *)malloc(sizeof(LiveOp) * (size_t)(count > 0 ? count : 1));
+		if (!job->ops) {
+			live_sync_job_free(job);
+			return;
+		}
+		for (int i = 0; i < count; i++) {
+			job->ops[i] = live_op_copy(&d->log[(from + 1 + i) % LIVE_LOG_MAX]);
+			// 補送的操作不計入延遲統計
+			job->ops[i].t_send = 0;
+			job->ops[i].t_relay = 0;
+		}
+		job->count = count;
+	} else {
+		job->snap = (char *)malloc(ed->length + 1);
+		if (!job->snap) {
+			live_sync_job_free(job);
+			return;
+		}
+		memcpy(job->snap, ed->buffer, ed->length);
+		job->total = ed->length;
+		job->no_final_nl = ed->no_final_nl;
+	}
+	job->known = (LivePresence *)malloc(sizeof(LivePresence) * (size_t)(d->presence_count > 0 ? d->presence_count : 1));
+	if (job->known) {
+		memcpy(job->known, d->presence, sizeof(LivePresence) * (size_t)d->presence_count);
+		job->nknown = d->presence_count;
+	}
+	// 觀看者首次同步時從目前的串流位置接續：先發布累積中的批次，其中的操作都已包含在這次的同步資料裡
+	int64_t spec_from = -1;
+	if (c->spectator) {
+		live_spec_publish();
+		pthread_rwlock_rdlock(&live_spec_lock);
+		spec_from = live_spec_end;
+		pthread_rwlock_unlock(&live_spec_lock);
+	}
+	pthread_mutex_lock(&c->send_mutex);
+	int closed = c->closed;
+	if (!closed) c->syncing++;
+	if (!closed && c->spec_off < 0) c->spec_off = spec_from;
+	pthread_mutex_unlock(&c->send_mutex);
+	if (closed) {
+		live_sync_job_free(job);
+		return;
+	}
+	__atomic_or_fetch(&c->ready, 1u << doc, __ATOMIC_RELEASE);
+	live_client_ref(c);
+	job->c = c;
+	live_queue_push(&live_jobs[c->worker], &job->node);
+	uint64_t one = 1;
+	ssize_t n = write(live_job_fd[c->worker], &one, sizeof(one));
+	(void)n;
+}
+
+// I/O 執行緒阻塞送出（同步資料）
+static void live_client_send_blocking(ClientInfo *c, const char *header, size_t hlen, const char *payload, size_t plen) {
+	if (c->shm) {
+		live_shm_send_frame(c->shm, header, hlen, payload, plen);
+	} else {
+		send_header_payload_to_fd(c->fd, header, hlen, payload, plen);
+	}
+}
+
+// I/O 執行緒：送出同步資料
+// 快照以壓縮分塊串流：SYNC_BEGIN → SYNC_CHUNK* → SYNC_END；續傳補送紀錄後送出 OP_RESUME_END
+// 送完後才補送同步期間排入輸出佇列的封包
+static void live_run_sync_job(LiveSyncJob *job) {
+	ClientInfo *c = job->c;
+	int doc = job->doc;
+	char header[160];
+	int header_len;
+	pthread_mutex_lock(&c->send_mutex);
+	int closed = c->closed;
+	pthread_mutex_unlock(&c->send_mutex);
+	uint8_t *zbuf = job->snap ? (uint8_t *)malloc(lz_bound(LIVE_SYNC_CHUNK)) : NULL;
+	if (closed || (job->snap && !zbuf)) {
+		// 已斷線或無法壓縮：不送出，由清理流程收尾
+		if (!closed) live_client_shutdown(c);
+	} else if (job->snap) {
+		char info[64];
+		size_t total = job->total;
+		size_t chunks = (total + LIVE_SYNC_CHUNK - 1) / LIVE_SYNC_CHUNK;
+		int info_len = snprintf(info, sizeof(info), "%zu %zu %d %d", total, chunks, job->version, job->no_final_nl);
+		header_len = snprintf(header, sizeof(header), "OP %d %d 0 %d\n", (int)OP_SYNC_BEGIN, doc, info_len);
+		live_client_send_blocking(c, header, (size_t)header_len, info, (size_t)info_len);
+		for (size_t off = 0; off < total; off += LIVE_SYNC_CHUNK) {
+			size_t raw = (total - off < LIVE_SYNC_CHUNK) ? total - off : LIVE_SYNC_CHUNK;
+			size_t zlen = lz_compress((const uint8_t *)job->snap + off, raw, zbuf);
+			header_len = snprintf(header, sizeof(header), "OP %d %d %zu %zu\n", (int)OP_SYNC_CHUNK, doc, raw, zlen);
+			live_client_send_blocking(c, header, (size_t)header_len, (const char *)zbuf, zlen);
+		}
+		header_len = snprintf(header, sizeof(header), "OP %d %d 0 0\n", (int)OP_SYNC_END, doc);
+		live_client_send_blocking(c, header, (size_t)header_len, NULL, 0);
+	} else {
+		for (int i = 0; i < job->count; i++) {
+			header_len = live_format_op_header(header, sizeof(header), &job->ops[i], job->ops[i].version - 1);
+			live_client_send_blocking(c, header, (size_t)header_len, job->ops[i].text, job->ops[i].tlen);
+		}
+		char info[64];
+		int info_len = snprintf(info, sizeof(info), "%d %d", job->from, job->from + job->count);
+		header_len = snprintf(header, sizeof(header), "OP %d %d 0 %d\n", (int)OP_RESUME_END, doc, info_len);
+		live_client_send_blocking(c, header, (size_t)header_len, info, (size_t)info_len);
+	}
+	// 該文件目前已知的游標（包含主機自己與其他人）
+	for (int i = 0; !closed && i < job->nknown; i++) {
+		char payload[64];
+		int plen = snprintf(payload, sizeof(payload), "%d %d %d", job->known[i].id, job->known[i].line, job->known[i].col);
+		header_len = snprintf(header, sizeof(header), "OP %d %d 0 %d\n", (int)OP_CURSOR, doc, plen);
+		live_client_send_blocking(c, header, (size_t)header_len, payload, (size_t)plen);
+	}
+	free(zbuf);
+	pthread_mutex_lock(&c->send_mutex);
+	c->syncing--;
+	pthread_mutex_unlock(&c->send_mutex);
+	live_client_flush_out(c);
+}
+
+// 網路執行緒：把訊息交給 UI 執行緒，payload 的所有權一併轉移
+static void live_post(int kind, const LiveHeader *h, char *payload, ClientInfo *from) {
+	LiveMsg *m = (LiveMsg *)calloc(1, sizeof(LiveMsg));
+	if (!m) {
+		free(payload);
+		return;
+	}
+	m->kind = kind;
+	if (h) m->h = *h;
+	m->payload = payload;
+	if (from) {
+		live_client_ref(from);
+		m->from = from;
+	}
+	live_queue_push(&live_inbox, &m->node);
+	ui_wake();
+}
+
+static void live_msg_free(LiveMsg *m) {
+	free(m->payload);
+	if (m->from) live_client_unref(m->from);
+	free(m);
+}
+
+static int live_id_in_use(int id) {
+	for (int i = 0; i < live_client_count; i++) {
+		if (live_clients[i]->id == id) return 1;
+	}
+	return 0;
+}
+
+// 從回收佇列移除指定 id（被重新連線者取回時）
+static void live_free_ids_remove(int id) {
+	for (int i = 0; i < live_free_count; i++) {
+		if (live_free_ids[(live_free_head + i) % live_free_cap] != id) continue;
+		for (int j = i; j + 1 < live_free_count; j++) {
+			live_free_ids[(live_free_head + j) % live_free_cap] = live_free_ids[(live_free_head + j + 1) % live_free_cap];
+		}
+		live_free_count--;
+		return;
+	}
+}
+
+// 分配 id（呼叫端持有 live_clients_mutex）：優先沿用 want，其次回收佇列，最後才用新編號；額滿回傳 0
+static int live_alloc_id(int want) {
+	if (live_client_count > LIVE_PEER_LIMIT) return 0;
+	if (want >= 2 && want < next_assign_id && !live_id_in_use(want)) {
+		live_free_ids_remove(want);
+		return want;
+	}
+	if (live_free_count > 0) {
+		int id = live_free_ids[live_free_head];
+		live_free_head = (live_free_head + 1) % live_free_cap;
+		live_free_count--;
+		return id;
+	}
+	return next_assign_id++;
+}
+
+// 釋放 id 到回收佇列尾端（呼叫端持有 live_clients_mutex）
+static void live_release_id(int id) {
+	if (id < 2) return;
+	if (live_free_count == live_free_cap) {
+		int cap = live_free_cap ? live_free_cap * 2 : 64;
+		int *nq = (int *)malloc(sizeof(int) * (size_t)cap);
+		if (!nq) return;
+		for (int i = 0; i < live_free_count; i++) {
+			nq[i] = live_free_ids[(live_free_head + i) % live_free_cap];
+		}
+		free(live_free_ids);
+		live_free_ids = nq;
+		live_free_head = 0;
+		live_free_cap = cap;
+	}
+	live_free_ids[(live_free_head + live_free_count) % live_free_cap] = id;
+	live_free_count++;
+}
+
+// ===== 轉送樹（主機端，呼叫端持有 live_clients_mutex） =====
+static ClientInfo *live_client_by_id(int id) {
+	for (int i = 0; i < live_client_count; i++) {
+		if (live_clients[i]->id == id) return live_clients[i];
+	}
+	return NULL;
+}
+
+// 為 c 選擇上游，回傳 NULL 表示由主機直接廣播
+// 主機還有空位時優先；否則選最淺、仍有空位且訂閱涵蓋 c 的轉送節點，都沒有時仍掛在主機下
+// max_depth >= 0 時只考慮不比它深的節點：深度沿上游到下游嚴格遞增，因此不會選到 c 自己的下游而形成迴圈
+static ClientInfo *live_tree_pick(ClientInfo *c, int max_depth) {
+	if (live_shm_name[0] || live_host_children < LIVE_RELAY_FANOUT) return NULL;
+	ClientInfo *best = NULL;
+	for (int i = 0; i < live_client_count; i++) {
+		ClientInfo *p = live_clients[i];
+		if (p == c || p->id <= 0 || p->relay_port <= 0 || p->children >= LIVE_RELAY_FANOUT) continue;
+		if ((p->subs & c->subs) != c->subs) continue;
+		if (max_depth >= 0 && p->depth > max_depth) continue;
+		if (!best || p->depth < best->depth) best = p;
+	}
+	return best;
+}
+
+// c 移動後更新整棵子樹的深度；深度正確時，深度不超過 c 的節點都不會是 c 的下游
+static void live_tree_redepth(ClientInfo *c) {
+	for (int i = 0; i < live_client_count; i++) {
+		ClientInfo *x = live_clients[i];
+		if (x != c && x->parent == c->id) {
+			x->depth = c->depth + 1;
+			live_tree_redepth(x);
+		}
+	}
+}
+
+// 將 c 掛到 p 之下（NULL 為主機）並通知 c 連線到新的上游
+static void live_tree_attach(ClientInfo *c, ClientInfo *p) {
+	char payload[96];
+	int plen;
+	if (p) {
+		p->children++;
+		c->parent = p->id;
+		c->depth = p->depth + 1;
+		plen = snprintf(payload, sizeof(payload), "%d %s %d", p->id, p->addr, p->relay_port);
+	} else {
+		live_host_children++;
+		c->parent = 1;
+		c->depth = 1;
+		plen = snprintf(payload, sizeof(payload), "1 - 0");
+	}
+	live_tree_redepth(c);
+	char header[64];
+	int header_len = snprintf(header, sizeof(header), "OP %d 0 0 %d\n", (int)OP_RELAY, plen);
+	live_client_send(c, header, (size_t)header_len, payload, (size_t)plen);
+}
+
+static void live_tree_detach(ClientInfo *c) {
+	if (c->parent == 1) {
+		live_host_children--;
+	} else if (c->parent > 1) {
+		ClientInfo *p = live_client_by_id(c->parent);
+		if (p) p->children--;
+	}
+	c->parent = 0;
+}
+
+// c 離線：它的下游各自改派到不比自己深的節點（不會是自己的下游，不會形成迴圈）
+static void live_tree_remove(ClientInfo *c) {
+	if (c->parent == 0) return;
+	live_tree_detach(c);
+	c->relay_port = 0;
+	for (int i = 0; i < live_client_count; i++) {
+		ClientInfo *x = live_clients[i];
+		if (x == c || x->parent != c->id) continue;
+		x->parent = 0;
+		live_tree_attach(x, live_tree_pick(x, x->depth));
+	}
+}
+
+// 斷線清理：通知 UI 移除游標、移出連線表、回收 id；連線表的參考由呼叫端釋放
+static void host_client_cleanup(ClientInfo *c) {
+	epoll_ctl(live_epoll_fd[c->worker], EPOLL_CTL_DEL, c->fd, NULL);
+	if (c->shm) epoll_ctl(live_epoll_fd[c->worker], EPOLL_CTL_DEL, c->shm->rx_efd, NULL);
+	int cid = c->id;
+	pthread_mutex_lock(&c->send_mutex);
+	c->closed = 1;
+	pthread_mutex_unlock(&c->send_mutex);
+	live_client_shutdown(c);
+	if (c->spectator) __atomic_sub_fetch(&live_spec_count, 1, __ATOMIC_RELEASE);
+	// 先送出離線訊息再回收 id，避免 UI 把沿用同一 id 的新參與者游標一併移除
+	if (cid > 0) {
+		LiveHeader h;
+		memset(&h, 0, sizeof(h));
+		h.origin = cid;
+		live_post(LIVE_MSG_LEAVE, &h, NULL, NULL);
+	}
+	pthread_mutex_lock(&live_clients_mutex);
+	if (live_mode == LIVE_HOST) live_tree_remove(c);
+	for (int i = 0; i < live_client_count; i++) {
+		if (live_clients[i] == c) {
+			live_clients[i] = live_clients[--live_client_count];
+			break;
+		}
+	}
+	live_release_id(cid);
+	pthread_mutex_unlock(&live_clients_mutex);
+}
+
+// 回覆 HELLO："id 對方送出時間 主機時間"，對方據此估計與主機的時鐘差
+static void host_hello_reply(ClientInfo *c, int cid, long long t0) {
+	char buf[96];
+	int n = snprintf(buf, sizeof(buf), "%d %lld %lld", cid, t0, live_now_us());
+	char header[64];
+	int header_len = snprintf(header, sizeof(header), "OP %d 0 0 %d\n", (int)OP_HELLO, n);
+	live_client_send(c, header, (size_t)header_len, buf, (size_t)n);
+}
+
+// 觀看者的 HELLO：只要求同步，之後不再接受它送來的任何封包
+static int host_spectator_hello(ClientInfo *c, unsigned subs, const int *resume_from, long long t0) {
+	if (!live_spec_ring) {
+		c->spectator = 0;
+		return 0;
+	}
+	c->spec_off = -1;
+	__atomic_add_fetch(&live_spec_count, 1, __ATOMIC_RELEASE);
+	host_hello_reply(c, 0, t0);
+	for (int doc = 0; doc < num_editors; doc++) {
+		if (!(subs & (1u << doc))) continue;
+		LiveHeader h;
+		memset(&h, 0, sizeof(h));
+		h.doc = doc;
+		h.base = resume_from[doc];
+		live_post(LIVE_MSG_JOIN, &h, NULL, c);
+	}
+	return 1;
+}
+
+// 處理 HELLO："id doc:version ... relay:PORT [watch] [t:TIME]"，列出要訂閱的文件（即對方開啟的文件）與各自最後確認的版本
+// 重新連線者帶回上次的 id；version 為 -1 表示尚未同步過；PORT 為對方供轉送樹下游連入的 port（0 表示不轉送）
+// 帶 watch 者為觀看者：不分配 id（回覆 0）、不加入轉送樹，依其版本續傳後改由共用串流接收廣播
+// TIME 為對方的送出時間，原樣放回回覆中
+// 回傳 0 表示人數已滿，應關閉連線
+static int host_client_hello(ClientInfo *c, const char *payload, size_t len) {
+	int want_id = 0;
+	int resume_from[LIVE_MAX_DOCS];
+	int relay_port = 0;
+	unsigned subs = 0;
+	long long t0 = 0;
+	char hello[128] = {0};
+	if (len < sizeof(hello)) {
+		if (len > 0) memcpy(hello, payload, len);
+		int pos = 0;
+		if (sscanf(hello, "%d%n", &want_id, &pos) == 1) {
+			int doc, ver, used;
+			while (sscanf(hello + pos, " %d:%d%n", &doc, &ver, &used) == 2) {
+				pos += used;
+				// 只接受主機也有開啟的文件
+				if (doc >= 0 && doc < num_editors) {
+					subs |= 1u << doc;
+					resume_from[doc] = ver;
+				}
+			}
+			sscanf(hello + pos, " relay:%d", &relay_port);
+			c->spectator = (strstr(hello + pos, " watch") != NULL);
+			const char *tp = strstr(hello + pos, " t:");
+			if (tp) sscanf(tp, " t:%lld", &t0);
+		}
+	}
+	if (c->spectator) {
+		return host_spectator_hello(c, subs, resume_from, t0);
+	}
+	pthread_mutex_lock(&live_clients_mutex);
+	int cid = live_alloc_id(want_id);
+	c->id = cid;
+	pthread_mutex_unlock(&live_clients_mutex);
+	if (cid <= 0) return 0;
+
+	// 發送 HELLO，同步資料由 UI 執行緒準備
+	host_hello_reply(c, cid, t0);
+
+	// 在轉送樹中找上游
+	pthread_mutex_lock(&live_clients_mutex);
+	c->subs = subs;
+	c->relay_port = (relay_port > 0 && relay_port < 65536 && !c->shm) ? relay_port : 0;
+	live_tree_attach(c, live_tree_pick(c, -1));
+	pthread_mutex_unlock(&live_clients_mutex);
+
+	for (int doc = 0; doc < num_editors; doc++) {
+		if (!(subs & (1u << doc))) continue;
+		// 續傳：只補送缺少的操作；id 不同或首次加入時改送完整快照
+		LiveHeader h;
+		memset(&h, 0, sizeof(h));
+		h.doc = doc;
+		h.base = (want_id == cid) ? resume_from[doc] : -1;
+		live_post(LIVE_MSG_JOIN, &h, NULL, c);
+	}
+	return 1;
+}
+
+// ===== 轉送樹（加入者端） =====
+// 下游接上時送來 "doc:version ..."：補送紀錄中它還沒收到的操作（-1 表示全部），之後才開始轉送給它
+static void live_relay_subscribe(ClientInfo *c, const char *payload, size_t len) {
+	char buf[64] = {0};
+	if (len >= sizeof(buf)) return;
+	if (len > 0) memcpy(buf, payload, len);
+	unsigned mask = 0;
+	int pos = 0, doc, ver, used;
+	pthread_mutex_lock(&live_relay_mutex);
+	while (sscanf(buf + pos, " %d:%d%n", &doc, &ver, &used) == 2) {
+		pos += used;
+		if (doc < 0 || doc >= LIVE_MAX_DOCS) continue;
+		mask |= 1u << doc;
+		if (!live_relay_log[doc]) continue;
+		int from = ver + 1;
+		if (from < live_relay_ver[doc] - LIVE_LOG_MAX + 1) from = live_relay_ver[doc] - LIVE_LOG_MAX + 1;
+		for (int v = from; v <= live_relay_ver[doc]; v++) {
+			LiveRelayFrame *f = &live_relay_log[doc][v % LIVE_LOG_MAX];
+			if (f->frame && f->ver == v) live_client_send(c, f->frame, f->len, NULL, 0);
+		}
+	}
+	__atomic_or_fetch(&c->ready, mask, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&live_relay_mutex);
+}
+
+// 網路執行緒：從上游（主機或轉送節點）收到的廣播原樣轉給下游，並記錄最近的操作
+// 同一版本只轉送一次，下游收到的操作版本嚴格遞增；缺漏由下游自行向主機要求補送
+static void live_relay_forward(const char *header, const LiveHeader *h, const char *payload) {
+	if (h->type != OP_SPLICE && h->type != OP_CHARS && h->type != OP_CURSOR) return;
+	size_t hlen = strlen(header);
+	pthread_mutex_lock(&live_relay_mutex);
+	if (h->type != OP_CURSOR) {
+		if (h->ver <= live_relay_ver[h->doc]) {
+			pthread_mutex_unlock(&live_relay_mutex);
+			return;
+		}
+		live_relay_ver[h->doc] = h->ver;
+		if (live_relay_port > 0) {
+			if (!live_relay_log[h->doc]) {
+				live_relay_log[h->doc] = (LiveRelayFrame *)calloc(LIVE_LOG_MAX, sizeof(LiveRelayFrame));
+			}
+			LiveRelayFrame *f = live_relay_log[h->doc] ? &live_relay_log[h->doc][h->ver % LIVE_LOG_MAX] : NULL;
+			char *frame = f ? (char *)malloc(hlen + h->len) : NULL;
+			if (frame) {
+				memcpy(frame, header, hlen);
+				if (h->len > 0) memcpy(frame + hlen, payload, h->len);
+				free(f->frame);
+				f->frame = frame;
+				f->len = hlen + h->len;
+				f->ver = h->ver;
+			}
+		}
+	}
+	if (live_relay_port > 0) broadcast_header_payload_except(h->doc, -1, header, hlen, payload, h->len);
+	pthread_mutex_unlock(&live_relay_mutex);
+}
+
+// 接收執行緒：主機指定新的上游 "id 位址 port"；中斷目前的上游連線，由轉送執行緒重新連線
+static void live_relay_assign(const char *payload, size_t len) {
+	char buf[96] = {0};
+	if (len >= sizeof(buf)) return;
+	if (len > 0) memcpy(buf, payload, len);
+	int id = 0, port = 0;
+	char addr[INET6_ADDRSTRLEN] = "";
+	if (sscanf(buf, "%d %45s %d", &id, addr, &port) < 1) return;
+	pthread_mutex_lock(&live_relay_mutex);
+	__atomic_store_n(&live_parent_id, id, __ATOMIC_RELEASE);
+	snprintf(live_parent_addr, sizeof(live_parent_addr), "%s", addr);
+	live_parent_port = port;
+	live_parent_gen++;
+	if (live_parent_sock >= 0) shutdown(live_parent_sock, SHUT_RDWR);
+	pthread_cond_broadcast(&live_relay_cond);
+	pthread_mutex_unlock(&live_relay_mutex);
+}
+
+// 連不上或失去上游：請主機改派
+static void live_relay_request(void) {
+	char header[64];
+	int header_len = snprintf(header, sizeof(header), "OP %d 0 0 0\n", (int)OP_RELAY);
+	live_sock_send(header, (size_t)header_len, NULL, 0);
+}
+
+static int live_tcp_connect(const char *host, int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)port);
+	if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0 ||
+	    connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	live_tcp_nodelay(fd);
+	return fd;
+}
+
+// 轉送執行緒：連上主機指定的上游並訂閱，收到的封包與主機連線上的一樣交給 UI 並往下游轉送
+static void *live_parent_thread_func(void *arg) {
+	(void)arg;
+	int seen = 0;
+	while (live_running) {
+		pthread_mutex_lock(&live_relay_mutex);
+		while (live_running && live_parent_gen == seen) {
+			pthread_cond_wait(&live_relay_cond, &live_relay_mutex);
+		}
+		seen = live_parent_gen;
+		int pid = live_parent_id;
+		int port = live_parent_port;
+		char addr[INET6_ADDRSTRLEN];
+		snprintf(addr, sizeof(addr), "%s", live_parent_addr);
+		pthread_mutex_unlock(&live_relay_mutex);
+		if (!live_running) break;
+		if (pid <= 1) continue;  // 由主機直接廣播
+
+		int fd = live_tcp_connect(addr, port);
+		if (fd < 0) {
+			live_relay_request();
+			continue;
+		}
+		// 從已收到的最新版本之後開始訂閱，-1 表示只接收之後的廣播
+		char sub[48] = "";
+		int sn = 0;
+		pthread_mutex_lock(&live_relay_mutex);
+		int stale = (live_parent_gen != seen);
+		if (!stale) live_parent_sock = fd;
+		for (int doc = 0; doc < num_editors; doc++) {
+			sn += snprintf(sub + sn, sizeof(sub) - (size_t)sn, "%s%d:%d", doc ? " " : "", doc, live_relay_ver[doc]);
+		}
+		pthread_mutex_unlock(&live_relay_mutex);
+		if (stale) {
+			close(fd);
+			continue;
+		}
+		char header[160];
+		int header_len = snprintf(header, sizeof(header), "OP %d 0 0 %d\n", (int)OP_HELLO, sn);
+		send_header_payload_to_fd(fd, header, (size_t)header_len, sub, (size_t)sn);
+		while (live_running) {
+			if (recv_line(fd, header, sizeof(header)) <= 0) break;
+			LiveHeader h;
+			if (!live_parse_header(header, &h)) continue;
+			char *payload = NULL;
+			if (h.len > 0) {
+				payload = (char *)malloc(h.len);
+				if (!payload || recv_all(fd, payload, h.len) != 0) {
+					free(payload);
+					break;
+				}
+			}
+			live_relay_forward(header, &h, payload);
+			live_post(LIVE_MSG_FRAME, &h, payload, NULL);
+		}
+		pthread_mutex_lock(&live_relay_mutex);
+		live_parent_sock = -1;
+		int reassigned = (live_parent_gen != seen);
+		pthread_mutex_unlock(&live_relay_mutex);
+		close(fd);
+		// 上游自行離開：主機清理它時也會改派，先提出要求可縮短中斷時間
+		if (!reassigned && live_running) live_relay_request();
+	}
+	return NULL;
+}
+
+// 處理一個完整封包；回傳 0 表示應關閉連線
+static int host_client_frame(ClientInfo *c, const char *header, const LiveHeader *h, const char *payload) {
+	if (live_mode == LIVE_JOIN) {
+		// 轉送樹的下游：只接受一次訂閱，其餘封包一律忽略
+		if (h->type == OP_HELLO && __atomic_load_n(&c->ready, __ATOMIC_ACQUIRE) == 0) {
+			live_relay_subscribe(c, payload, h->len);
+		}
+		return 1;
+	}
+	// 觀看者握手後不應再送出任何封包
+	if (c->spectator) return 0;
+	if (c->id == 0) {
+		// 握手階段只接受 HELLO
+		if (h->type != OP_HELLO) return 0;
+		return host_client_hello(c, payload, h->len);
+	}
+	if (h->type == OP_RELAY) {
+		// 對方連不上或失去指定的上游：該上游不再承接下游，改派給其他節點
+		pthread_mutex_lock(&live_clients_mutex);
+		ClientInfo *p = live_client_by_id(c->parent);
+		if (p) p->relay_port = 0;
+		live_tree_detach(c);
+		live_tree_attach(c, live_tree_pick(c, c->depth));
+		pthread_mutex_unlock(&live_clients_mutex);
+		return 1;
+	}
+	// 只處理對方已訂閱且同步完成的文件
+	if (!(__atomic_load_n(&c->ready, __ATOMIC_ACQUIRE) & (1u << h->doc))) return 1;
+	if (h->type == OP_RESYNC) {
+		live_post(LIVE_MSG_RESYNC, h, NULL, c);
+		return 1;
+	}
+	if (h->type == OP_CURSOR) {
+		// 游標直接轉發給訂閱同一文件的其它客戶端（不含來源）
+		broadcast_header_payload_except(h->doc, c->fd, header, strlen(header), payload, h->len);
+	}
+	// 套用與定序交給 UI 執行緒
+	char *copy = (h->len > 0) ? dup_payload(payload, h->len) : NULL;
+	live_post(LIVE_MSG_FRAME, h, copy, c);
+	return 1;
+}
+
+// 非阻塞接收；共享記憶體連線先清除 eventfd 通知再直接從緩衝區複製
+static ssize_t live_client_recv(ClientInfo *c, char *buf, size_t cap) {
+	if (!c->shm) return recv(c->fd, buf, cap, MSG_DONTWAIT);
+	live_efd_drain(c->shm->rx_efd);
+	size_t n = live_ring_read(c->shm, buf, cap);
+	if (n == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	// 回到 epoll 前標記等待；一次讀不完或其間又有資料時再觸發自己一次，效果等同 TCP 的水平觸發
+	if (live_ring_park(c->shm->rx)) live_efd_signal(c->shm->rx_efd);
+	return (ssize_t)n;
+}
+
+// 讀取可用資料並解析其中完整的封包；回傳 0 表示連線已結束
+static int host_client_readable(ClientInfo *c) {
+	if (c->in_cap - c->in_len < 65536) {
+		size_t cap = c->in_cap ? c->in_cap * 2 : 65536 * 2;
+		char *nb = (char *)realloc(c->in, cap);
+		if (!nb) return 0;
+		c->in = nb;
+		c->in_cap = cap;
+	}
+	ssize_t n = live_client_recv(c, c->in + c->in_len, c->in_cap - c->in_len);
+	if (n == 0) return 0;
+	if (n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+	c->in_len += (size_t)n;
+
+	size_t off = 0;
+	while (off < c->in_len) {
+		char *nl = memchr(c->in + off, '\n', c->in_len - off);
+		if (!nl) {
+			// 標頭過長視為協定錯誤
+			if (c->in_len - off >= 160) return 0;
+			break;
+		}
+		size_t hlen = (size_t)(nl - (c->in + off)) + 1;
+		if (hlen >= 160) return 0;
+		char header[160];
+		memcpy(header, c->in + off, hlen);
+		header[hlen] = '\0';
+		LiveHeader h;
+		if (!live_parse_header(header, &h)) {
+			off += hlen;
+			continue;
+		}
+		// 長度為負（%zu 讀成極大值）或超過上限：不等待 payload，直接中斷連線
+		if (h.len > LIVE_FRAME_MAX) return 0;
+		if (c->in_len - off - hlen < h.len) {
+			// 封包尚未收齊；確保緩衝區容得下整個封包
+			size_t need = hlen + h.len;
+			if (need > c->in_cap) {
+				char *nb = (char *)realloc(c->in, need);
+				if (!nb) return 0;
+				c->in = nb;
+				c->in_cap = need;
+			}
+			break;
+		}
+		const char *payload = h.len > 0 ? c->in + off + hlen : NULL;
+		off += hlen + h.len;
+		if (!host_client_frame(c, header, &h, payload)) return 0;
+	}
+	if (off > 0) {
+		memmove(c->in, c->in + off, c->in_len - off);
+		c->in_len -= off;
+	}
+	return 1;
+}
+
+// ===== Host 端：I/O 執行緒，以 epoll 服務分配到的所有連線 =====
+static void *host_io_thread(void *arg) {
+	int w = (int)(intptr_t)arg;
+	struct epoll_event events[64];
+	ClientInfo *dead[64];
+	while (live_running) {
+		int n = epoll_wait(live_epoll_fd[w], events, 64, 200);
+		int ndead = 0;
+		for (int i = 0; i < n; i++) {
+			// 共享記憶體連線註冊兩個 fd：eventfd 指向 c，交握 socket 以最低位元標記
+			uintptr_t tag = (uintptr_t)events[i].data.ptr;
+			ClientInfo *c = (ClientInfo *)(tag & ~(uintptr_t)1);
+			if (!c) {
+				// UI 執行緒交來的同步工作
+				uint64_t cnt;
+				ssize_t r = read(live_job_fd[w], &cnt, sizeof(cnt));
+				(void)r;
+				LiveNode *node;
+				while ((node = live_queue_pop(&live_jobs[w])) != NULL) {
+					live_run_sync_job((LiveSyncJob *)node);
+					live_sync_job_free((LiveSyncJob *)node);
+				}
+				// 也可能是共用串流有新資料
+				if (live_mode == LIVE_HOST) live_spec_flush_worker(w);
+				continue;
+			}
+			// 同一批事件中已清理的連線（延後到整批處理完才釋放）
+			int gone = 0;
+			for (int k = 0; k < ndead; k++) gone |= (dead[k] == c);
+			if (gone) continue;
+			int drop;
+			if (tag & 1) {
+				drop = 1;  // 交握 socket 只會回報對方離線
+			} else {
+				// 共享記憶體的 eventfd 同時代表有新資料與騰出空間
+				if ((events[i].events & EPOLLOUT) || c->shm) {
+					live_client_flush_out(c);
+				}
+				drop = (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !host_client_readable(c);
+			}
+			if (drop) {
+				host_client_cleanup(c);
+				dead[ndead++] = c;
+			}
+		}
+		for (int k = 0; k < ndead; k++) {
+			live_client_unref(dead[k]);
+		}
+	}
+	return NULL;
+}
+
+// Host 端：接受新連線，輪流分派給 I/O 執行緒
+static void *host_accept_thread(void *arg) {
+	(void)arg;
+	int next_worker = 0;
+	while (live_running) {
+		struct sockaddr_storage cliaddr;
+		socklen_t clilen = sizeof(cliaddr);
+		int cfd = accept(live_server_sock, (struct sockaddr *)&cliaddr, &clilen);
+		if (cfd < 0) {
+			if (!live_running) break;
+			continue;
+		}
+		// 送出逾時：同步資料由 I/O 執行緒阻塞送出，卡住的對等端不會無限期拖住它
+		struct timeval tv = { 5, 0 };
+		setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (!live_shm_name[0]) live_tcp_nodelay(cfd);
+		ClientInfo *c = (ClientInfo *)calloc(1, sizeof(ClientInfo));
+		if (!c) {
+			close(cfd);
+			continue;
+		}
+		c->fd = cfd;
+		if (live_shm_name[0] && (c->shm = live_shm_offer(cfd)) == NULL) {
+			close(cfd);
+			free(c);
+			continue;
+		}
+		c->refs = 1;  // 連線表持有
+		c->worker = next_worker;
+		next_worker = (next_worker + 1) % live_io_count;
+		// 記下對方位址，轉送樹的下游依此連入
+		if (cliaddr.ss_family == AF_INET) {
+			inet_ntop(AF_INET, &((struct sockaddr_in *)&cliaddr)->sin_addr, c->addr, sizeof(c->addr));
+		}
+		pthread_mutex_init(&c->send_mutex, NULL);
+		// 加入連線表（id 於收到 HELLO 後分配）
+		pthread_mutex_lock(&live_clients_mutex);
+		if (live_client_count == live_client_cap) {
+			int cap = live_client_cap ? live_client_cap * 2 : 32;
+			ClientInfo **nc = (ClientInfo **)realloc(live_clients, sizeof(ClientInfo *) * (size_t)cap);
+			if (!nc) {
+				pthread_mutex_unlock(&live_clients_mutex);
+				live_client_unref(c);
+				continue;
+			}
+			live_clients = nc;
+			live_client_cap = cap;
+		}
+		live_clients[live_client_count++] = c;
+		pthread_mutex_unlock(&live_clients_mutex);
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		int ok;
+		if (c->shm) {
+			// 資料與空間通知走 eventfd；交握 socket 只等待對方離線
+			ok = epoll_ctl(live_epoll_fd[c->worker], EPOLL_CTL_ADD, c->shm->rx_efd, &ev) == 0;
+			ev.events = EPOLLRDHUP;
+			ev.data.ptr = (void *)((uintptr_t)c | 1);
+			ok = ok && epoll_ctl(live_epoll_fd[c->worker], EPOLL_CTL_ADD, cfd, &ev) == 0;
+		} else {
+			ok = epoll_ctl(live_epoll_fd[c->worker], EPOLL_CTL_ADD, cfd, &ev) == 0;
+		}
+		if (!ok) {
+			host_client_cleanup(c);
+			live_client_unref(c);
+		}
+	}
+	return NULL;
+}
+
+// Client 端：建立到主機的連線，失敗回傳 -1；共享記憶體傳輸時一併傳回映射好的區段
+static int live_connect(LiveShm **shm) {
+	*shm = NULL;
+	if (live_shm_name[0]) return live_shm_connect(shm);
+	return live_tcp_connect(live_join_host, live_join_port);
+}
+
+// Client 端：送出 HELLO "id doc:version ..."，訂閱本地開啟的每個文件；首次加入為 "0 0:-1 ..."，觀看者另外帶 watch
+// 結尾附上送出時間，主機的回覆用來估計時鐘差
+static void live_send_hello(void) {
+	int id = 0;
+	char subs[48] = "";
+	int sn = 0;
+	for (int doc = 0; doc < num_editors; doc++) {
+		LiveDoc *d = &live_docs[doc];
+		if (d->synced) id = live_self_id;
+		sn += snprintf(subs + sn, sizeof(subs) - (size_t)sn, " %d:%d", doc, d->synced ? d->version : -1);
+	}
+	char hello[128];
+	int n = snprintf(hello, sizeof(hello), "%d%s relay:%d%s t:%lld", id, subs, live_relay_port,
+	                 live_spectator ? " watch" : "", live_now_us());
+	char header[64];
+	int header_len = snprintf(header, sizeof(header), "OP %d 0 0 %d\n", (int)OP_HELLO, n);
+	live_sock_send(header, (size_t)header_len, hello, (size_t)n);
+}
+
+// 接收執行緒：主機回覆 HELLO "id 送出時間 主機時間"，假設往返對稱，以中點估計主機時鐘與本機的差
+static void live_clock_estimate(const char *payload, size_t len) {
+	long long now = live_now_us();
+	char tmp[96] = {0};
+	if (!payload || len >= sizeof(tmp)) return;
+	memcpy(tmp, payload, len);
+	int id;
+	long long t0, thost;
+	if (sscanf(tmp, "%d %lld %lld", &id, &t0, &thost) != 3 || t0 <= 0 || t0 > now) return;
+	__atomic_store_n(&live_clock_offset, thost - (t0 + now) / 2, __ATOMIC_RELAXED);
+	__atomic_store_n(&live_clock_rtt, now - t0, __ATOMIC_RELAXED);
+}
+
+// 觀看者：展開主機合併壓縮的廣播（raw 為原始長度），回傳 0 表示資料損毀
+static int live_spectator_unpack(const char *payload, size_t len, int raw) {
+	if (raw <= 0) return 1;
+	char *buf = (char *)malloc((size_t)raw);
+	if (!buf) return 0;
+	if (lz_decompress((const uint8_t *)payload, len, (uint8_t *)buf, (size_t)raw) != raw) {
+		free(buf);
+		return 0;
+	}
+	size_t off = 0;
+	int ok = 1;
+	while (ok && off < (size_t)raw) {
+		char *nl = memchr(buf + off, '\n', (size_t)raw - off);
+		size_t hlen = nl ? (size_t)(nl - (buf + off)) + 1 : 0;
+		char header[160];
+		LiveHeader h;
+		ok = (hlen > 0 && hlen < sizeof(header));
+		if (ok) {
+			memcpy(header, buf + off, hlen);
+			header[hlen] = '\0';
+			ok = live_parse_header(header, &h) && h.len <= (size_t)raw - off - hlen;
+		}
+		if (!ok) break;
+		char *copy = (h.len > 0) ? dup_payload(buf + off + hlen, h.len) : NULL;
+		live_post(LIVE_MSG_FRAME, &h, copy, NULL);
+		off += hlen + h.len;
+	}
+	free(buf);
+	return ok;
+}
+
+// Client 端：接收主機廣播；斷線時以指數退避自動重新連線並續傳
+static void *live_thread_func(void *arg) {
+	(void)arg;
+	while (live_running) {
+		// 收取循環（client）
+		while (live_running) {
+			char header[160];
+			if (live_sock_recv_line(header, sizeof(header)) <= 0) {
+				break;
+			}
+			LiveHeader h;
+			if (!live_parse_header(header, &h)) {
+				continue;
+			}
+			size_t len = h.len;
+			char *payload = NULL;
+			if (len > 0) {
+				payload = (char *)malloc(len);
+				if (!payload) break;
+				if (live_sock_recv_all(payload, len) != 0) {
+					free(payload);
+					break;
+				}
+			}
+			if (h.type == OP_RELAY) {
+				// 主機指定轉送樹中的上游
+				live_relay_assign(payload, h.len);
+				free(payload);
+				continue;
+			}
+			if (h.type == OP_HELLO) live_clock_estimate(payload, h.len);
+			if (h.type == OP_BATCH) {
+				// 觀看者：解壓後逐一交給 UI 執行緒
+				int ok = live_spectator_unpack(payload, h.len, h.line);
+				free(payload);
+				if (!ok) break;
+				continue;
+			}
+			// 往下游轉送，再交給 UI 執行緒在下次繪製前套用
+			live_relay_forward(header, &h, payload);
+			live_post(LIVE_MSG_FRAME, &h, payload, NULL);
+		}
+		if (!live_running) break;
+
+		// 斷線：本地編輯繼續累積在待確認清單，重新連線後只補送缺少的部分
+		pthread_mutex_lock(&live_sock_mutex);
+		live_sock_close();
+		pthread_mutex_unlock(&live_sock_mutex);
+		live_connected = 0;
+		live_reconnects = 0;
+		live_post(LIVE_MSG_DISCONNECTED, NULL, NULL, NULL);
+		int delay_ms = 100;
+		while (live_running) {
+			LiveShm *shm;
+			int fd = live_connect(&shm);
+			if (fd >= 0) {
+				pthread_mutex_lock(&live_sock_mutex);
+				live_sock = fd;
+				live_sock_shm = shm;
+				pthread_mutex_unlock(&live_sock_mutex);
+				live_connected = 1;
+				// HELLO 由 UI 執行緒在套用完斷線前收到的操作後送出，帶上最新的確認版本
+				live_post(LIVE_MSG_CONNECTED, NULL, NULL, NULL);
+				break;
+			}
+			live_reconnects++;
+			ui_wake();
+			for (int waited = 0; waited < delay_ms && live_running; waited += 50) {
+				usleep(50 * 1000);
+			}
+			delay_ms = (delay_ms * 2 > 5000) ? 5000 : delay_ms * 2;
+		}
+	}
+	pthread_mutex_lock(&live_sock_mutex);
+	live_sock_close();
+	pthread_mutex_unlock(&live_sock_mutex);
+	return NULL;
+}
+
+// UI 執行緒處理一則網路訊息
+static void live_handle_msg(LiveMsg *m) {
+	if (m->kind == LIVE_MSG_FRAME) {
+		if (live_mode == LIVE_HOST && (m->h.type == OP_SPLICE || m->h.type == OP_CHARS)) {
+			// 編輯操作由主機定序後廣播給所有人（含來源）；基底版本太舊時改送快照
+			if (!live_host_receive_op(m->from->id, &m->h, m->payload)) {
+				live_queue_sync(m->from, m->h.doc, -1);
+			}
+		} else {
+			apply_remote_op(&m->h, m->payload);
+		}
+	} else if (m->kind == LIVE_MSG_JOIN) {
+		live_queue_sync(m->from, m->h.doc, m->h.base);
+	} else if (m->kind == LIVE_MSG_RESYNC) {
+		live_queue_sync(m->from, m->h.doc, m->h.line);
+	} else if (m->kind == LIVE_MSG_LEAVE) {
+		for (int doc = 0; doc < num_editors; doc++) {
+			live_presence_set(doc, m->h.origin, 0, 0);
+		}
+	} else if (m->kind == LIVE_MSG_DISCONNECTED) {
+		// 本地編輯繼續累積在待確認清單，重新連線後只補送缺少的部分
+		for (int doc = 0; doc < num_editors; doc++) {
+			live_docs[doc].resuming = 1;
+			live_docs[doc].resume_id = live_self_id;
+		}
+	} else if (m->kind == LIVE_MSG_CONNECTED) {
+		live_send_hello();
+	}
+}
+
+// UI 執行緒：在兩次繪製之間批次套用網路執行緒送來的訊息，回傳處理的數量
+static int live_drain(void) {
+	if (live_mode == LIVE_NONE) return 0;
+	// 先送出編輯中累積的按鍵，遠端操作才能直接修補到編輯中的內容
+	edit_session_flush();
+	int n = 0;
+	LiveNode *node;
+	while ((node = live_queue_pop(&live_inbox)) != NULL) {
+		LiveMsg *m = (LiveMsg *)node;
+		live_handle_msg(m);
+		live_msg_free(m);
+		n++;
+	}
+	return n;
+}
+
+// 丟棄尚未處理的訊息（停止 Live Share 時）
+static void live_drain_discard(void) {
+	LiveNode *node;
+	while ((node = live_queue_pop(&live_inbox)) != NULL) {
+		live_msg_free((LiveMsg *)node);
+	}
+}
+
+// 每個開啟的編輯器各自是一份共享文件
+static void live_docs_init(void) {
+	for (int doc = 0; doc < LIVE_MAX_DOCS; doc++) {
+		live_docs[doc].resumed_ops = -1;
+		live_docs[doc].sync.first_render_ms = -1;
+	}
+}
+
+static int live_start_host(int port) {
+	live_mode = LIVE_HOST;
+	live_self_id = 1;
+	live_docs_init();
+	live_queue_init(&live_inbox);
+	if (live_shm_name[0]) {
+		// 同機共享記憶體：只監聽交握用的 unix socket
+		live_server_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (live_server_sock < 0) return 0;
+		struct sockaddr_un uaddr;
+		socklen_t ulen = live_shm_addr(&uaddr);
+		if (bind(live_server_sock, (struct sockaddr *)&uaddr, ulen) < 0) return 0;
+	} else {
+		live_server_sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (live_server_sock < 0) return 0;
+		int opt = 1;
+		setsockopt(live_server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = INADDR_ANY;
+		addr.sin_port = htons((uint16_t)port);
+		if (bind(live_server_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) return 0;
+	}
+	if (listen(live_server_sock, SOMAXCONN) < 0) return 0;
+	// 觀看者的共用串流（只有實際寫入的部分才佔用記憶體）
+	live_spec_ring = (char *)malloc(LIVE_SPEC_RING);
+	live_spec_end = 0;
+	live_io_count = LIVE_IO_THREADS;
+	for (int w = 0; w < LIVE_IO_THREADS; w++) {
+		live_epoll_fd[w] = epoll_create1(0);
+		live_job_fd[w] = eventfd(0, EFD_NONBLOCK);
+		if (live_epoll_fd[w] < 0 || live_job_fd[w] < 0) return 0;
+		live_queue_init(&live_jobs[w]);
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;  // NULL 代表同步工作通知
+		epoll_ctl(live_epoll_fd[w], EPOLL_CTL_ADD, live_job_fd[w], &ev);
+	}
+	live_running = 1;
+	for (int w = 0; w < LIVE_IO_THREADS; w++) {
+		pthread_create(&live_io_threads[w], NULL, host_io_thread, (void *)(intptr_t)w);
+	}
+	if (pthread_create(&live_accept_tid, NULL, host_accept_thread, NULL) != 0) {
+		live_running = 0;
+		return 0;
+	}
+	// 主機的游標行先記錄
+	for (int doc = 0; doc < num_editors; doc++) {
+		if (editors[doc].current_line > 0) {
+			live_presence_set(doc, live_self_id, editors[doc].current_line, 0);
+		}
+	}
+	return 1;
+}
+
+// 加入者：監聽任意 port 供轉送樹的下游連入，使用一個 I/O 執行緒
+static void live_relay_listen(void) {
+	live_server_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (live_server_sock < 0) return;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = 0;
+	socklen_t alen = sizeof(addr);
+	live_epoll_fd[0] = epoll_create1(0);
+	live_job_fd[0] = -1;  // 下游的同步資料由主機送出，不需要同步工作
+	live_queue_init(&live_jobs[0]);  // 仍需初始化：停止時會清空這個佇列
+	if (bind(live_server_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(live_server_sock, SOMAXCONN) < 0 ||
+	    getsockname(live_server_sock, (struct sockaddr *)&addr, &alen) < 0 ||
+	    live_epoll_fd[0] < 0) {
+		close(live_server_sock);
+		live_server_sock = -1;
+		if (live_epoll_fd[0] >= 0) close(live_epoll_fd[0]);
+		live_epoll_fd[0] = -1;
+		return;
+	}
+	live_io_count = 1;
+	live_relay_port = ntohs(addr.sin_port);
+}
+
+static int live_start_join(const char *host, int port) {
+	live_mode = LIVE_JOIN;
+	live_self_id = 0; // 等待主機分配
+	live_docs_init();
+	live_queue_init(&live_inbox);
+	snprintf(live_join_host, sizeof(live_join_host), "%s", host);
+	live_join_port = port;
+	live_sock = live_connect(&live_sock_shm);
+	if (live_sock < 0) return 0;
+	live_connected = 1;
+	for (int doc = 0; doc < LIVE_MAX_DOCS; doc++) {
+		live_relay_ver[doc] = -1;
+	}
+	live_parent_id = 1;
+	// TCP 加入者同時是轉送樹的節點：開一個 port 讓主機指派的下游連入（失敗則只當葉節點）；觀看者不轉送
+	live_relay_port = 0;
+	if (!live_shm_name[0] && !live_spectator) live_relay_listen();
+	live_send_hello();
+	live_running = 1;
+	if (pthread_create(&live_thread, NULL, live_thread_func, NULL) != 0) {
+		live_running = 0;
+		return 0;
+	}
+	if (!live_spectator) pthread_create(&live_parent_thread, NULL, live_parent_thread_func, NULL);
+	if (live_relay_port > 0) {
+		pthread_create(&live_io_threads[0], NULL, host_io_thread, (void *)(intptr_t)0);
+		pthread_create(&live_accept_tid, NULL, host_accept_thread, NULL);
+	}
+	return 1;
+}
+
+// 停止接受連線與 I/O 執行緒並釋放所有連線（主機與轉送中的加入者）
+static void live_io_stop(void) {
+	// 中斷所有連線，避免 I/O 執行緒卡在送出
+	pthread_mutex_lock(&live_clients_mutex);
+	for (int i = 0; i < live_client_count; i++) {
+		live_client_shutdown(live_clients[i]);
+	}
+	pthread_mutex_unlock(&live_clients_mutex);
+	// 關閉 listen 並等待接受線程與 I/O 執行緒結束
+	if (live_server_sock >= 0) { shutdown(live_server_sock, SHUT_RDWR); close(live_server_sock); live_server_sock = -1; }
+	if (live_io_count > 0) pthread_join(live_accept_tid, NULL);
+	for (int w = 0; w < live_io_count; w++) {
+		pthread_join(live_io_threads[w], NULL);
+		// 丟棄尚未送出的同步工作
+		LiveNode *node;
+		while ((node = live_queue_pop(&live_jobs[w])) != NULL) {
+			live_sync_job_free((LiveSyncJob *)node);
+		}
+		if (live_job_fd[w] >= 0) close(live_job_fd[w]);
+		close(live_epoll_fd[w]);
+	}
+	live_io_count = 0;
+	live_drain_discard();
+	// 釋放連線表與 id 回收佇列
+	pthread_mutex_lock(&live_clients_mutex);
+	for (int i = 0; i < live_client_count; i++) {
+		live_client_unref(live_clients[i]);
+	}
+	live_client_count = 0;
+	live_free_count = 0;
+	live_free_head = 0;
+	next_assign_id = 2;
+	live_host_children = 0;
+	pthread_mutex_unlock(&live_clients_mutex);
+}
+
+static void live_stop() {
+	if (live_running) {
+		live_running = 0;
+		// 關閉 socket 以喚醒阻塞
+		if (live_mode == LIVE_JOIN) {
+			// 只 shutdown 喚醒接收執行緒，由其負責關閉
+			pthread_mutex_lock(&live_sock_mutex);
+			if (live_sock >= 0) shutdown(live_sock, SHUT_RDWR);
+			if (live_sock_shm) __atomic_store_n(&live_sock_shm->dead, 1, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&live_sock_mutex);
+			pthread_join(live_thread, NULL);
+			// 轉送執行緒：喚醒等待中的條件變數或中斷上游連線
+			pthread_mutex_lock(&live_relay_mutex);
+			if (live_parent_sock >= 0) shutdown(live_parent_sock, SHUT_RDWR);
+			pthread_cond_broadcast(&live_relay_cond);
+			pthread_mutex_unlock(&live_relay_mutex);
+			if (!live_spectator) pthread_join(live_parent_thread, NULL);
+			live_io_stop();
+			live_relay_port = 0;
+			live_parent_id = 1;
+			for (int doc = 0; doc < LIVE_MAX_DOCS; doc++) {
+				if (live_relay_log[doc]) {
+					for (int i = 0; i < LIVE_LOG_MAX; i++) {
+						free(live_relay_log[doc][i].frame);
+					}
+					free(live_relay_log[doc]);
+					live_relay_log[doc] = NULL;
+				}
+				live_client_clear_held(doc);
+			}
+		} else if (live_mode == LIVE_HOST) {
+			live_io_stop();
+			pthread_mutex_lock(&live_spec_batch_mutex);
+			free(live_spec_ring);
+			live_spec_ring = NULL;
+			live_spec_batch_len = 0;
+			live_spec_count = 0;
+			pthread_mutex_unlock(&live_spec_batch_mutex);
+			for (int doc = 0; doc < num_editors; doc++) {
+				live_docs[doc].presence_count = 0;
+			}
+		}
+	}
+	live_mode = LIVE_NONE;
+}
+
+// 顯示文件 doc 的快照串流進度或結果（壓縮率、首次繪製時間）
+static void print_live_sync_status(int doc) {
+	LiveSyncStats st = live_docs[doc].sync;
+	if (st.t_begin <= 0) return;
+	if (st.active) {
+		printf("[同步中] %zu/%zu KB（已接收壓縮資料 %zu KB）\n",
+		       st.raw_received / 1024, st.raw_total / 1024, st.wire_received / 1024);
+		return;
+	}
+	double ratio = (st.raw_received > 0) ? 100.0 * (double)st.wire_received / (double)st.raw_received : 100.0;
+	printf("[同步完成] %zu KB → %zu KB（壓縮率 %.1f%%），耗時 %.1f ms",
+	       st.raw_received / 1024, st.wire_received / 1024, ratio, st.t_end - st.t_begin);
+	if (st.first_render_ms >= 0) {
+		printf("，首次繪製 %.1f ms", st.first_render_ms);
+	}
+	printf("\n");
+}
+
+// 顯示斷線重連與續傳狀態
+static void print_live_connection_status(void) {
+	int resuming = 0, pending = 0, resumed = -1;
+	for (int doc = 0; doc < num_editors; doc++) {
+		LiveDoc *d = &live_docs[doc];
+		resuming |= d->resuming;
+		pending += d->pending_count;
+		if (d->resumed_ops >= 0) resumed = (resumed < 0) ? d->resumed_ops : resumed + d->resumed_ops;
+	}
+	if (!live_connected) {
+		printf("[Live Share] 連線中斷，重新連線中（已重試 %d 次，%d 個本地操作待送出）\n", live_reconnects, pending);
+	} else if (resuming) {
+		printf("[Live Share] 已重新連線，續傳中...\n");
+	} else if (resumed >= 0) {
+		printf("[Live Share] 已續傳：補送 %d 個操作\n", resumed);
+	}
+	int parent = __atomic_load_n(&live_parent_id, __ATOMIC_ACQUIRE);
+	if (live_mode == LIVE_JOIN && live_connected && parent > 1) {
+		printf("[Live Share] 經由 #%d 轉送\n", parent);
+	}
+}
+
+// 橫幅旁的延遲摘要：主機看參與者送出 → 定序，加入者看送出 → 本機套用
+static void print_live_latency_brief(void) {
+	const LiveHist *h = &live_lat[live_mode == LIVE_HOST ? LIVE_LAT_UP : LIVE_LAT_TOTAL];
+	if (h->total == 0) return;
+	printf("  lat p50 %.1f/p99 %.1f ms", live_hist_pct(h, 0.50) / 1000.0, live_hist_pct(h, 0.99) / 1000.0);
+}
+
+// 顯示完整的延遲分布（按 l），直方圖依 2 的次方區間合併成一列
+static void show_live_latency(void) {
+	static const char *names[LIVE_LAT_KINDS] = { "送出 → 主機定序", "主機定序 → 本機套用", "送出 → 本機套用" };
+	clear_screen();
+	printf("Live Share 操作延遲（毫秒）\n");
+	long long rtt = __atomic_load_n(&live_clock_rtt, __ATOMIC_RELAXED);
+	if (live_mode == LIVE_JOIN && rtt >= 0) {
+		printf("與主機的時鐘差 %+.3f ms（HELLO 往返 %.3f ms，誤差不超過往返的一半）\n",
+		       __atomic_load_n(&live_clock_offset, __ATOMIC_RELAXED) / 1000.0, rtt / 1000.0);
+	}
+	for (int k = 0; k < LIVE_LAT_KINDS; k++) {
+		const LiveHist *h = &live_lat[k];
+		printf("\n%s：%llu 筆\n", names[k], (unsigned long long)h->total);
+		if (h->total == 0) continue;
+		printf("  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+		       live_hist_pct(h, 0.50) / 1000.0, live_hist_pct(h, 0.90) / 1000.0, live_hist_pct(h, 0.99) / 1000.0,
+		       live_hist_pct(h, 0.999) / 1000.0, h->max / 1000.0);
+		uint64_t rows[64] = {0};
+		uint64_t peak = 0;
+		for (int i = 0; i < LIVE_HIST_BUCKETS; i++) {
+			if (h->count[i] == 0) continue;
+			long long v = live_hist_value(i);
+			int bits = (v > 0) ? 64 - __builtin_clzll((unsigned long long)v) : 0;
+			rows[bits] += h->count[i];
+			if (rows[bits] > peak) peak = rows[bits];
+		}
+		for (int b = 0; b < 64; b++) {
+			if (rows[b] == 0) continue;
+			char bar[41];
+			int w = (int)(rows[b] * 40 / peak);
+			memset(bar, '#', (size_t)w);
+			bar[w] = '\0';
+			printf("  < %10.3f %10llu %s\n", (double)(1ULL << b) / 1000.0, (unsigned long long)rows[b], bar);
+		}
+	}
+	printf("\n按任意鍵繼續...");
+	read_key();
+}
+
+// 恢復終端設定
+void disable_raw_mode() {
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+}
+
+// 設定終端為原始模式，可以讀取方向鍵
+void enable_raw_mode() {
+    tcgetattr(STDIN_FILENO, &orig_termios);
+    atexit(disable_raw_mode);
+    
+    struct termios raw = orig_termios;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+}
+
+// 方向鍵的內部表示（使用不可打印的控制字符避免衝突）
+#define KEY_UP         1
+#define KEY_DOWN       2
+#define KEY_RIGHT      3
+#define KEY_LEFT       4
+#define KEY_CTRL_LEFT  5
+#define KEY_CTRL_RIGHT 6
+#define KEY_REFRESH    7  // 非按鍵：網路執行緒要求重繪
+#define KEY_ALT_UP     14
+#define KEY_ALT_DOWN   15
+
+// ===== 巨集錄製與重播 =====
+// m 開始 / 結束錄製，[次數]@ 重播。錄下的是按鍵，以及提示列輸入的文字（前後各一個 '\0'）。
+// 重播時按鍵直接從錄製內容取出，期間不重繪、不自動保存、不廣播也不記錄逆操作；
+// 全部重播完後，把每個文件前後不同的行合成一次修改提交：一筆逆操作、一個網路封包，再重繪一次
+static char *macro_keys = NULL;
+static size_t macro_len = 0;
+static size_t macro_cap = 0;
+static int macro_recording = 0;
+static size_t macro_pos = 0;      // 重播位置
+static long macro_left = 0;       // 這一次之後還要重播幾次
+static int macro_saved_stdout = -1;
+static long repeat_count = 0;     // 按鍵前輸入的次數（目前只用於 @）
+#define MACRO_REPEAT_MAX 1000000
+
+typedef struct {
+	char *buffer;
+	size_t length;
+	int total_lines;
+} MacroSnapshot;
+
+static MacroSnapshot macro_before[2];
+
+static void macro_record(const char *data, size_t len) {
+	if (macro_len + len > macro_cap) {
+		size_t cap = macro_cap ? macro_cap * 2 : 256;
+		while (cap < macro_len + len) cap *= 2;
+		char *grown = (char *)realloc(macro_keys, cap);
+		if (!grown) return;
+		macro_keys = grown;
+		macro_cap = cap;
+	}
+	memcpy(macro_keys + macro_len, data, len);
+	macro_len += len;
+}
+
+// 重播的下一個按鍵；錄製內容用完（重播時走了和錄製時不同的路徑）時回傳 ESC，讓提示與編輯取消
+static char macro_next_key(void) {
+	while (macro_pos < macro_len && macro_keys[macro_pos] == '\0') {
+		const char *end = memchr(macro_keys + macro_pos + 1, '\0', macro_len - macro_pos - 1);
+		macro_pos = end ? (size_t)(end - macro_keys) + 1 : macro_len;
+	}
+	return (macro_pos < macro_len) ? macro_keys[macro_pos++] : '\033';
+}
+
+// 重播的下一行提示輸入；下一個不是錄下的文字時回傳 0
+static int macro_next_line(char *buf, size_t size) {
+	if (macro_pos >= macro_len || macro_keys[macro_pos] != '\0') return 0;
+	const char *text = macro_keys + macro_pos + 1;
+	const char *end = memchr(text, '\0', macro_len - macro_pos - 1);
+	size_t len = end ? (size_t)(end - text) : macro_len - macro_pos - 1;
+	macro_pos = end ? (size_t)(end - macro_keys) + 1 : macro_len;
+	if (len >= size) len = size - 1;
+	memcpy(buf, text, len);
+	buf[len] = '\0';
+	return 1;
+}
+
+// 讀取按鍵：重播時從錄製內容取出，錄製時一併記下
+char read_key() {
+	if (macro_replaying) return macro_next_key();
+	char c = read_key_raw();
+	if (macro_recording) macro_record(&c, 1);
+	return c;
+}
+
+// 在提示列讀取一行文字（含換行）：暫時離開原始模式；錄製時記下，重播時直接取出。讀不到回傳 0
+static int prompt_read_line(char *buf, int size) {
+	if (macro_replaying) return macro_next_line(buf, (size_t)size);
+	disable_raw_mode();
+	int ok = (fgets(buf, size, stdin) != NULL);
+	enable_raw_mode();
+	if (ok && macro_recording) {
+		macro_record("", 1);
+		macro_record(buf, strlen(buf) + 1);
+	}
+	return ok;
+}
+
+// m：開始錄製，或結束錄製（去掉結束用的這個 m）
+static void macro_toggle_record(void) {
+	if (macro_recording) {
+		macro_recording = 0;
+		if (macro_len > 0) macro_len--;
+	} else {
+		macro_len = 0;
+		macro_recording = 1;
+	}
+}
+
+// 開始重播 count 次；沒有錄製內容時回傳 0
+static int macro_start(long count) {
+	if (macro_recording || macro_replaying || macro_len == 0 || count < 1) return 0;
+	for (int i = 0; i < num_editors; i++) {
+		if (!editor_load_finish(i, 1)) return 0;
+	}
+	for (int i = 0; i < num_editors; i++) {
+		EditorState *ed = &editors[i];
+		MacroSnapshot *snap = &macro_before[i];
+		snap->buffer = (char *)malloc(ed->length + 1);
+		if (!snap->buffer) {
+			for (int j = 0; j < i; j++) free(macro_before[j].buffer);
+			return 0;
+		}
+		memcpy(snap->buffer, ed->buffer, ed->length + 1);
+		snap->length = ed->length;
+		snap->total_lines = ed->total_lines;
+		ed->suppress_undo++;
+	}
+	// 重播中零星的提示輸出導到 /dev/null，結束後整個畫面重繪
+	fflush(stdout);
+	int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (null_fd >= 0) {
+		macro_saved_stdout = dup(STDOUT_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+		close(null_fd);
+	}
+	macro_replaying = 1;
+	macro_pos = 0;
+	macro_left = count - 1;
+	return 1;
+}
+
+// 把重播前後不同的行合成一次修改：文件先換回重播前的內容，再以一個 splice 提交
+static void macro_commit(EditorState *ed, MacroSnapshot *snap) {
+	if (snap->length == ed->length && memcmp(snap->buffer, ed->buffer, ed->length) == 0) return;
+	EditorState before = *ed;
+	before.buffer = snap->buffer;
+	before.length = snap->length;
+	before.line_hint = 0;
+	int old_lines = snap->total_lines, new_lines = ed->total_lines;
+	// 前面相同的行
+	int pre = 0;
+	size_t oo = 0, no = 0;
+	while (pre < old_lines && pre < new_lines) {
+		size_t oe = editor_line_end(&before, oo), ne = editor_line_end(ed, no);
+		if (oe - oo != ne - no || memcmp(snap->buffer + oo, ed->buffer + no, oe - oo) != 0) break;
+		pre++;
+		oo = oe + 1;
+		no = ne + 1;
+		if (oo > snap->length || no > ed->length) break;
+	}
+	// 後面相同的行（不和前面重疊）
+	int suf = 0;
+	size_t oend = snap->length, nend = ed->length;
+	if (oend > 0 && snap->buffer[oend - 1] == '\n') oend--;
+	if (nend > 0 && ed->buffer[nend - 1] == '\n') nend--;
+	while (suf < old_lines - pre && suf < new_lines - pre) {
+		const char *onl = memrchr(snap->buffer, '\n', oend);
+		const char *nnl = memrchr(ed->buffer, '\n', nend);
+		size_t os = onl ? (size_t)(onl - snap->buffer) + 1 : 0;
+		size_t ns = nnl ? (size_t)(nnl - ed->buffer) + 1 : 0;
+		if (oend - os != nend - ns || memcmp(snap->buffer + os, ed->buffer + ns, oend - os) != 0) break;
+		suf++;
+		if (os == 0 || ns == 0) break;
+		oend = os - 1;
+		nend = ns - 1;
+	}
+	int del = old_lines - pre - suf, ins = new_lines - pre - suf;
+	if (del == 0 && ins == 0) return;  // 只差在結尾換行，行操作表達不了
+	size_t len;
+	char *text = (ins > 0) ? editor_lines_text(ed, pre + 1, pre + ins, &len) : NULL;
+	char *old = (del > 0) ? editor_lines_text(&before, pre + 1, pre + del, &len) : NULL;
+	// 空行在緩衝區結尾時 editor_lines_text 找不到它，當成空字串
+	if (ins > 0 && !text) text = (char *)calloc(1, 1);
+	if (del > 0 && !old) old = (char *)calloc(1, 1);
+	if (ins == 0 && del == old_lines) {
+		// 全部刪除時文件保留一個空行
+		free(text);
+		text = (char *)calloc(1, 1);
+		ins = 1;
+	}
+	// 換回重播前的內容，再以一次修改提交
+	if (!editor_reserve(ed, snap->length + 1)) {
+		free(text);
+		free(old);
+		return;
+	}
+	memcpy(ed->buffer, snap->buffer, snap->length + 1);
+	ed->length = snap->length;
+	ed->edit_gen++;
+	ed->total_lines = old_lines;
+	LiveOp op = live_op_make(pre + 1, del, ins ? text : NULL, ins);
+	editor_commit_local(ed, &op);
+	push_undo_text(ed, pre + 1, ins, old ? old : (char *)calloc(1, 1), del);
+	free(text);
+}
+
+// 主循環每一輪開始時呼叫：重播中回傳 1（不重繪）；錄製內容用完且次數也用完時提交並回傳 0
+static int macro_step(void) {
+	if (!macro_replaying) return 0;
+	if (macro_pos < macro_len) return 1;
+	if (macro_left > 0) {
+		macro_left--;
+		macro_pos = 0;
+		return 1;
+	}
+	macro_replaying = 0;
+	if (macro_saved_stdout >= 0) {
+		fflush(stdout);
+		dup2(macro_saved_stdout, STDOUT_FILENO);
+		close(macro_saved_stdout);
+		macro_saved_stdout = -1;
+	}
+	for (int i = 0; i < num_editors; i++) {
+		editors[i].suppress_undo--;
+		macro_commit(&editors[i], &macro_before[i]);
+		free(macro_before[i].buffer);
+		macro_before[i].buffer = NULL;
+		editor_clamp(&editors[i]);
+	}
+	EditorState *ed = &editors[active_editor];
+	live_broadcast_cursor(ed, ed->current_line, 0);
+	return 0;
+}
+
+// 讀取按鍵（不經過巨集）
+static char read_key_raw(void) {
+    char c;
+    while (read(STDIN_FILENO, &c, 1) != 1);
+    
+    // 檢測方向鍵（ESC序列）
+    if (c == '\033') {
+        char seq[6];
+        
+        // 使用非阻塞模式來判斷是否有後續字符
+        struct termios old_term;
+        tcgetattr(STDIN_FILENO, &old_term);
+        
+        struct termios new_term = old_term;
+        new_term.c_cc[VMIN] = 0;   // 非阻塞
+        new_term.c_cc[VTIME] = 1;  // 0.1 秒超時
+        tcsetattr(STDIN_FILENO, TCSANOW, &new_term);
+        
+        int nread1 = read(STDIN_FILENO, &seq[0], 1);
+        int nread2 = 0;
+        int nread3 = 0;
+        int nread4 = 0;
+        int nread5 = 0;
+        if (nread1 == 1) {
+            nread2 = read(STDIN_FILENO, &seq[1], 1);
+        }
+        if (nread2 == 1) {
+            nread3 = read(STDIN_FILENO, &seq[2], 1);
+        }
+        if (nread3 == 1) {
+            nread4 = read(STDIN_FILENO, &seq[3], 1);
+        }
+        if (nread4 == 1) {
+            nread5 = read(STDIN_FILENO, &seq[4], 1);
+        }
+        
+        // 恢復原始設定
+        tcsetattr(STDIN_FILENO, TCSANOW, &old_term);
+        
+        // 如果沒有後續字符，這是單純的 ESC
+        if (nread1 == 0) {
+            return c;  // 返回 ESC
+        }
+        
+        // 檢查是否是 Ctrl + 方向鍵序列 (ESC[1;5C 或 ESC[1;5D)
+        if (nread5 == 1 && seq[0] == '[' && seq[1] == '1' && seq[2] == ';' && seq[3] == '5') {
+            if (seq[4] == 'C') return KEY_CTRL_RIGHT;  // Ctrl+Right
+            if (seq[4] == 'D') return KEY_CTRL_LEFT;   // Ctrl+Left
+        }
+        
+        // Alt + 上下鍵 (ESC[1;3A 或 ESC[1;3B)
+        if (nread5 == 1 && seq[0] == '[' && seq[1] == '1' && seq[2] == ';' && seq[3] == '3') {
+            if (seq[4] == 'A') return KEY_ALT_UP;
+            if (seq[4] == 'B') return KEY_ALT_DOWN;
+        }
+        
+        // 檢查是否是普通方向鍵序列
+        if (nread2 == 1 && seq[0] == '[') {
+            if (seq[1] == 'A') return KEY_UP;      // Up arrow
+            if (seq[1] == 'B') return KEY_DOWN;    // Down arrow
+            if (seq[1] == 'C') return KEY_RIGHT;   // Right arrow
             if (seq[1] == 'D') return KEY_LEFT;    // Left arrow
         }
         
@@ -779,6 +3790,44 @@ char read_key() {
     return c;
 }
 
+// 讀取按鍵，等待期間若被 ui_wake 喚醒則回傳 KEY_REFRESH
+char read_key_or_refresh() {
+    if (macro_replaying) return read_key();
+    if (ui_wake_fd[0] >= 0) {
+        struct pollfd pfd[3];
+        pfd[0].fd = STDIN_FILENO;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = ui_wake_fd[0];
+        pfd[1].events = POLLIN;
+        pfd[2].fd = follow_inotify;  // 沒有追蹤時為 -1，poll 會略過
+        pfd[2].events = POLLIN;
+		// 等待輸入前，把這一輪累積的廣播一次交給觀看者
+		live_spec_publish();
+        while (1) {
+            int r = poll(pfd, 3, follow_timeout_ms(autosave_timeout_ms()));
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            // 保存防抖到期：交給背景執行緒後重繪狀態列
+            if (autosave_tick()) return KEY_REFRESH;
+            // 追蹤的文件有新內容：立即讀入，重繪則受節流限制
+            if (r > 0 && (pfd[2].revents & POLLIN)) follow_drain();
+            if (follow_paint_due()) return KEY_REFRESH;
+            if (r == 0) continue;
+            if (pfd[0].revents) break;
+            if (pfd[1].revents & POLLIN) {
+                char drain[64];
+                while (read(ui_wake_fd[0], drain, sizeof(drain)) > 0);
+                // 網路訊息只在這裡（兩次繪製之間）套用，UI 執行緒是文件唯一的修改者
+                live_drain();
+                return KEY_REFRESH;
+            }
+        }
+    }
+    return read_key();
+}
+
 // 計算總行數
 int count_lines(char *buffer) {
     int count = 0;
@@ -804,37 +3853,61 @@ int count_lines(char *buffer) {
 
 // 清除屏幕
 void clear_screen() {
+    if (macro_replaying) return;
     write(STDOUT_FILENO, "\033[2J", 4);
     write(STDOUT_FILENO, "\033[H", 3);
 }
 
+// 第 row_offset 行的起始位移；行數不夠時停在最後一行，line 設為實際到達的行號
+static size_t editor_view_offset(EditorState *ed, int *line) {
+	int n = 1;
+	size_t off = 0;
+	if (ed->view_line > 0 && ed->view_gen == ed->edit_gen && ed->view_off <= ed->length) {
+		n = ed->view_line;
+		off = ed->view_off;
+	}
+	while (n > ed->row_offset && off > 0) {
+		const char *prev = (off >= 2) ? memrchr(ed->buffer, '\n', off - 1) : NULL;
+		off = prev ? (size_t)(prev - ed->buffer) + 1 : 0;
+		n--;
+	}
+	if (n > ed->row_offset) n = 1;
+	while (n < ed->row_offset) {
+		const char *next = memchr(ed->buffer + off, '\n', ed->length - off);
+		if (!next) break;
+		off = (size_t)(next - ed->buffer) + 1;
+		n++;
+	}
+	ed->view_line = n;
+	ed->view_off = off;
+	ed->view_gen = ed->edit_gen;
+	*line = n;
+	return off;
+}
+
 // 顯示內容時帶行號（支援視窗滾動）
 void print_with_line_numbers(EditorState *ed){
-	// 讀取時鎖定，避免網路執行緒同時修改
+	if (macro_replaying) return;
 	int ed_idx = (ed == &editors[0]) ? 0 : 1;
-	live_lock_editor(ed_idx);
     char *buffer = ed->buffer;
     int highlight_line = ed->current_line;
     int row_offset = ed->row_offset;
     int total_lines = ed->total_lines;
     
-    char *line_start = buffer;
     char *line_end;
-    int line_num = 1;
+    int line_num = row_offset;
     
-    // 先移動到起始行
-    while(line_num < row_offset && *line_start){
-        line_end = strchr(line_start, '\n');
-        if(!line_end) break;
-        line_start = line_end + 1;
-        line_num++;
-    }
+    // 先移動到起始行（從上次畫面的起始行出發，大文件捲到尾端時不必每次從頭數）
+    char *line_start = buffer + editor_view_offset(ed, &line_num);
     
     printf("\n========== 文件內容 (顯示 %d-%d 行，共 %d 行) ==========\n", 
            row_offset, 
            (row_offset + VISIBLE_LINES - 1 > total_lines) ? total_lines : row_offset + VISIBLE_LINES - 1,
            total_lines);
     
+    int sel_first = 0, sel_last = -1;
+    if(ed->sel_anchor) editor_selection(ed, &sel_first, &sel_last);
+    
     int displayed_lines = 0;
     while(*line_start && displayed_lines < VISIBLE_LINES){
         line_end = strchr(line_start, '\n');
@@ -846,9 +3919,11 @@ void print_with_line_numbers(EditorState *ed){
             line_length = strlen(line_start);
         }
         
-		// 前綴：本地或普通
+		// 前綴：本地、選取範圍或普通
 		if(line_num == highlight_line){
 			printf("\033[1;32m>>> [行 %d] \033[0m", line_num);  // 本地：綠色加粗
+		} else if(line_num >= sel_first && line_num <= sel_last){
+			printf("\033[7m  | [行 %d] \033[0m", line_num);  // 選取範圍：反白
 		} else {
 			printf("    [行 %d] ", line_num);
 		}
@@ -857,20 +3932,20 @@ void print_with_line_numbers(EditorState *ed){
 		char remote_mark_multi[512] = {0};  // 是否有多個遠端重疊於該欄位
 		int remote_eol_id = 0;              // 行尾遠端的第一個 ID
 		int remote_eol_multi = 0;           // 行尾是否多個重疊
-		if (ed_idx == 0 && live_mode != LIVE_NONE) {
-			for (int pid = 1; pid <= MAX_PEERS; pid++) {
+		if (live_mode != LIVE_NONE) {
+			// 游標依行排序，只走訪落在此行的參與者
+			const LiveDoc *d = &live_docs[ed_idx];
+			for (int i = live_presence_lower_bound(d, line_num); i < d->presence_count && d->presence[i].line == line_num; i++) {
+				int pid = d->presence[i].id;
 				if (pid == live_self_id) continue;
-				if (live_peer_line[pid] == line_num) {
-					int col = live_peer_col[pid];
-					if (col < 0) col = 0;
-					if (col >= 511) col = 511;
-					if (col >= line_length) { // 行尾
-						if (remote_eol_id == 0) remote_eol_id = pid;
-						else remote_eol_multi = 1;
-					} else {
-						if (remote_mark_id[col] == 0) remote_mark_id[col] = pid;
-						else remote_mark_multi[col] = 1;
-					}
+				int col = d->presence[i].col;
+				if (col >= 511) col = 511;
+				if (col >= line_length) { // 行尾
+					if (remote_eol_id == 0) remote_eol_id = pid;
+					else remote_eol_multi = 1;
+				} else {
+					if (remote_mark_id[col] == 0) remote_mark_id[col] = pid;
+					else remote_mark_multi[col] = 1;
 				}
 			}
 		}
@@ -948,206 +4023,786 @@ void print_with_line_numbers(EditorState *ed){
         line_num++;
         displayed_lines++;
     }
-    
-    // 如果顯示的行數不足，填充空白
-    while(displayed_lines < VISIBLE_LINES){
-        printf("\n");
-        displayed_lines++;
+    
+    // 如果顯示的行數不足，填充空白
+    while(displayed_lines < VISIBLE_LINES){
+        printf("\n");
+        displayed_lines++;
+    }
+    
+    printf("====================================================\n\n");
+	// 快照串流中第一次畫出內容時記錄首次繪製時間
+	LiveSyncStats *sync = &live_docs[ed_idx].sync;
+	if (sync->t_begin > 0 && sync->first_render_ms < 0 && ed->length > 0) {
+		sync->first_render_ms = now_ms() - sync->t_begin;
+	}
+}
+
+// 在指定行之後插入新行
+void insert_new_line(EditorState *ed, int after_line){
+    // 套用並提交（上鎖寫入，避免網路執行緒同時修改）
+    LiveOp op = live_op_make(after_line + 1, 0, "", 1);
+    editor_commit_local(ed, &op);
+    
+    // 推入逆操作：刪除新插入的行
+    push_undo(ed, UNDO_DELETE_LINE, after_line + 1);
+
+    // printf("\n✓ 已在第 %d 行之後插入新行\n", after_line);
+    // printf("按任意鍵繼續...");
+    // read_key();
+}
+
+// 刪除指定行
+int delete_line(EditorState *ed, int line_to_delete){
+    // 如果文件只有一行，不允許刪除
+    if(ed->total_lines <= 1){
+        printf("\n✗ 無法刪除：文件至少需要保留一行\n");
+        printf("按任意鍵繼續...");
+        read_key();
+        return 0;  // 刪除失敗
+    }
+    
+    // 找到要刪除的行的起始位置
+    size_t line_start = editor_line_offset(ed, line_to_delete);
+    if(line_to_delete < 1 || line_start >= ed->length){
+        printf("\n✗ 錯誤：找不到指定行\n");
+        printf("按任意鍵繼續...");
+        read_key();
+        return 0;
+    }
+    
+    // 保存將被刪除的整行內容（不包含換行，不限長度）
+    size_t line_length = editor_line_end(ed, line_start) - line_start;
+    char *deleted_content = dup_payload(ed->buffer + line_start, line_length);
+    if(!deleted_content){
+        printf("\n✗ 記憶體不足，無法刪除\n");
+        printf("按任意鍵繼續...");
+        read_key();
+        return 0;
+    }
+
+    LiveOp op = live_op_make(line_to_delete, 1, NULL, 0);
+    editor_commit_local(ed, &op);
+    
+    // 推入逆操作：在原位置插回被刪除的內容（接手 deleted_content）
+    push_undo_text(ed, line_to_delete, 0, deleted_content, 1);
+
+    // printf("\n✓ 已刪除第 %d 行\n", line_to_delete);
+    // printf("按任意鍵繼續...");
+    // read_key();
+    return 1;  // 刪除成功
+}
+
+// 複製第 first 到 last 行到剪貼板：整段一次複製，不限行數與長度
+void copy_lines(EditorState *ed, int first, int last){
+    size_t len;
+    char *text = editor_lines_text(ed, first, last, &len);
+    if(!text){
+        printf("\n✗ 無法複製：找不到指定行或記憶體不足\n");
+        printf("按任意鍵繼續...");
+        read_key();
+        return;
+    }
+    free(clipboard);
+    clipboard = text;
+    clipboard_len = len;
+    clipboard_lines = last - first + 1;
+    clipboard_has_content = 1;
+}
+
+// 將剪貼板內容貼上到指定行之後：整段是一次修改、一筆逆操作、一個網路封包
+void paste_line(EditorState *ed, int after_line){
+    if(!clipboard_has_content){
+        printf("\n✗ 剪貼板為空，請先複製內容\n");
+        printf("按任意鍵繼續...");
+        read_key();
+        return;
+    }
+    
+    // 在指定行之後插入剪貼板內容
+    LiveOp op = live_op_make(after_line + 1, 0, clipboard, clipboard_lines);
+    editor_commit_local(ed, &op);
+    
+    // 推入逆操作：刪除新貼上的整段
+    if(clipboard_lines == 1){
+        push_undo(ed, UNDO_DELETE_LINE, after_line + 1);
+    } else {
+        push_undo_lines(ed, UNDO_DELETE_LINES, after_line + 1, clipboard_lines);
+    }
+}
+
+// ===== 範圍操作 =====
+// 每個範圍操作都只走過受影響的區段一次，產生一次修改、一筆逆操作（原內容）與一個網路封包
+
+// 刪除第 first 到 last 行；全部刪除時留下一個空行
+int delete_lines(EditorState *ed, int first, int last){
+    size_t len;
+    char *text = editor_lines_text(ed, first, last, &len);
+    if(!text){
+        printf("\n✗ 無法刪除：找不到指定行或記憶體不足\n");
+        printf("按任意鍵繼續...");
+        read_key();
+        return 0;
+    }
+    int n = last - first + 1;
+    if(first == 1 && n >= ed->total_lines){
+        LiveOp op = live_op_make(1, n, "", 1);
+        editor_commit_local(ed, &op);
+        push_undo_text(ed, 1, 1, text, n);
+    } else {
+        LiveOp op = live_op_make(first, n, NULL, 0);
+        editor_commit_local(ed, &op);
+        push_undo_text(ed, first, 0, text, n);
+    }
+    return 1;
+}
+
+// 縮排（每行前加四個空白，空行不變）或取消縮排（每行去掉最多四個空白或一個 tab）
+void indent_lines(EditorState *ed, int first, int last, int dedent){
+    size_t len;
+    char *text = editor_lines_text(ed, first, last, &len);
+    if(!text) return;
+    int n = last - first + 1;
+    char *out = (char *)malloc(len + (dedent ? 0 : (size_t)n * 4) + 1);
+    if(!out){
+        free(text);
+        return;
+    }
+    size_t o = 0;
+    int changed = 0;
+    for(size_t i = 0; i <= len;){
+        const char *nl = memchr(text + i, '\n', len - i);
+        size_t line_end = nl ? (size_t)(nl - text) : len;
+        size_t from = i;
+        if(dedent){
+            if(from < line_end && text[from] == '\t'){
+                from++;
+            } else {
+                while(from < line_end && from - i < 4 && text[from] == ' ') from++;
+            }
+        } else if(line_end > i){
+            memcpy(out + o, "    ", 4);
+            o += 4;
+        }
+        changed |= (from != i) || (!dedent && line_end > i);
+        memcpy(out + o, text + from, line_end - from);
+        o += line_end - from;
+        if(!nl) break;
+        out[o++] = '\n';
+        i = line_end + 1;
+    }
+    out[o] = '\0';
+    if(changed){
+        LiveOp op = live_op_make(first, n, out, n);
+        editor_commit_local(ed, &op);
+        push_undo_text(ed, first, n, text, n);
+    } else {
+        free(text);
+    }
+    free(out);
+}
+
+// 把第 first 到 last 行上移（dir = -1）或下移（dir = 1）一行：等於和相鄰的一行交換位置
+int move_lines(EditorState *ed, int first, int last, int dir){
+    int a = (dir < 0) ? first - 1 : first;
+    int b = (dir < 0) ? last : last + 1;
+    if(a < 1 || b > ed->total_lines) return 0;
+    size_t len;
+    char *text = editor_lines_text(ed, a, b, &len);
+    if(!text) return 0;
+    char *out = (char *)malloc(len + 1);
+    if(!out){
+        free(text);
+        return 0;
+    }
+    // 上移：相鄰行在開頭，移到最後；下移：相鄰行在最後，移到開頭
+    const char *nl = (dir < 0) ? memchr(text, '\n', len) : memrchr(text, '\n', len);
+    size_t cut = (size_t)(nl - text);
+    memcpy(out, text + cut + 1, len - cut - 1);
+    out[len - cut - 1] = '\n';
+    memcpy(out + len - cut, text, cut);
+    out[len] = '\0';
+    int n = b - a + 1;
+    LiveOp op = live_op_make(a, n, out, n);
+    editor_commit_local(ed, &op);
+    push_undo_text(ed, a, n, text, n);
+    free(out);
+    return 1;
+}
+
+// ===== 排序 / 去除重複 / 反轉 =====
+// 只排序指向各行的切片，不搬動文字：多核心時各執行緒先準備鍵並排好自己的一段，
+// 再一輪輪兩兩平行合併，最後一次組出新內容
+#define SORT_THREADS_MAX 8
+#define SORT_PARALLEL_MIN 65536   // 行數少於此數時單執行緒排序
+#define SORT_RUN 32               // 先以插入排序排好的小段長度
+
+typedef struct {
+    int field;      // 依第幾欄排序（以空白分隔，1 起算），0 表示整行
+    int numeric;    // 以開頭的數字比較（不是數字的視為 0）
+    int reverse;    // 由大到小
+    int unique;     // 排序後鍵相同的行只留第一行
+} SortSpec;
+
+typedef struct {
+    const char *line;
+    uint32_t len;       // 行長（不含換行）
+    uint32_t key_off;   // 鍵在行內的起點
+    uint32_t key_len;
+    union {
+        uint64_t prefix;    // 鍵的前 8 個位元組（大端序，不足補 0），多數比較不必讀到行的內容
+        double num;         // 數值模式的鍵
+    } k;
+} SortLine;
+
+typedef struct {
+    pthread_t thread;
+    SortLine *src;
+    SortLine *dst;
+    size_t lo, mid, hi;
+    int merge;          // 0：準備 [lo,hi) 的鍵並排序；1：把 src 的 [lo,mid) 與 [mid,hi) 合併到 dst
+    const SortSpec *sp;
+} SortTask;
+
+static double sort_parse_number(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    int neg = 0;
+    if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+    double v = 0;
+    while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+    if (p < end && *p == '.') {
+        double scale = 0.1;
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, scale /= 10) v += (*p - '0') * scale;
+    }
+    return neg ? -v : v;
+}
+
+static void sort_prepare_keys(SortLine *v, size_t n, const SortSpec *sp) {
+    for (size_t i = 0; i < n; i++) {
+        const char *p = v[i].line;
+        const char *end = p + v[i].len;
+        const char *key = p, *key_end = end;
+        if (sp->field > 0) {
+            // 第 field 個非空白片段；欄位不存在時為空鍵
+            for (int f = 1; f <= sp->field; f++) {
+                if (p == end) {
+                    key = end;
+                    break;
+                }
+                while (p < end && (*p == ' ' || *p == '\t')) p++;
+                key = p;
+                while (p < end && *p != ' ' && *p != '\t') p++;
+            }
+            key_end = p;
+        }
+        v[i].key_off = (uint32_t)(key - v[i].line);
+        v[i].key_len = (uint32_t)(key_end - key);
+        if (sp->numeric) {
+            v[i].k.num = sort_parse_number(key, key_end);
+        } else {
+            uint64_t prefix = 0;
+            for (int b = 0; b < 8; b++) {
+                prefix <<= 8;
+                if (key + b < key_end) prefix |= (unsigned char)key[b];
+            }
+            v[i].k.prefix = prefix;
+        }
+    }
+}
+
+static int sort_cmp(const SortLine *a, const SortLine *b, const SortSpec *sp) {
+    int c;
+    if (sp->numeric) {
+        c = (a->k.num > b->k.num) - (a->k.num < b->k.num);
+    } else if (a->k.prefix != b->k.prefix) {
+        c = (a->k.prefix > b->k.prefix) ? 1 : -1;
+    } else {
+        // 前 8 個位元組相同（行內沒有 NUL，補的 0 不會和內容混淆）
+        uint32_t n = (a->key_len < b->key_len) ? a->key_len : b->key_len;
+        c = (n > 8) ? memcmp(a->line + a->key_off + 8, b->line + b->key_off + 8, n - 8) : 0;
+        if (c == 0) c = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+    }
+    return sp->reverse ? -c : c;
+}
+
+// 穩定合併：相等時先取前一段
+static void sort_merge(const SortLine *a, size_t na, const SortLine *b, size_t nb, SortLine *out, const SortSpec *sp) {
+    size_t i = 0, j = 0, o = 0;
+    while (i < na && j < nb) out[o++] = (sort_cmp(&b[j], &a[i], sp) < 0) ? b[j++] : a[i++];
+    memcpy(out + o, a + i, (na - i) * sizeof(SortLine));
+    memcpy(out + o + (na - i), b + j, (nb - j) * sizeof(SortLine));
+}
+
+// 由下而上的穩定合併排序，結果留在 v
+static void sort_run(SortLine *v, SortLine *tmp, size_t n, const SortSpec *sp) {
+    for (size_t lo = 0; lo < n; lo += SORT_RUN) {
+        size_t hi = (lo + SORT_RUN < n) ? lo + SORT_RUN : n;
+        for (size_t i = lo + 1; i < hi; i++) {
+            SortLine x = v[i];
+            size_t j = i;
+            while (j > lo && sort_cmp(&x, &v[j - 1], sp) < 0) {
+                v[j] = v[j - 1];
+                j--;
+            }
+            v[j] = x;
+        }
+    }
+    SortLine *src = v, *dst = tmp;
+    for (size_t w = SORT_RUN; w < n; w *= 2) {
+        for (size_t lo = 0; lo < n; lo += 2 * w) {
+            size_t mid = (lo + w < n) ? lo + w : n;
+            size_t hi = (lo + 2 * w < n) ? lo + 2 * w : n;
+            sort_merge(src + lo, mid - lo, src + mid, hi - mid, dst + lo, sp);
+        }
+        SortLine *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != v) memcpy(v, src, n * sizeof(SortLine));
+}
+
+static void *sort_task_func(void *arg) {
+    SortTask *t = (SortTask *)arg;
+    if (t->merge) {
+        sort_merge(t->src + t->lo, t->mid - t->lo, t->src + t->mid, t->hi - t->mid, t->dst + t->lo, t->sp);
+    } else {
+        sort_prepare_keys(t->src + t->lo, t->hi - t->lo, t->sp);
+        sort_run(t->src + t->lo, t->dst + t->lo, t->hi - t->lo, t->sp);
+    }
+    return NULL;
+}
+
+// 第一個工作在呼叫端執行，其餘各開一個執行緒（建立失敗時也在呼叫端執行）
+static void sort_run_tasks(SortTask *tasks, int count) {
+    int started[SORT_THREADS_MAX] = {0};
+    for (int i = 1; i < count; i++) {
+        started[i] = (pthread_create(&tasks[i].thread, NULL, sort_task_func, &tasks[i]) == 0);
+        if (!started[i]) sort_task_func(&tasks[i]);
+    }
+    sort_task_func(&tasks[0]);
+    for (int i = 1; i < count; i++) {
+        if (started[i]) pthread_join(tasks[i].thread, NULL);
     }
-    
-    printf("====================================================\n\n");
-	live_unlock_editor(ed_idx);
 }
 
-// 在指定行之後插入新行
-void insert_new_line(EditorState *ed, int after_line){
-    // 找到插入位置
-    char *insert_pos = ed->buffer;
-    
-    if(after_line > 0){
-        for (int i = 0; i < after_line; i++){
-            char *next = strchr(insert_pos, '\n');
-            if(next){
-                insert_pos = next + 1;
-            } else {
-                // 如果到了文件末尾但沒有換行符，先添加一個
-                insert_pos = ed->buffer + strlen(ed->buffer);
-                break;
-            }
+// 平行合併排序；記憶體不足回傳 0（v 不變）
+static int sort_parallel(SortLine *v, size_t n, const SortSpec *sp) {
+    SortLine *tmp = (SortLine *)malloc((n ? n : 1) * sizeof(SortLine));
+    if (!tmp) return 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int runs = (cpus < 1) ? 1 : (cpus > SORT_THREADS_MAX ? SORT_THREADS_MAX : (int)cpus);
+    if (n < SORT_PARALLEL_MIN) runs = 1;
+    size_t bounds[SORT_THREADS_MAX + 1];
+    for (int i = 0; i <= runs; i++) bounds[i] = n * (size_t)i / (size_t)runs;
+    SortTask tasks[SORT_THREADS_MAX];
+    for (int i = 0; i < runs; i++) {
+        tasks[i] = (SortTask){ .src = v, .dst = tmp, .lo = bounds[i], .hi = bounds[i + 1], .merge = 0, .sp = sp };
+    }
+    sort_run_tasks(tasks, runs);
+    // 兩兩合併，每一輪的各對互不相干，可以同時進行
+    SortLine *src = v, *dst = tmp;
+    while (runs > 1) {
+        int pairs = runs / 2;
+        for (int p = 0; p < pairs; p++) {
+            tasks[p] = (SortTask){ .src = src, .dst = dst, .lo = bounds[2 * p], .mid = bounds[2 * p + 1],
+                                   .hi = bounds[2 * p + 2], .merge = 1, .sp = sp };
+        }
+        if (runs % 2) {
+            size_t lo = bounds[runs - 1];
+            memcpy(dst + lo, src + lo, (n - lo) * sizeof(SortLine));
         }
+        sort_run_tasks(tasks, pairs);
+        int next = (runs + 1) / 2;
+        for (int i = 0; i < next; i++) bounds[i] = bounds[2 * i];
+        bounds[next] = n;
+        runs = next;
+        SortLine *t = src;
+        src = dst;
+        dst = t;
     }
-    
-    // 保存插入位置之後的內容
-    char after_content[512] = {0};
-    strcpy(after_content, insert_pos);
-    
-    // 在插入位置添加新行（空行加換行符）
-    strcpy(insert_pos, "\n");
-    strcpy(insert_pos + 1, after_content);
-    
-    // 推入逆操作：刪除新插入的行
-    push_undo(ed, UNDO_DELETE_LINE, after_line + 1, NULL);
+    if (src != v) memcpy(v, src, n * sizeof(SortLine));
+    free(tmp);
+    return 1;
+}
 
-    // printf("\n✓ 已在第 %d 行之後插入新行\n", after_line);
-    // printf("按任意鍵繼續...");
-    // read_key();
-	// 廣播（不帶 payload 的插入）
-	live_broadcast_simple(OP_INSERT_AFTER, after_line);
+// 解析排序指令：s 字典序、n 數值、k<欄位> 依欄位，之後可加 n（數值）、r（由大到小）、u（去除重複）；
+// 單獨的 u 去除相鄰的重複行、r 反轉。op 設為 's'、'u' 或 'r'，無法辨識回傳 0
+static int sort_parse_command(const char *cmd, int *op, SortSpec *sp) {
+    memset(sp, 0, sizeof(*sp));
+    while (*cmd == ' ') cmd++;
+    if ((cmd[0] == 'u' || cmd[0] == 'r') && (cmd[1] == '\0' || cmd[1] == '\n')) {
+        *op = cmd[0];
+        return 1;
+    }
+    *op = 's';
+    if (*cmd == 's') {
+        cmd++;
+    } else if (*cmd == 'n') {
+        sp->numeric = 1;
+        cmd++;
+    } else if (*cmd == 'k') {
+        sp->field = (int)strtol(cmd + 1, (char **)&cmd, 10);
+        if (sp->field < 1) return 0;
+    } else {
+        return 0;
+    }
+    for (; *cmd && *cmd != '\n'; cmd++) {
+        if (*cmd == 'n') sp->numeric = 1;
+        else if (*cmd == 'r') sp->reverse = 1;
+        else if (*cmd == 'u') sp->unique = 1;
+        else if (*cmd != ' ') return 0;
+    }
+    return 1;
 }
 
-// 刪除指定行
-int delete_line(EditorState *ed, int line_to_delete){
-    // 如果文件只有一行，不允許刪除
-    int total = count_lines(ed->buffer);
-    if(total <= 1){
-        printf("\n✗ 無法刪除：文件至少需要保留一行\n");
-        printf("按任意鍵繼續...");
-        read_key();
-        return 0;  // 刪除失敗
+// 排序（op = 's'）、去除相鄰重複（'u'）或反轉（'r'）第 first 到 last 行：
+// 整段是一次修改、一筆逆操作、一個網路封包；內容沒有改變時回傳 0
+int sort_lines(EditorState *ed, int first, int last, int op, const SortSpec *sp){
+    size_t len;
+    char *text = editor_lines_text(ed, first, last, &len);
+    if(!text) return 0;
+    // 切片指向原內容的副本（逆操作也用它），套用修改時緩衝區會移動
+    size_t n = (size_t)(last - first + 1);
+    SortLine *v = (SortLine *)malloc(n * sizeof(SortLine));
+    char *out = (char *)malloc(len + 1);
+    if(!v || !out){
+        free(v);
+        free(out);
+        free(text);
+        return 0;
     }
-    
-    // 找到要刪除的行的起始位置
-    char *line_start = ed->buffer;
-    for(int i = 0; i < line_to_delete - 1; i++){
-        char *next = strchr(line_start, '\n');
-        if(next){
-            line_start = next + 1;
-        } else {
-            printf("\n✗ 錯誤：找不到指定行\n");
-            printf("按任意鍵繼續...");
-            read_key();
+    const char *p = text;
+    const char *end = text + len;
+    for(size_t i = 0; i < n; i++){
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        v[i].line = p;
+        v[i].len = (uint32_t)((nl ? nl : end) - p);
+        p = nl ? nl + 1 : end;
+    }
+    size_t count = n;
+    if(op == 's'){
+        if(!sort_parallel(v, n, sp)){
+            free(v);
+            free(out);
+            free(text);
             return 0;
         }
+    } else if(op == 'r'){
+        for(size_t i = 0, j = n - 1; i < j; i++, j--){
+            SortLine t = v[i];
+            v[i] = v[j];
+            v[j] = t;
+        }
     }
-    
-    // 找到要刪除的行的結束位置（下一個換行符）
-    char *line_end = strchr(line_start, '\n');
-    
-    // 保存將被刪除的內容（不包含換行）
-    char deleted_content[512] = {0};
-    int line_length = 0;
-    if(line_end){
-        line_length = (int)(line_end - line_start);
-    } else {
-        line_length = (int)strlen(line_start);
-    }
-    if (line_length > 511) line_length = 511;
-    strncpy(deleted_content, line_start, line_length);
-    deleted_content[line_length] = '\0';
-
-    // 保存要刪除行之後的內容
-    char after_content[512] = {0};
-    if(line_end){
-        // 如果找到換行符，保存換行符之後的所有內容
-        strcpy(after_content, line_end + 1);
-        // 將刪除行之後的內容複製到刪除行的起始位置
-        strcpy(line_start, after_content);
-    } else {
-        // 如果這是最後一行且沒有換行符
-        // 需要刪除前一個換行符
-        if(line_start > ed->buffer && *(line_start - 1) == '\n'){
-            *(line_start - 1) = '\0';
-        } else {
-            *line_start = '\0';
+    if(op == 'u' || (op == 's' && sp->unique)){
+        // 去除重複：排序時以鍵比較，否則整行相同才算
+        SortSpec whole = {0, 0, 0, 0};
+        const SortSpec *cmp_sp = (op == 's') ? sp : &whole;
+        if(op == 'u') sort_prepare_keys(v, n, &whole);
+        count = 1;
+        for(size_t i = 1; i < n; i++){
+            if(sort_cmp(&v[i], &v[count - 1], cmp_sp) != 0) v[count++] = v[i];
         }
     }
-    
-    // 推入逆操作：在前一行之後插回被刪除的內容
-    push_undo(ed, UNDO_INSERT_AFTER_WITH_CONTENT, line_to_delete - 1, deleted_content);
+    // 一次組出新內容
+    size_t o = 0;
+    for(size_t i = 0; i < count; i++){
+        memcpy(out + o, v[i].line, v[i].len);
+        o += v[i].len;
+        if(i + 1 < count) out[o++] = '\n';
+    }
+    out[o] = '\0';
+    free(v);
+    if(o == len && memcmp(out, text, len) == 0){
+        free(out);
+        free(text);
+        return 0;
+    }
+    LiveOp lop = live_op_make(first, (int)n, out, (int)count);
+    editor_commit_local(ed, &lop);
+    push_undo_text(ed, first, (int)count, text, (int)n);
+    free(out);
+    return 1;
+}
 
-    // printf("\n✓ 已刪除第 %d 行\n", line_to_delete);
-    // printf("按任意鍵繼續...");
-    // read_key();
+// ===== 以外部命令過濾 =====
+// 像 vim 的 :!，把第 first 到 last 行送進 /bin/sh -c 命令的標準輸入，同時讀回標準輸出取代這些行。
+// 輸入以 vmsplice 直接把緩衝區的分頁掛進管線，不另外複製；過濾期間不處理遠端修改，緩衝區保持不動
+#define FILTER_PAINT_MS 100
+#define FILTER_READ_CHUNK (1 << 16)
+#define FILTER_ERR_MAX 2048       // 最多保留的錯誤輸出
 
-	// 廣播刪除
-	live_broadcast_simple(OP_DELETE_LINE, line_to_delete);
-    return 1;  // 刪除成功
+typedef struct {
+    char *out;                  // 標準輸出（'\0' 結尾）
+    size_t out_len;
+    size_t out_cap;
+    char err[FILTER_ERR_MAX];   // 標準錯誤的開頭（'\0' 結尾）
+    size_t err_len;
+    int status;                 // waitpid 的結束狀態
+    int cancelled;
+} FilterResult;
+
+static volatile sig_atomic_t filter_interrupted = 0;
+
+static void filter_sigint(int sig) {
+    (void)sig;
+    filter_interrupted = 1;
 }
 
-// 複製指定行到剪貼板
-void copy_line(char *buffer, int line_to_copy){
-    // 找到要複製的行的起始位置
-    char *line_start = buffer;
-    for(int i = 0; i < line_to_copy - 1; i++){
-        char *next = strchr(line_start, '\n');
-        if(next){
-            line_start = next + 1;
-        } else {
-            printf("\n✗ 錯誤：找不到指定行\n");
-            printf("按任意鍵繼續...");
-            read_key();
-            return;
+// 把 iov 往前推進 n 個位元組
+static void filter_iov_advance(struct iovec *iov, int *cnt, size_t n) {
+    while (*cnt > 0 && n >= iov[0].iov_len) {
+        n -= iov[0].iov_len;
+        memmove(iov, iov + 1, (size_t)(*cnt - 1) * sizeof(struct iovec));
+        (*cnt)--;
+    }
+    if (*cnt > 0) {
+        iov[0].iov_base = (char *)iov[0].iov_base + n;
+        iov[0].iov_len -= n;
+    }
+}
+
+static void filter_paint(size_t sent, size_t total, size_t received) {
+    printf("\r\033[K過濾中：已送出 %zu / %zu KB，已收到 %zu KB（ESC 取消）", sent >> 10, total >> 10, received >> 10);
+    fflush(stdout);
+}
+
+// 執行命令：送出 iov 的內容，同時收集標準輸出與標準錯誤，期間按 ESC 或 Ctrl+C 取消。
+// 無法建立管線或子行程回傳 0
+static int filter_run(const char *cmd, struct iovec *iov, int iovcnt, FilterResult *r) {
+    int in[2], out[2], err[2];
+    if (pipe2(in, O_CLOEXEC) != 0) return 0;
+    if (pipe2(out, O_CLOEXEC) != 0) {
+        close(in[0]);
+        close(in[1]);
+        return 0;
+    }
+    if (pipe2(err, O_CLOEXEC) != 0) {
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        return 0;
+    }
+    // 管線另一端提早結束時寫入只回傳 EPIPE；Ctrl+C 只取消過濾
+    struct sigaction sa_int, sa_pipe, old_int, old_pipe;
+    memset(&sa_int, 0, sizeof(sa_int));
+    sa_int.sa_handler = filter_sigint;
+    sigemptyset(&sa_int.sa_mask);
+    sa_pipe = sa_int;
+    sa_pipe.sa_handler = SIG_IGN;
+    filter_interrupted = 0;
+    sigaction(SIGINT, &sa_int, &old_int);
+    sigaction(SIGPIPE, &sa_pipe, &old_pipe);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        setpgid(0, 0);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+    if (pid < 0) {
+        close(in[1]);
+        close(out[0]);
+        close(err[0]);
+        sigaction(SIGINT, &old_int, NULL);
+        sigaction(SIGPIPE, &old_pipe, NULL);
+        return 0;
+    }
+    setpgid(pid, pid);
+
+    int fds[3] = { in[1], out[0], err[0] };
+    for (int i = 0; i < 3; i++) fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    size_t total = 0, sent = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    if (iovcnt == 0 || total == 0) {
+        close(fds[0]);
+        fds[0] = -1;
+    }
+    int use_vmsplice = 1;
+    double last_paint = 0;
+    while (fds[1] >= 0 || fds[2] >= 0) {
+        struct pollfd p[4] = {
+            { fds[0], POLLOUT, 0 },
+            { fds[1], POLLIN, 0 },
+            { fds[2], POLLIN, 0 },
+            { STDIN_FILENO, POLLIN, 0 },
+        };
+        int ready = poll(p, 4, FILTER_PAINT_MS);
+        if (filter_interrupted) r->cancelled = 1;
+        if (ready > 0 && (p[3].revents & POLLIN)) {
+            char key = read_key();
+            if (key == '\033' || key == 'q' || key == 'Q') r->cancelled = 1;
+        }
+        if (r->cancelled) break;
+        if (ready > 0 && fds[0] >= 0 && (p[0].revents & (POLLOUT | POLLERR | POLLHUP))) {
+            ssize_t n = -1;
+            if (use_vmsplice) {
+                n = vmsplice(fds[0], iov, (unsigned long)iovcnt, SPLICE_F_NONBLOCK);
+                if (n < 0 && (errno == EINVAL || errno == ENOSYS)) use_vmsplice = 0;
+            }
+            if (!use_vmsplice) n = writev(fds[0], iov, iovcnt);
+            if (n > 0) {
+                sent += (size_t)n;
+                filter_iov_advance(iov, &iovcnt, (size_t)n);
+            }
+            // 全部送出，或命令不再讀取（例如 head）時關閉標準輸入
+            if (iovcnt == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                close(fds[0]);
+                fds[0] = -1;
+            }
+        }
+        if (ready > 0 && fds[1] >= 0 && (p[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            if (r->out_cap - r->out_len < FILTER_READ_CHUNK + 1) {
+                size_t cap = r->out_cap ? r->out_cap * 2 : FILTER_READ_CHUNK * 4;
+                while (cap - r->out_len < FILTER_READ_CHUNK + 1) cap *= 2;
+                char *grown = (char *)realloc(r->out, cap);
+                if (!grown) {
+                    r->cancelled = 1;
+                    break;
+                }
+                r->out = grown;
+                r->out_cap = cap;
+            }
+            ssize_t n = read(fds[1], r->out + r->out_len, FILTER_READ_CHUNK);
+            if (n > 0) {
+                r->out_len += (size_t)n;
+            } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                close(fds[1]);
+                fds[1] = -1;
+            }
+        }
+        if (ready > 0 && fds[2] >= 0 && (p[2].revents & (POLLIN | POLLHUP | POLLERR))) {
+            char buf[1024];
+            ssize_t n = read(fds[2], buf, sizeof(buf));
+            if (n > 0) {
+                size_t keep = FILTER_ERR_MAX - 1 - r->err_len;
+                if ((size_t)n < keep) keep = (size_t)n;
+                memcpy(r->err + r->err_len, buf, keep);
+                r->err_len += keep;
+            } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                close(fds[2]);
+                fds[2] = -1;
+            }
+        }
+        double t = now_ms();
+        if (t - last_paint >= FILTER_PAINT_MS) {
+            filter_paint(sent, total, r->out_len);
+            last_paint = t;
         }
     }
-    
-    // 找到行的結束位置
-    char *line_end = strchr(line_start, '\n');
-    int line_length;
-    
-    if(line_end){
-        line_length = line_end - line_start;
-    } else {
-        line_length = strlen(line_start);
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] >= 0) close(fds[i]);
     }
-    
-    // 複製到剪貼板（不包括換行符）
-    if(line_length >= 512){
-        line_length = 511;  // 防止緩衝區溢出
+    if (r->cancelled) {
+        // 先請整個行程群組結束，不理會再強制結束
+        kill(-pid, SIGTERM);
+        int waited = 0;
+        for (int i = 0; i < 20 && !waited; i++) {
+            waited = (waitpid(pid, &r->status, WNOHANG) == pid);
+            if (!waited) usleep(10000);
+        }
+        if (!waited) {
+            kill(-pid, SIGKILL);
+            waitpid(pid, &r->status, 0);
+        }
+    } else {
+        while (waitpid(pid, &r->status, 0) < 0 && errno == EINTR);
     }
-    
-    strncpy(clipboard, line_start, line_length);
-    clipboard[line_length] = '\0';
-    clipboard_has_content = 1;
-    
-    // printf("\n✓ 已複製第 %d 行到剪貼板\n", line_to_copy);
-    // printf("內容：%s\n", clipboard);
-    // printf("按任意鍵繼續...");
-    // read_key();
+    if (r->out) r->out[r->out_len] = '\0';
+    r->err[r->err_len] = '\0';
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    return 1;
 }
 
-// 將剪貼板內容貼上到指定行之後
-void paste_line(EditorState *ed, int after_line){
-    if(!clipboard_has_content){
-        printf("\n✗ 剪貼板為空，請先複製內容\n");
+// 用命令的輸出取代第 first 到 last 行：整段是一次修改、一筆逆操作、一個網路封包。
+// 命令失敗、被取消或輸出沒有改變時不修改並回傳 0
+int filter_lines(EditorState *ed, int first, int last, const char *cmd){
+    // 空文件只有一個空行，送出空的輸入
+    size_t start = 0, end = 0;
+    if(ed->length > 0 && !editor_lines_span(ed, first, last, &start, &end)){
+        printf("\n✗ 找不到指定行\n");
         printf("按任意鍵繼續...");
         read_key();
-        return;
+        return 0;
     }
-    
-    // 找到插入位置（在指定行之後）
-    char *insert_pos = ed->buffer;
-    
-    if(after_line > 0){
-        for(int i = 0; i < after_line; i++){
-            char *next = strchr(insert_pos, '\n');
-            if(next){
-                insert_pos = next + 1;
-            } else {
-                // 如果到了文件末尾但沒有換行符，先添加一個
-                insert_pos = ed->buffer + strlen(ed->buffer);
-                break;
-            }
-        }
+    static const char newline[] = "\n";
+    struct iovec iov[2] = {
+        { ed->buffer + start, end - start },
+        { (void *)newline, 0 },
+    };
+    if(end > start && ed->buffer[end - 1] != '\n') iov[1].iov_len = 1;   // 最後一行補上換行再送出
+    int iovcnt = (end > start) ? 2 : 0;
+
+    FilterResult r;
+    memset(&r, 0, sizeof(r));
+    printf("\n");
+    if(!filter_run(cmd, iov, iovcnt, &r)){
+        printf("\n✗ 無法執行命令：%s\n", strerror(errno));
+        printf("按任意鍵繼續...");
+        read_key();
+        return 0;
+    }
+    printf("\r\033[K");
+    const char *why = NULL;
+    char reason[64];
+    if(r.cancelled){
+        why = "已取消";
+    } else if(WIFSIGNALED(r.status)){
+        snprintf(reason, sizeof(reason), "命令被訊號 %d 終止", WTERMSIG(r.status));
+        why = reason;
+    } else if(!WIFEXITED(r.status) || WEXITSTATUS(r.status) != 0){
+        snprintf(reason, sizeof(reason), "命令結束碼 %d", WIFEXITED(r.status) ? WEXITSTATUS(r.status) : -1);
+        why = reason;
+    } else if(r.out_len > 0 && memchr(r.out, '\0', r.out_len)){
+        why = "輸出含有 NUL 字元";
+    }
+    if(why){
+        printf("✗ %s，內容未修改\n", why);
+        if(r.err_len > 0) printf("%s%s", r.err, r.err[r.err_len - 1] == '\n' ? "" : "\n");
+        printf("按任意鍵繼續...");
+        read_key();
+        free(r.out);
+        return 0;
     }
-    
-    // 保存插入位置之後的內容
-    char after_content[512] = {0};
-    strcpy(after_content, insert_pos);
-    
-    // 在插入位置添加剪貼板內容和換行符
-    strcpy(insert_pos, clipboard);
-    strcpy(insert_pos + strlen(clipboard), "\n");
-    strcpy(insert_pos + strlen(clipboard) + 1, after_content);
-    
-    // 推入逆操作：刪除新貼上的行
-    push_undo(ed, UNDO_DELETE_LINE, after_line + 1, NULL);
 
-    // printf("\n✓ 已在第 %d 行之後貼上內容\n", after_line);
-    // printf("內容：%s\n", clipboard);
-    // printf("按任意鍵繼續...");
-    // read_key();
-	// 廣播貼上（帶內容）
-	live_broadcast_with_payload(OP_PASTE_AFTER, after_line, clipboard);
+    // 輸出的最後一個換行是行尾，不是多一個空行；完全沒有輸出時刪除這些行
+    const char *text = r.out ? r.out : "";
+    size_t len = r.out_len;
+    int nlines = 0;
+    if(len > 0){
+        if(text[len - 1] == '\n') r.out[--len] = '\0';
+        nlines = 1;
+        for(const char *p = text; (p = memchr(p, '\n', len - (size_t)(p - text))) != NULL; p++) nlines++;
+    }
+    size_t old_len = 0;
+    char *old = (ed->length > 0) ? editor_lines_text(ed, first, last, &old_len) : (char *)calloc(1, 1);
+    if(!old){
+        free(r.out);
+        return 0;
+    }
+    int n = last - first + 1;
+    if(nlines == n && len == old_len && memcmp(text, old, len) == 0){
+        free(old);
+        free(r.out);
+        return 0;
+    }
+    if(nlines == 0 && first == 1 && n >= ed->total_lines){
+        nlines = 1;   // 文件至少保留一個空行
+    }
+    LiveOp op = live_op_make(first, n, nlines ? text : NULL, nlines);
+    editor_commit_local(ed, &op);
+    push_undo_text(ed, first, nlines, old, n);
+    free(r.out);
+    return 1;
 }
 
 // 計算總共有多少個匹配
@@ -1239,6 +4894,70 @@ int search_forward(char *buffer, const char *search_term, int start_line, int st
     return 0;  // 完全沒找到
 }
 
+// 排序 / 去除重複 / 反轉選取範圍（沒有選取時為整個文件），讓用戶輸入指令
+void enter_sort_mode(EditorState *ed) {
+    int first = 1, last = ed->total_lines;
+    if(ed->sel_anchor) editor_selection(ed, &first, &last);
+    
+    clear_screen();
+    print_with_line_numbers(ed);
+    
+    printf("\n");
+    printf("┌─────────────────────────────────────────┐\n");
+    printf("│ 第 %d-%d 行\n", first, last);
+    printf("│ s 字典序  n 數值  k2 依第 2 欄（k2n 以數值比較）\n");
+    printf("│ 後面加 r 由大到小、u 去除重複\n");
+    printf("│ 單獨 u 去除相鄰重複行、r 反轉\n");
+    printf("│ 請輸入指令（直接按 Enter 取消）：");
+    
+    char cmd[32];
+    if(!prompt_read_line(cmd, sizeof(cmd))) cmd[0] = '\0';
+    printf("└─────────────────────────────────────────┘\n");
+    
+    if(cmd[0] == '\n' || cmd[0] == '\0') return;
+    int op;
+    SortSpec spec;
+    if(!sort_parse_command(cmd, &op, &spec)){
+        printf("✗ 無法辨識的指令\n");
+        printf("按任意鍵繼續...");
+        fflush(stdout);
+        read_key();
+        return;
+    }
+    if(sort_lines(ed, first, last, op, &spec)){
+        // 行數可能變少（去除重複），選取結束
+        ed->sel_anchor = 0;
+        editor_clamp(ed);
+        live_broadcast_cursor(ed, ed->current_line, 0);
+    }
+}
+
+// 以外部命令過濾選取範圍（沒有選取時為當前行），讓用戶輸入命令
+void enter_filter_mode(EditorState *ed) {
+    int first, last;
+    editor_selection(ed, &first, &last);
+    
+    clear_screen();
+    print_with_line_numbers(ed);
+    
+    printf("\n");
+    printf("┌─────────────────────────────────────────┐\n");
+    printf("│ 第 %d-%d 行送進命令，以輸出取代（例如 sort -u、jq .、awk '{print $2}'）\n", first, last);
+    printf("│ 請輸入命令（直接按 Enter 取消）：");
+    
+    char cmd[1024];
+    if(!prompt_read_line(cmd, sizeof(cmd))) cmd[0] = '\0';
+    printf("└─────────────────────────────────────────┘");
+    
+    cmd[strcspn(cmd, "\n")] = '\0';
+    if(cmd[0] == '\0') return;
+    if(filter_lines(ed, first, last, cmd)){
+        ed->sel_anchor = 0;
+        editor_clamp(ed);
+        live_broadcast_cursor(ed, ed->current_line, 0);
+    }
+}
+
 // 進入搜尋模式，讓用戶輸入搜尋字串（顯示文本內容）
 void enter_search_mode(EditorState *ed) {
     clear_screen();
@@ -1254,10 +4973,7 @@ void enter_search_mode(EditorState *ed) {
     printf("┌─────────────────────────────────────────┐\n");
     printf("│ 請輸入要搜尋的字串：");
     
-    // 臨時禁用原始模式以便讀取一行文字
-    disable_raw_mode();
-    
-    if(fgets(ed->search_term, sizeof(ed->search_term), stdin) != NULL) {
+    if(prompt_read_line(ed->search_term, sizeof(ed->search_term))) {
         // 移除換行符
         size_t len = strlen(ed->search_term);
         if(len > 0 && ed->search_term[len-1] == '\n') {
@@ -1271,161 +4987,1635 @@ void enter_search_mode(EditorState *ed) {
     }
     
     printf("└─────────────────────────────────────────┘\n");
-    
-    // 重新啟用原始模式
-    enable_raw_mode();
 }
 
-void edit_line(EditorState *ed){
-    char *buffer = ed->buffer;
-    int current_line = ed->current_line;
-    
-	//（改至取得初始欄位位置後再廣播）
+// ===== 單行編輯 =====
+// 編輯中的行放在空隙緩衝區：空隙就是游標，插入與刪除只動游標旁的位元組，游標右邊的內容是連續的
+#define LINE_GAP_MIN 64
 
-    // 找到要編輯的行
-    char *line_ptr = buffer;
-    for (int i = 0; i < current_line - 1; i++){
-        line_ptr = strchr(line_ptr, '\n') + 1;
-    }
+typedef struct {
+	char *buf;
+	size_t cap;
+	size_t gap;       // 空隙起點，也就是游標位置（位元組）
+	size_t gap_end;   // 游標右邊的內容從這裡開始
+} LineGap;
+
+static size_t line_gap_len(const LineGap *g) {
+	return g->gap + (g->cap - g->gap_end);
+}
+
+// 確保空隙至少有 need 位元組
+static int line_gap_reserve(LineGap *g, size_t need) {
+	if (g->gap_end - g->gap >= need) return 1;
+	size_t tail = g->cap - g->gap_end;
+	size_t cap = g->cap * 2;
+	if (cap < g->cap + need + LINE_GAP_MIN) cap = g->cap + need + LINE_GAP_MIN;
+	char *grown = (char *)realloc(g->buf, cap);
+	if (!grown) return 0;
+	memmove(grown + cap - tail, grown + g->gap_end, tail);
+	g->buf = grown;
+	g->gap_end = cap - tail;
+	g->cap = cap;
+	return 1;
+}
+
+// 以 text 為內容，游標放在行尾
+static int line_gap_init(LineGap *g, const char *text, size_t len) {
+	memset(g, 0, sizeof(*g));
+	if (!line_gap_reserve(g, len + 1)) return 0;
+	memcpy(g->buf, text, len);
+	g->gap = len;
+	return 1;
+}
+
+static void line_gap_move(LineGap *g, size_t off) {
+	if (off < g->gap) {
+		size_t n = g->gap - off;
+		memmove(g->buf + g->gap_end - n, g->buf + off, n);
+		g->gap -= n;
+		g->gap_end -= n;
+	} else if (off > g->gap) {
+		size_t n = off - g->gap;
+		memmove(g->buf + g->gap, g->buf + g->gap_end, n);
+		g->gap += n;
+		g->gap_end += n;
+	}
+}
+
+// 整行內容（'\0' 結尾）；空隙移到行尾，游標隨之改變
+static const char *line_gap_text(LineGap *g) {
+	line_gap_move(g, line_gap_len(g));
+	if (!line_gap_reserve(g, 1)) return NULL;
+	g->buf[g->gap] = '\0';
+	return g->buf;
+}
+
+// UTF-8 字元：lead 起頭的位元組數，以及在終端機上佔的格數（三、四位元組的字元多半是中日韓文字，佔兩格）
+static size_t utf8_char_len(unsigned char lead) {
+	if (lead < 0xC0) return 1;
+	if (lead < 0xE0) return 2;
+	return (lead < 0xF0) ? 3 : 4;
+}
+
+static int utf8_char_width(unsigned char lead) {
+	return (lead < 0xE0) ? 1 : 2;
+}
+
+static int utf8_width(const char *s, size_t len) {
+	int w = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)s[i];
+		if (c < 0x80 || c >= 0xC0) w += utf8_char_width(c);
+	}
+	return w;
+}
+
+// 游標左邊那個字元的位元組數（略過 UTF-8 後續位元組）
+static size_t line_gap_prev_len(const LineGap *g) {
+	size_t n = 0;
+	while (n < g->gap) {
+		n++;
+		if (((unsigned char)g->buf[g->gap - n] & 0xC0) != 0x80) break;
+	}
+	return n;
+}
+
+// 游標右邊那個字元的位元組數
+static size_t line_gap_next_len(const LineGap *g) {
+	size_t left = g->cap - g->gap_end;
+	if (left == 0) return 0;
+	size_t n = utf8_char_len((unsigned char)g->buf[g->gap_end]);
+	return (n < left) ? n : left;
+}
+
+static int terminal_columns(void) {
+	struct winsize ws;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) return ws.ws_col;
+	return 80;
+}
+
+// 編輯框內游標與它右邊的內容：游標所在的字元反白，游標在行尾時反白一個空格
+static void edit_line_print_tail(const LineGap *g) {
+	const char *tail = g->buf + g->gap_end;
+	size_t tail_len = g->cap - g->gap_end;
+	size_t cur = line_gap_next_len(g);
+	if (cur == 0) {
+		fputs("\033[7m \033[0m", stdout);
+		return;
+	}
+	fputs("\033[7m", stdout);
+	fwrite(tail, 1, cur, stdout);
+	fputs("\033[0m", stdout);
+	fwrite(tail + cur, 1, tail_len - cur, stdout);
+}
+
+// 複製 [off, off + len) 的內容到 out（可能跨過空隙）
+static void line_gap_copy(const LineGap *g, size_t off, size_t len, char *out) {
+	size_t left = (off < g->gap) ? g->gap - off : 0;
+	if (left > len) left = len;
+	memcpy(out, g->buf + off, left);
+	if (len > left) memcpy(out + left, g->buf + g->gap_end + (off + left - g->gap), len - left);
+}
+
+// 在 off 刪除 del 位元組再插入 text（遠端修改）：游標在範圍之後時跟著平移，在範圍內時移到插入內容之後；
+// 游標正好在 off 時留在原地，插入的內容出現在游標右邊（與 live_op_transform 相同，先定序的一方在前：
+// 游標左邊是自己已送出的輸入，遠端內容排在它後面，接著輸入的內容仍與它相連）
+static int line_gap_splice(LineGap *g, size_t off, size_t del, const char *text, size_t len) {
+	size_t cur = g->gap;
+	line_gap_move(g, off);
+	g->gap_end += del;
+	if (!line_gap_reserve(g, len)) return 0;
+	memcpy(g->buf + g->gap, text, len);
+	g->gap += len;
+	if (cur != off) cur = (cur >= off + del) ? cur - del + len : off + len;
+	line_gap_move(g, cur);
+	return 1;
+}
+
+// Live Share 時編輯中的按鍵不等 Enter：連續輸入或連續倒退合併成一個字元層級操作，
+// 處理完目前所有已到達的按鍵（每個畫面）才送出；遠端修改則直接修補到編輯中的內容
+typedef struct {
+	EditorState *ed;   // NULL 表示沒有串流中的編輯
+	LineGap *g;
+	int line;          // 編輯中的行號，遠端在前面插入或刪除行時跟著移動
+	int gone;          // 這一行被遠端刪除
+	int changed;       // 遠端修改了編輯中的內容
+	// 尚未送出的本地修改：相對於已送出的內容，從 col 起刪除 cdel 位元組，新內容是 g 中的 [col, col + ins)
+	int pending;
+	size_t col;
+	size_t cdel;
+	size_t ins;
+} EditSession;
+
+static EditSession edit_session;
+
+static void edit_session_flush(void) {
+	EditSession *s = &edit_session;
+	if (!s->ed || !s->pending) return;
+	s->pending = 0;
+	if (s->cdel == 0 && s->ins == 0) return;
+	char *text = (char *)malloc(s->ins + 1);
+	if (!text) return;
+	line_gap_copy(s->g, s->col, s->ins, text);
+	LiveOp op = live_op_make_chars(s->line, (int)s->col, (int)s->cdel, text, s->ins);
+	free(text);
+	editor_commit_local(s->ed, &op);
+}
+
+// 在 at 插入 n 位元組之前呼叫：接在未送出的輸入後面就合併，否則先送出
+static void edit_session_insert(size_t at, size_t n) {
+	EditSession *s = &edit_session;
+	if (!s->ed) return;
+	if (s->pending && at != s->col + s->ins) edit_session_flush();
+	if (!s->pending) {
+		s->pending = 1;
+		s->col = at;
+		s->cdel = 0;
+		s->ins = 0;
+	}
+	s->ins += n;
+}
+
+// 刪除 [at, at + n) 之前呼叫：刪掉還沒送出的輸入，或接著往前倒退時合併
+static void edit_session_erase(size_t at, size_t n) {
+	EditSession *s = &edit_session;
+	if (!s->ed) return;
+	if (s->pending && at + n == s->col + s->ins && s->ins >= n) {
+		s->ins -= n;
+		return;
+	}
+	if (s->pending && at + n == s->col && s->ins == 0) {
+		s->col = at;
+		s->cdel += n;
+		return;
+	}
+	edit_session_flush();
+	s->pending = 1;
+	s->col = at;
+	s->cdel = n;
+	s->ins = 0;
+}
+
+// 從緩衝區重新讀入編輯中的行（同步快照或整行被取代時）；行已不存在就結束編輯
+static void edit_session_reload(EditorState *ed) {
+	EditSession *s = &edit_session;
+	if (s->ed != ed || s->gone) return;
+	if (s->line < 1 || s->line > ed->total_lines) {
+		s->gone = 1;
+		return;
+	}
+	size_t off = editor_line_offset(ed, s->line);
+	size_t len = editor_line_end(ed, off) - off;
+	size_t cur = s->g->gap;
+	LineGap fresh;
+	if (!line_gap_init(&fresh, ed->buffer + off, len)) {
+		s->gone = 1;
+		return;
+	}
+	free(s->g->buf);
+	*s->g = fresh;
+	line_gap_move(s->g, (cur < len) ? cur : len);
+	s->changed = 1;
+}
+
+// 遠端操作已套用到緩衝區之後呼叫（op 已轉換成本地座標）；此時本地修改都已送出，編輯中的內容等於緩衝區的那一行
+static void edit_session_patch(EditorState *ed, const LiveOp *op) {
+	EditSession *s = &edit_session;
+	if (s->ed != ed || s->gone) return;
+	if (op->chars) {
+		if (op->pos != s->line) return;
+		// 與 editor_apply_chars 相同的截斷規則
+		size_t len = line_gap_len(s->g);
+		size_t c = (op->col > 0) ? (size_t)op->col : 0;
+		size_t d = (op->cdel > 0) ? (size_t)op->cdel : 0;
+		if (c > len) c = len;
+		if (d > len - c) d = len - c;
+		if (d == 0 && op->tlen == 0) return;
+		if (!line_gap_splice(s->g, c, d, op->text, op->tlen)) {
+			edit_session_reload(ed);
+			return;
+		}
+		s->changed = 1;
+		return;
+	}
+	int ys = op->pos, ye = op->pos + op->del;
+	if (op->del == 0) {
+		if (ys <= s->line) s->line += op->nlines;
+	} else if (ye <= s->line) {
+		s->line += op->nlines - op->del;
+	} else if (ys <= s->line) {
+		// 這一行被刪除或整行取代：取代時改為編輯新內容中對應的那一行
+		if (op->nlines == 0) {
+			s->gone = 1;
+			return;
+		}
+		if (s->line >= ys + op->nlines) s->line = ys + op->nlines - 1;
+		edit_session_reload(ed);
+	}
+}
+
+static int stdin_pending(void) {
+	struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+	return poll(&p, 1, 0) > 0;
+}
+
+// 編輯框左右邊框之外的寬度：「│ 」佔兩格，結尾的游標空格佔一格
+#define EDIT_BOX_INDENT 2
+#define EDIT_BOX_MIN_COLUMNS 44  // 邊框本身的寬度，比這窄時框線會折行
+
+// 整個畫面重繪；畫完後終端機游標停在編輯框下兩列的行首
+static void edit_line_draw(EditorState *ed, int current_line, const LineGap *g) {
+    clear_screen();
+    printf("╔═══════════════════════════════════════════╗\n");
+    printf("║       編輯模式 - 行 %d                    ║\n", current_line);
+    printf("╚═══════════════════════════════════════════╝\n");
     
-    // 找到行尾
-    char *line_end = strchr(line_ptr, '\n');
-    int line_length = line_end ? (int)(line_end - line_ptr) : (int)strlen(line_ptr);
+    // 顯示文本內容讓用戶參考
+    print_with_line_numbers(ed);
+    
+    printf("\n");
+    printf("操作說明：[←/→] 移動光標  [Backspace] 刪除  [Enter] 完成  [ESC] 取消\n\n");
     
-    // 複製當前行內容到臨時緩衝區
-    char line_content[512] = {0};
-    strncpy(line_content, line_ptr, line_length);
+    printf("編輯第 %d 行：\n", current_line);
+    printf("┌─────────────────────────────────────────┐\n");
+    printf("│ ");
+    fwrite(g->buf, 1, g->gap, stdout);
+    edit_line_print_tail(g);
+    printf("\n└─────────────────────────────────────────┘\n");
+    fflush(stdout);
+}
+
+// 只重畫編輯框：從第 col 格開始印出 pre 與游標右邊的內容，再清掉行尾殘留，然後回到原來的位置
+static void edit_line_repaint(const LineGap *g, int col, const char *pre, size_t pre_len) {
+    printf("\033[2A\033[%dG", EDIT_BOX_INDENT + col + 1);
+    fwrite(pre, 1, pre_len, stdout);
+    edit_line_print_tail(g);
+    printf("\033[K\r\033[2B");
+    fflush(stdout);
+}
+
+void edit_line(EditorState *ed){
+    int current_line = ed->current_line;
     
-    // 保存行後面的內容
-    char after_line[512] = {0};
-    if(line_end){
-        strcpy(after_line, line_end);
+    // 複製當前行內容到空隙緩衝區（編輯期間緩衝區可能被網路更新或重新配置，不保留指標）
+    size_t line_off = editor_line_offset(ed, current_line);
+    size_t line_length = editor_line_end(ed, line_off) - line_off;
+    LineGap g;
+    // 保存原始內容供復原使用
+    char *orig_content = (char *)malloc(line_length + 1);
+    if(!orig_content || !line_gap_init(&g, ed->buffer + line_off, line_length)){
+        free(orig_content);
+        printf("\n✗ 記憶體不足，無法編輯\n");
+        printf("按任意鍵繼續...");
+        read_key();
+        return;
     }
+    memcpy(orig_content, ed->buffer + line_off, line_length);
+    orig_content[line_length] = '\0';
     
-    int cursor_pos = line_length;  // 光標位置（從行尾開始）
-    int content_len = line_length;
-	// 進入編輯時廣播目前行號與欄位
-	live_broadcast_cursor(current_line, cursor_pos);
+    int cursor_col = utf8_width(g.buf, g.gap);  // 游標左邊的顯示寬度
+    int line_cols = cursor_col;                 // 整行的顯示寬度
+	// Live Share 時按鍵即時串流給其他人（重播巨集時不送，結束後整批提交）
+	int stream = (live_mode != LIVE_NONE && !macro_replaying);
+	if (stream) {
+		memset(&edit_session, 0, sizeof(edit_session));
+		edit_session.ed = ed;
+		edit_session.g = &g;
+		edit_session.line = current_line;
+	}
+	// 進入編輯時廣播目前行號與欄位（欄位以位元組計）
+	live_broadcast_cursor(ed, current_line, (int)g.gap);
     
-    // 編輯循環
+    // 編輯循環：畫面只在進入、網路更新與編輯框折行時整個重繪，其他按鍵只重畫編輯框游標之後的部分
+    int redraw = 1;
+    int drawn_columns = 0;  // 上次整個重繪時的終端機寬度，編輯框折行時為 0
     while(1){
-        // 清除屏幕並顯示編輯界面
-        clear_screen();
-        printf("╔═══════════════════════════════════════════╗\n");
-        printf("║       編輯模式 - 行 %d                    ║\n", current_line);
-        printf("╚═══════════════════════════════════════════╝\n");
-        
-        // 顯示文本內容讓用戶參考
-        print_with_line_numbers(ed);
-        
-        printf("\n");
-        printf("操作說明：[←/→] 移動光標  [Backspace] 刪除  [Enter] 完成  [ESC] 取消\n\n");
-        
-        printf("編輯第 %d 行：\n", current_line);
-        printf("┌─────────────────────────────────────────┐\n");
-        printf("│ ");
-        
-        // 顯示內容，在光標位置顯示特殊標記
-        for(int i = 0; i < content_len; i++){
-            if(i == cursor_pos){
-                printf("\033[7m"); // 反色顯示光標位置
-            }
-            printf("%c", line_content[i]);
-            if(i == cursor_pos){
-                printf("\033[0m"); // 重置顏色
-            }
-        }
-        
-        // 如果光標在最後，顯示空格光標
-        if(cursor_pos == content_len){
-            printf("\033[7m \033[0m");
+        if(redraw && !macro_replaying){
+            drawn_columns = terminal_columns();
+            if(drawn_columns < EDIT_BOX_MIN_COLUMNS || EDIT_BOX_INDENT + line_cols + 1 >= drawn_columns) drawn_columns = 0;
+            edit_line_draw(ed, current_line, &g);
         }
+        redraw = 0;
         
-        printf("\n└─────────────────────────────────────────┘\n");
-        
-        // 讀取按鍵
-        char key = read_key();
+        // 讀取按鍵（網路更新時重繪）
+        char key = read_key_or_refresh();
         
-        if(key == '\r' || key == '\n'){
-            // Enter - 完成編輯
-            line_content[content_len] = '\0';
-			// 推入逆操作：記錄原始行內容
-			{
-				char orig_content[512] = {0};
-				int orig_len = line_length < 511 ? line_length : 511;
-				strncpy(orig_content, line_ptr, orig_len);
-				orig_content[orig_len] = '\0';
-				push_undo(ed, UNDO_SET_LINE, current_line, orig_content);
+        // 這次按鍵之後要重畫的起點（-1 表示不用畫）與游標左邊要一起印出的位元組
+        int paint_col = -1;
+        const char *pre = NULL;
+        size_t pre_len = 0;
+		if (stream) {
+			// 遠端修改：行號可能移動（主畫面的目前行跟著走），內容已修補到 g
+			if (edit_session.gone) break;
+			if (edit_session.line != current_line) {
+				current_line = edit_session.line;
+				ed->current_line = current_line;
+				live_broadcast_cursor(ed, current_line, (int)g.gap);
 			}
-			// 寫入時短暫上鎖
-			live_lock_editor((ed == &editors[0]) ? 0 : 1);
-			strcpy(line_ptr, line_content);
-			strcpy(line_ptr + content_len, after_line);
-			live_unlock_editor((ed == &editors[0]) ? 0 : 1);
-			// 廣播更新此行
-			live_broadcast_with_payload(OP_EDIT_LINE, current_line, line_content);
+			if (edit_session.changed) {
+				edit_session.changed = 0;
+				cursor_col = utf8_width(g.buf, g.gap);
+				line_cols = cursor_col + utf8_width(g.buf + g.gap_end, g.cap - g.gap_end);
+				redraw = 1;
+			}
+		}
+        if(key == KEY_REFRESH){
+            redraw = 1;
+            continue;
+        }
+        else if(key == '\r' || key == '\n'){
+            // Enter - 完成編輯；內容沒變時不產生修改（串流時修改已經送出，只記錄復原）
+			if (stream) edit_session_flush();
+            const char *text = line_gap_text(&g);
+            if(text && strcmp(text, orig_content) != 0){
+				if (!stream) {
+					LiveOp op = live_op_make(current_line, 1, text, 1);
+					editor_commit_local(ed, &op);
+				}
+                // 推入逆操作：換回原始行內容（接手 orig_content）
+                push_undo_text(ed, current_line, 1, orig_content, 1);
+                orig_content = NULL;
+            }
             break;
         }
         else if(key == '\033'){
-            // ESC - 取消編輯
-            // clear_screen();
-            // printf("\n✗ 已取消編輯\n");
-            // printf("按任意鍵繼續...");
-            // read_key();
+            // ESC - 取消編輯；串流時已送出的修改以整行換回原始內容撤銷
+			if (stream) {
+				edit_session_flush();
+				const char *text = line_gap_text(&g);
+				if (text && strcmp(text, orig_content) != 0) {
+					LiveOp op = live_op_make(current_line, 1, orig_content, 1);
+					editor_commit_local(ed, &op);
+				}
+			}
             break;
         }
         else if(key == KEY_LEFT){
-            // 左移光標
-            if(cursor_pos > 0){
-                cursor_pos--;
-				live_broadcast_cursor(current_line, cursor_pos);
+            // 左移光標（整個 UTF-8 字元）
+            size_t n = line_gap_prev_len(&g);
+            if(n > 0){
+                line_gap_move(&g, g.gap - n);
+                cursor_col -= utf8_char_width((unsigned char)g.buf[g.gap_end]);
+                paint_col = cursor_col;
+				live_broadcast_cursor(ed, current_line, (int)g.gap);
             }
         }
         else if(key == KEY_RIGHT){
-            // 右移光標
-            if(cursor_pos < content_len){
-                cursor_pos++;
-				live_broadcast_cursor(current_line, cursor_pos);
+            // 右移光標：原本反白的字元改回一般顯示
+            size_t n = line_gap_next_len(&g);
+            if(n > 0){
+                paint_col = cursor_col;
+                line_gap_move(&g, g.gap + n);
+                pre = g.buf + g.gap - n;
+                pre_len = n;
+                cursor_col += utf8_char_width((unsigned char)*pre);
+				live_broadcast_cursor(ed, current_line, (int)g.gap);
             }
         }
         else if(key == 127 || key == '\b'){
-            // Backspace - 刪除光標前的字符
-            if(cursor_pos > 0){
-                // 將光標後的內容前移
-                for(int i = cursor_pos - 1; i < content_len; i++){
-                    line_content[i] = line_content[i + 1];
-                }
-                cursor_pos--;
-                content_len--;
-				live_broadcast_cursor(current_line, cursor_pos);
+            // Backspace - 刪除光標前的字元
+            size_t n = line_gap_prev_len(&g);
+            if(n > 0){
+                int w = utf8_char_width((unsigned char)g.buf[g.gap - n]);
+				if (stream) edit_session_erase(g.gap - n, n);
+                g.gap -= n;
+                cursor_col -= w;
+                line_cols -= w;
+                paint_col = cursor_col;
+				live_broadcast_cursor(ed, current_line, (int)g.gap);
             }
         }
         else if(key >= 32 && key <= 126){
             // 可打印字符 - 在光標位置插入
-            if(content_len < 510){
-                // 將光標後的內容後移
-                for(int i = content_len; i > cursor_pos; i--){
-                    line_content[i] = line_content[i - 1];
-                }
-                line_content[cursor_pos] = key;
-                cursor_pos++;
-                content_len++;
-				live_broadcast_cursor(current_line, cursor_pos);
+            if(line_gap_reserve(&g, 1)){
+				if (stream) edit_session_insert(g.gap, 1);
+                paint_col = cursor_col;
+                g.buf[g.gap++] = key;
+                pre = g.buf + g.gap - 1;
+                pre_len = 1;
+                cursor_col++;
+                line_cols++;
+				live_broadcast_cursor(ed, current_line, (int)g.gap);
             }
         }
+        
+		// 已到達的按鍵都處理完才送出，快速輸入時一個畫面只送一個操作
+		if (stream && !stdin_pending()) edit_session_flush();
+        if(paint_col < 0 || macro_replaying) continue;
+        // 編輯框折行（或終端機寬度變了）時整個重繪，否則只重畫游標之後
+        int columns = terminal_columns();
+        if(columns != drawn_columns || EDIT_BOX_INDENT + line_cols + 1 >= columns){
+            redraw = 1;
+        } else {
+            edit_line_repaint(&g, paint_col, pre, pre_len);
+        }
+    }
+	if (stream) memset(&edit_session, 0, sizeof(edit_session));
+    free(orig_content);
+    free(g.buf);
+}
+
+// ===== 背景自動保存 =====
+// 修改後先防抖，到期時 UI 執行緒只複製一份內容交給寫入執行緒；
+// 寫入執行緒寫到同目錄的暫存檔，再以 rename() 取代原檔，中途當機不會留下截斷的文件
+#define AUTOSAVE_DELAY_MS 500      // 最後一次修改後多久保存
+#define AUTOSAVE_MAX_DELAY_MS 5000 // 持續修改時最多延後多久
+// 日誌模式（--journal）：每筆修改附加到 <文件>.journal 並只 fsync 這筆紀錄，
+// 主文件只在日誌過長或退出時於背景整份重寫（壓實）；開啟時重播日誌
+#define JOURNAL_COMPACT_BYTES (16u << 20)  // 日誌超過此大小就壓實
+#define JOURNAL_COMPACT_RECORDS 8192       // 紀錄數上限（限制重播時間）
+#define JOURNAL_MAGIC "TEJ1"
+
+enum {
+	SAVE_FSYNC_NONE = 0,  // 只 rename，不等磁碟
+	SAVE_FSYNC_FILE = 1,  // rename 前 fsync 暫存檔（預設）
+	SAVE_FSYNC_FULL = 2   // 另外 fsync 所在目錄，確保 rename 本身落地
+};
+static int save_fsync_policy = SAVE_FSYNC_FILE;
+static int journal_mode = 0;
+
+typedef struct {
+	char *data;          // 待寫入的內容快照（NULL 表示沒有工作）
+	size_t len;
+	unsigned long gen;
+	int borrowed;        // data 直接指向編輯器緩衝區（退出時不必複製），寫完不釋放
+	char *jbuf;          // 待附加到日誌的紀錄
+	size_t jlen;
+	size_t jcap;
+	size_t jcut;         // 快照排入時 jbuf 的長度：在此之前的紀錄已包含在快照中
+	unsigned long jgen;  // jbuf 最後一筆紀錄對應的版本
+	int journal_fd;      // 日誌檔，開啟後只由寫入執行緒使用
+	int swap_sync;       // 要求把交換檔 msync 到磁碟
+	DirtyRanges *ranges; // 非 NULL 時 data 只串接了這些區段與尾段，就地 pwrite 回原檔；len 為新的總長度
+	struct stat disk;    // 最近一次保存後主文件的狀態（用來確認沒有被外部修改）
+	int disk_known;      // disk 是否代表上一個排入版本的內容
+} SaveJob;
+
+static SaveJob save_jobs[2];
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t save_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t save_thread;
+static int save_thread_started = 0;
+static int save_quit = 0;
+
+// 寫到暫存檔後 rename 取代目標；成功回傳 0，否則回傳 errno
+static int save_write_file(const char *filename, const char *data, size_t len) {
+	// 目標是符號連結時取代它指向的文件，而不是連結本身
+	char *resolved = realpath(filename, NULL);
+	const char *target = resolved ? resolved : filename;
+	size_t tlen = strlen(target);
+	char *tmp = (char *)malloc(tlen + 8);
+	if (!tmp) {
+		free(resolved);
+		return ENOMEM;
+	}
+	memcpy(tmp, target, tlen);
+	memcpy(tmp + tlen, ".XXXXXX", 8);
+	int err = 0;
+	int fd = mkstemp(tmp);
+	if (fd < 0) {
+		err = errno;
+		free(tmp);
+		free(resolved);
+		return err;
+	}
+	struct stat st;
+	if (stat(target, &st) == 0) {
+		fchmod(fd, st.st_mode & 07777);
+	} else {
+		fchmod(fd, 0644);
+	}
+	size_t off = 0;
+	while (off < len && !err) {
+		ssize_t n = write(fd, data + off, len - off);
+		if (n < 0) {
+			if (errno != EINTR) err = errno;
+		} else {
+			off += (size_t)n;
+		}
+	}
+	if (!err && save_fsync_policy != SAVE_FSYNC_NONE && fsync(fd) != 0) err = errno;
+	if (close(fd) != 0 && !err) err = errno;
+	if (!err && rename(tmp, target) != 0) err = errno;
+	if (err) {
+		unlink(tmp);
+	} else if (save_fsync_policy == SAVE_FSYNC_FULL) {
+		char *slash = strrchr(tmp, '/');
+		if (slash == tmp) slash[1] = '\0';
+		else if (slash) *slash = '\0';
+		int dfd = open(slash ? tmp : ".", O_RDONLY | O_DIRECTORY);
+		if (dfd >= 0) {
+			if (fsync(dfd) != 0) err = errno;
+			close(dfd);
+		}
+	}
+	free(tmp);
+	free(resolved);
+	return err;
+}
+
+static int save_pwrite(int fd, const char *data, size_t len, size_t off) {
+	while (len > 0) {
+		ssize_t n = pwrite(fd, data, len, (off_t)off);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return errno;
+		}
+		data += n;
+		len -= (size_t)n;
+		off += (size_t)n;
+	}
+	return 0;
+}
+
+// 就地寫回：依序 pwrite 各修改區段，長度改變時從 tail 起寫到結尾並截斷；回傳 errno
+// data 依相同順序串接了這些內容，new_len 為新的總長度
+static int save_write_ranges(const char *filename, const DirtyRanges *r, const char *data, size_t new_len) {
+	int fd = open(filename, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) return errno;
+	int err = 0;
+	size_t src = 0;
+	for (int i = 0; i < r->count && !err; i++) {
+		size_t n = r->end[i] - r->start[i];
+		err = save_pwrite(fd, data + src, n, r->start[i]);
+		src += n;
+	}
+	if (!err && r->has_tail) {
+		err = save_pwrite(fd, data + src, new_len - r->tail, r->tail);
+		if (!err && ftruncate(fd, (off_t)new_len) != 0) err = errno;
+	}
+	if (!err && save_fsync_policy != SAVE_FSYNC_NONE && fdatasync(fd) != 0) err = errno;
+	if (close(fd) != 0 && !err) err = errno;
+	return err;
+}
+
+// 記錄一筆修改的範圍：長度不變的修改合併進區段，改變長度的修改讓其後全部成為尾段
+static void dirty_mark(DirtyRanges *d, size_t off, size_t del, size_t ins) {
+	if (d->full) return;
+	if (del != ins) {
+		if (!d->has_tail || off < d->tail) {
+			d->has_tail = 1;
+			d->tail = off;
+		}
+		while (d->count > 0 && d->start[d->count - 1] >= d->tail) d->count--;
+		if (d->count > 0 && d->end[d->count - 1] > d->tail) d->end[d->count - 1] = d->tail;
+		return;
+	}
+	size_t s = off, e = off + ins;
+	if (d->has_tail) {
+		if (s >= d->tail) return;
+		if (e > d->tail) e = d->tail;
+	}
+	if (s == e) return;
+	// 與重疊或相鄰的區段合併
+	int i = 0;
+	while (i < d->count && d->end[i] < s) i++;
+	int j = i;
+	while (j < d->count && d->start[j] <= e) {
+		if (d->start[j] < s) s = d->start[j];
+		if (d->end[j] > e) e = d->end[j];
+		j++;
+	}
+	if (j == i) {
+		if (d->count == DIRTY_RANGES_MAX) {
+			d->full = 1;
+			return;
+		}
+		memmove(d->start + i + 1, d->start + i, (size_t)(d->count - i) * sizeof(size_t));
+		memmove(d->end + i + 1, d->end + i, (size_t)(d->count - i) * sizeof(size_t));
+		d->count++;
+	} else if (j > i + 1) {
+		memmove(d->start + i + 1, d->start + j, (size_t)(d->count - j) * sizeof(size_t));
+		memmove(d->end + i + 1, d->end + j, (size_t)(d->count - j) * sizeof(size_t));
+		d->count -= j - i - 1;
+	}
+	d->start[i] = s;
+	d->end[i] = e;
+}
+
+// CRC-32（IEEE），只在 UI 執行緒使用
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+	static uint32_t table[256];
+	static int ready = 0;
+	if (!ready) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		ready = 1;
+	}
+	const uint8_t *p = (const uint8_t *)data;
+	crc = ~crc;
+	for (size_t i = 0; i < len; i++) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+// 日誌標頭記錄它所接續的主文件（inode、大小、修改時間）；主文件被壓實或外部修改後舊日誌自動作廢
+static int journal_header(char *buf, size_t cap, const struct stat *st) {
+	return snprintf(buf, cap, "%s %llu %lld %lld.%09ld\n", JOURNAL_MAGIC, (unsigned long long)st->st_ino,
+	                (long long)st->st_size, (long long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec);
+}
+
+static int journal_write(int fd, const char *data, size_t len) {
+	size_t off = 0;
+	while (off < len) {
+		ssize_t n = write(fd, data + off, len - off);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return errno;
+		}
+		off += (size_t)n;
+	}
+	if (save_fsync_policy != SAVE_FSYNC_NONE && fdatasync(fd) != 0) return errno;
+	return 0;
+}
+
+// 主文件壓實後清空日誌，標頭改指向新的主文件
+static int journal_reset(int idx) {
+	struct stat st;
+	char hdr[128];
+	if (stat(editors[idx].filename, &st) != 0) return errno;
+	int hl = journal_header(hdr, sizeof(hdr), &st);
+	int fd = save_jobs[idx].journal_fd;
+	if (ftruncate(fd, 0) != 0) return errno;
+	return journal_write(fd, hdr, (size_t)hl);
+}
+
+static void *save_thread_func(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&save_lock);
+	while (1) {
+		int idx = -1;
+		for (int i = 0; i < num_editors; i++) {
+			if (save_jobs[i].data || save_jobs[i].jlen || save_jobs[i].swap_sync) {
+				idx = i;
+				break;
+			}
+		}
+		if (idx < 0) {
+			if (save_quit) break;
+			pthread_cond_wait(&save_cond, &save_lock);
+			continue;
+		}
+		SaveJob job = save_jobs[idx];
+		save_jobs[idx].data = NULL;
+		save_jobs[idx].ranges = NULL;
+		save_jobs[idx].jbuf = NULL;
+		save_jobs[idx].jlen = 0;
+		save_jobs[idx].jcap = 0;
+		save_jobs[idx].swap_sync = 0;
+		pthread_mutex_unlock(&save_lock);
+		EditorState *ed = &editors[idx];
+		if (job.swap_sync) swap_msync(idx);
+		int err = 0;
+		size_t jfrom = 0;
+		unsigned long long written = 0;
+		if (job.data) {
+			size_t bytes = job.len;
+			if (job.ranges) {
+				// 區段是相對於上一個版本；上一次保存失敗時磁碟內容不明，不能就地修改
+				pthread_mutex_lock(&save_lock);
+				int known = save_jobs[idx].disk_known;
+				pthread_mutex_unlock(&save_lock);
+				bytes = 0;
+				for (int i = 0; i < job.ranges->count; i++) bytes += job.ranges->end[i] - job.ranges->start[i];
+				if (job.ranges->has_tail) bytes += job.len - job.ranges->tail;
+				err = known ? save_write_ranges(ed->filename, job.ranges, job.data, job.len) : ESTALE;
+				free(job.ranges);
+			} else {
+				err = save_write_file(ed->filename, job.data, job.len);
+			}
+			if (!job.borrowed) free(job.data);
+			if (!err && ed->journal) err = journal_reset(idx);
+			struct stat st;
+			int known = (!err && stat(ed->filename, &st) == 0);
+			pthread_mutex_lock(&save_lock);
+			save_jobs[idx].disk_known = known;
+			if (known) save_jobs[idx].disk = st;
+			pthread_mutex_unlock(&save_lock);
+			if (!err) {
+				written += bytes;
+				__atomic_store_n(&ed->saved_gen, job.gen, __ATOMIC_RELEASE);
+				// 快照之前的紀錄已在主文件中；壓實失敗時仍照常寫入日誌
+				jfrom = job.jcut;
+			}
+		}
+		if (job.jlen > jfrom) {
+			int jerr = journal_write(job.journal_fd, job.jbuf + jfrom, job.jlen - jfrom);
+			if (jerr) err = jerr;
+			else written += job.jlen - jfrom;
+			if (!err) __atomic_store_n(&ed->saved_gen, job.jgen, __ATOMIC_RELEASE);
+		}
+		free(job.jbuf);
+		if (written > 0) {
+			__atomic_store_n(&ed->save_last_bytes, written, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&ed->save_total_bytes, written, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&ed->save_errno, err, __ATOMIC_RELAXED);
+		ui_wake();
+		pthread_mutex_lock(&save_lock);
+	}
+	pthread_mutex_unlock(&save_lock);
+	return NULL;
+}
+
+static int save_thread_ensure(void) {
+	if (!save_thread_started) {
+		if (pthread_create(&save_thread, NULL, save_thread_func, NULL) != 0) return 0;
+		save_thread_started = 1;
+	}
+	return 1;
+}
+
+// 紀錄格式為 "E 位移 刪除長度 插入長度 CRC\n" 後接插入內容，CRC 涵蓋數字與內容；回傳標頭長度
+// 日誌與交換檔共用這個格式
+static int journal_encode(char *hdr, size_t cap, size_t off, size_t del, const char *ins, size_t ins_len) {
+	int hl = snprintf(hdr, cap, "E %zu %zu %zu ", off, del, ins_len);
+	uint32_t crc = crc32_update(crc32_update(0, hdr, (size_t)hl), ins, ins_len);
+	return hl + snprintf(hdr + hl, cap - (size_t)hl, "%08x\n", (unsigned)crc);
+}
+
+// 日誌模式：把一筆位元組層級的修改（與 editor_splice 參數相同）交給寫入執行緒附加
+static void journal_record(EditorState *ed, size_t off, size_t del, const char *ins, size_t ins_len) {
+	if (!ed->journal || ed->journal_stale) return;
+	char hdr[96];
+	int hl = journal_encode(hdr, sizeof(hdr), off, del, ins, ins_len);
+	SaveJob *j = &save_jobs[ed - editors];
+	if (!save_thread_ensure()) {
+		// 無法建立寫入執行緒：改由下一次整份保存處理
+		ed->journal_stale = 1;
+		return;
+	}
+	pthread_mutex_lock(&save_lock);
+	size_t need = j->jlen + (size_t)hl + ins_len;
+	if (need > j->jcap) {
+		size_t cap = j->jcap ? j->jcap : 4096;
+		while (cap < need) cap *= 2;
+		char *nb = (char *)realloc(j->jbuf, cap);
+		if (!nb) {
+			pthread_mutex_unlock(&save_lock);
+			ed->journal_stale = 1;
+			return;
+		}
+		j->jbuf = nb;
+		j->jcap = cap;
+	}
+	memcpy(j->jbuf + j->jlen, hdr, (size_t)hl);
+	if (ins_len > 0) memcpy(j->jbuf + j->jlen + hl, ins, ins_len);
+	j->jlen = need;
+	j->jgen = ed->edit_gen;
+	pthread_cond_signal(&save_cond);
+	pthread_mutex_unlock(&save_lock);
+	ed->queued_gen = ed->edit_gen;
+	ed->journal_bytes += (size_t)hl + ins_len;
+	ed->journal_records++;
+}
+
+// 重播用的片段表：每筆紀錄只切分片段，全部套用後才一次組出新內容
+typedef struct {
+	const char *p;
+	size_t len;
+} JournalPiece;
+
+typedef struct {
+	JournalPiece *v;
+	size_t n;
+	size_t cap;
+} JournalPieces;
+
+static int journal_pieces_insert(JournalPieces *ps, size_t at, JournalPiece piece) {
+	if (ps->n == ps->cap) {
+		size_t cap = ps->cap ? ps->cap * 2 : 64;
+		JournalPiece *nv = (JournalPiece *)realloc(ps->v, cap * sizeof(JournalPiece));
+		if (!nv) return 0;
+		ps->v = nv;
+		ps->cap = cap;
+	}
+	memmove(ps->v + at + 1, ps->v + at, (ps->n - at) * sizeof(JournalPiece));
+	ps->v[at] = piece;
+	ps->n++;
+	return 1;
+}
+
+// 確保 pos 落在片段邊界，回傳從 pos 開始的片段索引（pos 在結尾時回傳 n）；失敗回傳 -1
+static long journal_pieces_split(JournalPieces *ps, size_t pos) {
+	size_t acc = 0;
+	for (size_t i = 0; i < ps->n; i++) {
+		if (pos == acc) return (long)i;
+		if (pos < acc + ps->v[i].len) {
+			size_t head = pos - acc;
+			JournalPiece tail = { ps->v[i].p + head, ps->v[i].len - head };
+			ps->v[i].len = head;
+			return journal_pieces_insert(ps, i + 1, tail) ? (long)(i + 1) : -1;
+		}
+		acc += ps->v[i].len;
+	}
+	return (long)ps->n;
+}
+
+// 以 base 為起點依序套用 data 中的紀錄，結果放進 ed（base 可以就是 ed 目前的內容）；
+// 回傳完整且校驗正確的紀錄總長度，遇到截斷或損毀的紀錄即停止
+static size_t journal_apply(EditorState *ed, const char *base, size_t base_len, const char *data, size_t n,
+                            int *records_out) {
+	JournalPieces ps = { NULL, 0, 0 };
+	size_t total = base_len;
+	*records_out = 0;
+	if (total > 0 && !journal_pieces_insert(&ps, 0, (JournalPiece){ base, total })) return 0;
+	size_t pos = 0;
+	int records = 0;
+	while (pos < n) {
+		const char *nl = memchr(data + pos, '\n', n - pos < 96 ? n - pos : 96);
+		if (!nl) break;
+		size_t off, del, len;
+		unsigned crc;
+		int prefix = 0;
+		char line[96];
+		memcpy(line, data + pos, (size_t)(nl - (data + pos)));
+		line[nl - (data + pos)] = '\0';
+		if (sscanf(line, "E %zu %zu %zu %n%x", &off, &del, &len, &prefix, &crc) != 4) break;
+		const char *payload = nl + 1;
+		if (len > n - (size_t)(payload - data)) break;
+		if (crc32_update(crc32_update(0, line, (size_t)prefix), payload, len) != crc) break;
+		if (off > total || del > total - off) break;
+		long a = journal_pieces_split(&ps, off);
+		long b = (a < 0) ? -1 : journal_pieces_split(&ps, off + del);
+		if (b < 0) break;
+		memmove(ps.v + a, ps.v + b, (ps.n - (size_t)b) * sizeof(JournalPiece));
+		ps.n -= (size_t)(b - a);
+		if (len > 0 && !journal_pieces_insert(&ps, (size_t)a, (JournalPiece){ payload, len })) break;
+		total = total - del + len;
+		pos = (size_t)(payload - data) + len;
+		records++;
+	}
+	if (records > 0 || base != ed->buffer) {
+		char *nb = (char *)malloc(total + 1);
+		if (!nb) {
+			free(ps.v);
+			return 0;
+		}
+		size_t w = 0;
+		for (size_t i = 0; i < ps.n; i++) {
+			memcpy(nb + w, ps.v[i].p, ps.v[i].len);
+			w += ps.v[i].len;
+		}
+		nb[total] = '\0';
+		free(ed->buffer);
+		ed->buffer = nb;
+		ed->length = total;
+		ed->capacity = total + 1;
+	}
+	free(ps.v);
+	*records_out = records;
+	return pos;
+}
+
+// 把日誌內容重播到 ed；回傳日誌中完整且校驗正確的長度（標頭不符回傳 0）
+static size_t journal_replay(EditorState *ed, const struct stat *st, const char *data, size_t n) {
+	char expect[128];
+	int el = journal_header(expect, sizeof(expect), st);
+	if (n < (size_t)el || memcmp(data, expect, (size_t)el) != 0) return 0;
+	int records = 0;
+	size_t used = journal_apply(ed, ed->buffer, ed->length, data + el, n - (size_t)el, &records);
+	ed->journal_bytes = used;
+	ed->journal_records = records;
+	return (size_t)el + used;
+}
+
+// 開啟 <文件>.journal，若它接續目前的主文件就重播；失敗回傳 0
+static int journal_open(int idx) {
+	EditorState *ed = &editors[idx];
+	char path[300];
+	snprintf(path, sizeof(path), "%s.journal", ed->filename);
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) return 0;
+	struct stat st, jst;
+	if (stat(ed->filename, &st) != 0 || fstat(fd, &jst) != 0) {
+		close(fd);
+		return 0;
+	}
+	size_t valid = 0;
+	size_t jsize = (size_t)jst.st_size;
+	if (jsize > 0) {
+		char *jdata = (char *)malloc(jsize);
+		if (jdata) {
+			size_t got = 0;
+			while (got < jsize) {
+				ssize_t r = pread(fd, jdata + got, jsize - got, (off_t)got);
+				if (r <= 0) break;
+				got += (size_t)r;
+			}
+			valid = journal_replay(ed, &st, jdata, got);
+			free(jdata);
+		}
+	}
+	int err = 0;
+	if (valid == 0) {
+		// 沒有日誌，或日誌屬於舊的主文件：重寫標頭
+		char hdr[128];
+		int hl = journal_header(hdr, sizeof(hdr), &st);
+		if (ftruncate(fd, 0) != 0) err = errno;
+		if (!err) err = journal_write(fd, hdr, (size_t)hl);
+	} else if (valid < jsize) {
+		// 截掉最後寫到一半或校驗失敗的紀錄
+		if (ftruncate(fd, (off_t)valid) != 0) err = errno;
+	}
+	if (err) {
+		close(fd);
+		errno = err;
+		return 0;
+	}
+	ed->total_lines = count_lines(ed->buffer);
+	editor_detect_final_nl(ed);
+	save_jobs[idx].journal_fd = fd;
+	ed->journal = 1;
+	return 1;
+}
+
+// ===== 交換檔（當機復原） =====
+// <文件>.swp 以 mmap 對應：第一頁是標頭，接著是整份內容的快照，最後是快照之後的修改紀錄（與日誌同格式）。
+// 每筆修改只是一次 memcpy 附加到紀錄區；紀錄區滿了才重寫快照。寫入執行緒在自動保存時順便 msync，
+// 程序被殺（斷線、OOM）時內容已在分頁快取中，正常退出且保存成功後刪除
+#define SWAP_MAGIC "TESWAP1"
+#define SWAP_HEADER 4096
+#define SWAP_TAIL_MAX (4u << 20)
+#define SWAP_SNAP_INVALID UINT64_MAX  // 快照重寫中
+
+typedef struct {
+	char magic[8];
+	int32_t pid;
+	int32_t live_mode;      // 上次的 Live Share 角色（復原時提示）
+	int32_t live_version;   // 最後一筆修改記錄時該文件的共享版本
+	int32_t records;        // 紀錄區的紀錄數
+	uint64_t snap_len;      // 快照長度
+	uint64_t snap_cap;      // 快照區大小（紀錄區緊接在後）
+	uint64_t tail_len;      // 紀錄區已使用的長度
+	char live_peer[128];    // 加入者連線的主機
+} SwapHeader;
+
+typedef struct {
+	int fd;
+	SwapHeader *map;        // NULL 表示這個文件沒有交換檔
+	size_t map_len;
+	int dirty;              // 上次 msync 之後有新內容
+	char path[300];
+} SwapFile;
+
+static SwapFile swaps[2];
+static pthread_mutex_t swap_lock = PTHREAD_MUTEX_INITIALIZER;  // 保護重新對應與寫入執行緒的 msync
+static int swap_disabled = 0;  // --noswap
+static char swap_recovered_note[2][512];  // 復原結果，顯示在開始畫面
+
+static void swap_path(int idx, char *buf, size_t cap) {
+	snprintf(buf, cap, "%s.swp", editors[idx].filename);
+}
+
+// 寫入執行緒：把交換檔落地（快照重寫時 UI 會在 swap_lock 下重新對應）
+static void swap_msync(int idx) {
+	pthread_mutex_lock(&swap_lock);
+	if (swaps[idx].map) msync(swaps[idx].map, swaps[idx].map_len, MS_SYNC);
+	pthread_mutex_unlock(&swap_lock);
+}
+
+// 重寫快照並清空紀錄區；空間不足時先放大檔案並重新對應
+static void swap_snapshot(int idx) {
+	SwapFile *sw = &swaps[idx];
+	EditorState *ed = &editors[idx];
+	if (sw->fd <= 0) return;
+	long page = sysconf(_SC_PAGESIZE);
+	size_t cap = ed->length + ed->length / 4 + 65536;
+	cap = (cap + (size_t)page - 1) / (size_t)page * (size_t)page;
+	if (!sw->map || ed->length > sw->map->snap_cap) {
+		size_t len = SWAP_HEADER + cap + SWAP_TAIL_MAX;
+		pthread_mutex_lock(&swap_lock);
+		if (sw->map) munmap(sw->map, sw->map_len);
+		sw->map = NULL;
+		if (ftruncate(sw->fd, (off_t)len) == 0) {
+			void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, sw->fd, 0);
+			if (m != MAP_FAILED) {
+				sw->map = (SwapHeader *)m;
+				sw->map_len = len;
+			}
+		}
+		pthread_mutex_unlock(&swap_lock);
+		if (!sw->map) return;
+		sw->map->snap_cap = cap;
+	}
+	SwapHeader *h = sw->map;
+	memcpy(h->magic, SWAP_MAGIC, sizeof(h->magic));
+	h->pid = (int32_t)getpid();
+	// 先標記失效：複製途中被殺時不會被誤認為完整快照
+	__atomic_store_n(&h->snap_len, SWAP_SNAP_INVALID, __ATOMIC_RELEASE);
+	memcpy((char *)h + SWAP_HEADER, ed->buffer, ed->length);
+	h->tail_len = 0;
+	h->records = 0;
+	__atomic_store_n(&h->snap_len, (uint64_t)ed->length, __ATOMIC_RELEASE);
+	sw->dirty = 1;
+}
+
+// 把一筆修改附加到交換檔的紀錄區
+static void swap_record(EditorState *ed, size_t off, size_t del, const char *ins, size_t ins_len) {
+	int idx = (int)(ed - editors);
+	SwapFile *sw = &swaps[idx];
+	if (!sw->map || live_docs[idx].sync.active) return;
+	SwapHeader *h = sw->map;
+	char hdr[96];
+	int hl = journal_encode(hdr, sizeof(hdr), off, del, ins, ins_len);
+	if (h->tail_len + (size_t)hl + ins_len > SWAP_TAIL_MAX) {
+		// 紀錄區已滿：緩衝區已包含這筆修改，直接重寫快照
+		swap_snapshot(idx);
+		return;
+	}
+	char *tail = (char *)h + SWAP_HEADER + h->snap_cap + h->tail_len;
+	memcpy(tail, hdr, (size_t)hl);
+	if (ins_len > 0) memcpy(tail + hl, ins, ins_len);
+	__atomic_store_n(&h->tail_len, h->tail_len + (size_t)hl + ins_len, __ATOMIC_RELEASE);
+	h->records++;
+	h->live_mode = live_mode;
+	h->live_version = live_docs[idx].version;
+	if (live_mode == LIVE_JOIN && h->live_peer[0] == '\0') {
+		if (live_shm_name[0]) snprintf(h->live_peer, sizeof(h->live_peer), "shm:%s", live_shm_name);
+		else snprintf(h->live_peer, sizeof(h->live_peer), "%s:%d", live_join_host, live_join_port);
+	}
+	sw->dirty = 1;
+}
+
+// 請寫入執行緒在背景 msync
+static void swap_request_sync(int idx) {
+	if (!swaps[idx].map || !swaps[idx].dirty) return;
+	swaps[idx].dirty = 0;
+	if (!save_thread_ensure()) return;
+	pthread_mutex_lock(&save_lock);
+	save_jobs[idx].swap_sync = 1;
+	pthread_cond_signal(&save_cond);
+	pthread_mutex_unlock(&save_lock);
+}
+
+// 為文件建立交換檔並寫入第一份快照；失敗時只是不使用交換檔
+static void swap_open(int idx) {
+	SwapFile *sw = &swaps[idx];
+	swap_path(idx, sw->path, sizeof(sw->path));
+	sw->fd = open(sw->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (sw->fd < 0) {
+		sw->fd = 0;
+		return;
+	}
+	swap_snapshot(idx);
+	if (!sw->map) {
+		close(sw->fd);
+		sw->fd = 0;
+		unlink(sw->path);
+	}
+}
+
+// 關閉交換檔；remove 為 1 時（內容已安全保存）一併刪除
+static void swap_close(int idx, int remove) {
+	SwapFile *sw = &swaps[idx];
+	if (sw->fd <= 0) return;
+	pthread_mutex_lock(&swap_lock);
+	if (sw->map) munmap(sw->map, sw->map_len);
+	sw->map = NULL;
+	pthread_mutex_unlock(&swap_lock);
+	close(sw->fd);
+	sw->fd = 0;
+	if (remove) unlink(sw->path);
+}
+
+// 啟動時檢查上次留下的交換檔並詢問是否復原；回傳 0 表示使用者選擇退出，
+// 2 表示交換檔屬於仍在執行的編輯器（不碰它，這個文件改為不使用交換檔）
+static int swap_recover(int idx) {
+	EditorState *ed = &editors[idx];
+	char path[300];
+	swap_path(idx, path, sizeof(path));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 1;
+	struct stat st;
+	SwapHeader *h = NULL;
+	if (fstat(fd, &st) == 0 && st.st_size >= SWAP_HEADER) {
+		void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+		if (m != MAP_FAILED) h = (SwapHeader *)m;
+	}
+	close(fd);
+	if (!h) return 1;
+	int ret = 1;
+	size_t size = (size_t)st.st_size;
+	int valid = memcmp(h->magic, SWAP_MAGIC, sizeof(h->magic)) == 0 && h->snap_len != SWAP_SNAP_INVALID &&
+	            h->snap_len <= h->snap_cap && h->snap_cap <= size - SWAP_HEADER &&
+	            h->tail_len <= size - SWAP_HEADER - h->snap_cap;
+	if (valid && h->pid != (int32_t)getpid() && (kill(h->pid, 0) == 0 || errno == EPERM)) {
+		printf("%s 正由另一個編輯器（pid %d）編輯，這次不使用交換檔\n", ed->filename, (int)h->pid);
+		ret = 2;
+	} else if (!valid) {
+		printf("交換檔 %s 不完整，已忽略\n", path);
+	} else {
+		printf("發現交換檔 %s：上次的編輯器（pid %d）沒有正常結束\n", path, (int)h->pid);
+		printf("  快照 %llu 位元組，之後 %d 筆修改", (unsigned long long)h->snap_len, (int)h->records);
+		if (h->live_mode == LIVE_HOST) {
+			printf("；當時是 Live Share 主機（文件版本 %d 之後）", (int)h->live_version);
+		} else if (h->live_mode == LIVE_JOIN) {
+			printf("；當時以 Live Share 加入 %.*s（文件版本 %d 之後，重新加入後以主機內容為準）",
+			       (int)sizeof(h->live_peer), h->live_peer, (int)h->live_version);
+		}
+		printf("\n[r] 復原  [d] 捨棄交換檔  [q] 退出：");
+		fflush(stdout);
+		char answer[16] = {0};
+		if (!fgets(answer, sizeof(answer), stdin)) answer[0] = 'q';
+		if (answer[0] == 'r' || answer[0] == 'R') {
+			double t0 = now_ms();
+			// 以快照為基底重播紀錄，只組出一次新內容；日誌與修改區段都無法表示整份取代，標記之後整份重寫
+			ed->journal_stale = 1;
+			ed->dirty.full = 1;
+			int records = 0;
+			size_t used = journal_apply(ed, (const char *)h + SWAP_HEADER, (size_t)h->snap_len,
+			                            (const char *)h + SWAP_HEADER + h->snap_cap, (size_t)h->tail_len, &records);
+			ed->edit_gen++;
+			save_editor(ed);
+			editor_recount_and_clamp(ed);
+			editor_detect_final_nl(ed);
+			snprintf(swap_recovered_note[idx], sizeof(swap_recovered_note[idx]),
+			         "已從交換檔復原 %s：%zu 位元組，套用 %d 筆修改%s，耗時 %.1f ms", ed->filename, ed->length, records,
+			         (used < h->tail_len) ? "（最後一筆不完整已略過）" : "", now_ms() - t0);
+		} else if (answer[0] != 'd' && answer[0] != 'D') {
+			ret = 0;
+		}
+	}
+	munmap(h, size);
+	return ret;
+}
+
+// 主文件仍是上一個排入版本的內容：寫入執行緒沒有未取走的工作、上次保存成功，而且沒有被外部修改
+static int save_disk_unchanged(int idx) {
+	SaveJob *j = &save_jobs[idx];
+	pthread_mutex_lock(&save_lock);
+	int known = j->disk_known && !j->data;
+	struct stat disk = j->disk;
+	pthread_mutex_unlock(&save_lock);
+	struct stat st;
+	if (!known || stat(editors[idx].filename, &st) != 0) return 0;
+	return st.st_ino == disk.st_ino && st.st_size == disk.st_size && st.st_mtim.tv_sec == disk.st_mtim.tv_sec &&
+	       st.st_mtim.tv_nsec == disk.st_mtim.tv_nsec;
+}
+
+// 把目前內容交給寫入執行緒；尚未寫出的舊快照直接被取代
+// final 表示即將退出：直接借用編輯器緩衝區，不必複製
+static void save_queue(int idx, int final) {
+	EditorState *ed = &editors[idx];
+	ed->save_due = 0;
+	ed->dirty_since = 0;
+	int failed = __atomic_load_n(&ed->save_errno, __ATOMIC_RELAXED);
+	if (ed->journal) {
+		// 修改已逐筆寫入日誌；只有日誌無法表示、過長、退出或寫入失敗時才壓實
+		int compact = ed->journal_stale || failed || ed->journal_bytes >= JOURNAL_COMPACT_BYTES ||
+		              ed->journal_records >= JOURNAL_COMPACT_RECORDS || (final && ed->journal_bytes > 0);
+		if (!compact) return;
+	} else if (ed->queued_gen == ed->edit_gen && !failed) {
+		// 已排入且沒有失敗過就不必再寫；上次失敗則重試
+		return;
+	}
+	// 只改了少數範圍時就地寫回，只複製修改過的內容；中途當機由交換檔復原，所以沒有交換檔時一律整份取代
+	DirtyRanges *ranges = NULL;
+	if (!ed->journal && !ed->dirty.full && !failed && swaps[idx].map && save_disk_unchanged(idx)) {
+		ranges = (DirtyRanges *)malloc(sizeof(DirtyRanges));
+		if (ranges) *ranges = ed->dirty;
+	}
+	char *copy = ed->buffer;
+	if (ranges) {
+		size_t bytes = 0;
+		for (int i = 0; i < ranges->count; i++) bytes += ranges->end[i] - ranges->start[i];
+		if (ranges->has_tail) bytes += ed->length - ranges->tail;
+		copy = (char *)malloc(bytes ? bytes : 1);
+		if (copy) {
+			size_t w = 0;
+			for (int i = 0; i < ranges->count; i++) {
+				memcpy(copy + w, ed->buffer + ranges->start[i], ranges->end[i] - ranges->start[i]);
+				w += ranges->end[i] - ranges->start[i];
+			}
+			if (ranges->has_tail) memcpy(copy + w, ed->buffer + ranges->tail, ed->length - ranges->tail);
+		}
+	} else if (!final) {
+		copy = (char *)malloc(ed->length ? ed->length : 1);
+		if (copy) memcpy(copy, ed->buffer, ed->length);
+	}
+	if (!copy) {
+		free(ranges);
+		__atomic_store_n(&ed->save_errno, ENOMEM, __ATOMIC_RELAXED);
+		return;
+	}
+	memset(&ed->dirty, 0, sizeof(ed->dirty));
+	ed->queued_gen = ed->edit_gen;
+	ed->journal_stale = 0;
+	ed->journal_bytes = 0;
+	ed->journal_records = 0;
+	if (!save_thread_ensure()) {
+		// 無法建立執行緒時退回同步寫入（沒有執行緒也就沒有待處理的工作，區段一定是相對於磁碟內容）
+		int err = ranges ? save_write_ranges(ed->filename, ranges, copy, ed->length)
+		                 : save_write_file(ed->filename, copy, ed->length);
+		if (ranges || !final) free(copy);
+		free(ranges);
+		if (!err && ed->journal) err = journal_reset(idx);
+		ed->save_errno = err;
+		if (!err) ed->saved_gen = ed->queued_gen;
+		return;
+	}
+	pthread_mutex_lock(&save_lock);
+	SaveJob *j = &save_jobs[idx];
+	if (j->data && !j->borrowed) free(j->data);
+	free(j->ranges);
+	j->data = copy;
+	j->len = ed->length;
+	j->gen = ed->queued_gen;
+	j->borrowed = final && !ranges;
+	j->ranges = ranges;
+	j->jcut = j->jlen;
+	pthread_cond_signal(&save_cond);
+	pthread_mutex_unlock(&save_lock);
+}
+
+// 分塊快照接收中的文件內容不完整，等同步結束再保存
+static int save_blocked(int idx) {
+	return live_docs[idx].sync.active;
+}
+
+// 距離最近一次保存到期還有幾毫秒；沒有排程回傳 -1（給 poll 當逾時）
+static int autosave_timeout_ms(void) {
+	double now = now_ms();
+	int best = -1;
+	for (int i = 0; i < num_editors; i++) {
+		if (editors[i].save_due == 0 || save_blocked(i)) continue;
+		double left = editors[i].save_due - now;
+		int ms = (left <= 0) ? 0 : (int)left + 1;
+		if (best < 0 || ms < best) best = ms;
+	}
+	return best;
+}
+
+// 到期的文件排入背景保存；有排入時回傳 1（狀態列需要重繪）
+static int autosave_tick(void) {
+	double now = now_ms();
+	int queued = 0;
+	for (int i = 0; i < num_editors; i++) {
+		if (editors[i].save_due == 0 || editors[i].save_due > now || save_blocked(i)) continue;
+		save_queue(i, 0);
+		swap_request_sync(i);
+		queued = 1;
+	}
+	return queued;
+}
+
+// 退出前：保存所有未寫出的修改並等待寫入執行緒結束；全部成功回傳 1
+static int autosave_finish(void) {
+	for (int i = 0; i < num_editors; i++) {
+		save_queue(i, 1);
+	}
+	if (save_thread_started) {
+		pthread_mutex_lock(&save_lock);
+		save_quit = 1;
+		pthread_cond_signal(&save_cond);
+		pthread_mutex_unlock(&save_lock);
+		pthread_join(save_thread, NULL);
+		save_thread_started = 0;
+	}
+	int ok = 1;
+	for (int i = 0; i < num_editors; i++) {
+		if (editors[i].save_errno) {
+			printf("保存失敗: %s (%s)\n", editors[i].filename, strerror(editors[i].save_errno));
+			ok = 0;
+		}
+	}
+	return ok;
+}
+
+// 狀態列上的保存狀態
+static void print_save_status(const EditorState *ed) {
+	unsigned long saved = __atomic_load_n(&ed->saved_gen, __ATOMIC_ACQUIRE);
+	int err = __atomic_load_n(&ed->save_errno, __ATOMIC_RELAXED);
+	if (err) {
+		printf("  [保存失敗: %s]", strerror(err));
+	} else if (saved == ed->edit_gen) {
+		unsigned long long last = __atomic_load_n(&ed->save_last_bytes, __ATOMIC_RELAXED);
+		if (last == 0) printf("  [已保存]");
+		else if (last < 10240) printf("  [已保存，寫入 %llu B]", last);
+		else printf("  [已保存，寫入 %llu KB]", last / 1024);
+	} else if (ed->queued_gen == ed->edit_gen) {
+		printf("  [保存中...]");
+	} else {
+		printf("  [未保存]");
+	}
+}
+
+// 排程保存：最後一次修改後 AUTOSAVE_DELAY_MS 由背景執行緒寫入
+void save_editor(EditorState *ed) {
+    if (macro_replaying) return;  // 重播結束提交時才排程
+    double now = now_ms();
+    if (ed->dirty_since == 0) {
+        ed->dirty_since = now;
     }
+    ed->save_due = now + AUTOSAVE_DELAY_MS;
+    if (ed->save_due > ed->dirty_since + AUTOSAVE_MAX_DELAY_MS) {
+        ed->save_due = ed->dirty_since + AUTOSAVE_MAX_DELAY_MS;
+    }
+}
+
+// ===== 追蹤模式（--follow，類似 tail -f）=====
+// inotify 放在 UI 的 poll 裡：文件變大時只讀新增的位元組接到內容後面，行數只數新增部分，
+// 游標在最後一行時跟著捲動。文件被截短時從頭重讀；被輪替（改名或刪除後重建）時重新開啟同名文件
+#define FOLLOW_PAINT_MS 50   // 追加內容時最多每隔這麼久重繪一次
+#define FOLLOW_CHUNK (1024 * 1024)
+
+typedef struct {
+	int active;
+	int fd;                  // 追蹤中的文件，-1 表示等待同名文件重新建立
+	int wd;                  // 文件本身的監看
+	int dir_wd;              // 所在目錄的監看（輪替後新建的同名文件）
+	char base[256];          // 不含目錄的文件名
+} FollowFile;
+
+static FollowFile follows[2];
+static int follow_pending = 0;     // 有新內容還沒重繪
+static double follow_painted = 0;
+
+// 把 buffer 尾端剛讀入的 n 個位元組納入內容：只數新增部分的換行，游標在最後一行時跟著捲動
+static void follow_extend(EditorState *ed, size_t n) {
+	int at_end = ed->current_line >= ed->total_lines;
+	// 原本最後一行沒有換行時，新內容接在那一行後面
+	int lines = ed->total_lines - ((ed->length > 0 && ed->buffer[ed->length - 1] != '\n') ? 1 : 0);
+	const char *p = ed->buffer + ed->length;
+	const char *end = p + n;
+	while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+		lines++;
+		p++;
+	}
+	ed->length += n;
+	ed->buffer[ed->length] = '\0';
+	ed->total_lines = lines + ((ed->length > 0 && ed->buffer[ed->length - 1] != '\n') ? 1 : 0);
+	if (at_end && ed->total_lines > 0) {
+		ed->current_line = ed->total_lines;
+		if (ed->current_line >= ed->row_offset + VISIBLE_LINES) ed->row_offset = ed->current_line - VISIBLE_LINES + 1;
+	}
+	follow_pending = 1;
+}
+
+// 讀入上次位置之後新增的內容；文件比已讀的短（被截短）時清空後從頭讀
+static void follow_read(int idx) {
+	EditorState *ed = &editors[idx];
+	FollowFile *f = &follows[idx];
+	struct stat st;
+	if (f->fd < 0 || fstat(f->fd, &st) != 0) return;
+	if ((size_t)st.st_size < ed->length) {
+		ed->length = 0;
+		ed->total_lines = 0;
+		ed->current_line = 1;
+		ed->row_offset = 1;
+		ed->view_line = 0;
+		ed->line_hint = 0;
+		ed->buffer[0] = '\0';
+		follow_pending = 1;
+	}
+	while (1) {
+		if (!editor_reserve(ed, ed->length + FOLLOW_CHUNK + 1)) return;
+		ssize_t n = pread(f->fd, ed->buffer + ed->length, FOLLOW_CHUNK, (off_t)ed->length);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return;
+		follow_extend(ed, (size_t)n);
+	}
+}
+
+// 開啟（或輪替後重新開啟）要追蹤的文件；還不存在時等目錄的建立事件
+static void follow_reopen(int idx) {
+	EditorState *ed = &editors[idx];
+	FollowFile *f = &follows[idx];
+	if (f->fd >= 0) {
+		// 舊文件改名前最後寫入的內容
+		follow_read(idx);
+		close(f->fd);
+		f->fd = -1;
+	}
+	if (f->wd >= 0) inotify_rm_watch(follow_inotify, f->wd);
+	f->wd = -1;
+	int fd = open(ed->filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+	f->fd = fd;
+	f->wd = inotify_add_watch(follow_inotify, ed->filename, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+	// 新文件從頭顯示
+	ed->length = 0;
+	ed->total_lines = 0;
+	ed->current_line = 1;
+	ed->row_offset = 1;
+	ed->view_line = 0;
+	ed->line_hint = 0;
+	ed->buffer[0] = '\0';
+	follow_pending = 1;
+	follow_read(idx);
+}
+
+// 內容載入完成後開始追蹤：游標移到最後一行，並補讀載入之後新增的內容
+static void follow_start(int idx) {
+	EditorState *ed = &editors[idx];
+	FollowFile *f = &follows[idx];
+	if (follow_inotify < 0 || f->active) return;
+	f->active = 1;
+	char dir[256];
+	const char *slash = strrchr(ed->filename, '/');
+	snprintf(f->base, sizeof(f->base), "%s", slash ? slash + 1 : ed->filename);
+	if (slash) snprintf(dir, sizeof(dir), "%.*s", (int)(slash - ed->filename) + (slash == ed->filename), ed->filename);
+	else snprintf(dir, sizeof(dir), ".");
+	f->dir_wd = inotify_add_watch(follow_inotify, dir, IN_CREATE | IN_MOVED_TO);
+	f->fd = open(ed->filename, O_RDONLY | O_CLOEXEC);
+	f->wd = (f->fd >= 0) ? inotify_add_watch(follow_inotify, ed->filename, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF) : -1;
+	ed->current_line = ed->total_lines > 0 ? ed->total_lines : 1;
+	ed->row_offset = (ed->current_line > VISIBLE_LINES) ? ed->current_line - VISIBLE_LINES + 1 : 1;
+	follow_read(idx);
+}
+
+// 處理 inotify 事件：輪替的文件重新開啟，其餘一律補讀新增內容（fstat 很便宜，不必分辨事件）
+static void follow_drain(void) {
+	uint64_t raw[512];   // 以 8 位元組對齊存放 inotify_event
+	ssize_t n;
+	while ((n = read(follow_inotify, raw, sizeof(raw))) > 0) {
+		for (char *p = (char *)raw; p < (char *)raw + n;) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			for (int i = 0; i < num_editors; i++) {
+				FollowFile *f = &follows[i];
+				if (!f->active) continue;
+				int gone = (ev->wd == f->wd && (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)));
+				int created = (ev->wd == f->dir_wd && ev->len > 0 && strcmp(ev->name, f->base) == 0);
+				if (gone || created) follow_reopen(i);
+			}
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	for (int i = 0; i < num_editors; i++) {
+		if (follows[i].active) follow_read(i);
+	}
+}
+
+// 有追加內容待重繪時，poll 最多等到下一次可以重繪
+static int follow_timeout_ms(int timeout) {
+	if (!follow_pending) return timeout;
+	double left = follow_painted + FOLLOW_PAINT_MS - now_ms();
+	int ms = (left <= 0) ? 0 : (int)left + 1;
+	return (timeout < 0 || ms < timeout) ? ms : timeout;
+}
+
+// 追加內容的重繪節流：到時間才回傳 1
+static int follow_paint_due(void) {
+	if (!follow_pending || now_ms() - follow_painted < FOLLOW_PAINT_MS) return 0;
+	follow_pending = 0;
+	follow_painted = now_ms();
+	return 1;
+}
+
+// ===== 背景載入 =====
+// 大文件只先讀開頭一段就畫出第一個畫面，完整內容與行數由背景執行緒讀入，讀完後由 UI 執行緒接手
+#define LOAD_PREFIX_BYTES (64 * 1024)   // 第一個畫面用的開頭內容
+#define LOAD_ASYNC_MIN (1024 * 1024)    // 小於此大小直接同步讀完
+#define LOAD_CHUNK (1024 * 1024)
+
+typedef struct {
+	pthread_t thread;
+	int started;               // 有背景執行緒（建立失敗時在呼叫端同步讀完）
+	int fd;
+	size_t size;               // 開檔時的大小（進度用）
+	char *buffer;              // 讀入的完整內容，接手前只有載入執行緒會碰
+	size_t length;
+	size_t capacity;
+	int total_lines;
+	int err;                   // 讀取失敗的 errno
+	size_t loaded;             // 已讀入的位元組（原子存取，標題列進度用）
+	int done;                  // 讀完（原子存取）
+	int open_swap;             // 接手後建立交換檔（快照需要完整內容）
+} EditorLoad;
+
+static EditorLoad editor_loads[2];
+
+// 從頭讀入整個文件並計算行數
+static void *editor_load_func(void *arg) {
+	EditorLoad *ld = (EditorLoad *)arg;
+	posix_fadvise(ld->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	ld->capacity = ld->size + LOAD_CHUNK + 1;
+	ld->buffer = (char *)malloc(ld->capacity);
+	if (!ld->buffer) ld->err = ENOMEM;
+	int step = 0;
+	while (!ld->err) {
+		if (ld->length + LOAD_CHUNK + 1 > ld->capacity) {
+			// 文件在開檔後變大
+			char *nb = (char *)realloc(ld->buffer, ld->capacity * 2);
+			if (!nb) {
+				ld->err = ENOMEM;
+				break;
+			}
+			ld->buffer = nb;
+			ld->capacity *= 2;
+		}
+		ssize_t n = pread(ld->fd, ld->buffer + ld->length, LOAD_CHUNK, (off_t)ld->length);
+		if (n < 0) {
+			if (errno != EINTR) ld->err = errno;
+			continue;
+		}
+		if (n == 0) break;
+		ld->length += (size_t)n;
+		__atomic_store_n(&ld->loaded, ld->length, __ATOMIC_RELAXED);
+		// 每多讀一成喚醒 UI 更新標題列進度
+		int tenth = ld->size ? (int)(ld->length * 10 / ld->size) : 10;
+		if (tenth > step) {
+			step = tenth;
+			ui_wake();
+		}
+	}
+	if (!ld->err) {
+		ld->buffer[ld->length] = '\0';
+		ld->total_lines = count_lines(ld->buffer);
+	}
+	close(ld->fd);
+	__atomic_store_n(&ld->done, 1, __ATOMIC_RELEASE);
+	ui_wake();
+	return NULL;
 }
 
-// 保存編輯器狀態到文件
-void save_editor(EditorState *ed) {
-    FILE *file = fopen(ed->filename, "w");
-    if(file) {
-		// 寫入前鎖定，避免與網路執行緒衝突
-		live_lock_editor((ed == &editors[0]) ? 0 : 1);
-		fwrite(ed->buffer, strlen(ed->buffer), 1, file);
-		live_unlock_editor((ed == &editors[0]) ? 0 : 1);
-        fclose(file);
-    }
+// UI 執行緒接手背景載入的內容；wait 為 0 時還沒讀完就直接返回
+// 回傳 0 表示讀取失敗或文件為空（已印出原因；追蹤模式允許空文件）
+static int editor_load_finish(int idx, int wait) {
+	EditorState *ed = &editors[idx];
+	EditorLoad *ld = &editor_loads[idx];
+	if (!ed->loading) return 1;
+	if (!__atomic_load_n(&ld->done, __ATOMIC_ACQUIRE)) {
+		if (!wait) return 1;
+		printf("\n正在載入 %s...\n", ed->filename);
+		fflush(stdout);
+	}
+	if (ld->started) pthread_join(ld->thread, NULL);
+	ld->started = 0;
+	ed->loading = 0;
+	if (ld->err || (ld->total_lines == 0 && !follow_mode)) {
+		if (ld->err) printf("無法讀取文件: %s (%s)\n", ed->filename, strerror(ld->err));
+		else printf("文件為空: %s\n", ed->filename);
+		free(ld->buffer);
+		ld->buffer = NULL;
+		return 0;
+	}
+	free(ed->buffer);
+	ed->buffer = ld->buffer;
+	ed->length = ld->length;
+	ed->capacity = ld->capacity;
+	ed->total_lines = ld->total_lines;
+	editor_detect_final_nl(ed);
+	ld->buffer = NULL;
+	if (ld->open_swap) swap_open(idx);
+	if (follow_mode) follow_start(idx);
+	return 1;
+}
+
+// 標題列的文件名稱；載入中附上進度
+static void editor_title(int idx, char *buf, size_t cap) {
+	const EditorState *ed = &editors[idx];
+	const EditorLoad *ld = &editor_loads[idx];
+	if (!ed->loading) {
+		snprintf(buf, cap, "%s", ed->filename);
+		return;
+	}
+	size_t loaded = __atomic_load_n(&ld->loaded, __ATOMIC_RELAXED);
+	int pct = ld->size ? (int)(loaded * 100 / ld->size) : 0;
+	snprintf(buf, cap, "%s [載入中 %d%%]", ed->filename, pct > 99 ? 99 : pct);
 }
 
 // 初始化編輯器狀態
@@ -1433,22 +6623,6 @@ int init_editor(EditorState *ed, const char *filename) {
     strncpy(ed->filename, filename, sizeof(ed->filename) - 1);
     ed->filename[sizeof(ed->filename) - 1] = '\0';
     
-    FILE *file = fopen(filename, "r");
-    if(!file) {
-        printf("無法打開文件: %s\n", filename);
-        return 0;
-    }
-    
-    memset(ed->buffer, 0, sizeof(ed->buffer));
-    fread(ed->buffer, 1, sizeof(ed->buffer) - 1, file);
-    fclose(file);
-    
-    ed->total_lines = count_lines(ed->buffer);
-    if(ed->total_lines == 0) {
-        printf("文件為空: %s\n", filename);
-        return 0;
-    }
-    
     ed->current_line = 1;
     ed->row_offset = 1;
     ed->search_mode = 0;
@@ -1458,21 +6632,678 @@ int init_editor(EditorState *ed, const char *filename) {
     ed->total_matches = 0;
     ed->current_match = 0;
     
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        printf("無法打開文件: %s\n", filename);
+        return 0;
+    }
+    
+    // 大文件先讀開頭一段（切在最後一個換行）供第一個畫面使用，其餘交給背景執行緒
+    EditorLoad *ld = &editor_loads[ed - editors];
+    memset(ld, 0, sizeof(*ld));
+    struct stat st;
+    ld->fd = fd;
+    ld->size = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) ? (size_t)st.st_size : 0;
+    ed->length = 0;
+    ed->loading = 1;
+    if(ld->size >= LOAD_ASYNC_MIN) {
+        if(!editor_reserve(ed, LOAD_PREFIX_BYTES + 1)) {
+            printf("記憶體不足: %s\n", filename);
+            close(fd);
+            return 0;
+        }
+        ssize_t n = pread(fd, ed->buffer, LOAD_PREFIX_BYTES, 0);
+        if(n > 0) {
+            char *nl = memrchr(ed->buffer, '\n', (size_t)n);
+            ed->length = nl ? (size_t)(nl - ed->buffer) + 1 : (size_t)n;
+        }
+        ed->buffer[ed->length] = '\0';
+        ed->total_lines = count_lines(ed->buffer);
+        if(pthread_create(&ld->thread, NULL, editor_load_func, ld) == 0) {
+            ld->started = 1;
+        } else {
+            editor_load_func(ld);
+        }
+    } else {
+        editor_load_func(ld);
+        if(!editor_load_finish((int)(ed - editors), 1)) {
+            return 0;
+        }
+    }
+    
     return 1;
 }
 
+// ===== 批次模式 =====
+// --batch SCRIPT（- 表示標準輸入）：不開終端機、不進原始模式，逐行套用類似 ed 的命令，最後寫回一次。
+// 文字放在空隙緩衝區（gap buffer），修改只搬動上一次修改位置到這次位置之間的內容；
+// 行號從上一次用到的行往前或往後數，所以依行號順序處理文件的腳本最快
+#define BATCH_GAP_MIN (1 << 16)
+
+typedef struct {
+	char *buf;
+	size_t cap;
+	size_t gap;       // 空隙起點，也是空隙前的文字長度
+	size_t gap_end;   // 空隙之後的文字從這裡開始
+	int lines;        // 行數（與 count_lines 相同：結尾的換行不多算一行）
+	int at_line;      // 快取：第 at_line 行從邏輯偏移 at_off 開始
+	size_t at_off;
+	int dirty;        // 上次寫入後有修改
+} BatchText;
+
+static size_t batch_len(const BatchText *t) {
+	return t->gap + (t->cap - t->gap_end);
+}
+
+// 邏輯偏移 off 之後（含）第一個換行的位置；沒有時回傳內容長度
+static size_t batch_next_nl(const BatchText *t, size_t off) {
+	size_t len = batch_len(t);
+	if (off < t->gap) {
+		const char *nl = memchr(t->buf + off, '\n', t->gap - off);
+		if (nl) return (size_t)(nl - t->buf);
+		off = t->gap;
+	}
+	if (off < len) {
+		const char *p = t->buf + t->gap_end + (off - t->gap);
+		const char *nl = memchr(p, '\n', len - off);
+		if (nl) return off + (size_t)(nl - p);
+	}
+	return len;
+}
+
+// 邏輯偏移 off 之前（不含）最後一個換行的位置；沒有時回傳 SIZE_MAX
+static size_t batch_prev_nl(const BatchText *t, size_t off) {
+	if (off > t->gap) {
+		const char *p = t->buf + t->gap_end;
+		const char *nl = memrchr(p, '\n', off - t->gap);
+		if (nl) return t->gap + (size_t)(nl - p);
+		off = t->gap;
+	}
+	const char *nl = memrchr(t->buf, '\n', off);
+	return nl ? (size_t)(nl - t->buf) : SIZE_MAX;
+}
+
+// 第 line 行（1 起算，可為 lines + 1）的起始偏移，從快取的行往前或往後數
+static size_t batch_line_start(BatchText *t, int line) {
+	if (line < 1) line = 1;
+	if (line > t->lines + 1) line = t->lines + 1;
+	int at = t->at_line;
+	size_t off = t->at_off;
+	if (line < at && line - 1 < at - line) {
+		at = 1;
+		off = 0;
+	}
+	while (at < line) {
+		off = batch_next_nl(t, off) + 1;
+		at++;
+	}
+	while (at > line) {
+		size_t nl = batch_prev_nl(t, off - 1);
+		off = (nl == SIZE_MAX) ? 0 : nl + 1;
+		at--;
+	}
+	t->at_line = line;
+	t->at_off = off;
+	return off;
+}
+
+static void batch_move_gap(BatchText *t, size_t off) {
+	if (off < t->gap) {
+		size_t n = t->gap - off;
+		memmove(t->buf + t->gap_end - n, t->buf + off, n);
+		t->gap -= n;
+		t->gap_end -= n;
+	} else if (off > t->gap) {
+		size_t n = off - t->gap;
+		memmove(t->buf + t->gap, t->buf + t->gap_end, n);
+		t->gap += n;
+		t->gap_end += n;
+	}
+}
+
+static int batch_reserve(BatchText *t, size_t need) {
+	if (t->gap_end - t->gap >= need) return 1;
+	size_t tail = t->cap - t->gap_end;
+	size_t cap = t->cap * 2;
+	if (cap < t->cap + need + BATCH_GAP_MIN) cap = t->cap + need + BATCH_GAP_MIN;
+	char *grown = (char *)realloc(t->buf, cap);
+	if (!grown) return 0;
+	memmove(grown + cap - tail, grown + t->gap_end, tail);
+	t->buf = grown;
+	t->gap_end = cap - tail;
+	t->cap = cap;
+	return 1;
+}
+
+// 刪除 [off, off + del) 並在 off 插入 ins；記憶體不足回傳 0
+// 修改在快取的行之後不影響它的起點，在之前時快取改回第一行
+static int batch_splice(BatchText *t, size_t off, size_t del, const char *ins, size_t ins_len) {
+	if (off < t->at_off) {
+		t->at_line = 1;
+		t->at_off = 0;
+	}
+	batch_move_gap(t, off);
+	t->gap_end += del;
+	if (!batch_reserve(t, ins_len)) return 0;
+	memcpy(t->buf + t->gap, ins, ins_len);
+	t->gap += ins_len;
+	t->dirty = 1;
+	return 1;
+}
+
+// 第 line 行的內容移到空隙之後，回傳連續的指標與長度
+static const char *batch_line(BatchText *t, int line, size_t *len) {
+	size_t start = batch_line_start(t, line);
+	batch_move_gap(t, start);
+	*len = batch_next_nl(t, start) - start;
+	return t->buf + t->gap_end;
+}
+
+static int batch_load(BatchText *t, const char *filename) {
+	memset(t, 0, sizeof(*t));
+	t->at_line = 1;
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	size_t size = 0;
+	if (fd >= 0 && fstat(fd, &st) == 0) size = (size_t)st.st_size;
+	else if (fd >= 0 || errno != ENOENT) return 0;   // 文件不存在時從空白開始，寫入時建立
+	t->cap = size + size / 8 + BATCH_GAP_MIN;
+	t->buf = (char *)malloc(t->cap);
+	if (!t->buf) {
+		if (fd >= 0) close(fd);
+		return 0;
+	}
+	// 內容放在緩衝區尾端，空隙從開頭開始
+	t->gap_end = t->cap - size;
+	size_t got = 0;
+	while (got < size) {
+		ssize_t n = read(fd, t->buf + t->gap_end + got, size - got);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		got += (size_t)n;
+	}
+	if (fd >= 0) close(fd);
+	if (got < size) {
+		errno = EIO;
+		return 0;
+	}
+	const char *p = t->buf + t->gap_end;
+	const char *end = p + size;
+	while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+		t->lines++;
+		p++;
+	}
+	if (size > 0 && end[-1] != '\n') t->lines++;
+	return 1;
+}
+
+static int batch_write(BatchText *t, const char *filename) {
+	batch_move_gap(t, batch_len(t));
+	t->at_line = 1;
+	t->at_off = 0;
+	return save_write_file(filename, t->buf, t->gap);
+}
+
+// 取代第 line 行
+static int batch_change(BatchText *t, int line, const char *text, size_t len) {
+	size_t start = batch_line_start(t, line);
+	return batch_splice(t, start, batch_next_nl(t, start) - start, text, len);
+}
+
+// 在第 line 行之後（0 表示最前面）插入一行；和 ed 一樣新的一行以換行結尾，
+// 接在沒有換行的最後一行之後時先替那一行補上換行
+static int batch_append(BatchText *t, int line, const char *text, size_t len) {
+	if (!batch_reserve(t, len + 2)) return 0;
+	size_t at = 0;
+	if (line > 0) {
+		at = batch_next_nl(t, batch_line_start(t, line));
+		if (at == batch_len(t)) batch_splice(t, at, 0, "\n", 1);
+		at++;
+	}
+	batch_splice(t, at, 0, text, len);
+	batch_splice(t, at + len, 0, "\n", 1);
+	t->lines++;
+	return 1;
+}
+
+// 刪除第 first 到 last 行
+static void batch_delete(BatchText *t, int first, int last) {
+	size_t start, end;
+	if (last < t->lines) {
+		// 先找結尾再找起點，快取停在第 first 行：刪除後它的起點不變
+		end = batch_line_start(t, last + 1);
+		start = batch_line_start(t, first);
+	} else if (first > 1) {
+		// 刪到最後一行：連同前一行的換行一起刪，保留文件原本結尾的換行
+		end = batch_next_nl(t, batch_line_start(t, last));
+		start = batch_next_nl(t, batch_line_start(t, first - 1));
+	} else {
+		start = 0;
+		end = batch_len(t);
+	}
+	batch_splice(t, start, end - start, NULL, 0);
+	t->lines -= last - first + 1;
+}
+
+typedef struct {
+	regex_t re;
+	int compiled;
+	char *pattern;    // 上一次編譯的樣式（空樣式沿用它）
+	char *repl;       // 取代字串（& 與 \1..\9 在套用時展開）
+	int global;
+	char *out;        // 組出新行用的暫存區
+	size_t out_cap;
+} BatchSubst;
+
+// 解析 s/樣式/取代/[g]（分隔字元可以是任何非空白字元）；錯誤時回傳訊息
+static const char *batch_parse_subst(BatchSubst *sb, const char *p) {
+	char delim = *p++;
+	if (delim == '\0' || delim == ' ' || delim == '\\' || delim == '\n') return "s 命令缺少分隔字元";
+	char *parts[2];
+	for (int k = 0; k < 2; k++) {
+		size_t cap = strlen(p) + 1, n = 0;
+		char *part = (char *)malloc(cap);
+		if (!part) return "記憶體不足";
+		while (*p && *p != delim) {
+			// 跳脫的分隔字元只留下字元本身，其他跳脫原樣保留給 regex 或取代字串
+			if (*p == '\\' && p[1] == delim) p++;
+			else if (*p == '\\' && p[1]) part[n++] = *p++;
+			part[n++] = *p++;
+		}
+		part[n] = '\0';
+		parts[k] = part;
+		if (*p == delim) p++;
+		else if (k == 0) {
+			free(part);
+			return "s 命令缺少取代字串";
+		}
+	}
+	sb->global = 0;
+	for (; *p; p++) {
+		if (*p == 'g') sb->global = 1;
+		else {
+			free(parts[0]);
+			free(parts[1]);
+			return "s 命令的旗標只接受 g";
+		}
+	}
+	free(sb->repl);
+	sb->repl = parts[1];
+	if (parts[0][0] == '\0') {
+		free(parts[0]);
+		return sb->compiled ? NULL : "沒有上一次的樣式";
+	}
+	if (sb->compiled && strcmp(parts[0], sb->pattern) == 0) {
+		free(parts[0]);
+		return NULL;
+	}
+	if (sb->compiled) regfree(&sb->re);
+	free(sb->pattern);
+	sb->pattern = parts[0];
+	sb->compiled = (regcomp(&sb->re, sb->pattern, 0) == 0);
+	return sb->compiled ? NULL : "無法編譯樣式";
+}
+
+static int batch_out_put(BatchSubst *sb, size_t *n, const char *s, size_t len) {
+	if (*n + len > sb->out_cap) {
+		size_t cap = sb->out_cap ? sb->out_cap * 2 : 256;
+		while (cap < *n + len) cap *= 2;
+		char *grown = (char *)realloc(sb->out, cap);
+		if (!grown) return 0;
+		sb->out = grown;
+		sb->out_cap = cap;
+	}
+	memcpy(sb->out + *n, s, len);
+	*n += len;
+	return 1;
+}
+
+// 對第 line 行做取代；有改變回傳 1，沒有符合回傳 0，記憶體不足回傳 -1
+static int batch_subst_line(BatchText *t, BatchSubst *sb, int line) {
+	size_t len;
+	const char *text = batch_line(t, line, &len);
+	regmatch_t m[10];
+	size_t pos = 0, n = 0;
+	int changed = 0;
+	while (pos <= len) {
+		m[0].rm_so = (regoff_t)pos;
+		m[0].rm_eo = (regoff_t)len;
+		if (regexec(&sb->re, text, 10, m, REG_STARTEND | (pos > 0 ? REG_NOTBOL : 0)) != 0) break;
+		size_t so = (size_t)m[0].rm_so, eo = (size_t)m[0].rm_eo;
+		if (!batch_out_put(sb, &n, text + pos, so - pos)) return -1;
+		for (const char *r = sb->repl; *r; r++) {
+			int group = -1;
+			if (*r == '&') group = 0;
+			else if (*r == '\\' && r[1] >= '0' && r[1] <= '9') group = *++r - '0';
+			else if (*r == '\\' && r[1]) r++;
+			if (group < 0) {
+				if (!batch_out_put(sb, &n, r, 1)) return -1;
+			} else if (m[group].rm_so >= 0) {
+				if (!batch_out_put(sb, &n, text + m[group].rm_so, (size_t)(m[group].rm_eo - m[group].rm_so))) return -1;
+			}
+		}
+		changed = 1;
+		pos = eo;
+		if (so == eo) {
+			// 空的符合：複製一個字元再往後找，避免原地打轉
+			if (pos < len && !batch_out_put(sb, &n, text + pos, 1)) return -1;
+			pos++;
+		}
+		if (!sb->global) break;
+	}
+	if (!changed) return 0;
+	if (pos < len && !batch_out_put(sb, &n, text + pos, len - pos)) return -1;
+	return batch_change(t, line, sb->out, n) ? 1 : -1;
+}
+
+// 解析一個位址：N、.、$，後面可接 +N 或 -N；單獨的 +N / -N 相對於目前行。沒有位址回傳 0
+static int batch_parse_addr(const char **pp, int cur, int last, int *out) {
+	const char *p = *pp;
+	int have = 1;
+	long v;
+	if (*p >= '0' && *p <= '9') v = strtol(p, (char **)&p, 10);
+	else if (*p == '.') v = cur, p++;
+	else if (*p == '$') v = last, p++;
+	else if (*p == '+' || *p == '-') v = cur;
+	else have = 0;
+	while (have && (*p == '+' || *p == '-')) {
+		int sign = (*p++ == '+') ? 1 : -1;
+		long d = (*p >= '0' && *p <= '9') ? strtol(p, (char **)&p, 10) : 1;
+		v += sign * d;
+	}
+	if (!have) return 0;
+	*out = (v < -1) ? -1 : (v > INT32_MAX ? INT32_MAX : (int)v);
+	*pp = p;
+	return 1;
+}
+
+// 執行一行命令；錯誤時回傳訊息。*quit 設為 1 表示 q
+static const char *batch_command(BatchText *t, BatchSubst *sb, int *cur, const char *p, const char *filename, int *quit) {
+	while (*p == ' ' || *p == '\t') p++;
+	if (*p == '\0' || *p == '#') return NULL;
+	int first = *cur, last = *cur;
+	if (*p == '%') {
+		first = 1;
+		last = t->lines;
+		p++;
+	} else if (batch_parse_addr(&p, *cur, t->lines, &first)) {
+		last = first;
+		if (*p == ',') {
+			p++;
+			if (!batch_parse_addr(&p, *cur, t->lines, &last)) return "逗號後缺少位址";
+		}
+	}
+	char cmd = *p ? *p++ : '\0';
+	// 文字參數：命令字母後的第一個空白是分隔，之後原樣保留
+	const char *arg = (*p == ' ') ? p + 1 : p;
+	int ok;
+	if (cmd == 'a') ok = (last >= 0 && last <= t->lines);
+	else if (cmd == 'i') ok = (last >= 0 && last <= (t->lines ? t->lines : 1));   // 0i 與 1i 相同
+	else if (cmd == 'w' || cmd == 'q') ok = 1;
+	else ok = (first >= 1 && first <= last && last <= t->lines);
+	if (!ok) return "位址超出範圍";
+	switch (cmd) {
+	case '\0':
+		*cur = last;
+		return NULL;
+	case 'c':
+		if (!batch_change(t, last, arg, strlen(arg))) return "記憶體不足";
+		*cur = last;
+		return NULL;
+	case 'a':
+	case 'i': {
+		int after = (cmd == 'a') ? last : (last > 0 ? last - 1 : 0);
+		if (after > t->lines) after = t->lines;
+		if (!batch_append(t, after, arg, strlen(arg))) return "記憶體不足";
+		*cur = after + 1;
+		return NULL;
+	}
+	case 'd':
+		batch_delete(t, first, last);
+		*cur = (first <= t->lines) ? first : t->lines;
+		return NULL;
+	case 's': {
+		const char *err = batch_parse_subst(sb, p);
+		if (err) return err;
+		for (int line = first; line <= last; line++) {
+			int r = batch_subst_line(t, sb, line);
+			if (r < 0) return "記憶體不足";
+			if (r > 0) *cur = line;
+		}
+		return NULL;
+	}
+	case 'w': {
+		const char *target = (*arg) ? arg : filename;
+		int err = batch_write(t, target);
+		if (err) {
+			static char msg[128];
+			snprintf(msg, sizeof(msg), "無法寫入文件（%s）", strerror(err));
+			return msg;
+		}
+		if (!*arg) t->dirty = 0;
+		return NULL;
+	}
+	case 'q':
+		*quit = 1;
+		return NULL;
+	default:
+		return "無法辨識的命令";
+	}
+}
+
+// 讀入整個腳本（- 表示標準輸入），'\0' 結尾
+static char *batch_read_script(const char *path, size_t *len) {
+	int fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	size_t cap = 1 << 16, n = 0;
+	char *buf = (char *)malloc(cap);
+	while (buf) {
+		if (cap - n < 4096 + 1) {
+			char *grown = (char *)realloc(buf, cap * 2);
+			if (!grown) {
+				free(buf);
+				buf = NULL;
+				break;
+			}
+			buf = grown;
+			cap *= 2;
+		}
+		ssize_t r = read(fd, buf + n, cap - n - 1);
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0) {
+			free(buf);
+			buf = NULL;
+		}
+		if (r <= 0) break;
+		n += (size_t)r;
+	}
+	if (fd != STDIN_FILENO) close(fd);
+	if (buf) {
+		buf[n] = '\0';
+		*len = n;
+	}
+	return buf;
+}
+
+// 批次模式的進入點，回傳行程結束碼；遇到錯誤的命令即停止，不寫回
+static int batch_run(const char *script_path, const char *filename) {
+	size_t script_len;
+	char *script = batch_read_script(script_path, &script_len);
+	if (!script) {
+		fprintf(stderr, "無法讀取批次腳本 %s（%s）\n", script_path, strerror(errno));
+		return 1;
+	}
+	BatchText t;
+	if (!batch_load(&t, filename)) {
+		fprintf(stderr, "無法開啟文件 %s（%s）\n", filename, strerror(errno));
+		free(script);
+		return 1;
+	}
+	BatchSubst sb;
+	memset(&sb, 0, sizeof(sb));
+	int cur = t.lines, quit = 0, status = 0;
+	long lineno = 0;
+	char *p = script;
+	char *end = script + script_len;
+	while (p < end && !quit) {
+		char *nl = memchr(p, '\n', (size_t)(end - p));
+		char *eol = nl ? nl : end;
+		*eol = '\0';
+		if (eol > p && eol[-1] == '\r') eol[-1] = '\0';
+		lineno++;
+		const char *err = batch_command(&t, &sb, &cur, p, filename, &quit);
+		if (err) {
+			fprintf(stderr, "批次腳本第 %ld 行：%s：%s\n", lineno, err, p);
+			status = 1;
+			break;
+		}
+		p = eol + 1;
+	}
+	if (status == 0 && t.dirty) {
+		int err = batch_write(&t, filename);
+		if (err) {
+			fprintf(stderr, "無法寫入文件 %s（%s）\n", filename, strerror(err));
+			status = 1;
+		}
+	}
+	if (sb.compiled) regfree(&sb.re);
+	free(sb.pattern);
+	free(sb.repl);
+	free(sb.out);
+	free(t.buf);
+	free(script);
+	return status;
+}
+
+// 主畫面：標題、文件內容、狀態列與操作說明
+static void draw_main_screen(EditorState *ed) {
+    clear_screen();
+    
+    // 顯示標題
+	char title[300];
+	editor_title(active_editor, title, sizeof(title));
+    if(num_editors == 2) {
+        printf("╔═══════════════════════════════════════════╗\n");
+        printf("║  視窗 %d/%d: %-32s║\n", active_editor + 1, num_editors, title);
+        printf("╚═══════════════════════════════════════════╝\n");
+    } else {
+        printf("╔═══════════════════════════════════════════╗\n");
+        printf("║  文件: %-35s║\n", title);
+        printf("╚═══════════════════════════════════════════╝\n");
+    }
+	if (live_mode != LIVE_NONE) {
+		printf("[Live Share] 模式: %s", live_mode == LIVE_HOST ? "主機" : (live_spectator ? "觀看（唯讀）" : "加入"));
+		print_live_latency_brief();
+		printf("\n");
+		if (live_mode == LIVE_JOIN) {
+			print_live_sync_status(active_editor);
+			print_live_connection_status();
+		}
+	}
+    
+    // 顯示文件內容，高亮當前行
+    print_with_line_numbers(ed);
+    
+    // 顯示提示信息
+    printf("\n");
+    printf("當前選擇：第 %d 行 (共 %d 行)%s%s ", 
+           ed->current_line, ed->total_lines, 
+           clipboard_has_content ? "  [剪貼板:" : "",
+           ed->search_mode ? "  [搜尋: " : "");
+    if(ed->search_mode) {
+        printf("%s] (%d/%d)", ed->search_term, ed->current_match, ed->total_matches);
+    }
+	if (macro_recording) printf("  [錄製巨集]");
+	if (repeat_count > 0) printf("  [次數: %ld]", repeat_count);
+	if (clipboard_has_content) {
+		// 顯示剪貼板內容預覽（第一行最多 40 字，多行時附上行數）
+		const char *clip_nl = memchr(clipboard, '\n', clipboard_len);
+		int clip_len = clip_nl ? (int)(clip_nl - clipboard) : (int)clipboard_len;
+		int show_len = (clip_len > 40) ? 40 : clip_len;
+		char clip_preview[64] = {0};
+		strncpy(clip_preview, clipboard, show_len);
+		clip_preview[show_len] = '\0';
+		printf(" %s%s", clip_preview, (clip_len > show_len) ? "..." : "");
+		if (clipboard_lines > 1) printf(" (共 %d 行)", clipboard_lines);
+		printf("]");
+	}
+	if (ed->sel_anchor) {
+		int first, last;
+		editor_selection(ed, &first, &last);
+		printf("  [選取: 第 %d-%d 行]", first, last);
+	}
+	if (follow_mode) {
+		printf("  [追蹤中]");
+	} else {
+		print_save_status(ed);
+	}
+    printf("\n");
+    if(ed->search_mode) {
+        printf("操作：[n] 下一個匹配  [ESC] 退出搜尋  [↑↓] 移動  [Enter] 編輯  [q] 退出\n");
+    } else if (live_spectator || follow_mode) {
+        printf("操作：[f] 搜尋  [↑↓] 移動%s  [q] 退出（%s，唯讀）\n", num_editors == 2 ? "  [Ctrl+←/→] 切換" : "",
+               follow_mode ? "追蹤模式，移到最後一行即跟著捲動" : "觀看模式");
+    } else {
+        if(num_editors == 2) {
+            printf("操作：[f] 搜尋  [↑↓] 移動  [Enter] 編輯  [n] 新增  [d] 刪除  [v] 選取  [c] 複製  [p] 貼上  [u] 復原  [m] 錄製  [@] 重播  [Ctrl+←/→] 切換  [q] 退出\n");
+        } else {
+            printf("操作：[f] 搜尋  [↑↓] 移動  [Enter] 編輯  [n] 新增  [d] 刪除  [v] 選取  [c] 複製  [p] 貼上  [u] 復原  [m] 錄製  [@] 重播  [q] 退出\n");
+        }
+    }
+}
+
 int main(int argc,char **argv){
 
 	int argi = 1;
 	const char *join_host = NULL;
 	int join_port = 0;
 	int host_port = 0;
+	const char *batch_script = NULL;
 
-	// 參數解析： [--host PORT | --join HOST:PORT] <filename1> [filename2]
-	if (argc >= 3 && strcmp(argv[argi], "--host") == 0) {
+	// 參數解析： [--fsync none|file|full] [--journal] [--noswap] [--follow] [--batch SCRIPT] [--host PORT | --join HOST:PORT | --watch HOST:PORT] <filename1> [filename2]
+	// PORT 或 HOST:PORT 寫成 shm:NAME 時改用同機共享記憶體傳輸
+	// --watch 與 --join 相同，但以唯讀觀看者身分連線
+	while (argi < argc) {
+		if (argc - argi >= 2 && strcmp(argv[argi], "--fsync") == 0) {
+			const char *mode = argv[argi + 1];
+			if (strcmp(mode, "none") == 0) save_fsync_policy = SAVE_FSYNC_NONE;
+			else if (strcmp(mode, "file") == 0) save_fsync_policy = SAVE_FSYNC_FILE;
+			else if (strcmp(mode, "full") == 0) save_fsync_policy = SAVE_FSYNC_FULL;
+			else {
+				printf("--fsync 只接受 none、file 或 full\n");
+				return 1;
+			}
+			argi += 2;
+		} else if (strcmp(argv[argi], "--journal") == 0) {
+			journal_mode = 1;
+			argi++;
+		} else if (strcmp(argv[argi], "--noswap") == 0) {
+			swap_disabled = 1;
+			argi++;
+		} else if (strcmp(argv[argi], "--follow") == 0) {
+			follow_mode = 1;
+			argi++;
+		} else if (argc - argi >= 2 && strcmp(argv[argi], "--batch") == 0) {
+			batch_script = argv[argi + 1];
+			argi += 2;
+		} else {
+			break;
+		}
+	}
+	if (argc - argi >= 2 && strcmp(argv[argi], "--watch") == 0) {
+		live_spectator = 1;
+		argv[argi] = "--join";
+	}
+	if (argc - argi >= 2 && (strcmp(argv[argi], "--host") == 0 || strcmp(argv[argi], "--join") == 0) &&
+	    strncmp(argv[argi + 1], "shm:", 4) == 0 && argv[argi + 1][4] != '\0') {
+		snprintf(live_shm_name, sizeof(live_shm_name), "%s", argv[argi + 1] + 4);
+		if (strcmp(argv[argi], "--host") == 0) host_port = -1;
+		else join_host = "shm";
+		argi += 2;
+	} else if (argc - argi >= 2 && strcmp(argv[argi], "--host") == 0) {
 		host_port = atoi(argv[argi + 1]);
 		argi += 2;
-	} else if (argc >= 3 && strcmp(argv[argi], "--join") == 0) {
+	} else if (argc - argi >= 2 && strcmp(argv[argi], "--join") == 0) {
 		char *hp = argv[argi + 1];
 		char *colon = strchr(hp, ':');
 		if (colon) {
@@ -1481,20 +7312,56 @@ int main(int argc,char **argv){
 			join_port = atoi(colon + 1);
 			argi += 2;
 		} else {
-			printf("使用方式: %s [--host PORT | --join HOST:PORT] <filename1> [filename2]\n", argv[0]);
+			printf("使用方式: %s [--fsync none|file|full] [--journal] [--noswap] [--follow] [--batch SCRIPT|-] [--host PORT|shm:NAME | --join|--watch HOST:PORT|shm:NAME] <filename1> [filename2]\n", argv[0]);
 			return 1;
 		}
 	}
 
 	if(argc - argi < 1){
-		printf("使用方式: %s [--host PORT | --join HOST:PORT] <filename1> [filename2]\n", argv[0]);
+		printf("使用方式: %s [--fsync none|file|full] [--journal] [--noswap] [--follow] [--batch SCRIPT|-] [--host PORT|shm:NAME | --join|--watch HOST:PORT|shm:NAME] <filename1> [filename2]\n", argv[0]);
 		printf("  filename1: 第一個要編輯的文件\n");
 		printf("  filename2: (可選) 第二個要編輯的文件\n");
 		printf("  使用 Ctrl+左/右 鍵在兩個文件間切換\n");
-		printf("  Live Share: --host 啟動主機；--join 以 HOST:PORT 連線\n");
+		printf("  Live Share: --host 啟動主機；--join 以 HOST:PORT 連線；同一台機器可用 shm:NAME 走共享記憶體\n");
+		printf("              --watch 以唯讀觀看者連線，不佔參與人數\n");
+		printf("  --fsync: 自動保存的落地策略，none 只 rename、file 先 fsync 文件（預設）、full 另外 fsync 目錄\n");
+		printf("  --journal: 修改逐筆附加到 <文件>.journal，主文件只在日誌過長或退出時重寫（適合大型文件）\n");
+		printf("  --noswap: 不建立 <文件>.swp 交換檔（當機復原用）\n");
+		printf("  --follow: 唯讀追蹤文件尾端新增的內容（類似 tail -f），適合觀看持續成長的日誌\n");
+		printf("  --batch: 不開啟畫面，從 SCRIPT（- 為標準輸入）逐行套用類似 ed 的命令後寫回一次\n");
+		printf("           N 跳到第 N 行、c 文字 取代、a 文字 / i 文字 插入、d 刪除、s/樣式/取代/g、w [文件]、q\n");
 		return 1;
 	}
 
+	// 批次模式不使用終端機，只處理一個文件
+	if (batch_script) {
+		if (follow_mode || journal_mode || host_port != 0 || join_host || argc - argi != 1) {
+			fprintf(stderr, "--batch 只處理一個文件，不能與 --follow、--journal 或 Live Share 同時使用\n");
+			return 1;
+		}
+		return batch_run(batch_script, argv[argi]);
+	}
+
+	// 追蹤模式唯讀，不會保存，也就不需要交換檔；日誌與 Live Share 都會修改文件，不能同時使用
+	if (follow_mode) {
+		if (journal_mode || host_port != 0 || join_host) {
+			printf("--follow 不能與 --journal 或 Live Share 同時使用\n");
+			return 1;
+		}
+		swap_disabled = 1;
+		follow_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (follow_inotify < 0) {
+			printf("無法啟用追蹤模式（inotify: %s）\n", strerror(errno));
+			return 1;
+		}
+	}
+
+	// 網路與載入執行緒透過 pipe 喚醒 UI 重繪
+	if (pipe(ui_wake_fd) == 0) {
+		fcntl(ui_wake_fd[0], F_SETFL, O_NONBLOCK);
+		fcntl(ui_wake_fd[1], F_SETFL, O_NONBLOCK);
+	}
+
     // 初始化編輯器
 	num_editors = ((argc - argi) >= 2) ? 2 : 1;
     
@@ -1510,8 +7377,52 @@ int main(int argc,char **argv){
     
     active_editor = 0;
 
+	// 日誌、交換檔復原與 Live Share 都要從完整內容開始：這些情況先等背景載入完成
+	for (int i = 0; i < num_editors; i++) {
+		char path[300];
+		swap_path(i, path, sizeof(path));
+		if (journal_mode || host_port != 0 || join_host || (!swap_disabled && access(path, F_OK) == 0)) {
+			if (!editor_load_finish(i, 1)) return 1;
+		}
+	}
+
+	// 日誌模式：接續上次未壓實的日誌
+	for (int i = 0; journal_mode && i < num_editors; i++) {
+		if (!journal_open(i)) {
+			printf("無法開啟日誌 %s.journal（%s），改為整份保存\n", editors[i].filename, strerror(errno));
+		}
+	}
+
+	// 交換檔：上次當機留下的先詢問是否復原，再建立這次的
+	for (int i = 0; !swap_disabled && i < num_editors; i++) {
+		if (editors[i].loading) {
+			// 沒有舊的交換檔：等內容讀完再建立
+			editor_loads[i].open_swap = 1;
+			continue;
+		}
+		int r = swap_recover(i);
+		if (r == 0) return 1;
+		if (r == 1) swap_open(i);
+	}
+	// 之後的保存可以只寫回修改過的範圍：記下目前主文件的狀態
+	for (int i = 0; i < num_editors; i++) {
+		save_jobs[i].disk_known = (stat(editors[i].filename, &save_jobs[i].disk) == 0);
+	}
+
 	// 啟動 Live Share（若有要求）
-	if (host_port > 0) {
+	if (live_shm_name[0] && host_port < 0) {
+		if (!live_start_host(0)) {
+			printf("Live Share 主機啟動失敗（shm:%s）\n", live_shm_name);
+		} else {
+			printf("Live Share 主機啟動中，等待連線（shm:%s）...\n", live_shm_name);
+		}
+	} else if (live_shm_name[0] && join_host) {
+		if (!live_start_join(join_host, 0)) {
+			printf("Live Share 無法連線到 shm:%s\n", live_shm_name);
+		} else {
+			printf("Live Share 已連線到 shm:%s\n", live_shm_name);
+		}
+	} else if (host_port > 0) {
 		if (!live_start_host(host_port)) {
 			printf("Live Share 主機啟動失敗（port=%d）\n", host_port);
 		} else {
@@ -1541,6 +7452,15 @@ int main(int argc,char **argv){
     printf("  c       - 複製當前行\n");
     printf("  p       - 貼上複製的內容\n");
     printf("  u       - 復原上一個動作\n");
+    printf("  v       - 選取多行（之後 d 刪除、c 複製、</> 縮排、Alt+↑/↓ 搬移整段）\n");
+    printf("  s       - 排序 / 去除重複 / 反轉選取的行（沒有選取時為整個文件）\n");
+    printf("  !       - 把選取的行（沒有選取時為當前行）送進外部命令，以輸出取代\n");
+    printf("  g/G     - 跳到第一行 / 最後一行\n");
+    printf("  m       - 開始 / 結束錄製巨集\n");
+    printf("  [次數]@ - 重播巨集（例如 100@ 重播 100 次）\n");
+	if (live_mode != LIVE_NONE) {
+		printf("  l       - 顯示 Live Share 操作延遲分布\n");
+	}
     if(num_editors == 2) {
         printf("  Ctrl+←/→ - 切換視窗\n");
     }
@@ -1548,68 +7468,40 @@ int main(int argc,char **argv){
 	if (live_mode == LIVE_HOST) {
 		printf("[Live Share] 角色：主機（等待/已連線）\n");
 	} else if (live_mode == LIVE_JOIN) {
-		printf("[Live Share] 角色：加入（已連線）\n");
+		printf("[Live Share] 角色：%s（已連線）\n", live_spectator ? "觀看（唯讀）" : "加入");
 	}
     printf("編輯模式功能：\n");
     printf("  ←/→      - 左右移動光標\n");
     printf("  字符輸入  - 在光標位置插入\n");
     printf("  Backspace - 刪除字符\n\n");
+	for (int i = 0; i < num_editors; i++) {
+		if (swap_recovered_note[i][0]) printf("%s\n", swap_recovered_note[i]);
+	}
     printf("按任意鍵開始...\n");
     read_key();
     
     // 主循環
     while(1){
-        EditorState *ed = &editors[active_editor];
-        clear_screen();
-        
-        // 顯示標題
-        if(num_editors == 2) {
-            printf("╔═══════════════════════════════════════════╗\n");
-            printf("║  視窗 %d/%d: %-32s║\n", active_editor + 1, num_editors, ed->filename);
-            printf("╚═══════════════════════════════════════════╝\n");
-        } else {
-            printf("╔═══════════════════════════════════════════╗\n");
-            printf("║  文件: %-35s║\n", ed->filename);
-            printf("╚═══════════════════════════════════════════╝\n");
-        }
-		if (live_mode != LIVE_NONE) {
-			printf("[Live Share] 模式: %s\n", live_mode == LIVE_HOST ? "主機" : "加入");
+		// 接手已在背景讀完的文件
+		for (int i = 0; i < num_editors; i++) {
+			if (!editor_load_finish(i, 0)) return 1;
 		}
+        // 重播巨集時不重繪，重播結束後才畫一次
+        EditorState *ed = &editors[active_editor];
+        if(!macro_step()) draw_main_screen(ed);
         
-        // 顯示文件內容，高亮當前行
-        print_with_line_numbers(ed);
+        // 讀取按鍵（網路更新時直接重繪）
+        char key = read_key_or_refresh();
+        if (key == KEY_REFRESH) continue;
         
-        // 顯示提示信息
-        printf("\n");
-        printf("當前選擇：第 %d 行 (共 %d 行)%s%s ", 
-               ed->current_line, ed->total_lines, 
-               clipboard_has_content ? "  [剪貼板:" : "",
-               ed->search_mode ? "  [搜尋: " : "");
-        if(ed->search_mode) {
-            printf("%s] (%d/%d)", ed->search_term, ed->current_match, ed->total_matches);
-        }
-		if (clipboard_has_content) {
-			// 顯示剪貼板內容預覽（最多 40 字）
-			int clip_len = (int)strlen(clipboard);
-			int show_len = (clip_len > 40) ? 40 : clip_len;
-			char clip_preview[64] = {0};
-			strncpy(clip_preview, clipboard, show_len);
-			clip_preview[show_len] = '\0';
-			printf(" %s%s]", clip_preview, (clip_len > show_len) ? "..." : "");
-		}
-        printf("\n");
-        if(ed->search_mode) {
-            printf("操作：[n] 下一個匹配  [ESC] 退出搜尋  [↑↓] 移動  [Enter] 編輯  [q] 退出\n");
-        } else {
-            if(num_editors == 2) {
-                printf("操作：[f] 搜尋  [↑↓] 移動  [Enter] 編輯  [n] 新增  [d] 刪除  [c] 複製  [p] 貼上  [u] 復原  [Ctrl+←/→] 切換  [q] 退出\n");
-            } else {
-                printf("操作：[f] 搜尋  [↑↓] 移動  [Enter] 編輯  [n] 新增  [d] 刪除  [c] 複製  [p] 貼上  [u] 復原  [q] 退出\n");
-            }
+        // 次數前綴：數字累積起來給下一個按鍵使用
+        if (key >= '0' && key <= '9' && (key != '0' || repeat_count > 0)) {
+            repeat_count = repeat_count * 10 + (key - '0');
+            if (repeat_count > MACRO_REPEAT_MAX) repeat_count = MACRO_REPEAT_MAX;
+            continue;
         }
-        
-        // 讀取按鍵
-        char key = read_key();
+        long count = repeat_count ? repeat_count : 1;
+        repeat_count = 0;
         
         // 處理視窗切換
         if(num_editors == 2 && (key == KEY_CTRL_LEFT || key == KEY_CTRL_RIGHT)) {
@@ -1620,6 +7512,20 @@ int main(int argc,char **argv){
             }
             continue;
         }
+
+		// 還在背景載入：只能在已讀入的開頭範圍內移動，其他操作先等載入完成
+		if (ed->loading && key != KEY_UP && !(key == KEY_DOWN && ed->current_line < ed->total_lines) &&
+		    key != 'q' && key != 'Q') {
+			if (!editor_load_finish(active_editor, 1)) return 1;
+		}
+
+		// 觀看者與追蹤模式唯讀：忽略所有編輯操作（搜尋模式下的 n 仍是跳到下一個匹配）
+		if ((live_spectator || follow_mode) && (key == 'd' || key == 'D' || key == 'p' || key == 'P' || key == 'u' || key == 'U' ||
+		                                        key == '<' || key == '>' || key == KEY_ALT_UP || key == KEY_ALT_DOWN ||
+		                                        key == 's' || key == 'S' || key == '!' ||
+		                       key == '\r' || key == '\n' || ((key == 'n' || key == 'N') && !ed->search_mode))) {
+			continue;
+		}
         
         if(key == 'f' || key == 'F'){  // F 鍵
             // 進入搜尋模式（顯示當前文本內容）
@@ -1643,7 +7549,7 @@ int main(int argc,char **argv){
                             ed->row_offset = ed->current_line - VISIBLE_LINES + 1;
                         }
 						// 廣播游標位置（非編輯模式，欄位以 0 表示）
-						live_broadcast_cursor(ed->current_line, 0);
+						live_broadcast_cursor(ed, ed->current_line, 0);
                     }
                 } else {
                     ed->search_mode = 0;
@@ -1655,6 +7561,7 @@ int main(int argc,char **argv){
             }
         }
         else if(key == '\033'){  // ESC 鍵
+            ed->sel_anchor = 0;
             if(ed->search_mode){
                 // 退出搜尋模式
                 ed->search_mode = 0;
@@ -1665,6 +7572,22 @@ int main(int argc,char **argv){
                 ed->search_result_offset = 0;
             }
         }
+        else if(key == 'm' || key == 'M'){
+            // 開始 / 結束錄製巨集（重播中忽略）
+            if(!macro_replaying) macro_toggle_record();
+        }
+        else if(key == '@'){
+            // 重播巨集 count 次（錄製或重播中忽略，避免巨集呼叫自己）
+            if(!macro_replaying && !macro_recording && !macro_start(count)){
+                clear_screen();
+                printf("\n✗ 沒有可重播的巨集（按 m 開始錄製，再按 m 結束）\n");
+                printf("按任意鍵繼續...");
+                read_key();
+            }
+        }
+        else if((key == 'q' || key == 'Q') && macro_replaying){
+            // 重播中不退出
+        }
         else if(key == 'q' || key == 'Q'){
             // 退出
             clear_screen();
@@ -1682,7 +7605,7 @@ int main(int argc,char **argv){
                     ed->row_offset = ed->current_line;
                 }
 				// 廣播游標位置（非編輯模式，欄位以 0 表示）
-				live_broadcast_cursor(ed->current_line, 0);
+				live_broadcast_cursor(ed, ed->current_line, 0);
             }
         }
         else if(key == KEY_DOWN){
@@ -1694,7 +7617,7 @@ int main(int argc,char **argv){
                     ed->row_offset = ed->current_line - VISIBLE_LINES + 1;
                 }
 				// 廣播游標位置（非編輯模式，欄位以 0 表示）
-				live_broadcast_cursor(ed->current_line, 0);
+				live_broadcast_cursor(ed, ed->current_line, 0);
             }
         }
         else if(key == 'n' || key == 'N'){
@@ -1717,7 +7640,7 @@ int main(int argc,char **argv){
                         ed->row_offset = ed->current_line - VISIBLE_LINES + 1;
                     }
 					// 廣播游標位置（非編輯模式，欄位以 0 表示）
-					live_broadcast_cursor(ed->current_line, 0);
+					live_broadcast_cursor(ed, ed->current_line, 0);
                 }
             } else {
                 // 非搜尋模式：在當前行之後新增一行
@@ -1728,11 +7651,8 @@ int main(int argc,char **argv){
                 
                 // 自動保存
                 save_editor(ed);
-                
-                // 重新計算行數
-                ed->total_lines = count_lines(ed->buffer);
 
-                // 移動到新插入的行
+                // 移動到新插入的行（套用修改時已更新行數）
                 ed->current_line++;
                 if(ed->current_line > ed->total_lines){
                     ed->current_line = ed->total_lines;
@@ -1742,7 +7662,18 @@ int main(int argc,char **argv){
                     ed->row_offset = ed->current_line - VISIBLE_LINES + 1;
                 }
 				// 廣播游標位置（非編輯模式，欄位以 0 表示）
-				live_broadcast_cursor(ed->current_line, 0);
+				live_broadcast_cursor(ed, ed->current_line, 0);
+            }
+        }
+        else if((key == 'd' || key == 'D') && ed->sel_anchor){
+            // 刪除整個選取範圍：一次修改、一筆逆操作
+            int first, last;
+            editor_selection(ed, &first, &last);
+            if(delete_lines(ed, first, last)){
+                ed->current_line = first;
+                ed->sel_anchor = 0;
+                editor_clamp(ed);
+                live_broadcast_cursor(ed, ed->current_line, 0);
             }
         }
         else if(key == 'd' || key == 'D'){
@@ -1757,10 +7688,7 @@ int main(int argc,char **argv){
                 // 自動保存
                 save_editor(ed);
                 
-                // 重新計算行數
-                ed->total_lines = count_lines(ed->buffer);
-                
-                // 調整當前行位置
+                // 調整當前行位置（delete_line 已更新行數）
                 if(ed->current_line > ed->total_lines){
                     ed->current_line = ed->total_lines;
                 }
@@ -1776,15 +7704,52 @@ int main(int argc,char **argv){
                     ed->row_offset = ed->current_line - VISIBLE_LINES + 1;
                 }
 				// 廣播游標位置（非編輯模式，欄位以 0 表示）
-				live_broadcast_cursor(ed->current_line, 0);
+				live_broadcast_cursor(ed, ed->current_line, 0);
             }
         }
         else if(key == 'c' || key == 'C'){
-            // 複製當前行
+            // 複製選取範圍（沒有選取時為當前行），複製後結束選取
             clear_screen();
             print_with_line_numbers(ed);
             
-            copy_line(ed->buffer, ed->current_line);
+            int first, last;
+            editor_selection(ed, &first, &last);
+            copy_lines(ed, first, last);
+            ed->sel_anchor = 0;
+        }
+        else if(key == '>' || key == '<'){
+            // 縮排 / 取消縮排選取範圍（沒有選取時為當前行），選取保持不變方便連續操作
+            int first, last;
+            editor_selection(ed, &first, &last);
+            indent_lines(ed, first, last, key == '<');
+        }
+        else if(key == KEY_ALT_UP || key == KEY_ALT_DOWN){
+            // 選取範圍（沒有選取時為當前行）整段上移或下移一行，游標與選取跟著移動
+            int dir = (key == KEY_ALT_UP) ? -1 : 1;
+            int first, last;
+            editor_selection(ed, &first, &last);
+            if(move_lines(ed, first, last, dir)){
+                ed->current_line += dir;
+                if(ed->sel_anchor) ed->sel_anchor += dir;
+                editor_clamp(ed);
+                live_broadcast_cursor(ed, ed->current_line, 0);
+            }
+        }
+        else if(key == 's' || key == 'S'){
+            enter_sort_mode(ed);
+        }
+        else if(key == '!'){
+            enter_filter_mode(ed);
+        }
+        else if(key == 'g' || key == 'G'){
+            // 跳到第一行 / 最後一行
+            ed->current_line = (key == 'g') ? 1 : ed->total_lines;
+            editor_clamp(ed);
+            live_broadcast_cursor(ed, ed->current_line, 0);
+        }
+        else if(key == 'v' || key == 'V'){
+            // 從當前行開始選取，再按一次取消
+            ed->sel_anchor = ed->sel_anchor ? 0 : ed->current_line;
         }
         else if(key == 'p' || key == 'P'){
             // 貼上複製的內容到當前行之後
@@ -1793,12 +7758,6 @@ int main(int argc,char **argv){
             
             paste_line(ed, ed->current_line);
             
-            // 自動保存
-            save_editor(ed);
-            
-            // 重新計算行數
-            ed->total_lines = count_lines(ed->buffer);
-            
             // 移動到新貼上的行
             if(clipboard_has_content){
                 ed->current_line++;
@@ -1810,7 +7769,7 @@ int main(int argc,char **argv){
                     ed->row_offset = ed->current_line - VISIBLE_LINES + 1;
                 }
                 // 廣播游標位置（非編輯模式，欄位以 0 表示）
-                live_broadcast_cursor(ed->current_line, 0);
+                live_broadcast_cursor(ed, ed->current_line, 0);
             }
         }
         else if(key == 'u' || key == 'U'){
@@ -1821,6 +7780,9 @@ int main(int argc,char **argv){
             // 狀態已在復原過程中更新並保存，這裡再保險一次視窗邊界
             editor_recount_and_clamp(ed);
         }
+		else if ((key == 'l' || key == 'L') && live_mode != LIVE_NONE) {
+			show_live_latency();
+		}
         else if(key == KEY_LEFT || key == KEY_RIGHT){
             // 左右方向鍵在主選單中不執行任何操作（僅在編輯模式中使用）
             // 忽略這些按鍵，避免未處理的輸入
@@ -1832,17 +7794,19 @@ int main(int argc,char **argv){
             // 自動保存
             save_editor(ed);
             
-            // 重新計算行數（可能有變化）
-            ed->total_lines = count_lines(ed->buffer);
-            if(ed->current_line > ed->total_lines){
-                ed->current_line = ed->total_lines;
-            }
+            // 取代一行不改變行數；編輯期間收到的遠端修改已在套用時重算
+            editor_clamp(ed);
         }
     }
     
-    // 最終保存所有編輯器
+    // 最終保存所有編輯器（等待背景寫入完成）；保存失敗時保留交換檔供下次復原
+    int saved_ok = autosave_finish();
     for(int i = 0; i < num_editors; i++) {
-        save_editor(&editors[i]);
+        swap_close(i, saved_ok);
+    }
+    if(!saved_ok) {
+        printf("再見！\n\n");
+        return 1;
     }
     
     if(num_editors == 2) {
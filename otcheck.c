@@ -0,0 +1,274 @@
+// Live Share 操作轉換（OT）的隨機收斂測試
+// 在同一個行程裡模擬一個主機與數個加入者：每個加入者隨機產生行層級（OP_SPLICE）與字元層級（OP_CHARS）操作
+// （包含在沒有換行的最後一行之後新增空行再輸入），
+// 訊息以隨機順序送達（每條連線內維持先後），主機與加入者用 main.c 的 live_op_transform / editor_apply_op
+// 依照 live_host_receive_op 與 live_client_receive_op 的方式轉換與套用。全部送達後所有副本必須完全相同
+//
+// 使用方式： ./otcheck [-r 回合數] [-c 加入者數] [-n 每人操作數] [-s 種子]，副本不一致時結束碼為 1
+#define main editor_main
+#include "main.c"
+#undef main
+
+#define OTC_MAX_CLIENTS 16
+
+typedef struct {
+	LiveOp op;
+	int base;  // 加入者送出時的版本
+} OtcMsg;
+
+typedef struct {
+	OtcMsg *items;
+	int head;
+	int count;
+	int cap;
+} OtcQueue;
+
+typedef struct {
+	EditorState *ed;
+	int id;
+	int version;     // 最後套用的主機版本
+	LiveOp *pending; // 已在本地套用、尚未確認的操作；第一個在途
+	int pending_count;
+	int pending_cap;
+	int inflight;
+	int made;        // 已產生的操作數
+	OtcQueue up;     // 加入者 → 主機
+	OtcQueue down;   // 主機 → 加入者
+} OtcClient;
+
+static EditorState *host_ed;
+static LiveOp *host_log;
+static int host_version;
+static OtcClient clients[OTC_MAX_CLIENTS];
+static int client_count = 4;
+static int ops_per_client = 40;
+
+static void *otc_alloc(size_t n) {
+	void *p = calloc(1, n);
+	if (!p) {
+		printf("記憶體不足\n");
+		exit(2);
+	}
+	return p;
+}
+
+static void queue_push(OtcQueue *q, LiveOp op, int base) {
+	if (q->head + q->count == q->cap) {
+		q->cap = q->cap ? q->cap * 2 : 64;
+		OtcMsg *items = (OtcMsg *)otc_alloc(sizeof(OtcMsg) * (size_t)q->cap);
+		memcpy(items, q->items + q->head, sizeof(OtcMsg) * (size_t)q->count);
+		free(q->items);
+		q->items = items;
+		q->head = 0;
+	}
+	q->items[q->head + q->count].op = op;
+	q->items[q->head + q->count].base = base;
+	q->count++;
+}
+
+static OtcMsg queue_pop(OtcQueue *q) {
+	OtcMsg m = q->items[q->head++];
+	q->count--;
+	return m;
+}
+
+static EditorState *replica_new(const char *text) {
+	EditorState *ed = (EditorState *)otc_alloc(sizeof(EditorState));
+	editor_reserve(ed, strlen(text) + 1);
+	editor_splice(ed, 0, 0, text, strlen(text));
+	ed->total_lines = count_lines(ed->buffer);
+	editor_detect_final_nl(ed);
+	return ed;
+}
+
+static void replica_free(EditorState *ed) {
+	free(ed->buffer);
+	free(ed);
+}
+
+static void replica_apply(EditorState *ed, const LiveOp *op) {
+	editor_apply_op(ed, op);
+	if (!op->chars) ed->total_lines = count_lines(ed->buffer);
+}
+
+// 依目前內容隨機產生一個有效的操作
+static LiveOp random_op(OtcClient *c) {
+	EditorState *ed = c->ed;
+	int lines = ed->total_lines;
+	char text[64];
+	if (lines > 0 && rand() % 2) {
+		// 偶爾編輯最後一行之後、從內容結尾開始的那一行
+		int line = 1 + rand() % (lines + (rand() % 8 == 0));
+		size_t off = editor_line_offset(ed, line);
+		int len = (int)(editor_line_end(ed, off) - off);
+		int col = rand() % (len + 1);
+		int cdel = (rand() % 3 == 0) ? 0 : rand() % (len - col + 1);
+		static const char *inserts[] = { "", "x", "yz", "<c>" };
+		const char *ins = inserts[rand() % 4];
+		if (cdel == 0 && ins[0] == '\0') ins = "x";
+		return live_op_make_chars(line, col, cdel, ins, strlen(ins));
+	}
+	int pos = 1 + rand() % (lines + 1);
+	int del = (pos <= lines && rand() % 2) ? 1 + rand() % (lines - pos + 1 < 3 ? lines - pos + 1 : 3) : 0;
+	int nlines = rand() % 3;
+	if (del == 0 && nlines == 0) nlines = 1;
+	// 空行（新增一行）與最後一行是空行的多行（貼上）要在沒有換行的最後一行之後也成為真正的行
+	int empty = (rand() % 4 == 0);
+	if (nlines == 1 && empty) text[0] = '\0';
+	else if (nlines == 1) snprintf(text, sizeof(text), "c%d-%d", c->id, c->made);
+	else if (empty) snprintf(text, sizeof(text), "c%d-%da\n", c->id, c->made);
+	else snprintf(text, sizeof(text), "c%d-%da\nc%d-%db", c->id, c->made, c->id, c->made);
+	return live_op_make(pos, del, nlines ? text : NULL, nlines);
+}
+
+// 與 live_client_flush 相同：一次只有一個在途操作
+static void client_flush(OtcClient *c) {
+	if (c->inflight || c->pending_count == 0) return;
+	c->inflight = 1;
+	queue_push(&c->up, live_op_copy(&c->pending[0]), c->version);
+}
+
+static void client_local_edit(OtcClient *c) {
+	LiveOp op = random_op(c);
+	op.origin = c->id;
+	replica_apply(c->ed, &op);
+	if (c->pending_count == c->pending_cap) {
+		c->pending_cap = c->pending_cap ? c->pending_cap * 2 : 16;
+		LiveOp *np = (LiveOp *)otc_alloc(sizeof(LiveOp) * (size_t)c->pending_cap);
+		memcpy(np, c->pending, sizeof(LiveOp) * (size_t)c->pending_count);
+		free(c->pending);
+		c->pending = np;
+	}
+	c->pending[c->pending_count++] = op;
+	c->made++;
+	client_flush(c);
+}
+
+// 與 live_host_receive_op 相同：對 base 之後的紀錄轉換，套用後定序並廣播給所有人
+static void host_receive(OtcClient *c) {
+	OtcMsg m = queue_pop(&c->up);
+	LiveOp op = m.op;
+	for (int v = m.base + 1; v <= host_version; v++) {
+		live_op_transform(&op, &host_log[v], 1);
+	}
+	replica_apply(host_ed, &op);
+	op.version = ++host_version;
+	host_log[host_version] = live_op_copy(&op);
+	for (int i = 0; i < client_count; i++) {
+		queue_push(&clients[i].down, live_op_copy(&op), 0);
+	}
+	live_op_free(&op);
+}
+
+// 與 live_client_receive_op 相同：自己的回聲視為確認，其他操作與未確認操作互相轉換
+static void client_receive(OtcClient *c) {
+	OtcMsg m = queue_pop(&c->down);
+	LiveOp op = m.op;
+	if (op.origin == c->id && c->inflight) {
+		live_op_free(&c->pending[0]);
+		memmove(c->pending, c->pending + 1, sizeof(LiveOp) * (size_t)(c->pending_count - 1));
+		c->pending_count--;
+		c->inflight = 0;
+		c->version = op.version;
+		live_op_free(&op);
+		client_flush(c);
+		return;
+	}
+	for (int i = 0; i < c->pending_count; i++) {
+		LiveOp remote = op;
+		live_op_transform(&op, &c->pending[i], 0);
+		live_op_transform(&c->pending[i], &remote, 1);
+	}
+	replica_apply(c->ed, &op);
+	c->version = op.version;
+	live_op_free(&op);
+}
+
+// 一個回合：從同一份內容開始，隨機交錯產生、處理與送達，直到全部送達；回傳是否收斂
+static int run_round(int round) {
+	// 單數回合從最後一行沒有換行的內容開始
+	const char *initial = (round % 2) ? "alpha\nbravo\ncharlie\ndelta\necho" : "alpha\nbravo\ncharlie\ndelta\necho\n";
+	int total_ops = client_count * ops_per_client;
+	host_ed = replica_new(initial);
+	host_log = (LiveOp *)otc_alloc(sizeof(LiveOp) * (size_t)(total_ops + 1));
+	host_version = 0;
+	for (int i = 0; i < client_count; i++) {
+		memset(&clients[i], 0, sizeof(clients[i]));
+		clients[i].ed = replica_new(initial);
+		clients[i].id = i + 1;
+	}
+	while (1) {
+		// 可以進行的動作：產生本地操作、主機處理上行訊息、加入者處理下行訊息
+		int choices[OTC_MAX_CLIENTS * 3];
+		int n = 0;
+		for (int i = 0; i < client_count; i++) {
+			if (clients[i].made < ops_per_client) choices[n++] = i * 3;
+			if (clients[i].up.count > 0) choices[n++] = i * 3 + 1;
+			if (clients[i].down.count > 0) choices[n++] = i * 3 + 2;
+		}
+		if (n == 0) break;
+		int pick = choices[rand() % n];
+		OtcClient *c = &clients[pick / 3];
+		if (pick % 3 == 0) client_local_edit(c);
+		else if (pick % 3 == 1) host_receive(c);
+		else client_receive(c);
+	}
+	int ok = 1;
+	for (int i = 0; i < client_count; i++) {
+		EditorState *ed = clients[i].ed;
+		if (ed->length != host_ed->length || memcmp(ed->buffer, host_ed->buffer, ed->length) != 0) {
+			if (ok) printf("✗ 第 %d 回合不一致（版本 %d）\n主機：\n%s\n", round, host_version, host_ed->buffer);
+			printf("加入者 %d：\n%s\n", clients[i].id, ed->buffer);
+			ok = 0;
+		}
+	}
+	for (int i = 0; i < client_count; i++) {
+		replica_free(clients[i].ed);
+		free(clients[i].pending);
+		free(clients[i].up.items);
+		free(clients[i].down.items);
+	}
+	for (int v = 1; v <= host_version; v++) live_op_free(&host_log[v]);
+	free(host_log);
+	replica_free(host_ed);
+	return ok;
+}
+
+static void usage(const char *prog) {
+	printf("使用方式: %s [-r 回合數] [-c 加入者數] [-n 每人操作數] [-s 種子]\n", prog);
+	printf("  -r  回合數（預設 2000）\n");
+	printf("  -c  加入者數（預設 4，最多 %d）\n", OTC_MAX_CLIENTS);
+	printf("  -n  每個加入者每回合產生的操作數（預設 40）\n");
+	printf("  -s  亂數種子（預設 1）\n");
+}
+
+int main(int argc, char **argv) {
+	int rounds = 2000;
+	unsigned seed = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:c:n:s:h")) != -1) {
+		if (opt == 'r') rounds = atoi(optarg);
+		else if (opt == 'c') client_count = atoi(optarg);
+		else if (opt == 'n') ops_per_client = atoi(optarg);
+		else if (opt == 's') seed = (unsigned)strtoul(optarg, NULL, 10);
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (rounds < 1 || client_count < 1 || client_count > OTC_MAX_CLIENTS || ops_per_client < 1) {
+		usage(argv[0]);
+		return 2;
+	}
+	// 副本不是真正開啟的文件：比照巨集重播，套用時不記錄日誌、交換檔，也不排程保存
+	macro_replaying = 1;
+	srand(seed);
+	for (int r = 1; r <= rounds; r++) {
+		if (!run_round(r)) {
+			printf("種子 %u，%d 個加入者，每人 %d 個操作\n", seed, client_count, ops_per_client);
+			return 1;
+		}
+	}
+	printf("✓ %d 回合、%d 個加入者、每人 %d 個操作，所有副本一致\n", rounds, client_count, ops_per_client);
+	return 0;
+}
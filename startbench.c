@@ -0,0 +1,236 @@
+// 啟動時間量測工具
+// 產生指定大小的文件，在虛擬終端機裡啟動編輯器，量測從執行到第一個畫面（說明畫面）、
+// 第一個編輯畫面，以及內容完整載入（標題列不再顯示「載入中」）各花多少時間
+//
+// 使用方式： ./startbench [-s 大小MB,...] [-r 次數] [-d 暫存目錄] [-e 編輯器執行檔]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_SIZES 16
+
+static const char *bench_exe = "./main";
+static const char *bench_dir = "/tmp";
+static int bench_runs = 3;
+static int bench_sizes[MAX_SIZES] = { 1, 16, 64, 256 };
+static int bench_nsizes = 4;
+
+// 畫面上用來判斷進度的字串（與 main.c 的輸出相同）
+static const char MARK_HELP[] = "按任意鍵開始";
+static const char MARK_SCREEN[] = "當前選擇";
+static const char MARK_LOADING[] = "載入中";
+static const char MARK_CLEAR[] = "\033[2J";
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void usage(const char *prog) {
+	printf("使用方式: %s [-s 大小MB,...] [-r 次數] [-d 暫存目錄] [-e 編輯器執行檔]\n", prog);
+	printf("  -s  要量測的文件大小（MB，逗號分隔，預設 1,16,64,256）\n");
+	printf("  -r  每個大小重複幾次取中位數（預設 3）\n");
+	printf("  -d  產生測試文件的目錄（預設 /tmp）\n");
+	printf("  -e  編輯器執行檔（預設 ./main）\n");
+}
+
+static int parse_sizes(const char *arg) {
+	bench_nsizes = 0;
+	char *copy = strdup(arg);
+	for (char *tok = strtok(copy, ","); tok && bench_nsizes < MAX_SIZES; tok = strtok(NULL, ",")) {
+		int mb = atoi(tok);
+		if (mb <= 0) {
+			free(copy);
+			return 0;
+		}
+		bench_sizes[bench_nsizes++] = mb;
+	}
+	free(copy);
+	return bench_nsizes > 0;
+}
+
+// 產生約 mb MB 的測試文件；已存在且大小相同時直接沿用
+static int make_file(const char *path, int mb) {
+	size_t want = (size_t)mb * 1024 * 1024;
+	struct stat st;
+	if (stat(path, &st) == 0 && (size_t)st.st_size >= want && (size_t)st.st_size < want + 128) return 1;
+	FILE *f = fopen(path, "w");
+	if (!f) return 0;
+	size_t written = 0;
+	for (long i = 1; written < want; i++) {
+		int n = fprintf(f, "line %08ld the quick brown fox jumps over the lazy dog\n", i);
+		if (n < 0) break;
+		written += (size_t)n;
+	}
+	return fclose(f) == 0;
+}
+
+typedef struct {
+	double help;     // 說明畫面出現
+	double screen;   // 第一個編輯畫面出現
+	double loaded;   // 完整載入後的畫面出現
+} StartTimes;
+
+// 在虛擬終端機裡啟動一次編輯器並量測；失敗回傳 0
+static int run_once(const char *path, StartTimes *out) {
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+		perror("posix_openpt");
+		return 0;
+	}
+	char *slave_name = ptsname(master);
+	char swp[600];
+	snprintf(swp, sizeof(swp), "%s.swp", path);
+	unlink(swp);
+
+	double t0 = now_ms();
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(master);
+		return 0;
+	}
+	if (pid == 0) {
+		setsid();
+		int slave = open(slave_name, O_RDWR);
+		if (slave < 0) _exit(127);
+		dup2(slave, STDIN_FILENO);
+		dup2(slave, STDOUT_FILENO);
+		dup2(slave, STDERR_FILENO);
+		close(slave);
+		close(master);
+		execl(bench_exe, bench_exe, path, (char *)NULL);
+		_exit(127);
+	}
+
+	// 累積輸出；frame 是最近一次清除畫面之後的位置
+	size_t cap = 1 << 16, len = 0, frame = 0;
+	char *buf = (char *)malloc(cap);
+	int stage = 0;   // 0 等說明畫面、1 等編輯畫面、2 等載入完成、3 已送出退出
+	int ok = 0;
+	while (buf) {
+		struct pollfd pfd = { master, POLLIN, 0 };
+		int r = poll(&pfd, 1, 60000);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) continue;
+			fprintf(stderr, "等待畫面逾時\n");
+			break;
+		}
+		if (len + 4096 > cap) {
+			char *nb = (char *)realloc(buf, cap * 2);
+			if (!nb) break;
+			buf = nb;
+			cap *= 2;
+		}
+		ssize_t n = read(master, buf + len, cap - len - 1);
+		if (n <= 0) {
+			// 編輯器已結束（虛擬終端機另一端關閉時 read 回傳 EIO）
+			ok = (stage == 3);
+			break;
+		}
+		double t = now_ms() - t0;
+		len += (size_t)n;
+		buf[len] = '\0';
+		char *clr;
+		while ((clr = memmem(buf + frame + 1, len - frame - 1, MARK_CLEAR, sizeof(MARK_CLEAR) - 1)) != NULL) {
+			frame = (size_t)(clr - buf);
+		}
+		if (stage == 0 && memmem(buf, len, MARK_HELP, sizeof(MARK_HELP) - 1)) {
+			out->help = t;
+			stage = 1;
+			if (write(master, " ", 1) != 1) break;
+		}
+		if (stage >= 1 && stage <= 2) {
+			// 畫面要完整畫到狀態列才算數
+			char *cur = memmem(buf + frame, len - frame, MARK_SCREEN, sizeof(MARK_SCREEN) - 1);
+			if (cur && stage == 1) {
+				out->screen = t;
+				stage = 2;
+			}
+			if (cur && !memmem(buf + frame, len - frame, MARK_LOADING, sizeof(MARK_LOADING) - 1)) {
+				out->loaded = t;
+				stage = 3;
+				if (write(master, "q", 1) != 1) break;
+			}
+		}
+	}
+	free(buf);
+	close(master);
+	if (!ok) kill(pid, SIGKILL);
+	int status;
+	waitpid(pid, &status, 0);
+	unlink(swp);
+	return ok;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double median(double *v, int n) {
+	qsort(v, (size_t)n, sizeof(double), cmp_double);
+	return v[n / 2];
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "s:r:d:e:h")) != -1) {
+		if (opt == 's' && parse_sizes(optarg)) continue;
+		else if (opt == 'r') bench_runs = atoi(optarg);
+		else if (opt == 'd') bench_dir = optarg;
+		else if (opt == 'e') bench_exe = optarg;
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (bench_runs < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (access(bench_exe, X_OK) != 0) {
+		printf("找不到編輯器執行檔 %s（先執行 make）\n", bench_exe);
+		return 1;
+	}
+
+	printf("編輯器: %s，每個大小 %d 次取中位數（文件已在頁快取中）\n\n", bench_exe, bench_runs);
+	printf("    大小      說明畫面      編輯畫面      完整載入\n");
+	for (int s = 0; s < bench_nsizes; s++) {
+		char path[512];
+		snprintf(path, sizeof(path), "%s/startbench-%dmb.txt", bench_dir, bench_sizes[s]);
+		if (!make_file(path, bench_sizes[s])) {
+			printf("無法建立測試文件 %s（%s）\n", path, strerror(errno));
+			return 1;
+		}
+		double help[64], screen[64], loaded[64];
+		int runs = bench_runs < 64 ? bench_runs : 64;
+		int done = 0;
+		for (int r = 0; r < runs; r++) {
+			StartTimes t;
+			if (!run_once(path, &t)) {
+				printf("第 %d 次量測失敗（%d MB）\n", r + 1, bench_sizes[s]);
+				continue;
+			}
+			help[done] = t.help;
+			screen[done] = t.screen;
+			loaded[done] = t.loaded;
+			done++;
+		}
+		if (done == 0) return 1;
+		printf("%5d MB  %9.1f ms  %9.1f ms  %9.1f ms\n", bench_sizes[s], median(help, done), median(screen, done),
+		       median(loaded, done));
+	}
+	return 0;
+}
@@ -0,0 +1,136 @@
+// 刪除與復原的回歸測試
+// 刪除各種長度的行（包含超過 512 位元組的長行）再復原，緩衝區與保存後的文件都必須和原本完全相同；
+// 另外從最後一行沒有換行的文件開始新增、貼上、刪除與復原，行數必須一直與內容相符
+//
+// 使用方式： ./undocheck [暫存目錄]，有差異時結束碼為 1
+#define main editor_main
+#include "main.c"
+#undef main
+
+static const size_t check_lengths[] = { 0, 1, 511, 512, 513, 2000, 70000 };
+#define CHECK_LINES ((int)(sizeof(check_lengths) / sizeof(check_lengths[0])))
+
+static int failures = 0;
+
+static void expect_same(const char *what, const char *got, size_t got_len, const char *want, size_t want_len) {
+	if (got_len == want_len && memcmp(got, want, want_len) == 0) return;
+	printf("✗ %s：長度 %zu，應為 %zu\n", what, got_len, want_len);
+	failures++;
+}
+
+// 行數與內容相符，而且最後一行真的存在（跳到、刪除與複製最後一行都要找得到它）
+static int expect_lines(const char *what, EditorState *ed) {
+	int lines = count_lines(ed->buffer);
+	if (ed->total_lines == lines && editor_line_offset(ed, lines) < ed->length) return 1;
+	printf("✗ %s：行數 %d，內容有 %d 行\n", what, ed->total_lines, lines);
+	failures++;
+	return 0;
+}
+
+// 最後一行沒有換行的文件：在它之後新增空行、貼上，再刪除與全部復原
+static void check_unterminated(const char *dir) {
+	static const char initial[] = "first\nlast";
+	char path[512];
+	snprintf(path, sizeof(path), "%s/undocheck-%d-tail.txt", dir, (int)getpid());
+	FILE *f = fopen(path, "w");
+	if (!f || fwrite(initial, 1, sizeof(initial) - 1, f) != sizeof(initial) - 1 || fclose(f) != 0) {
+		printf("無法建立測試文件 %s（%s）\n", path, strerror(errno));
+		failures++;
+		return;
+	}
+	EditorState *ed = &editors[1];
+	num_editors = 2;
+	if (!init_editor(ed, path)) {
+		printf("無法開啟 %s\n", path);
+		failures++;
+		unlink(path);
+		return;
+	}
+	expect_lines("開啟最後一行沒有換行的文件", ed);
+	insert_new_line(ed, ed->total_lines);
+	expect_lines("在沒有換行的最後一行之後新增一行", ed);
+	insert_new_line(ed, ed->total_lines);
+	if (expect_lines("再新增一行", ed)) {
+		copy_lines(ed, 2, ed->total_lines);
+		paste_line(ed, ed->total_lines);
+		if (expect_lines("貼上以空行結尾的多行", ed)) {
+			delete_line(ed, ed->total_lines);
+			expect_lines("刪除最後一行", ed);
+		}
+	}
+	while (ed->undo_top > 0) undo_last_action(ed);
+	expect_lines("全部復原", ed);
+	expect_same("全部復原後的內容", ed->buffer, ed->length, initial, sizeof(initial) - 1);
+	autosave_finish();
+	unlink(path);
+	num_editors = 1;
+}
+
+int main(int argc, char **argv) {
+	const char *dir = (argc > 1) ? argv[1] : "/tmp";
+	char path[512];
+	snprintf(path, sizeof(path), "%s/undocheck-%d.txt", dir, (int)getpid());
+
+	// 第 1 行是短行，之後每行長度取自 check_lengths，內容隨位置變化
+	size_t cap = 64;
+	for (int i = 0; i < CHECK_LINES; i++) cap += check_lengths[i] + 1;
+	char *want = (char *)malloc(cap);
+	if (!want) return 1;
+	size_t want_len = (size_t)sprintf(want, "first\n");
+	for (int i = 0; i < CHECK_LINES; i++) {
+		for (size_t j = 0; j < check_lengths[i]; j++) want[want_len++] = (char)('a' + (i * 7 + j) % 26);
+		want[want_len++] = '\n';
+	}
+	FILE *f = fopen(path, "w");
+	if (!f || fwrite(want, 1, want_len, f) != want_len || fclose(f) != 0) {
+		printf("無法建立測試文件 %s（%s）\n", path, strerror(errno));
+		return 1;
+	}
+
+	swap_disabled = 1;
+	num_editors = 1;
+	EditorState *ed = &editors[0];
+	if (!init_editor(ed, path)) {
+		printf("無法開啟 %s\n", path);
+		return 1;
+	}
+
+	// 逐行刪除後立即復原
+	for (int line = 2; line <= CHECK_LINES + 1; line++) {
+		char what[64];
+		ed->current_line = line;
+		if (!delete_line(ed, line)) {
+			printf("✗ 無法刪除第 %d 行\n", line);
+			failures++;
+			continue;
+		}
+		undo_last_action(ed);
+		snprintf(what, sizeof(what), "刪除並復原第 %d 行（%zu 位元組）", line, check_lengths[line - 2]);
+		expect_same(what, ed->buffer, ed->length, want, want_len);
+	}
+
+	// 連續刪除所有長行，再依序全部復原
+	for (int i = 0; i < CHECK_LINES; i++) delete_line(ed, 2);
+	for (int i = 0; i < CHECK_LINES; i++) undo_last_action(ed);
+	expect_same("連續刪除後全部復原", ed->buffer, ed->length, want, want_len);
+
+	// 保存後的文件也必須完整
+	autosave_finish();
+	f = fopen(path, "r");
+	char *disk = (char *)malloc(want_len + 1);
+	size_t disk_len = (f && disk) ? fread(disk, 1, want_len + 1, f) : 0;
+	if (f) fclose(f);
+	expect_same("保存後的文件", disk ? disk : "", disk_len, want, want_len);
+	unlink(path);
+	free(disk);
+	free(want);
+
+	check_unterminated(dir);
+
+	if (failures) {
+		printf("%d 項檢查失敗\n", failures);
+		return 1;
+	}
+	printf("✓ 刪除與復原 %d 種長度的行，內容與保存結果一致；沒有換行結尾的文件行數正確\n", CHECK_LINES);
+	return 0;
+}